@@ -0,0 +1,354 @@
+/*
+ ============================================================================
+ Name        : BalanceBench.c
+ Author      : Giacomo Persichini
+ Description : A hot file shared by owners of different speeds, who gets the downloaders
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand_r() */
+#include <string.h> /* memset() */
+#include <time.h> /* nanosleep() */
+#include <math.h> /* log() */
+#include <unistd.h> /* close() */
+#include <fcntl.h> /* open() */
+#include <sys/stat.h> /* mkdir() */
+#include <sys/wait.h> /* waitpid() */
+#include <sys/socket.h> /* socket() - connect() */
+#include <arpa/inet.h> /* inet_addr() */
+
+#include "Bench.h"
+
+#define TICK 0.1			/* Virtual seconds */
+#define MAX_DOWNLOADS 4096	/* At once from one owner */
+
+typedef struct download {
+	double	left;			/* Bytes */
+	double	start;
+} download;
+
+typedef struct owner {
+	conn		*cn;
+	double		capacity;	/* Bytes per second */
+	double		sent;		/* Since the last report */
+	download	*downloads;
+	int			active;
+	long		picked;
+	char		ip[INET_ADDRSTRLEN];
+} owner;
+
+typedef struct outcome {
+	bench_samples	done;		/* Virtual ms each download took */
+	long			full;		/* Sent to an owner with no slot free */
+	long			unfinished;
+} outcome;
+
+/* The owner's slots go to its downloads evenly, whatever they are */
+static void transfer(owner *o, double now, outcome *out) {
+	double	each;
+	int		i;
+
+	if (o->active == 0)
+		return;
+	each = o->capacity * TICK / o->active;
+	for (i = 0; i < o->active; i++) {
+		o->sent += o->downloads[i].left < each ? o->downloads[i].left : each;
+		o->downloads[i].left -= each;
+		if (o->downloads[i].left <= 0) {
+			bench_sample(&out->done, (now + TICK - o->downloads[i].start) * 1000);
+			o->downloads[i--] = o->downloads[--o->active];
+		}
+	}
+}
+
+/* What a peer's reporter thread sends every LOAD_INTERVAL */
+static int report(owner *o, int slots) {
+	load_report	r;
+
+	r.active = o->active;
+	r.free_slots = o->active < slots ? slots - o->active : 0;
+	r.rate = o->sent / LOAD_INTERVAL;
+	r.limit = 0;
+	o->sent = 0;
+	return send_load(o->cn, &r);
+}
+
+static conn *join(char *ip, int port, char *list, int options) {
+	struct sockaddr_in	addr;
+	conn				*cn = NULL;
+	int					fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || (cn = conn_open(fd)) == NULL
+			|| handshake(HANDSHAKE_SERVER, cn, options) != 0 || send_file(list, cn) != 0) {
+		fprintf(stderr, "[ERROR] %s couldn't join the server\n", ip);
+		if (cn == NULL)
+			close(fd);
+		else
+			conn_close(cn);
+		return NULL;
+	}
+	return cn;
+}
+
+/*
+ * A real peer at binary joins the server, with metrics on metrics_port:
+ * its reporter thread must be heard, two LOAD reports at least within
+ * 3 LOAD_INTERVALs. Returns 1 if they don't come.
+ */
+static int reports(char *binary, char *dir, int port, int metrics_port) {
+	struct timespec		pause = { 0, 100000000 };
+	unsigned long long	start;
+	hash_record			*records = NULL;
+	char				path[1100],
+						config[64];
+	long				before,
+						after = -1;
+	int					input = -1,
+						bad;
+	pid_t				pid;
+
+	snprintf(path, sizeof(path), "%s/peer", dir);
+	mkdir(path, 0755);
+	snprintf(config, sizeof(config), "servers=127.0.0.1:%d\n", port);
+	if ((pid = bench_share(binary, path, 4, 4096, config, &input, &records)) == -1)
+		return 1;
+	before = bench_server_metric(metrics_port, "fs_load_reports_total");
+	start = bench_usec();
+	/* Menu entry 1 connects to the server */
+	write(input, "1\n", 2);
+	while (bench_usec() - start < 3 * LOAD_INTERVAL * 1000000ULL
+			&& (after = bench_server_metric(metrics_port, "fs_load_reports_total")) < before + 2)
+		nanosleep(&pause, NULL);
+	bad = before < 0 || after < before + 2;
+	printf("balance: a peer's load reports reach the server: %s, %ld in %.1f s\n", bad ? "FAILED" : "ok",
+			after - before, (bench_usec() - start) / 1e6);
+	bench_stop(pid, input);
+	free(records);
+	return bad;
+}
+
+/*
+ * The same peer joining the server and one that's always busy, after
+ * it: while it waits to try that one again, the reports must keep
+ * coming on the connection it has. Returns 1 if they stop.
+ */
+static int reports_while_busy(char *binary, char *dir, int port, int metrics_port) {
+	struct timespec		pause = { 0, 10000000 };
+	unsigned long long	start;
+	bench_busy			b;
+	hash_record			*records = NULL;
+	char				path[1100],
+						config[128];
+	long				before = -1,
+						after = -1;
+	int					input = -1,
+						bad = 1;
+	pid_t				pid = -1;
+
+	if (bench_busy_start(&b, port + 2, 1000) == -1)
+		return 1;
+	snprintf(path, sizeof(path), "%s/busy", dir);
+	mkdir(path, 0755);
+	snprintf(config, sizeof(config), "servers=127.0.0.1:%d;127.0.0.1:%d\nconnect-retries=3\n", port, port + 2);
+	if ((pid = bench_share(binary, path, 4, 4096, config, &input, &records)) == -1)
+		goto out;
+	write(input, "1\n", 2);
+	start = bench_usec();
+	/* From the first time it's turned away to the last, about 3 s */
+	while (bench_busy_answered(&b) < 1 && bench_usec() - start < 10000000ULL)
+		nanosleep(&pause, NULL);
+	before = bench_server_metric(metrics_port, "fs_load_reports_total");
+	while (bench_busy_answered(&b) < 4 && bench_usec() - start < 10000000ULL)
+		nanosleep(&pause, NULL);
+	after = bench_server_metric(metrics_port, "fs_load_reports_total");
+	bad = before < 0 || after <= before || bench_busy_answered(&b) < 4;
+	printf("balance: reports go on while another server is busy: %s, %ld of them\n", bad ? "FAILED" : "ok",
+			after - before);
+out:
+	bench_busy_stop(&b);
+	if (pid != -1)
+		bench_stop(pid, input);
+	free(records);
+	return bad;
+}
+
+/*
+ * Downloaders come at random, rate per second, for seconds: each one asks
+ * the server (or picks an owner at random when there's none) and downloads
+ * size bytes from the owner, sharing its bandwidth with the others. The
+ * same seed makes the same downloaders come.
+ */
+static int simulate(owner *owners, int num, conn *requester, char *hash, double rate, double size, int seconds,
+		int slots, unsigned int seed, outcome *out) {
+	char	reply[FOUND_SIZE];
+	double	now,
+			next;
+	int		ticks,
+			i,
+			k;
+
+	memset(out, 0, sizeof(outcome));
+	for (k = 0; k < num; k++) {
+		owners[k].active = 0;
+		owners[k].sent = 0;
+		owners[k].picked = 0;
+	}
+	next = -log((rand_r(&seed) + 1.0) / (RAND_MAX + 2.0)) / rate;
+	for (ticks = 0, now = 0; now < seconds * 4; ticks++, now = ticks * TICK) {
+		/* Reports are sent every LOAD_INTERVAL, each owner at a different time */
+		for (k = 0; requester != NULL && k < num; k++)
+			if ((ticks + k) % (int) (LOAD_INTERVAL / TICK) == 0 && report(&owners[k], slots) != 0)
+				return -1;
+		while (next < now + TICK && now < seconds) {
+			if (requester == NULL)
+				k = rand_r(&seed) % num;
+			else {
+				if (send_query(requester, hash) != 0 || read_reply(requester, reply) != 1)
+					return -1;
+				for (k = 0; k < num && strcmp(owners[k].ip, reply) != 0; k++)
+					;
+				if (k == num) {
+					fprintf(stderr, "[ERROR] The server sent the downloader to '%s'\n", reply);
+					return -1;
+				}
+			}
+			if (owners[k].active >= slots)
+				out->full++;
+			if (owners[k].active < MAX_DOWNLOADS) {
+				owners[k].downloads[owners[k].active].left = size;
+				owners[k].downloads[owners[k].active++].start = next;
+			}
+			owners[k].picked++;
+			next += -log((rand_r(&seed) + 1.0) / (RAND_MAX + 2.0)) / rate;
+		}
+		for (k = 0; k < num; k++)
+			transfer(&owners[k], now, out);
+	}
+	/* Not done by 4 times the arrivals' time: the owner is swamped */
+	for (k = 0; k < num; k++)
+		out->unfinished += owners[k].active;
+	for (i = 0; i < out->unfinished; i++)
+		bench_sample(&out->done, seconds * 4000);
+	return 0;
+}
+
+static void print(owner *owners, int num, outcome *out, char *what) {
+	int	k;
+
+	printf("balance: %-14s p50 %.1f s, p99 %.1f s, %ld sent to a full owner, %ld unfinished\n", what,
+			bench_percentile(&out->done, 0.5) / 1000.0, bench_percentile(&out->done, 0.99) / 1000.0,
+			out->full, out->unfinished);
+	printf("balance: %-14s", "");
+	for (k = 0; k < num; k++)
+		printf(" %.0fM:%ld", owners[k].capacity / 1048576, owners[k].picked);
+	printf("\n");
+}
+
+int bench_balance(int argc, char **argv) {
+	owner				*owners;
+	outcome				spread,
+						balanced;
+	hash_record			rec;
+	conn				*requester = NULL;
+	char				*dir = bench_tmpdir(),
+						*server = bench_sarg(argc, argv, "server", NULL),
+						*peer = bench_sarg(argc, argv, "peer", NULL),
+						path[1024],
+						config[256],
+						hash[HASH_LEN + 1];
+	double				total = 0,
+						size = bench_arg(argc, argv, "size", 8) * 1048576.0;
+	int					num = bench_arg(argc, argv, "owners", 8),
+						seconds = bench_arg(argc, argv, "seconds", 300),
+						load = bench_arg(argc, argv, "load", 70),
+						slots = bench_arg(argc, argv, "slots", 4),
+						port = bench_arg(argc, argv, "port", 13160),
+						input,
+						bad = 1,
+						fd,
+						k;
+	unsigned int		seed = bench_arg(argc, argv, "seed", 1);
+	pid_t				pid = -1;
+
+	if (server == NULL || num < 2 || num > 200 || seconds < 1 || load < 1 || slots < 1 || size < 1) {
+		fprintf(stderr, "[ERROR] balance needs server=PATH and 2 to 200 owners\n");
+		return 1;
+	}
+	owners = calloc(num, sizeof(owner));
+	memset(&spread, 0, sizeof(spread));
+	memset(&balanced, 0, sizeof(balanced));
+
+	/* 1, 1, 2, 2, 4, 4, 8, 8 MB/s and again */
+	for (k = 0; k < num; k++) {
+		owners[k].capacity = (1 << (k / 2 % 4)) * 1048576.0;
+		owners[k].downloads = malloc(MAX_DOWNLOADS * sizeof(download));
+		snprintf(owners[k].ip, sizeof(owners[k].ip), "127.0.0.%d", 10 + k);
+		total += owners[k].capacity;
+	}
+
+	snprintf(config, sizeof(config),
+			"server-ip=127.0.0.1\nserver-port=%d\nmax-connections=%d\nmetrics-port=%d\nlog-level=warn\n",
+			port, num + 10, port + 1);
+	snprintf(path, sizeof(path), "%s/db", dir);
+	if (dir == NULL || bench_write_file(dir, "config", config) == -1 || mkdir(path, 0755) == -1
+			|| (pid = bench_spawn(server, dir, &input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || waitpid(pid, NULL, WNOHANG) != 0) {
+		fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", dir);
+		goto out;
+	}
+	/* With peer=PATH, before the owners come */
+	if (peer != NULL && (reports(peer, dir, port, port + 1) != 0 || reports_while_busy(peer, dir, port, port + 1) != 0))
+		goto out;
+
+	/* Everybody shares the hot file, the requester too: it must never be sent to itself */
+	memset(&rec, 0, sizeof(rec));
+	bench_random_hash(rec.hash);
+	memcpy(hash, rec.hash, sizeof(hash));
+	snprintf(rec.filename, sizeof(rec.filename), "hot.bin");
+	record_set_size(&rec, size);
+	snprintf(path, sizeof(path), "%s/list", dir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	write(fd, &rec, sizeof(rec));
+	close(fd);
+	for (k = 0; k < num; k++)
+		if ((owners[k].cn = join(owners[k].ip, port, path, OPT_LOAD)) == NULL)
+			goto out;
+	if ((requester = join("127.0.0.2", port, path, 0)) == NULL)
+		goto out;
+	printf("balance: %d owners, %.0f MB/s together, downloaders for %d%% of it, %d slots each\n", num,
+			total / 1048576, load, slots);
+
+	if (simulate(owners, num, NULL, hash, total * load / 100 / size, size, seconds, slots, seed, &spread) != 0)
+		goto out;
+	print(owners, num, &spread, "at random:");
+	if (simulate(owners, num, requester, hash, total * load / 100 / size, size, seconds, slots, seed, &balanced) != 0) {
+		fprintf(stderr, "[ERROR] balance: the server stopped answering\n");
+		goto out;
+	}
+	print(owners, num, &balanced, "by the server:");
+	/* The slow owners can't keep up with an even share, the server must see it */
+	bad = balanced.unfinished > 0 || bench_percentile(&balanced.done, 0.99) >= bench_percentile(&spread.done, 0.99);
+	printf("balance: %s\n", bad ? "FAILED" : "ok");
+out:
+	for (k = 0; k < num; k++) {
+		conn_close(owners[k].cn);
+		free(owners[k].downloads);
+	}
+	conn_close(requester);
+	if (pid != -1)
+		bench_stop(pid, input);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	free(owners);
+	free(spread.done.values);
+	free(balanced.done.values);
+	return bad;
+}
@@ -0,0 +1,551 @@
+/*
+ ============================================================================
+ Name        : Bench.c
+ Author      : Giacomo Persichini
+ Description : Benchmarks for the server and the peer, one per sub-command
+ ============================================================================
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h> /* strtol() - qsort() - mkdtemp() - realpath() */
+#include <limits.h> /* PATH_MAX */
+#include <string.h> /* strcmp() - strncmp() - memcmp() - strrchr() */
+#include <time.h> /* clock_gettime() - nanosleep() */
+#include <sys/time.h> /* struct timeval */
+#include <ftw.h> /* nftw() */
+#include <fcntl.h> /* open() */
+#include <signal.h> /* kill() */
+#include <unistd.h> /* fork() - execl() - pipe() - sysconf() */
+#include <sys/stat.h> /* mkdir() - stat() */
+#include <sys/wait.h> /* waitpid() - WNOHANG */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <sys/un.h> /* struct sockaddr_un */
+#include <arpa/inet.h> /* inet_addr() */
+/* Non-standard header files */
+#include <openssl/evp.h> /* EVP_EC_gen() */
+#include <openssl/pem.h> /* PEM_write_X509() - PEM_write_PrivateKey() */
+#include <openssl/x509.h> /* X509_new() - X509_sign() */
+
+#include "Bench.h"
+
+typedef struct bench_cmd {
+	char	*name;
+	int		(*run)(int, char **);
+	char	*usage;
+} bench_cmd;
+
+static bench_cmd commands[] = {
+	{ "log", bench_log, "log [connections] - listener loop with logging off, synchronous and asynchronous" },
+	{ "load", bench_load, "load [server=PATH | address=IP:PORT] [peers=N] [concurrency=N] [files=N] [queries=N] [pool=N] [shards=N] [max-failed=N]" },
+	{ "shards", bench_shards, "shards [max=N] [load options] - lookups per second as the server becomes a cluster of 1, 2, 4... up to N" },
+	{ "overload", bench_overload, "overload [max-connections=16] [peers=N] [backoff=off] [goodput=PERCENT] [server=PATH] [peer=PATH] - admission rules, then peers past what the server has room for, sessions done per second" },
+	{ "transfer", bench_transfer, "transfer [peer=PATH [limit=KB/s] | address=IP hash=HASH] [size=MB] [count=N] [parallel=N] [compression=zlib] [delta=on] [tls=on] [max-failed=N]" },
+	{ "conn", bench_conn, "conn [frames=N] [queries=N] [size=MB] - checks the buffered connections, then raw against buffered I/O" },
+	{ "uring", bench_uring, "uring [size=MB] - 1 and 64 transfers through the io_uring engine and the plain loop" },
+	{ "compress", bench_compress, "compress [size=MB] - compression ratio and CPU cost for text, compressed files and hash lists" },
+	{ "delta", bench_delta, "delta [size=MB] [percent=N] [edits=N] [compression=zlib] - updates an edited file by its changed chunks" },
+	{ "verify", bench_verify, "verify [size=MB] [runs=3] [edits=8] - downloads hashed as they're received, then with a byte flipped on the way" },
+	{ "cache", bench_cache, "cache [size=MB] [readahead=KB] - a large file hashed and sent cold with each page-cache mode, speed and what stays cached" },
+	{ "tls", bench_tls, "tls [size=MB] [runs=3] [handshakes=200] - downloads in plaintext, with TLS in OpenSSL and in the kernel, and who's turned away" },
+	{ "client", bench_client, "client server=PATH peer=PATH [files=500] [size=KB] [parallel=32] [lookups=N] [compression=zlib] - the event-loop client library against blocking lookups and downloads" },
+	{ "hot", bench_hot, "hot [peer=PATH] [files=1000] [size=KB] [requests=N] [parallel=16] [skew=1.0] - checks the hot-file cache, then a Zipf workload with and without it" },
+	{ "bundle", bench_bundle, "bundle peer=PATH [files=2000] [size=KB] [parallel=8] [compression=zlib] - many small files from one peer, in bundles and one connection each" },
+	{ "store", bench_store, "store [size=MB] [copies=N] - dedupe, downloads found locally and pruning of the local store" },
+	{ "dht", bench_dht, "dht [nodes=N] [keys=N] [lookups=N] [down=PERCENT] - records a node keeps, then peers finding owners among themselves, hops and latency" },
+	{ "search", bench_search, "search [names=N] [queries=N] [server=PATH] - checks the name index, then query latency on N names" },
+	{ "balance", bench_balance, "balance [owners=8] [seconds=N] [load=%] [server=PATH] - owners of different speeds, who the server sends downloaders to" },
+	{ "reap", bench_reap, "reap [timers=N] [peers=60] [timeout=2] [server=PATH] - the timer wheel, then peers that vanish from the server" },
+	{ "owners", bench_owners, "owners [entries=10000000] [peers=1000] [lookups=N] [max-bytes=48] - the server's index of who has each file, bytes per entry and lookups" },
+	{ "ingest", bench_ingest, "ingest [records=2000000] [dups=100] - hash lists checked, decoded and indexed, records per second" },
+	{ "shape", bench_shape, "shape [rate=KB/s] [seconds=N] [tolerance=PERCENT] - checks the bandwidth limits and weights" },
+	{ NULL, NULL, NULL }
+};
+
+unsigned long long bench_usec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Options are given as name=value */
+char *bench_sarg(int argc, char **argv, char *name, char *def) {
+	int		i;
+	size_t	len = strlen(name);
+
+	for (i = 0; i < argc; i++)
+		if (strncmp(argv[i], name, len) == 0 && argv[i][len] == '=')
+			return argv[i] + len + 1;
+	return def;
+}
+
+long bench_arg(int argc, char **argv, char *name, long def) {
+	char	*value = bench_sarg(argc, argv, name, NULL);
+
+	return value != NULL ? strtol(value, NULL, 10) : def;
+}
+
+void bench_sample(bench_samples *s, unsigned long long usec) {
+	if (s->num == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->values = realloc(s->values, s->size * sizeof(unsigned int));
+	}
+	s->values[s->num++] = usec > 0xffffffffULL ? 0xffffffffU : (unsigned int) usec;
+}
+
+static int cmp_uint(const void *a, const void *b) {
+	unsigned int	x = *(const unsigned int *) a,
+					y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples the first time it's called on them */
+unsigned int bench_percentile(bench_samples *s, double p) {
+	long	i;
+
+	if (s->num == 0)
+		return 0;
+	qsort(s->values, s->num, sizeof(unsigned int), cmp_uint);
+	i = (long) (p * s->num);
+	return s->values[i < s->num ? i : s->num - 1];
+}
+
+char *bench_tmpdir() {
+	static char	dir[64];
+
+	strcpy(dir, "/tmp/fsbench.XXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		perror("[ERROR] mkdtemp() call failed");
+		return NULL;
+	}
+	return dir;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+void bench_rmdir(char *dir) {
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int bench_write_file(char *dir, char *name, char *content) {
+	char	path[1024];
+	FILE	*file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((file = fopen(path, "w")) == NULL) {
+		perror("[ERROR] Couldn't write a file for the benchmark");
+		return -1;
+	}
+	fputs(content, file);
+	fclose(file);
+	return 0;
+}
+
+/*
+ * Runs one of the programs inside dir. Its standard input is a pipe, so
+ * the menu can be driven and "0" can be sent to stop it; its output ends
+ * in dir/output.
+ */
+pid_t bench_spawn(char *binary, char *dir, int *input) {
+	int		fds[2],
+			out;
+	pid_t	pid;
+	char	path[1024],
+			program[PATH_MAX];
+
+	/* The program runs inside dir, a relative path wouldn't be found there */
+	if (realpath(binary, program) == NULL) {
+		fprintf(stderr, "[ERROR] Can't find %s\n", binary);
+		return -1;
+	}
+	if (pipe(fds) == -1) {
+		perror("[ERROR] pipe() call failed");
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/output", dir);
+	if ((pid = fork()) == 0) {
+		if (chdir(dir) == -1)
+			_exit(127);
+		out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dup2(fds[0], 0);
+		dup2(out, 1);
+		dup2(out, 2);
+		close(fds[1]);
+		execl(program, program, (char *) NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+	if (pid == -1) {
+		perror("[ERROR] fork() call failed");
+		close(fds[1]);
+		return -1;
+	}
+	*input = fds[1];
+	return pid;
+}
+
+/* Asks the program to quit, kills it if it doesn't within 3 seconds */
+void bench_stop(pid_t pid, int input) {
+	struct timespec	pause = { 0, 50000000 };
+	int				i;
+
+	write(input, "0\n", 2);
+	close(input);
+	for (i = 0; i < 60; i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return;
+		nanosleep(&pause, NULL);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* Peak resident memory in KB, read from /proc */
+long bench_peak_rss(pid_t pid) {
+	char	path[64],
+			line[256];
+	long	kb = -1;
+	FILE	*status;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+	if ((status = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), status) != NULL)
+		if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+			break;
+	fclose(status);
+	return kb;
+}
+
+/* CPU time pid has used, user and system, in usec, read from /proc */
+long bench_cpu_usec(pid_t pid) {
+	char			path[64],
+					line[1024],
+					*end;
+	unsigned long	user,
+					sys;
+	FILE			*stat;
+	int				ok;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	if ((stat = fopen(path, "r")) == NULL)
+		return -1;
+	/* The name in parentheses may hold spaces, the fields are counted after it */
+	ok = fgets(line, sizeof(line), stat) != NULL && (end = strrchr(line, ')')) != NULL
+			&& sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &user, &sys) == 2;
+	fclose(stat);
+	return ok ? (long) ((user + sys) * (1000000.0 / sysconf(_SC_CLK_TCK))) : -1;
+}
+
+/* Waits until something accepts connections on ip:port */
+int bench_wait_port(char *ip, int port, int msec) {
+	struct sockaddr_in	addr;
+	struct timespec		pause = { 0, 20000000 };
+	int					fd,
+						waited;
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port = htons(port);
+	memset(&addr.sin_zero, '\0', sizeof(addr.sin_zero));
+	for (waited = 0; waited < msec; waited += 20) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			close(fd);
+			return 0;
+		}
+		close(fd);
+		nanosleep(&pause, NULL);
+	}
+	return -1;
+}
+
+/* Loopback TCP connections: senders[i] is connected to receivers[i] */
+int bench_tcp_pairs(int n, conn **senders, conn **receivers) {
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	int					listener,
+						fd,
+						i;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, n) == -1
+			|| getsockname(listener, (struct sockaddr *) &addr, &len) == -1) {
+		perror("[ERROR] Couldn't listen on the loopback");
+		close(listener);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			perror("[ERROR] connect() call failed");
+			close(fd);
+			close(listener);
+			return -1;
+		}
+		senders[i] = conn_open(fd);
+		receivers[i] = conn_open(accept(listener, NULL, NULL));
+	}
+	close(listener);
+	return 0;
+}
+
+void bench_random_hash(char *out) {
+	static const char	hex[] = "0123456789abcdef";
+	int					i;
+
+	for (i = 0; i < HASH_LEN; i++)
+		out[i] = hex[rand() & 15];
+	out[HASH_LEN] = '\0';
+}
+
+/* A counter of the peer running in dir, from its control socket. -1 if it didn't answer */
+long bench_peer_stat(char *dir, char *name) {
+	struct sockaddr_un	addr;
+	char				out[4096],
+						*line;
+	ssize_t				n,
+						len = 0;
+	size_t				name_len = strlen(name);
+	int					fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/control", dir);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || write(fd, "STATS", 5) != 5) {
+		close(fd);
+		return -1;
+	}
+	while (len < (ssize_t) sizeof(out) - 1 && (n = read(fd, out + len, sizeof(out) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	out[len] = '\0';
+	for (line = out; line != NULL && *line != '\0'; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+		if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ')
+			return strtol(line + name_len + 1, NULL, 10);
+	return -1;
+}
+
+/* A counter or gauge of the server with metrics-port=port. -1 if it didn't answer */
+long bench_server_metric(int port, char *name) {
+	struct sockaddr_in	addr;
+	char				request[] = "GET /metrics HTTP/1.0\r\n\r\n",
+						*out = malloc(65536),
+						*line;
+	ssize_t				n,
+						len = 0;
+	size_t				name_len = strlen(name);
+	long				value = -1;
+	int					fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	if (out == NULL || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+			|| write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+		close(fd);
+		free(out);
+		return -1;
+	}
+	while (len < 65535 && (n = read(fd, out + len, 65535 - len)) > 0)
+		len += n;
+	close(fd);
+	out[len] = '\0';
+	for (line = out; line != NULL && *line != '\0'; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+		if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ') {
+			value = strtol(line + name_len + 1, NULL, 10);
+			break;
+		}
+	free(out);
+	return value;
+}
+
+static void *turn_away(void *arg) {
+	bench_busy	*b = arg;
+	int			fd,
+				n;
+
+	while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE))
+		if ((fd = accept(b->listener, NULL, NULL)) != -1) {
+			send_busy(fd, b->hint);
+			close(fd);
+			if ((n = __atomic_load_n(&b->answered, __ATOMIC_RELAXED)) < BENCH_BUSY_TIMES)
+				b->at[n] = bench_usec();
+			__atomic_add_fetch(&b->answered, 1, __ATOMIC_RELEASE);
+		}
+	return NULL;
+}
+
+/*
+ * A server on port of the loopback that's always busy: everyone
+ * connecting is asked to come back in hint msec, the time of the first
+ * BENCH_BUSY_TIMES noted in at. Returns 0 or -1.
+ */
+int bench_busy_start(bench_busy *b, int port, unsigned int hint) {
+	struct sockaddr_in	addr;
+	struct timeval		timeout = { 0, 100000 };
+	int					yes = 1;
+
+	memset(b, 0, sizeof(bench_busy));
+	b->hint = hint;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	b->listener = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(b->listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	/* accept() gives up now and then, to see whether to stop */
+	setsockopt(b->listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (bind(b->listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(b->listener, 8) == -1
+			|| pthread_create(&b->thread, NULL, turn_away, b) != 0) {
+		close(b->listener);
+		return -1;
+	}
+	return 0;
+}
+
+/* How many were turned away so far */
+int bench_busy_answered(bench_busy *b) {
+	return __atomic_load_n(&b->answered, __ATOMIC_ACQUIRE);
+}
+
+void bench_busy_stop(bench_busy *b) {
+	__atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(b->thread, NULL);
+	close(b->listener);
+}
+
+/*
+ * num files of size bytes in dir/shared, then the peer at binary lists
+ * them all, with the lines in config added to its own. records gets the
+ * list, as many as there are files.
+ */
+pid_t bench_share(char *binary, char *dir, int num, long size, char *config, int *input, hash_record **records) {
+	char			path[1100],
+					lines[2048],
+					*block = malloc(size);
+	struct timespec	pause = { 0, 50000000 };
+	struct stat		st;
+	long			i;
+	int				fd,
+					waited;
+	pid_t			pid;
+
+	snprintf(path, sizeof(path), "%s/shared", dir);
+	mkdir(path, 0755);
+	for (i = 0; i < num; i++) {
+		snprintf(path, sizeof(path), "%s/shared/file%ld", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bench_random_hash(block);
+		memset(block + HASH_LEN, i & 0xff, size - HASH_LEN);
+		write(fd, block, size);
+		close(fd);
+	}
+	free(block);
+	snprintf(lines, sizeof(lines), "server-ip=127.0.0.1\nserver-port=1\nshared-folder=%s/shared\n%s", dir, config);
+	if (bench_write_file(dir, "config", lines) == -1 || (pid = bench_spawn(binary, dir, input)) == -1)
+		return -1;
+	/* Menu entry 3 generates the hash list, then any key goes back */
+	write(*input, "3\nx\n", 4);
+	snprintf(path, sizeof(path), "%s/hash", dir);
+	/* Listed once the peer serves them, not only once the list is written */
+	for (waited = 0; waited < 1200; waited++, nanosleep(&pause, NULL)) {
+		if (stat(path, &st) == -1 || st.st_size < (off_t) (num * sizeof(hash_record))
+				|| bench_peer_stat(dir, "shared_files") < num)
+			continue;
+		*records = malloc(num * sizeof(hash_record));
+		fd = open(path, O_RDONLY);
+		if (read(fd, *records, num * sizeof(hash_record)) != (ssize_t) (num * sizeof(hash_record))) {
+			free(*records);
+			*records = NULL;
+		}
+		close(fd);
+		return pid;
+	}
+	fprintf(stderr, "[ERROR] The peer didn't generate its hash list, see %s/output\n", dir);
+	bench_stop(pid, *input);
+	return -1;
+}
+
+/* A self-signed certificate for name and its key, PEM, good for an hour */
+int bench_make_cert(char *cert, char *key, char *name) {
+	EVP_PKEY	*pkey = EVP_EC_gen("P-256");
+	X509		*x = X509_new();
+	FILE		*f;
+	int			ok = pkey != NULL && x != NULL;
+
+	if (ok) {
+		ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+		X509_gmtime_adj(X509_getm_notBefore(x), 0);
+		X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+		X509_set_pubkey(x, pkey);
+		X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC, (unsigned char *) name, -1, -1, 0);
+		X509_set_issuer_name(x, X509_get_subject_name(x));
+		ok = X509_sign(x, pkey, EVP_sha256()) > 0;
+	}
+	if (ok && (f = fopen(cert, "w")) != NULL) {
+		ok = PEM_write_X509(f, x) == 1;
+		fclose(f);
+	}
+	else
+		ok = 0;
+	if (ok && (f = fopen(key, "w")) != NULL) {
+		ok = PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL) == 1;
+		fclose(f);
+	}
+	else
+		ok = 0;
+	X509_free(x);
+	EVP_PKEY_free(pkey);
+	return ok ? 0 : -1;
+}
+
+/* Both files have the same bytes */
+int bench_same_content(char *a, char *b) {
+	char	*x = malloc(TRANSFER_CHUNK),
+			*y = malloc(TRANSFER_CHUNK);
+	int		fa = open(a, O_RDONLY),
+			fb = open(b, O_RDONLY),
+			same = fa != -1 && fb != -1;
+	ssize_t	na,
+			nb;
+
+	while (same) {
+		na = read(fa, x, TRANSFER_CHUNK);
+		nb = read(fb, y, TRANSFER_CHUNK);
+		same = na == nb && na >= 0 && memcmp(x, y, na) == 0;
+		if (na <= 0)
+			break;
+	}
+	close(fa);
+	close(fb);
+	free(x);
+	free(y);
+	return same;
+}
+
+int main(int argc, char **argv) {
+	int	i;
+
+	if (argc > 1)
+		for (i = 0; commands[i].name != NULL; i++)
+			if (strcmp(argv[1], commands[i].name) == 0)
+				return commands[i].run(argc - 2, argv + 2);
+
+	fprintf(stderr, "Bench %2.2f\nUsage: %s <command> [options]\n\n", _VERSION_, argv[0]);
+	for (i = 0; commands[i].name != NULL; i++)
+		fprintf(stderr, "  %s\n", commands[i].usage);
+	return 1;
+}
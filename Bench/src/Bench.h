@@ -0,0 +1,83 @@
+/*
+ * Bench.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <sys/types.h> /* pid_t */
+#include <pthread.h> /* pthread_t */
+
+#include "Conn.h"
+#include "Protocol.h"
+
+#define _VERSION_ 0.01
+#define BENCH_BUSY_TIMES 16	/* Connections a busy server notes the time of */
+
+/* Growable array of latencies, in microseconds */
+typedef struct bench_samples {
+	unsigned int	*values;
+	long			num;
+	long			size;
+} bench_samples;
+
+/* A server that's always busy, see bench_busy_start() */
+typedef struct bench_busy {
+	int					listener;
+	unsigned int		hint;		/* msec the peers are asked to wait */
+	int					answered;
+	int					stop;
+	pthread_t			thread;
+	unsigned long long	at[BENCH_BUSY_TIMES];	/* usec each was answered */
+} bench_busy;
+
+unsigned long long bench_usec();
+long bench_arg(int, char **, char *, long);
+char *bench_sarg(int, char **, char *, char *);
+void bench_sample(bench_samples *, unsigned long long);
+unsigned int bench_percentile(bench_samples *, double);
+char *bench_tmpdir();
+void bench_rmdir(char *);
+int bench_write_file(char *, char *, char *);
+pid_t bench_spawn(char *, char *, int *);
+void bench_stop(pid_t, int);
+long bench_peak_rss(pid_t);
+long bench_cpu_usec(pid_t);
+int bench_wait_port(char *, int, int);
+int bench_tcp_pairs(int, conn **, conn **);
+void bench_random_hash(char *);
+int bench_same_content(char *, char *);
+int bench_make_cert(char *, char *, char *);
+long bench_peer_stat(char *, char *);
+long bench_server_metric(int, char *);
+int bench_busy_start(bench_busy *, int, unsigned int);
+int bench_busy_answered(bench_busy *);
+void bench_busy_stop(bench_busy *);
+pid_t bench_share(char *, char *, int, long, char *, int *, hash_record **);
+int bench_log(int, char **);
+int bench_load(int, char **);
+int bench_shards(int, char **);
+int bench_overload(int, char **);
+int bench_transfer(int, char **);
+int bench_conn(int, char **);
+int bench_uring(int, char **);
+int bench_shape(int, char **);
+int bench_compress(int, char **);
+int bench_delta(int, char **);
+int bench_store(int, char **);
+int bench_dht(int, char **);
+int bench_search(int, char **);
+int bench_balance(int, char **);
+int bench_reap(int, char **);
+int bench_owners(int, char **);
+int bench_ingest(int, char **);
+int bench_verify(int, char **);
+int bench_cache(int, char **);
+int bench_tls(int, char **);
+int bench_client(int, char **);
+int bench_hot(int, char **);
+int bench_bundle(int, char **);
+
+#endif /* BENCH_H_ */
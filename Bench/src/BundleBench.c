@@ -0,0 +1,250 @@
+/*
+ ============================================================================
+ Name        : BundleBench.c
+ Author      : Giacomo Persichini
+ Description : Many small files from one peer, in bundles and one connection each
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* strdup() - strcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* unlink() - read() - write() */
+#include <sys/stat.h> /* mkdir() - stat() */
+#include <arpa/inet.h> /* INET_ADDRSTRLEN */
+
+#include "Bench.h"
+#include "Client.h"
+
+/* What the callbacks count */
+typedef struct tally {
+	long	ok;
+	long	notfound;
+	long	failed;
+} tally;
+
+static tally	t;
+
+static void got(void *arg, char *hash, int status, unsigned long long bytes) {
+	if (status == CLIENT_OK)
+		t.ok++;
+	else if (status == CLIENT_NOTFOUND)
+		t.notfound++;
+	else
+		t.failed++;
+}
+
+/* Every file into paths, or only checked, a download each or in bundles. Returns the files per second */
+static double fetch_all(client *c, hash_record *records, char **hashes, char **paths, int num, int bundled) {
+	unsigned long long	start;
+	char				owner[INET_ADDRSTRLEN];
+	int					i;
+
+	memset(&t, 0, sizeof(t));
+	start = bench_usec();
+	if (bundled)
+		client_bundle(c, "127.0.0.1", hashes, paths, num, got, NULL);
+	/*
+	 * The peer closes first and its side of each connection waits in
+	 * TIME_WAIT: over 8 addresses, ports come back 8 times less often.
+	 */
+	else for (i = 0; i < num; i++) {
+		snprintf(owner, sizeof(owner), "127.0.20.%d", i % 8 + 1);
+		client_download(c, records[i].hash, owner, paths != NULL ? paths[i] : NULL, got, NULL);
+	}
+	while (client_run(c, 1000) > 0)
+		;
+	return num / ((bench_usec() - start) / 1e6);
+}
+
+/* Where a run writes the files, a directory of its own */
+static char **make_paths(char *dir, char *name, int num) {
+	char	path[1100],
+			**paths = calloc(num, sizeof(char *));
+	int		i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	mkdir(path, 0755);
+	for (i = 0; paths != NULL && i < num; i++) {
+		snprintf(path, sizeof(path), "%s/%s/got%d", dir, name, i);
+		paths[i] = strdup(path);
+	}
+	return paths;
+}
+
+static void free_paths(char **paths, int num) {
+	int	i;
+
+	for (i = 0; paths != NULL && i < num; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+/* The files written are the ones shared, then they go */
+static long check_and_remove(hash_record *records, char **paths, int num) {
+	long	same = 0;
+	int		i;
+
+	for (i = 0; i < num; i++) {
+		same += bench_same_content(records[i].filename, paths[i]);
+		unlink(paths[i]);
+	}
+	return same;
+}
+
+/*
+ * A peer sending 8 files of 128 KB at 512 KB/s, with one of more than
+ * BUNDLE_FILE_MAX among them: that one comes on its own, and the
+ * listener answers STATS while the bundle is still going. Returns 1 if
+ * something went wrong.
+ */
+static int limited(char *peer, char *dir) {
+	char		path[1100],
+				*block = malloc(BUNDLE_FILE_MAX + 1),
+				*hashes[9];
+	hash_record	*records = NULL,
+				all[9];
+	client		*c = NULL;
+	pid_t		pid = -1;
+	long		served = -1;
+	int			input = -1,
+				bad = 1,
+				fd,
+				i;
+
+	snprintf(path, sizeof(path), "%s/limited", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/limited/shared", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/limited/shared/large", dir);
+	if (block == NULL || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		free(block);
+		return 1;
+	}
+	bench_random_hash(block);
+	memset(block + HASH_LEN, 'x', BUNDLE_FILE_MAX + 1 - HASH_LEN);
+	write(fd, block, BUNDLE_FILE_MAX + 1);
+	close(fd);
+	free(block);
+	snprintf(path, sizeof(path), "%s/limited", dir);
+	if ((pid = bench_share(peer, path, 8, 128 * 1024, "upload-limit=512\n", &input, &records)) == -1
+			|| records == NULL || bench_wait_port("127.0.0.1", PEER_PORT, 5000) == -1
+			|| (c = client_open(1, 0)) == NULL)
+		goto out;
+	/* bench_share() read the first 8, the large one may be any of them */
+	snprintf(path, sizeof(path), "%s/limited/hash", dir);
+	if ((fd = open(path, O_RDONLY)) == -1 || read(fd, all, sizeof(all)) != sizeof(all)) {
+		close(fd);
+		goto out;
+	}
+	close(fd);
+	for (i = 0; i < 9; i++)
+		hashes[i] = all[i].hash;
+	memset(&t, 0, sizeof(t));
+	client_bundle(c, "127.0.0.1", hashes, NULL, 9, got, NULL);
+	while (t.ok + t.notfound + t.failed == 0 && client_run(c, 1000) > 0)
+		;
+	snprintf(path, sizeof(path), "%s/limited", dir);
+	served = bench_peer_stat(path, "bundles_served");
+	while (client_run(c, 1000) > 0)
+		;
+	bad = t.ok != 9 || served != 0;
+	printf("bundle: limited to 512 KB/s, a file over %d KB on its own, STATS answered meanwhile: %s\n",
+			BUNDLE_FILE_MAX / 1024, bad ? "FAILED" : "ok");
+out:
+	client_close(c);
+	if (pid != -1)
+		bench_stop(pid, input);
+	free(records);
+	return bad;
+}
+
+/*
+ * A peer sharing files=N files of size=KB, all downloaded with
+ * parallel=N connections at a time, compression=zlib if asked: one
+ * connection each, then in bundles. First only checked against their
+ * hash, then written out too, where creating the files may cost more
+ * than receiving them: each run in a new directory, one that's just had
+ * as many files deleted is slower to create them in. Before
+ * that, a bundle with a hash the peer doesn't have must get every other
+ * file and that one not found. After, see limited().
+ */
+int bench_bundle(int argc, char **argv) {
+	char		*peer = bench_sarg(argc, argv, "peer", NULL),
+				*dir = bench_tmpdir(),
+				peer_dir[1024],
+				unknown[HASH_LEN + 1],
+				*few[11],
+				**hashes = NULL,
+				**each = NULL,
+				**bundles = NULL;
+	int			num = bench_arg(argc, argv, "files", 2000),
+				parallel = bench_arg(argc, argv, "parallel", 8),
+				options = strcmp(bench_sarg(argc, argv, "compression", "off"), "zlib") == 0 ? OPT_ZLIB : 0,
+				input = -1,
+				bad = 1,
+				write,
+				i;
+	long		size = bench_arg(argc, argv, "size", 1) * 1024;
+	hash_record	*records = NULL;
+	client		*c = NULL;
+	pid_t		pid = -1;
+	double		single,
+				bundled;
+
+	if (peer == NULL || dir == NULL || num < 10 || parallel < 1 || size < HASH_LEN) {
+		fprintf(stderr, "[ERROR] bundle needs peer=PATH and 10 files at least\n");
+		return 1;
+	}
+	snprintf(peer_dir, sizeof(peer_dir), "%s/peer", dir);
+	mkdir(peer_dir, 0755);
+	if ((pid = bench_share(peer, peer_dir, num, size, "", &input, &records)) == -1 || records == NULL
+			|| bench_wait_port("127.0.0.1", PEER_PORT, 5000) == -1 || (c = client_open(parallel, options)) == NULL) {
+		fprintf(stderr, "[ERROR] The peer didn't start, see %s\n", peer_dir);
+		goto out;
+	}
+	hashes = malloc(num * sizeof(char *));
+	for (i = 0; i < num; i++)
+		hashes[i] = records[i].hash;
+
+	/* Only checked, nothing written: the unknown one in the middle mustn't stop the others */
+	bench_random_hash(unknown);
+	for (i = 0; i < 10; i++)
+		few[i < 5 ? i : i + 1] = records[i].hash;
+	few[5] = unknown;
+	memset(&t, 0, sizeof(t));
+	client_bundle(c, "127.0.0.1", few, NULL, 11, got, NULL);
+	while (client_run(c, 1000) > 0)
+		;
+	bad = t.ok != 10 || t.notfound != 1 || t.failed != 0;
+	printf("bundle: 10 files and one the peer doesn't have: %s\n", bad ? "FAILED" : "ok");
+
+	each = make_paths(dir, "each", num);
+	bundles = make_paths(dir, "bundles", num);
+	for (write = 0; write < 2; write++) {
+		single = fetch_all(c, records, hashes, write ? each : NULL, num, 0);
+		bad |= t.ok != num || (write && check_and_remove(records, each, num) != num);
+		bundled = fetch_all(c, records, hashes, write ? bundles : NULL, num, 1);
+		bad |= t.ok != num || (write && check_and_remove(records, bundles, num) != num);
+		printf("bundle: %d files of %ld KB %s, %.0f/s one connection each, %.0f/s in bundles of %d (%.1fx)%s\n",
+				num, size / 1024, write ? "written out" : "checked only", single, bundled, BUNDLE_MAX, bundled / single,
+				options ? ", compressed" : "");
+	}
+	client_close(c);
+	c = NULL;
+	bench_stop(pid, input);
+	pid = -1;
+	bad |= limited(peer, dir);
+	printf("bundle: %s\n", bad ? "FAILED" : "ok");
+out:
+	client_close(c);
+	if (pid != -1)
+		bench_stop(pid, input);
+	free_paths(each, num);
+	free_paths(bundles, num);
+	free(hashes);
+	free(records);
+	bench_rmdir(dir);
+	return bad;
+}
@@ -0,0 +1,296 @@
+/*
+ ============================================================================
+ Name        : CacheBench.c
+ Author      : Giacomo Persichini
+ Description : Large files hashed and moved with each page cache mode, how fast and how much stays cached
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memcpy() - strcmp() */
+#include <fcntl.h> /* open() - posix_fadvise() */
+#include <unistd.h> /* write() - close() - fsync() - unlink() */
+#include <pthread.h> /* stuff with threads */
+#include <signal.h> /* signal() - SIGPIPE */
+#include <sys/mman.h> /* mmap() - mincore() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/socket.h> /* shutdown() */
+
+#include "Bench.h"
+#include "Cache.h"
+#include "Conn.h"
+#include "Delta.h"
+#include "Protocol.h"
+
+#define BLOCK (1 << 20)
+#define FOOTPRINT (2 * CACHE_STEP)	/* Bytes dontneed and direct may leave cached, per file */
+
+typedef struct sender {
+	conn	*c;
+	char	*path;
+	int		ret;
+} sender;
+
+static const char	*names[] = { "normal", "sequential", "dontneed", "direct" };
+
+/* What follows in the xorshift sequence at *x */
+static void noise(char *buffer, size_t n, unsigned long long *x) {
+	size_t	i;
+
+	for (i = 0; i < n; i += sizeof(*x)) {
+		*x ^= *x << 13;
+		*x ^= *x >> 7;
+		*x ^= *x << 17;
+		memcpy(buffer + i, x, n - i < sizeof(*x) ? n - i : sizeof(*x));
+	}
+}
+
+static int write_noise(char *path, unsigned long long size) {
+	unsigned long long	x = 0x2545f4914f6cdd1dULL,
+						written;
+	char				*buffer = malloc(BLOCK);
+	size_t				n;
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (written = 0; fd != -1 && buffer != NULL && written < size; written += n) {
+		n = size - written < BLOCK ? size - written : BLOCK;
+		noise(buffer, n, &x);
+		if (write(fd, buffer, n) != (ssize_t) n)
+			break;
+	}
+	/* Clean pages, or the cache couldn't let go of them */
+	if (fd != -1)
+		fsync(fd);
+	close(fd);
+	free(buffer);
+	return fd != -1 && written == size ? 0 : -1;
+}
+
+/* Out of the page cache, every run starts from the disk */
+static void drop(char *path) {
+	int	fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		return;
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/* Bytes of path in the page cache, mincore() on a mapping of it */
+static unsigned long long resident(char *path) {
+	unsigned long long	pages = 0;
+	unsigned char		*vec;
+	struct stat			st;
+	size_t				num,
+						i;
+	void				*p;
+	long				page = sysconf(_SC_PAGESIZE);
+	int					fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	num = (st.st_size + page - 1) / page;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	if ((vec = malloc(num)) != NULL && mincore(p, st.st_size, vec) == 0)
+		for (i = 0; i < num; i++)
+			pages += vec[i] & 1;
+	free(vec);
+	munmap(p, st.st_size);
+	return pages * page;
+}
+
+static void *serve(void *arg) {
+	sender	*s = arg;
+
+	s->ret = send_file(s->path, s->c);
+	return NULL;
+}
+
+/* path sent to target over the loopback. Returns the MB/s, 0 if it failed */
+static double transfer_file(char *path, char *target, unsigned long long size) {
+	conn				*out,
+						*in;
+	sender				s;
+	pthread_t			thread;
+	unsigned long long	start,
+						took;
+	int					ok;
+
+	if (bench_tcp_pairs(1, &out, &in) == -1)
+		return 0;
+	s.c = out;
+	s.path = path;
+	start = bench_usec();
+	pthread_create(&thread, NULL, serve, &s);
+	ok = receive_file(target, in, FILE_SIZE_MAX);
+	pthread_join(thread, NULL);
+	took = bench_usec() - start;
+	conn_close(out);
+	conn_close(in);
+	return ok && s.ret == 0 ? size / 1048576.0 / (took / 1e6) : 0;
+}
+
+/* What a sparse file's receiver saw: how much, and whether the last block was the one written */
+typedef struct tail {
+	unsigned long long	size,
+						got;
+	char				*expected;
+	int					same;
+} tail;
+
+static void check_tail(void *arg, const char *data, size_t len) {
+	tail				*t = arg;
+	unsigned long long	start = t->size - BLOCK,
+						from;
+
+	if (t->got + len > start) {
+		from = t->got > start ? t->got : start;
+		t->same &= memcmp(data + (from - t->got), t->expected + (from - start), t->got + len - from) == 0;
+	}
+	t->got += len;
+}
+
+/*
+ * A hole of size MB less a block, then a block of noise, sent over the
+ * loopback to /dev/null: more than 32 bits of size, without writing them
+ * out. All of it must arrive and end with the same block. Then again, to
+ * a receiver taking a byte less: nothing may be written.
+ */
+static int sparse_file(char *path, unsigned long long size) {
+	unsigned long long	x = 0x2545f4914f6cdd1dULL,
+						start;
+	conn				*out,
+						*in;
+	sender				s;
+	pthread_t			thread;
+	tail				t = { size, 0, malloc(BLOCK), 1 };
+	char				refused[1100];
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+						ok = 0;
+
+	if (t.expected != NULL)
+		noise(t.expected, BLOCK, &x);
+	if (fd == -1 || t.expected == NULL || pwrite(fd, t.expected, BLOCK, size - BLOCK) != BLOCK
+			|| bench_tcp_pairs(1, &out, &in) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the sparse file\n");
+		close(fd);
+		free(t.expected);
+		return 1;
+	}
+	close(fd);
+	s.c = out;
+	s.path = path;
+	start = bench_usec();
+	pthread_create(&thread, NULL, serve, &s);
+	ok = receive_stream("/dev/null", in, FILE_SIZE_MAX, check_tail, &t);
+	pthread_join(thread, NULL);
+	ok &= s.ret == 0 && t.got == size && t.same;
+	printf("cache: %llu MB sparse, sent %7.1f MB/s, %llu MB received, %s\n", size >> 20,
+			t.got / 1048576.0 / ((bench_usec() - start) / 1e6), t.got >> 20, ok ? "same size and tail" : "FAILED");
+	conn_close(out);
+	conn_close(in);
+
+	if (bench_tcp_pairs(1, &out, &in) == -1)
+		ok = 0;
+	else {
+		/* The receiver hangs up on the sender, writing to it must not kill us */
+		signal(SIGPIPE, SIG_IGN);
+		s.c = out;
+		pthread_create(&thread, NULL, serve, &s);
+		snprintf(refused, sizeof(refused), "%s.refused", path);
+		fd = receive_file(refused, in, size - 1) == 0 && access(refused, F_OK) == -1;
+		/* The sender is still at it */
+		shutdown(in->fd, SHUT_RDWR);
+		pthread_join(thread, NULL);
+		printf("cache: a byte over what the receiver takes: %s\n", fd ? "turned down, nothing written" : "FAILED");
+		ok &= fd;
+		unlink(refused);
+		conn_close(out);
+		conn_close(in);
+	}
+	free(t.expected);
+	unlink(path);
+	return !ok;
+}
+
+/*
+ * A file of size=MB, cold every time: hashed with its manifest, then sent
+ * and received over the loopback, with each page-cache mode and
+ * readahead=KB. How fast, and how much of it is left in the page cache
+ * after. The hashes must agree, and dontneed and direct must leave
+ * little behind. Then with sparse=MB, a file that large sent as above.
+ */
+int bench_cache(int argc, char **argv) {
+	manifest			m;
+	unsigned long long	size = (unsigned long long) bench_arg(argc, argv, "size", 1024) << 20,
+						ahead = (unsigned long long) bench_arg(argc, argv, "readahead", 0) << 10,
+						sparse = (unsigned long long) bench_arg(argc, argv, "sparse", 0) << 20,
+						start,
+						took,
+						cached;
+	char				*dir = bench_tmpdir(),
+						path[1024],
+						target[1024],
+						first[HASH_LEN + 1],
+						hash[HASH_LEN + 1];
+	double				rate;
+	int					bad = 0,
+						mode;
+
+	if (size == 0 || dir == NULL || (sparse != 0 && sparse < BLOCK)) {
+		fprintf(stderr, "[ERROR] cache needs files of 1 MB at least\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/file", dir);
+	snprintf(target, sizeof(target), "%s/received", dir);
+	if (write_noise(path, size) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the file\n");
+		bench_rmdir(dir);
+		return 1;
+	}
+	printf("cache: %llu MB, readahead %llu KB\n", size >> 20, ahead >> 10);
+	for (mode = CACHE_NORMAL; mode <= CACHE_DIRECT; mode++) {
+		cache_init(mode, 0, ahead);
+
+		drop(path);
+		start = bench_usec();
+		if (manifest_build_file(&m, path, hash) == -1) {
+			fprintf(stderr, "[ERROR] cache: %s couldn't hash the file\n", names[mode]);
+			bad = 1;
+			continue;
+		}
+		took = bench_usec() - start;
+		manifest_free(&m);
+		cached = resident(path);
+		if (mode == CACHE_NORMAL)
+			memcpy(first, hash, sizeof(first));
+		bad |= strcmp(hash, first) != 0 || (mode >= CACHE_DONTNEED && cached > FOOTPRINT);
+		printf("cache: %-10s hashed  %7.1f MB/s, %6.1f MB cached after, %s\n", names[mode],
+				size / 1048576.0 / (took / 1e6), cached / 1048576.0, strcmp(hash, first) == 0 ? "same hash" : "FAILED");
+
+		drop(path);
+		unlink(target);
+		rate = transfer_file(path, target, size);
+		cached = resident(path) + resident(target);
+		bad |= rate == 0 || (mode >= CACHE_DONTNEED && cached > 2 * FOOTPRINT);
+		/* Not timed, and dropped again before the next mode */
+		bad |= manifest_build_file(&m, target, hash) == -1 || strcmp(hash, first) != 0;
+		manifest_free(&m);
+		printf("cache: %-10s sent    %7.1f MB/s, %6.1f MB cached after, both ends, %s\n", names[mode], rate,
+				cached / 1048576.0, rate > 0 && strcmp(hash, first) == 0 ? "same content" : "FAILED");
+		drop(target);
+	}
+	cache_init(CACHE_NORMAL, (unsigned long long) CACHE_MIN << 20, 0);
+	if (sparse != 0)
+		bad |= sparse_file(path, sparse);
+	printf("cache: %s\n", bad ? "FAILED" : "ok");
+	bench_rmdir(dir);
+	return bad;
+}
@@ -0,0 +1,271 @@
+/*
+ ============================================================================
+ Name        : ClientBench.c
+ Author      : Giacomo Persichini
+ Description : The client library against a real server and peer, and the blocking calls
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memset() - strcmp() */
+#include <unistd.h> /* close() - unlink() - access() */
+#include <sys/stat.h> /* mkdir() */
+#include <sys/wait.h> /* waitpid() - WNOHANG */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <arpa/inet.h> /* inet_addr() - htons() */
+
+#include "Bench.h"
+#include "Client.h"
+
+#define OWNER "127.0.0.2"	/* Where the peer's list comes from, so that it's the owner */
+
+/* What the callbacks count */
+typedef struct tally {
+	long	ok;
+	long	notfound;
+	long	failed;
+	long	wrong;		/* Found at another owner, or a download not like the original */
+	int		ready;
+	char	**originals;	/* By the index passed as the callbacks' argument */
+	char	*dir;
+} tally;
+
+static tally	t;
+
+static conn *dial(char *from, char *ip, int port) {
+	struct sockaddr_in	addr;
+	conn				*cn;
+	int					fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(from);
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || (cn = conn_open(fd)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	return cn;
+}
+
+/* A server connection as the peer makes it, with the list at path */
+static conn *join(char *from, int port, char *path) {
+	conn	*cn = dial(from, "127.0.0.1", port);
+
+	if (cn != NULL && (handshake(HANDSHAKE_SERVER, cn, 0) != 0 || send_file(path, cn) != 0)) {
+		conn_close(cn);
+		return NULL;
+	}
+	return cn;
+}
+
+static void reset() {
+	t.ok = t.notfound = t.failed = t.wrong = 0;
+}
+
+static void ready(void *arg, int status) {
+	t.ready = status == CLIENT_OK ? 1 : -1;
+}
+
+static void looked_up(void *arg, char *hash, int status, char *owner) {
+	if (status == CLIENT_OK && strcmp(owner, OWNER) == 0)
+		t.ok++;
+	else if (status == CLIENT_NOTFOUND)
+		t.notfound++;
+	else if (status == CLIENT_OK)
+		t.wrong++;
+	else
+		t.failed++;
+}
+
+static void downloaded(void *arg, char *hash, int status, unsigned long long bytes) {
+	char	path[1024];
+	long	i = (long) arg;
+
+	snprintf(path, sizeof(path), "%s/got%ld", t.dir, i);
+	if (status != CLIENT_OK)
+		t.failed++;
+	else if (i < 0 || !bench_same_content(t.originals[i], path))
+		t.wrong++;
+	else
+		t.ok++;
+}
+
+static int run_all(client *c) {
+	int	left;
+
+	while ((left = client_run(c, 1000)) > 0)
+		;
+	return left;
+}
+
+/* One after the other, each from a connection of its own like the peer's downloads */
+static long blocking_downloads(hash_record *records, int num, char *dir, int options) {
+	char	path[1100];
+	conn	*cn;
+	long	ok = 0;
+	int		i;
+
+	for (i = 0; i < num; i++) {
+		snprintf(path, sizeof(path), "%s/got%d", dir, i);
+		if ((cn = dial("127.0.0.1", OWNER, PEER_PORT)) == NULL)
+			continue;
+		if (handshake(HANDSHAKE_PEER, cn, options) == 0 && send_query(cn, records[i].hash) == 0
+				&& receive_file(path, cn, FILE_SIZE_MAX) == 1 && bench_same_content(records[i].filename, path))
+			ok++;
+		conn_close(cn);
+		unlink(path);
+	}
+	return ok;
+}
+
+/*
+ * A peer sharing files=N files of size=KB and a server knowing about
+ * them. lookups=N lookups one at a time on a blocking connection, then
+ * all at once through the client library; every file downloaded one after
+ * the other, then parallel=N at a time by the library (lookup and
+ * download each), with compression=zlib if asked. Unknown hashes must
+ * come back not found, and a download the peer can't serve as failed.
+ */
+int bench_client(int argc, char **argv) {
+	char				*server = bench_sarg(argc, argv, "server", NULL),
+						*peer = bench_sarg(argc, argv, "peer", NULL),
+						*dir = bench_tmpdir(),
+						peer_dir[1024],
+						server_dir[1024],
+						path[1100],
+						owner[FOUND_SIZE],
+						config[256],
+						hash[HASH_LEN + 1];
+	int					num = bench_arg(argc, argv, "files", 500),
+						parallel = bench_arg(argc, argv, "parallel", 32),
+						lookups = bench_arg(argc, argv, "lookups", 20000),
+						port = bench_arg(argc, argv, "port", 13170),
+						options = strcmp(bench_sarg(argc, argv, "compression", "off"), "zlib") == 0 ? OPT_ZLIB : 0,
+						peer_input = -1,
+						server_input = -1,
+						bad = 1,
+						i;
+	long				size = bench_arg(argc, argv, "size", 4) * 1024,
+						ok;
+	hash_record			*records = NULL;
+	conn				*owner_cn = NULL,
+						*cn = NULL;
+	client				*c = NULL;
+	pid_t				peer_pid = -1,
+						server_pid = -1;
+	unsigned long long	start;
+	double				blocking,
+						async;
+
+	if (server == NULL || peer == NULL || dir == NULL || num < 1 || parallel < 1 || lookups < 1 || size < HASH_LEN) {
+		fprintf(stderr, "[ERROR] client needs server=PATH and peer=PATH\n");
+		return 1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.dir = dir;
+	snprintf(peer_dir, sizeof(peer_dir), "%s/peer", dir);
+	snprintf(server_dir, sizeof(server_dir), "%s/server", dir);
+	snprintf(path, sizeof(path), "%s/server/db", dir);
+	mkdir(peer_dir, 0755);
+	mkdir(server_dir, 0755);
+	mkdir(path, 0755);
+	snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=%d\nmax-connections=16\nlog-level=warn\n", port);
+	if ((peer_pid = bench_share(peer, peer_dir, num, size, "", &peer_input, &records)) == -1 || records == NULL
+			|| bench_write_file(server_dir, "config", config) == -1
+			|| (server_pid = bench_spawn(server, server_dir, &server_input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || waitpid(server_pid, NULL, WNOHANG) != 0
+			|| bench_wait_port(OWNER, PEER_PORT, 5000) == -1) {
+		fprintf(stderr, "[ERROR] The server or the peer didn't start, see %s\n", dir);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/hash", peer_dir);
+	if ((owner_cn = join(OWNER, port, path)) == NULL) {
+		fprintf(stderr, "[ERROR] The peer's list couldn't be handed to the server\n");
+		goto out;
+	}
+	t.originals = malloc(num * sizeof(char *));
+	for (i = 0; i < num; i++)
+		t.originals[i] = records[i].filename;
+	bad = 0;
+
+	/* Lookups: a query, its answer, the next one */
+	snprintf(path, sizeof(path), "%s/empty", dir);
+	bench_write_file(dir, "empty", "");
+	if ((cn = join("127.0.0.1", port, path)) == NULL) {
+		fprintf(stderr, "[ERROR] Couldn't connect to the server\n");
+		bad = 1;
+		goto out;
+	}
+	start = bench_usec();
+	for (i = 0, ok = 0; i < lookups; i++)
+		ok += send_query(cn, records[i % num].hash) == 0 && read_reply(cn, owner) == 1 && strcmp(owner, OWNER) == 0;
+	blocking = lookups / ((bench_usec() - start) / 1e6);
+	bad |= ok != lookups;
+
+	c = client_open(parallel, options);
+	if (c == NULL || client_connect(c, "127.0.0.1", port, ready, NULL) == -1) {
+		fprintf(stderr, "[ERROR] The client couldn't connect to the server\n");
+		bad = 1;
+		goto out;
+	}
+	while (t.ready == 0 && client_run(c, 1000) > 0)
+		;
+	start = bench_usec();
+	for (i = 0; i < lookups; i++)
+		client_lookup(c, records[i % num].hash, looked_up, NULL);
+	run_all(c);
+	async = lookups / ((bench_usec() - start) / 1e6);
+	bad |= t.ready != 1 || t.ok != lookups || t.failed + t.wrong > 0;
+	printf("client: %d lookups, %.0f/s one at a time, %.0f/s all at once through the library\n", lookups,
+			blocking, async);
+
+	/* Downloads: one after the other, then through the library */
+	start = bench_usec();
+	ok = blocking_downloads(records, num, dir, options);
+	blocking = num / ((bench_usec() - start) / 1e6);
+	bad |= ok != num;
+	reset();
+	start = bench_usec();
+	for (i = 0; i < num; i++) {
+		snprintf(path, sizeof(path), "%s/got%d", dir, i);
+		client_fetch(c, records[i].hash, path, downloaded, (void *) (long) i);
+	}
+	run_all(c);
+	async = num / ((bench_usec() - start) / 1e6);
+	bad |= t.ok != num || t.failed + t.wrong > 0;
+	printf("client: %d files of %ld KB, %.0f/s one after the other, %.0f/s %d at a time through the library"
+			" (%.1f MB/s)%s\n", num, size / 1024, blocking, async, parallel, async * size / 1048576,
+			options ? ", compressed" : "");
+	for (i = 0; i < num; i++) {
+		snprintf(path, sizeof(path), "%s/got%d", dir, i);
+		unlink(path);
+	}
+
+	/* Nobody has it, and a peer asked for what it doesn't have */
+	reset();
+	bench_random_hash(hash);
+	client_lookup(c, hash, looked_up, NULL);
+	client_download(c, hash, OWNER, path, downloaded, (void *) -1L);
+	run_all(c);
+	bad |= t.notfound != 1 || t.failed != 1 || t.ok + t.wrong > 0 || access(path, F_OK) == 0;
+	printf("client: unknown hash %s, download from the wrong peer %s\n", t.notfound == 1 ? "not found" : "FAILED",
+			t.failed == 1 ? "failed" : "FAILED");
+	printf("client: %s\n", bad ? "FAILED" : "ok");
+out:
+	client_close(c);
+	conn_close(cn);
+	conn_close(owner_cn);
+	if (server_pid != -1)
+		bench_stop(server_pid, server_input);
+	if (peer_pid != -1)
+		bench_stop(peer_pid, peer_input);
+	free(t.originals);
+	free(records);
+	bench_rmdir(dir);
+	return bad;
+}
@@ -0,0 +1,206 @@
+/*
+ ============================================================================
+ Name        : CompressBench.c
+ Author      : Giacomo Persichini
+ Description : Compression ratio and CPU cost of transfers, by kind of file
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* rand() */
+#include <string.h> /* memset() */
+#include <time.h> /* clock_gettime() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* write() - close() */
+#include <netinet/in.h> /* IPPROTO_TCP */
+#include <linux/tcp.h> /* TCP_INFO - tcpi_bytes_received */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Codec.h"
+#include "Conn.h"
+#include "Engine.h"
+#include "Protocol.h"
+
+typedef struct side {
+	conn	*c;
+	char	*path;
+	int		use_engine;
+	int		ok;
+} side;
+
+static char	*words[] = { "the", "peer", "server", "file", "hash", "list", "sent", "received", "connection",
+		"[INFO]", "[ERROR]", "listener", "download", "upload", "bytes", "timeout", "select()", "config",
+		"shared", "folder", "int", "char", "return", "if", "while", "for", "static", "void", "->", "{", "}",
+		"/*", "*/", "=", "==", "NULL", "struct", "conn", "size_t", "printf(", ");" };
+
+static unsigned long long cpu_usec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Log lines and source code, what shared folders are mostly made of */
+static void write_text(int fd, unsigned long long size) {
+	char				line[256];
+	unsigned long long	written = 0;
+	int					len,
+						i;
+
+	while (written < size) {
+		len = snprintf(line, sizeof(line), "%02d:%02d:%02d.%03d %5d", rand() % 24, rand() % 60, rand() % 60,
+				rand() % 1000, rand() % 65536);
+		for (i = 0; i < 4 + rand() % 10 && len < 200; i++)
+			len += snprintf(line + len, sizeof(line) - len, " %s", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+		line[len++] = '\n';
+		if (written + len > size)
+			len = size - written;
+		write(fd, line, len);
+		written += len;
+	}
+}
+
+/* Archives, pictures and videos look like noise to the compressor */
+static void write_noise(int fd, unsigned long long size) {
+	char				block[4096];
+	unsigned long long	written;
+	size_t				i,
+						n;
+
+	for (written = 0; written < size; written += n) {
+		for (i = 0; i < sizeof(block); i++)
+			block[i] = (char) rand();
+		n = size - written < sizeof(block) ? size - written : sizeof(block);
+		write(fd, block, n);
+	}
+}
+
+/* What conn_to_server() sends: names far shorter than their 1024 bytes */
+static void write_hash_list(int fd, unsigned long long size) {
+	hash_record	rec;
+	long		i;
+
+	for (i = 0; (unsigned long long) (i + 1) * sizeof(rec) <= size; i++) {
+		memset(&rec, 0, sizeof(rec));
+		bench_random_hash(rec.hash);
+		snprintf(rec.filename, sizeof(rec.filename), "/home/user/shared/documents/file-%ld.txt", i);
+		write(fd, &rec, sizeof(rec));
+	}
+}
+
+static void *sender(void *arg) {
+	side		*s = arg;
+	engine		*e;
+	transfer	t;
+
+	if (!s->use_engine) {
+		s->ok = send_file(s->path, s->c) == 0;
+		return NULL;
+	}
+	e = engine_open(1);
+	memset(&t, 0, sizeof(t));
+	if (e != NULL && engine_upload(e, &t, s->c, s->path) == 0) {
+		s->ok = engine_wait(e, &t) == ENGINE_DONE;
+		close(t.file);
+	}
+	engine_close(e);
+	return NULL;
+}
+
+static void *receiver(void *arg) {
+	side		*s = arg;
+	engine		*e;
+	transfer	t;
+
+	if (!s->use_engine) {
+		s->ok = receive_file(s->path, s->c, FILE_SIZE_MAX);
+		return NULL;
+	}
+	e = engine_open(1);
+	memset(&t, 0, sizeof(t));
+	if (e != NULL && engine_download(e, &t, s->c, s->path) == 0) {
+		s->ok = engine_wait(e, &t) == ENGINE_DONE;
+		close(t.file);
+	}
+	engine_close(e);
+	return NULL;
+}
+
+/* One file over the loopback; the bytes on the wire come from the kernel */
+static int run(char *kind, char *source, char *target, unsigned long long size, int use_engine, int options) {
+	conn				*out,
+						*in;
+	side				s,
+						r;
+	pthread_t			threads[2];
+	struct tcp_info		info;
+	socklen_t			len = sizeof(info);
+	unsigned long long	start,
+						cpu;
+	double				elapsed,
+						wire;
+	int					bad;
+
+	if (bench_tcp_pairs(1, &out, &in) == -1)
+		return 1;
+	/* What handshake() would agree on, it's checked by the conn command */
+	out->options = in->options = options;
+	s.c = out;
+	s.path = source;
+	r.c = in;
+	r.path = target;
+	s.use_engine = r.use_engine = use_engine;
+	s.ok = r.ok = 0;
+	start = bench_usec();
+	cpu = cpu_usec();
+	pthread_create(&threads[0], NULL, sender, &s);
+	pthread_create(&threads[1], NULL, receiver, &r);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	cpu = cpu_usec() - cpu;
+	elapsed = (bench_usec() - start) / 1e6;
+	memset(&info, 0, sizeof(info));
+	getsockopt(in->fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+	wire = info.tcpi_bytes_received;
+	bad = !s.ok || !r.ok || !bench_same_content(source, target);
+	printf("compress: %-10s %-6s %-4s %6.2fx, %8.1f MB on the wire, %6.2f ms CPU per MB, %7.1f MB/s, %s\n", kind,
+			use_engine ? "engine" : "loop", options & OPT_ZLIB ? "zlib" : "off", size / (wire ? wire : 1),
+			wire / 1048576, cpu / 1e3 / (size / 1048576.0), size / elapsed / 1048576, bad ? "FAILED" : "ok");
+	conn_close(out);
+	conn_close(in);
+	return bad;
+}
+
+int bench_compress(int argc, char **argv) {
+	unsigned long long	size = bench_arg(argc, argv, "size", 64) << 20;
+	char				*dir = bench_tmpdir(),
+						source[1024],
+						target[1024],
+						*kinds[] = { "text", "compressed", "hash-list" };
+	void				(*makers[])(int, unsigned long long) = { write_text, write_noise, write_hash_list };
+	engine				*probe = engine_open(1);
+	int					bad = 0,
+						engines = probe != NULL ? 2 : 1,
+						fd,
+						i,
+						j;
+
+	engine_close(probe);
+	if (dir == NULL)
+		return 1;
+	snprintf(source, sizeof(source), "%s/source", dir);
+	snprintf(target, sizeof(target), "%s/target", dir);
+	srand(7);
+	for (i = 0; i < 3; i++) {
+		fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		makers[i](fd, size);
+		close(fd);
+		for (j = 0; j < engines; j++) {
+			bad |= run(kinds[i], source, target, size, j, 0);
+			bad |= run(kinds[i], source, target, size, j, OPT_ZLIB);
+		}
+	}
+	bench_rmdir(dir);
+	return bad;
+}
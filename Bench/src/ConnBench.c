@@ -0,0 +1,378 @@
+/*
+ ============================================================================
+ Name        : ConnBench.c
+ Author      : Giacomo Persichini
+ Description : Checks and measures the buffered connections
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() */
+#include <string.h> /* memset() - memcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - close() */
+#include <sys/socket.h> /* socketpair() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Protocol.h"
+
+#define FRAME_MAX 3000
+#define PROTOCOL_FILE_SIZE 300000	/* Not a multiple of the transfer chunk */
+
+typedef struct stream {
+	int		fd;
+	long	frames;
+	long	bytes;
+	long	syscalls;
+	int		chunk;
+	char	*path;
+} stream;
+
+static long	reads,
+			writes;
+
+static void count_read(size_t bytes) {
+	(void) bytes;
+	reads++;
+}
+
+static void count_write(size_t bytes) {
+	(void) bytes;
+	writes++;
+}
+
+static int write_full(int fd, const void *buffer, size_t len) {
+	const char	*p = buffer;
+	ssize_t		bytes;
+
+	while (len > 0) {
+		if ((bytes = write(fd, p, len)) <= 0)
+			return -1;
+		p += bytes;
+		len -= bytes;
+	}
+	return 0;
+}
+
+static void fill_frame(char *frame, long seq, int len) {
+	int	i;
+
+	for (i = 0; i < len; i++)
+		frame[i] = (char) (seq * 7 + i);
+}
+
+/* Frames cut in random pieces, the way TCP is free to deliver them */
+static void *chopped_writer(void *arg) {
+	stream	*s = arg;
+	char	*out = malloc(s->frames * (FRAME_MAX + sizeof(int))),
+			*p = out;
+	long	i;
+	int		len,
+			piece;
+
+	srand(2);
+	for (i = 0; i < s->frames; i++) {
+		len = rand() % FRAME_MAX;
+		memcpy(p, &len, sizeof(len));
+		fill_frame(p + sizeof(len), i, len);
+		p += sizeof(len) + len;
+	}
+	s->bytes = p - out;
+	for (p = out; p < out + s->bytes; p += piece) {
+		piece = 1 + rand() % 4096;
+		if (piece > out + s->bytes - p)
+			piece = out + s->bytes - p;
+		if (write_full(s->fd, p, piece) == -1)
+			break;
+	}
+	free(out);
+	close(s->fd);
+	return NULL;
+}
+
+/* Half the frames are read blocking, half from what's already buffered */
+static int check_framing(long frames) {
+	stream		s;
+	pthread_t	writer;
+	conn		*c;
+	char		frame[FRAME_MAX],
+				expected[FRAME_MAX],
+				*p;
+	int			fds[2],
+				len,
+				bad = 0;
+	long		i;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	s.fd = fds[1];
+	s.frames = frames;
+	c = conn_open(fds[0]);
+	pthread_create(&writer, NULL, chopped_writer, &s);
+	for (i = 0; i < frames && !bad; i++) {
+		if (i % 2 == 0) {
+			if (conn_read(c, &len, sizeof(len)) == -1 || len < 0 || len >= FRAME_MAX
+					|| conn_read(c, frame, len) == -1)
+				bad = 1;
+			p = frame;
+		}
+		else {
+			while ((p = conn_frame(c, sizeof(len))) == NULL)
+				if (conn_fill(c) <= 0)
+					break;
+			if (p == NULL) {
+				bad = 1;
+				break;
+			}
+			memcpy(&len, p, sizeof(len));
+			while ((p = conn_frame(c, len)) == NULL)
+				if (conn_fill(c) <= 0)
+					break;
+			bad = p == NULL;
+		}
+		if (!bad) {
+			fill_frame(expected, i, len);
+			bad = memcmp(p, expected, len) != 0;
+		}
+	}
+	if (!bad && conn_fill(c) != 0)
+		bad = 1;	/* Nothing may be left after the last frame */
+	pthread_join(writer, NULL);
+	conn_close(c);
+	printf("conn: framing %s, %ld frames in random pieces\n", bad ? "FAILED" : "ok", frames);
+	return bad;
+}
+
+/*
+ * The peer's side: hand-shake, hash list, then two queries right behind
+ * it. chunk holds the options it offers.
+ */
+static void *protocol_peer(void *arg) {
+	stream	*s = arg;
+	conn	*c = conn_open(s->fd);
+	char	owner[FOUND_SIZE],
+			hash[HASH_LEN + 1];
+
+	s->frames = 0;
+	bench_random_hash(hash);
+	if (handshake(HANDSHAKE_SERVER, c, s->chunk) == 0 && send_file(s->path, c) == 0
+			&& send_query(c, hash) == 0 && send_query(c, hash) == 0
+			&& read_reply(c, owner) == 1 && strcmp(owner, "10.0.0.7") == 0
+			&& read_reply(c, owner) == 0)
+		s->frames = 1;
+	conn_close(c);
+	return NULL;
+}
+
+static int check_protocol(int options) {
+	stream		s;
+	pthread_t	peer;
+	conn		*c;
+	char		*dir = bench_tmpdir(),
+				*content = malloc(PROTOCOL_FILE_SIZE),
+				*back = malloc(PROTOCOL_FILE_SIZE + 1),
+				sent[1024],
+				got[1024],
+				hash[HASH_LEN + 1];
+	int			fds[2],
+				fd,
+				bad = 0;
+
+	if (dir == NULL)
+		return 1;
+	snprintf(sent, sizeof(sent), "%s/sent", dir);
+	snprintf(got, sizeof(got), "%s/got", dir);
+	fill_frame(content, 3, PROTOCOL_FILE_SIZE);
+	fd = open(sent, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	write_full(fd, content, PROTOCOL_FILE_SIZE);
+	close(fd);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	s.fd = fds[1];
+	s.path = sent;
+	s.chunk = options;
+	c = conn_open(fds[0]);
+	pthread_create(&peer, NULL, protocol_peer, &s);
+	if (handshake_reply(HANDSHAKE_SERVER, c, options) == -1 || receive_file(got, c, FILE_SIZE_MAX) != 1
+			|| read_query(c, hash) == -1 || send_reply(c, "10.0.0.7") == -1
+			|| read_query(c, hash) == -1 || send_reply(c, NULL) == -1)
+		bad = 1;
+	pthread_join(peer, NULL);
+
+	/* The received file must be the same, not a byte more */
+	if ((fd = open(got, O_RDONLY)) == -1)
+		bad = 1;
+	else {
+		if (read(fd, back, PROTOCOL_FILE_SIZE + 1) != PROTOCOL_FILE_SIZE
+				|| memcmp(back, content, PROTOCOL_FILE_SIZE) != 0)
+			bad = 1;
+		close(fd);
+	}
+	bad = bad || !s.frames || c->options != options;
+	bench_rmdir(dir);
+	free(content);
+	free(back);
+	printf("conn: protocol %s, hand-shake, hash list and queries sent back to back%s\n", bad ? "FAILED" : "ok",
+			options & OPT_ZLIB ? ", compressed" : "");
+	conn_close(c);
+	return bad;
+}
+
+/* Queries one at a time, like the programs used to, or batched through a conn */
+static void *query_writer(void *arg) {
+	stream	*s = arg;
+	conn	*c;
+	char	query[QUERY_SIZE];
+	long	i;
+
+	memset(query, 'q', sizeof(query));
+	if (s->chunk == 0) {
+		for (i = 0; i < s->frames; i++, s->syscalls++)
+			write_full(s->fd, query, sizeof(query));
+		close(s->fd);
+		return NULL;
+	}
+	c = conn_open(s->fd);
+	c->on_write = count_write;
+	for (i = 0; i < s->frames; i++)
+		conn_write(c, query, sizeof(query));
+	conn_flush(c);
+	conn_close(c);
+	return NULL;
+}
+
+static void run_queries(long frames, int buffered) {
+	stream				s;
+	pthread_t			writer;
+	conn				*c = NULL;
+	char				query[QUERY_SIZE];
+	int					fds[2];
+	long				i,
+						calls = 0;
+	ssize_t				bytes;
+	size_t				got;
+	unsigned long long	start;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	memset(&s, 0, sizeof(s));
+	s.fd = fds[1];
+	s.frames = frames;
+	s.chunk = buffered;
+	reads = writes = 0;
+	start = bench_usec();
+	pthread_create(&writer, NULL, query_writer, &s);
+	if (buffered) {
+		c = conn_open(fds[0]);
+		c->on_read = count_read;
+		for (i = 0; i < frames; i++)
+			conn_read(c, query, sizeof(query));
+		conn_close(c);
+		calls = reads + writes;
+	}
+	else {
+		for (i = 0; i < frames; i++)
+			for (got = 0; got < sizeof(query); got += bytes, calls++)
+				if ((bytes = read(fds[0], query + got, sizeof(query) - got)) <= 0)
+					break;
+		close(fds[0]);
+	}
+	pthread_join(writer, NULL);
+	start = bench_usec() - start;
+	calls += s.syscalls;
+	printf("conn: %-8s %8.0f queries/s, %.3f syscalls per query\n", buffered ? "buffered" : "raw",
+			frames * 1e6 / (start ? start : 1), (double) calls / frames);
+}
+
+/* A file's worth of bytes, in the old 1 KB pieces or through a conn */
+static void *bulk_writer(void *arg) {
+	stream	*s = arg;
+	char	*buffer = calloc(1, TRANSFER_CHUNK);
+	conn	*c;
+	long	left;
+	int		n;
+
+	if (s->chunk != 0) {
+		for (left = s->bytes; left > 0; left -= n, s->syscalls++) {
+			n = left < s->chunk ? left : s->chunk;
+			write_full(s->fd, buffer, n);
+		}
+		close(s->fd);
+	}
+	else {
+		c = conn_open(s->fd);
+		c->on_write = count_write;
+		for (left = s->bytes; left > 0; left -= n) {
+			n = left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK;
+			conn_write(c, buffer, n);
+		}
+		conn_flush(c);
+		conn_close(c);
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void run_bulk(long megabytes, int chunk) {
+	stream				s;
+	pthread_t			writer;
+	conn				*c = NULL;
+	char				*buffer = malloc(TRANSFER_CHUNK);
+	int					fds[2];
+	long				left,
+						calls = 0;
+	ssize_t				bytes;
+	unsigned long long	start;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	memset(&s, 0, sizeof(s));
+	s.fd = fds[1];
+	s.bytes = megabytes << 20;
+	s.chunk = chunk;
+	reads = writes = 0;
+	start = bench_usec();
+	pthread_create(&writer, NULL, bulk_writer, &s);
+	if (chunk != 0) {
+		for (left = s.bytes; left > 0; left -= bytes, calls++)
+			if ((bytes = read(fds[0], buffer, chunk)) <= 0)
+				break;
+		close(fds[0]);
+	}
+	else {
+		c = conn_open(fds[0]);
+		c->on_read = count_read;
+		for (left = s.bytes; left > 0; left -= bytes) {
+			bytes = left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK;
+			if (conn_read(c, buffer, bytes) == -1)
+				break;
+		}
+		conn_close(c);
+		calls = reads + writes;
+	}
+	pthread_join(writer, NULL);
+	start = bench_usec() - start;
+	calls += s.syscalls;
+	printf("conn: %-8s %8.1f MB/s, %ld syscalls for %ld MB\n", chunk ? "1 KB" : "buffered",
+			megabytes * 1e6 / (start ? start : 1), calls, megabytes);
+	free(buffer);
+}
+
+int bench_conn(int argc, char **argv) {
+	long	frames = bench_arg(argc, argv, "frames", 20000),
+			queries = bench_arg(argc, argv, "queries", 200000),
+			size = bench_arg(argc, argv, "size", 256);
+	int		bad;
+
+	bad = check_framing(frames);
+	bad |= check_protocol(0);
+	bad |= check_protocol(OPT_ZLIB);
+	if (queries > 0) {
+		run_queries(queries, 0);
+		run_queries(queries, 1);
+	}
+	if (size > 0) {
+		run_bulk(size, 1024);
+		run_bulk(size, 0);
+	}
+	return bad;
+}
@@ -0,0 +1,230 @@
+/*
+ ============================================================================
+ Name        : DeltaBench.c
+ Author      : Giacomo Persichini
+ Description : Updates an edited file by its changed chunks, over the loopback
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - qsort() */
+#include <string.h> /* memset() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - close() */
+#include <netinet/in.h> /* IPPROTO_TCP */
+#include <linux/tcp.h> /* TCP_INFO - tcpi_bytes_received */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Delta.h"
+#include "Protocol.h"
+
+#define BLOCK (1 << 20)
+
+typedef struct edit {
+	unsigned long long	offset;
+	int					kind;	/* 0 overwrites, 1 inserts, 2 deletes */
+} edit;
+
+typedef struct server_side {
+	conn		*c;
+	char		*path;
+	char		*manifest_path;
+	long long	sent;
+} server_side;
+
+static unsigned long long	state = 88172645463325252ULL;
+
+/* rand() is far too slow for gigabytes */
+static unsigned long long next() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static void fill(char *buffer, size_t len) {
+	unsigned long long	x;
+	size_t				i;
+
+	for (i = 0; i < len; i += sizeof(x)) {
+		x = next();
+		memcpy(buffer + i, &x, len - i < sizeof(x) ? len - i : sizeof(x));
+	}
+}
+
+/* Builds, artifacts and disk images look like noise, nothing to compress */
+static int write_noise(char *path, unsigned long long size, char *buffer) {
+	unsigned long long	written;
+	size_t				n;
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (written = 0; fd != -1 && written < size; written += n) {
+		n = size - written < BLOCK ? size - written : BLOCK;
+		fill(buffer, n);
+		if (write(fd, buffer, n) != (ssize_t) n)
+			break;
+	}
+	close(fd);
+	return fd != -1 && written == size ? 0 : -1;
+}
+
+/* len bytes of from go to to, from where each one is */
+static int copy(int from, int to, unsigned long long len, char *buffer) {
+	ssize_t	n;
+
+	while (len > 0) {
+		n = read(from, buffer, len < BLOCK ? len : BLOCK);
+		if (n <= 0 || write(to, buffer, n) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static int by_offset(const void *a, const void *b) {
+	const edit	*x = a,
+				*y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * The new version: edits spread over the old one, each changing len
+ * bytes. Insertions and deletions move everything after them, fixed size
+ * blocks would all look changed from there on.
+ */
+static int write_edited(char *old, char *new, unsigned long long size, int edits, size_t len, char *buffer) {
+	edit				*e = calloc(edits, sizeof(edit));
+	unsigned long long	at = 0;
+	int					in = open(old, O_RDONLY),
+						out = open(new, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+						bad = e == NULL || in == -1 || out == -1,
+						i;
+
+	for (i = 0; i < edits && !bad; i++) {
+		e[i].offset = next() % (size - len);
+		e[i].kind = i % 3;
+	}
+	if (!bad)
+		qsort(e, edits, sizeof(edit), by_offset);
+	for (i = 0; i < edits && !bad; i++) {
+		/* Edits that would overlap the one before come right after it */
+		if (e[i].offset < at)
+			e[i].offset = at;
+		bad |= copy(in, out, e[i].offset - at, buffer) == -1;
+		at = e[i].offset;
+		if (e[i].kind != 1) {
+			lseek(in, len, SEEK_CUR);
+			at += len;
+		}
+		if (e[i].kind != 2) {
+			fill(buffer, len);
+			bad |= write(out, buffer, len) != (ssize_t) len;
+		}
+	}
+	if (!bad && at < size)
+		bad |= copy(in, out, size - at, buffer) == -1;
+	free(e);
+	close(in);
+	close(out);
+	return bad ? -1 : 0;
+}
+
+static void *serve(void *arg) {
+	server_side	*s = arg;
+
+	s->sent = delta_serve(s->c, s->path, s->manifest_path);
+	return NULL;
+}
+
+int bench_delta(int argc, char **argv) {
+	unsigned long long	size = bench_arg(argc, argv, "size", 1024) << 20,
+						start,
+						built,
+						took;
+	long				percent = bench_arg(argc, argv, "percent", 2);
+	int					edits = bench_arg(argc, argv, "edits", 64),
+						bad = 1,
+						from,
+						to;
+	size_t				len = size * percent / 100 / (edits > 0 ? edits : 1);
+	char				*dir = bench_tmpdir(),
+						*buffer = malloc(BLOCK),
+						old[1024],
+						new[1024],
+						target[1024],
+						manifest_path[1024],
+						hash[HASH_LEN + 1];
+	manifest			m;
+	conn				*out,
+						*in;
+	server_side			s;
+	delta_stats			ds;
+	pthread_t			thread;
+	struct tcp_info		info;
+	socklen_t			info_len = sizeof(info);
+
+	if (dir == NULL || buffer == NULL || edits < 1 || len == 0 || len >= size) {
+		fprintf(stderr, "[ERROR] size, percent and edits must leave something to edit\n");
+		free(buffer);
+		return 1;
+	}
+	snprintf(old, sizeof(old), "%s/old", dir);
+	snprintf(new, sizeof(new), "%s/new", dir);
+	snprintf(target, sizeof(target), "%s/target", dir);
+	snprintf(manifest_path, sizeof(manifest_path), "%s/manifest", dir);
+	if (write_noise(old, size, buffer) == -1 || write_edited(old, new, size, edits, len, buffer) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the files\n");
+		goto out;
+	}
+	/* The downloader's copy of the old version, rebuilt in place */
+	from = open(old, O_RDONLY);
+	to = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bad = copy(from, to, size, buffer) == -1;
+	close(from);
+	close(to);
+
+	/* What write_hash_list() does for every shared file */
+	start = bench_usec();
+	if (bad || manifest_build_file(&m, new, hash) == -1 || manifest_save(&m, manifest_path) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't build the manifest\n");
+		bad = 1;
+		goto out;
+	}
+	built = bench_usec() - start;
+	printf("delta: manifest of %.1f MB, %lu chunks of %.1f KB on average, built at %.1f MB/s\n",
+			m.size / 1048576.0, (unsigned long) m.count, m.size / 1024.0 / m.count, m.size / 1048576.0 / (built / 1e6));
+
+	if (bench_tcp_pairs(1, &out, &in) == -1) {
+		manifest_free(&m);
+		bad = 1;
+		goto out;
+	}
+	/* What handshake() would agree on between two peers */
+	out->options = in->options = OPT_DELTA | (strcmp(bench_sarg(argc, argv, "compression", "off"), "zlib") == 0 ? OPT_ZLIB : 0);
+	s.c = out;
+	s.path = new;
+	s.manifest_path = manifest_path;
+	start = bench_usec();
+	pthread_create(&thread, NULL, serve, &s);
+	bad = delta_receive(in, hash, target, &ds) == -1;
+	pthread_join(thread, NULL);
+	took = bench_usec() - start;
+	memset(&info, 0, sizeof(info));
+	getsockopt(in->fd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+	bad |= s.sent == -1 || !bench_same_content(new, target) || ds.fetched >= m.size;
+	printf("delta: %d edits of %lu KB, %ld%% of %.1f MB, %.1f MB reused, %.1f MB fetched\n", edits,
+			(unsigned long) len / 1024, percent, size / 1048576.0, ds.reused / 1048576.0, ds.fetched / 1048576.0);
+	printf("delta: %.1f MB on the wire instead of %.1f MB (%.2f%%), updated in %.2f s, %s\n",
+			info.tcpi_bytes_received / 1048576.0, m.size / 1048576.0, 100.0 * info.tcpi_bytes_received / m.size,
+			took / 1e6, bad ? "FAILED" : "ok");
+	conn_close(out);
+	conn_close(in);
+	manifest_free(&m);
+out:
+	free(buffer);
+	bench_rmdir(dir);
+	return bad;
+}
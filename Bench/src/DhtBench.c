@@ -0,0 +1,241 @@
+/*
+ ============================================================================
+ Name        : DhtBench.c
+ Author      : Giacomo Persichini
+ Description : Hundreds of DHT nodes on the loopback, lookups without the server
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() */
+#include <string.h> /* memset() */
+#include <unistd.h> /* close() */
+#include <sys/epoll.h> /* epoll_create1() - epoll_wait() */
+#include <sys/socket.h> /* recv() */
+#include <arpa/inet.h> /* ntohs() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Dht.h"
+
+typedef struct network {
+	dht				**nodes;
+	char			*down;		/* Nodes that stopped answering */
+	int				num;
+	int				epfd;
+	int				stop;
+} network;
+
+/* One thread answers for every node, like each peer's listener would */
+static void *serve(void *arg) {
+	network				*net = arg;
+	struct epoll_event	events[64];
+	char				junk[512];
+	long				i;
+	int					n,
+						j;
+
+	while (!__atomic_load_n(&net->stop, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(net->epfd, events, 64, 50);
+		for (j = 0; j < n; j++) {
+			i = events[j].data.u64;
+			if (__atomic_load_n(&net->down[i], __ATOMIC_RELAXED))
+				while (recv(dht_fd(net->nodes[i]), junk, sizeof(junk), MSG_DONTWAIT) > 0)
+					;
+			else
+				while (dht_handle(net->nodes[i]) != -1)
+					;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Every key is announced by one node, then looked up from random ones:
+ * found means the owner that came back is the one that announced it.
+ */
+static int lookups(network *net, char (*keys)[HASH_LEN + 1], int *announcer, int num_keys, int num, char *what) {
+	struct sockaddr_in	owners[DHT_MAX_OWNERS];
+	dht_stats			stats;
+	bench_samples		hops,
+						latency;
+	long				rpcs = 0,
+						timeouts = 0;
+	int					found = 0,
+						from,
+						key,
+						n,
+						i,
+						j;
+
+	memset(&hops, 0, sizeof(hops));
+	memset(&latency, 0, sizeof(latency));
+	for (i = 0; i < num; i++) {
+		do
+			from = rand() % net->num;
+		while (net->down[from]);
+		key = rand() % num_keys;
+		n = dht_find(net->nodes[from], keys[key], owners, DHT_MAX_OWNERS, &stats);
+		for (j = 0; j < n; j++)
+			if (ntohs(owners[j].sin_port) == 10000 + announcer[key]) {
+				found++;
+				break;
+			}
+		bench_sample(&hops, stats.hops);
+		bench_sample(&latency, stats.usec);
+		rpcs += stats.rpcs;
+		timeouts += stats.timeouts;
+	}
+	printf("dht: %s, %d lookups, %.1f%% found, %.1f requests and %.2f timeouts each\n", what, num, 100.0 * found / num,
+			(double) rpcs / num, (double) timeouts / num);
+	printf("dht: %s, hops p50 %u, p99 %u, max %u, latency p50 %u us, p99 %u us\n", what,
+			bench_percentile(&hops, 0.5), bench_percentile(&hops, 0.99), bench_percentile(&hops, 1.0),
+			bench_percentile(&latency, 0.5), bench_percentile(&latency, 0.99));
+	free(hops.values);
+	free(latency.values);
+	return found;
+}
+
+/*
+ * Stores sent to a node from one address, as many owners' ports and keys
+ * as it likes, like a spoofed sender would: a key keeps DHT_MAX_OWNERS
+ * records, the node DHT_MAX_VALUES. A store is "FSK1", type 7, a
+ * transaction id, the sender's id and port (0, not a node), the key and
+ * the owner's port. Returns 1 if more were kept.
+ */
+static int flood() {
+	struct sockaddr_in	addr;
+	unsigned char		msg[53];
+	dht					*node = dht_open(0);
+	int					sock = socket(AF_INET, SOCK_DGRAM, 0),
+						per_key = 0,
+						all = 0,
+						i,
+						j;
+
+	if (node == NULL || sock == -1) {
+		dht_close(node);
+		if (sock != -1)
+			close(sock);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(dht_port(node));
+	memset(msg, 0, sizeof(msg));
+	memcpy(msg, "FSK1", 4);
+	msg[4] = 7;
+	/* One key first, then new keys: a few at a time, the node's socket would drop the rest */
+	for (i = 0; i < DHT_MAX_VALUES + DHT_MAX_VALUES / 4 + 2 * DHT_MAX_OWNERS; i++) {
+		if (i == 2 * DHT_MAX_OWNERS) {
+			while (dht_handle(node) != -1)
+				;
+			per_key = dht_records(node);
+		}
+		if (i == 0 || i >= 2 * DHT_MAX_OWNERS)
+			for (j = 31; j < 51; j++)
+				msg[j] = rand();
+		msg[51] = i >> 8;
+		msg[52] = i;
+		sendto(sock, msg, sizeof(msg), 0, (struct sockaddr *) &addr, sizeof(addr));
+		if (i % 16 == 15)
+			while (dht_handle(node) != -1)
+				;
+	}
+	while (dht_handle(node) != -1)
+		;
+	all = dht_records(node);
+	printf("dht: a flood of stores kept %d records of one key, %d in all: %s\n", per_key, all,
+			per_key == DHT_MAX_OWNERS && all == DHT_MAX_VALUES ? "ok" : "FAILED");
+	dht_close(node);
+	close(sock);
+	return per_key != DHT_MAX_OWNERS || all != DHT_MAX_VALUES;
+}
+
+int bench_dht(int argc, char **argv) {
+	network				net;
+	pthread_t			thread;
+	struct epoll_event	ev;
+	dht_stats			stats;
+	char				(*keys)[HASH_LEN + 1],
+						bootstrap[64];
+	int					*announcer,
+						num_keys = bench_arg(argc, argv, "keys", 1000),
+						num_lookups = bench_arg(argc, argv, "lookups", 1000),
+						down = bench_arg(argc, argv, "down", 10),
+						bad = 0,
+						stored = 0,
+						contacts = 0,
+						i;
+	unsigned long long	start;
+
+	memset(&net, 0, sizeof(net));
+	net.num = bench_arg(argc, argv, "nodes", 300);
+	if (net.num < 2 || num_keys < 1 || num_lookups < 1 || down < 0 || down > 90) {
+		fprintf(stderr, "[ERROR] nodes must be 2 at least, down at most 90%%\n");
+		return 1;
+	}
+	net.nodes = calloc(net.num, sizeof(dht *));
+	net.down = calloc(net.num, 1);
+	keys = malloc(num_keys * sizeof(*keys));
+	announcer = malloc(num_keys * sizeof(int));
+	net.epfd = epoll_create1(0);
+	srand(bench_arg(argc, argv, "seed", 1));
+	bad |= flood();
+	for (i = 0; i < net.num; i++) {
+		if ((net.nodes[i] = dht_open(0)) == NULL) {
+			fprintf(stderr, "[ERROR] Couldn't open node %d\n", i);
+			net.num = i;
+			bad = 1;
+			goto out;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u64 = i;
+		epoll_ctl(net.epfd, EPOLL_CTL_ADD, dht_fd(net.nodes[i]), &ev);
+	}
+	pthread_create(&thread, NULL, serve, &net);
+
+	/* Everybody knows about the first node only, the DHT does the rest */
+	start = bench_usec();
+	snprintf(bootstrap, sizeof(bootstrap), "127.0.0.1:%d", dht_port(net.nodes[0]));
+	for (i = 1; i < net.num; i++)
+		dht_join(net.nodes[i], bootstrap);
+	for (i = 0; i < net.num; i++)
+		contacts += dht_contacts(net.nodes[i]);
+	printf("dht: %d nodes joined in %.2f s, %.1f contacts each\n", net.num, (bench_usec() - start) / 1e6,
+			(double) contacts / net.num);
+
+	/* What each peer does for its hash list, port tells the owners apart */
+	start = bench_usec();
+	for (i = 0; i < num_keys; i++) {
+		bench_random_hash(keys[i]);
+		announcer[i] = rand() % net.num;
+		stored += dht_announce(net.nodes[announcer[i]], keys[i], 10000 + announcer[i], &stats);
+	}
+	printf("dht: %d keys announced in %.2f s, kept by %.1f nodes each\n", num_keys, (bench_usec() - start) / 1e6,
+			(double) stored / num_keys);
+
+	bad |= lookups(&net, keys, announcer, num_keys, num_lookups, "all up") != num_lookups;
+	/* Replicas on DHT_K nodes: losing some of them loses nothing */
+	if (down > 0) {
+		for (i = 0; i < net.num * down / 100; i++)
+			__atomic_store_n(&net.down[1 + rand() % (net.num - 1)], 1, __ATOMIC_RELAXED);
+		for (contacts = 0, i = 0; i < net.num; i++)
+			contacts += net.down[i];
+		snprintf(bootstrap, sizeof(bootstrap), "%d down", contacts);
+		bad |= lookups(&net, keys, announcer, num_keys, num_lookups, bootstrap) < num_lookups * 99 / 100;
+	}
+	__atomic_store_n(&net.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	printf("dht: %s\n", bad ? "FAILED" : "ok");
+out:
+	for (i = 0; i < net.num; i++)
+		dht_close(net.nodes[i]);
+	close(net.epfd);
+	free(net.nodes);
+	free(net.down);
+	free(keys);
+	free(announcer);
+	return bad;
+}
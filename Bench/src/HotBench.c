@@ -0,0 +1,350 @@
+/*
+ ============================================================================
+ Name        : HotBench.c
+ Author      : Giacomo Persichini
+ Description : The peer's hot-file cache, checked and then under a Zipf workload
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() - atof() */
+#include <string.h> /* memcmp() - memcpy() */
+#include <math.h> /* pow() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* write() - close() - pread() */
+#include <sys/stat.h> /* mkdir() */
+#include <arpa/inet.h> /* INET_ADDRSTRLEN */
+#include <pthread.h> /* pthread_barrier_wait() */
+
+#include "Bench.h"
+#include "Client.h"
+#include "Codec.h"
+#include "Hot.h"
+
+#define SMALL 3000		/* Bytes in each file the checks keep in memory */
+#define RACERS 8		/* Uploads asking for the same file at once */
+#define ROUNDS 200
+
+typedef struct racer {
+	hot_cache			*h;
+	char				*hash;
+	char				*path;
+	pthread_barrier_t	*start;
+	hot_entry			*got;
+	int					encoding;
+} racer;
+
+typedef struct zipf_run {
+	long	ok;
+	long	failed;
+} zipf_run;
+
+static zipf_run	z;
+
+static int write_text(char *path, long size) {
+	char	*text = malloc(size);
+	long	i;
+	int		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+			ok;
+
+	for (i = 0; text != NULL && i < size; i++)
+		text[i] = "the quick brown fox jumps over the lazy dog "[(i + size) % 44];
+	ok = fd != -1 && text != NULL && write(fd, text, size) == size;
+	close(fd);
+	free(text);
+	return ok ? 0 : -1;
+}
+
+/* The file's bytes back from a zlib image, 1 if they're the same as path's */
+static int same_unpacked(char *image, size_t len, char *path, long size) {
+	char	*want = malloc(size),
+			out[TRANSFER_CHUNK];
+	size_t	at = FILE_HEADER_SIZE;
+	long	payload,
+			got = 0,
+			n;
+	int		is_stored,
+			fd = open(path, O_RDONLY),
+			same = want != NULL && pread(fd, want, size, 0) == size;
+
+	while (same && at < len) {
+		if ((payload = codec_payload(image + at, &is_stored)) == -1
+				|| (n = codec_unpack(image + at + CODEC_HEADER, payload, is_stored, out, sizeof(out))) <= 0
+				|| got + n > size || memcmp(want + got, out, n) != 0)
+			same = 0;
+		else {
+			at += CODEC_HEADER + payload;
+			got += n;
+		}
+	}
+	close(fd);
+	free(want);
+	return same && got == size;
+}
+
+/*
+ * 8 small files and a large one through a cache with room for 4 open
+ * and 2 small ones in memory: contents kept only once asked for again
+ * and exactly as they're sent, compressed too, the least recently used
+ * going first, never past the budget, and a file in use still readable
+ * once the cache has been cleared.
+ */
+static int check(char *dir) {
+	char		paths[9][1100],
+				hashes[9][HASH_LEN + 1],
+				header[FILE_HEADER_SIZE],
+				*image,
+				*want = malloc(SMALL);
+	size_t		budget = 2 * (FILE_HEADER_SIZE + SMALL),
+				len;
+	hot_cache	*h = hot_open(budget, 64 << 10, 4);
+	hot_entry	*e;
+	int			bad = h == NULL || want == NULL,
+				fd,
+				i;
+
+	for (i = 0; i < 9; i++) {
+		snprintf(paths[i], sizeof(paths[i]), "%s/hot%d", dir, i);
+		bench_random_hash(hashes[i]);
+		bad |= write_text(paths[i], i < 8 ? SMALL : 100 << 10) == -1;
+	}
+	if (bad) {
+		fprintf(stderr, "[ERROR] hot: couldn't write the files\n");
+		hot_close(h);
+		free(want);
+		return 1;
+	}
+	fd = open(paths[0], O_RDONLY);
+	read(fd, want, SMALL);
+	close(fd);
+	pack_file_header(header, SMALL, ENCODING_RAW);
+
+	/* Asked once: open, not in memory. Twice: in memory, as it's sent */
+	e = hot_get(h, hashes[0], paths[0]);
+	bad |= e == NULL || hot_image(h, e, 0, &len) != NULL;
+	hot_release(h, e);
+	e = hot_get(h, hashes[0], paths[0]);
+	image = hot_image(h, e, 0, &len);
+	bad |= image == NULL || len != FILE_HEADER_SIZE + SMALL || memcmp(image, header, FILE_HEADER_SIZE) != 0
+			|| memcmp(image + FILE_HEADER_SIZE, want, SMALL) != 0;
+	/* Text shrinks: the zlib image holds frames that give the file back */
+	image = hot_image(h, e, 1, &len);
+	bad |= image == NULL || image[4] != ENCODING_ZLIB || len >= FILE_HEADER_SIZE + SMALL
+			|| !same_unpacked(image, len, paths[0], SMALL);
+	hot_release(h, e);
+	bad |= h->hits != 1 || h->misses != 1 || h->bytes > budget;
+	printf("hot: kept in memory the second time, raw and compressed: %s\n", bad ? "FAILED" : "ok");
+
+	/* Every file twice: 4 stay open, memory never goes past the budget */
+	for (i = 0; i < 9; i++) {
+		e = hot_get(h, hashes[i], paths[i]);
+		hot_release(h, e);
+		e = hot_get(h, hashes[i], paths[i]);
+		image = hot_image(h, e, 0, &len);
+		bad |= e == NULL || (i < 8) != (image != NULL) || h->bytes > budget;
+		hot_release(h, e);
+	}
+	bad |= h->num != 4 || h->evicted != 5;
+	e = hot_get(h, hashes[8], paths[8]);
+	bad |= h->hits != 12;
+	hot_release(h, e);
+	e = hot_get(h, hashes[0], paths[0]);
+	bad |= h->misses != 10;
+	printf("hot: %d open, %zu bytes in memory of %zu, %llu evicted: %s\n", h->num, h->bytes, budget, h->evicted,
+			bad ? "FAILED" : "ok");
+
+	/* Still in use when the cache forgets everything */
+	hot_clear(h);
+	bad |= h->num != 0 || pread(e->fd, want, SMALL, 0) != SMALL;
+	hot_release(h, e);
+	printf("hot: a file in use survives a clear: %s\n", bad ? "FAILED" : "ok");
+	hot_close(h);
+	free(want);
+	return bad;
+}
+
+static void *race_one(void *arg) {
+	racer	*r = arg;
+
+	pthread_barrier_wait(r->start);
+	if ((r->got = hot_get(r->h, r->hash, r->path)) != NULL)
+		r->encoding = hot_encoding(r->h, r->got, 1);
+	return NULL;
+}
+
+/*
+ * RACERS uploads asking for a file nobody asked for before, all at once:
+ * it's opened by each of them but the cache keeps one entry, and they
+ * all send it the same way. Returns 1 if a file got more.
+ */
+static int race(char *dir) {
+	pthread_barrier_t	start;
+	pthread_t			threads[RACERS];
+	racer				racers[RACERS];
+	char				path[1100],
+						hash[HASH_LEN + 1];
+	hot_cache			*h = hot_open(0, 0, 2 * RACERS * ROUNDS);
+	int					bad = h == NULL,
+						round,
+						i;
+
+	snprintf(path, sizeof(path), "%s/hot0", dir);
+	for (round = 0; !bad && round < ROUNDS; round++) {
+		bench_random_hash(hash);
+		pthread_barrier_init(&start, NULL, RACERS);
+		for (i = 0; i < RACERS; i++) {
+			racers[i] = (racer) { h, hash, path, &start, NULL, -1 };
+			pthread_create(&threads[i], NULL, race_one, &racers[i]);
+		}
+		for (i = 0; i < RACERS; i++)
+			pthread_join(threads[i], NULL);
+		pthread_barrier_destroy(&start);
+		for (i = 0; i < RACERS; i++) {
+			bad |= racers[i].got == NULL || racers[i].got != racers[0].got
+					|| racers[i].encoding != racers[0].encoding;
+			if (racers[i].got != NULL)
+				hot_release(h, racers[i].got);
+		}
+	}
+	bad |= h == NULL || h->num != ROUNDS || h->misses != ROUNDS;
+	printf("hot: %d uploads asking for a new file at once, one entry for it: %s\n", RACERS, bad ? "FAILED" : "ok");
+	hot_close(h);
+	return bad;
+}
+
+static void done(void *arg, char *hash, int status, unsigned long long bytes) {
+	if (status == CLIENT_OK)
+		z.ok++;
+	else
+		z.failed++;
+}
+
+/* Picks, num of them, the file at rank r asked for as often as 1 / (r + 1)^skew */
+static int *zipf(int files, long num, double skew) {
+	double	*cdf = malloc(files * sizeof(double)),
+			total = 0,
+			u;
+	int		*picks = malloc(num * sizeof(int)),
+			lo,
+			hi,
+			mid,
+			i;
+	long	k;
+
+	for (i = 0; i < files; i++)
+		cdf[i] = total += 1 / pow(i + 1, skew);
+	srand(7);
+	for (k = 0; k < num; k++) {
+		u = (double) rand() / RAND_MAX * total;
+		for (lo = 0, hi = files - 1; lo < hi;) {
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		picks[k] = lo;
+	}
+	free(cdf);
+	return picks;
+}
+
+/*
+ * The peer in dir shares files, asked for them in the order of picks.
+ * Returns the peer's CPU time per request in usec: over loopback on a
+ * small machine requests/s move with whatever else is running.
+ */
+static double serve_zipf(char *dir, char *peer, char *config, int files, long size, int *picks, long num,
+		int parallel, int base) {
+	hash_record			*records = NULL;
+	unsigned long long	start,
+						took;
+	long				cpu;
+	client				*c = NULL;
+	char				owner[INET_ADDRSTRLEN];
+	int					input;
+	long				k;
+	pid_t				pid;
+
+	z.ok = z.failed = 0;
+	if ((pid = bench_share(peer, dir, files, size, config, &input, &records)) == -1 || records == NULL
+			|| bench_wait_port("127.0.0.1", PEER_PORT, 5000) == -1 || (c = client_open(parallel, 0)) == NULL) {
+		if (pid != -1)
+			bench_stop(pid, input);
+		free(records);
+		return 0;
+	}
+	/*
+	 * The peer closes first, its side of each connection waits in
+	 * TIME_WAIT: a port used again towards the same address can stall for
+	 * a second. Over 8 addresses, ports come back 8 times less often.
+	 * Downloads are only checked against their hash, so that writing them
+	 * out doesn't take more time than the peer sending them.
+	 */
+	start = bench_usec();
+	cpu = bench_cpu_usec(pid);
+	for (k = 0; k < num; k++) {
+		snprintf(owner, sizeof(owner), "127.0.%d.%ld", base, k % 8 + 1);
+		client_download(c, records[picks[k]].hash, owner, NULL, done, NULL);
+	}
+	while (client_run(c, 1000) > 0)
+		;
+	took = bench_usec() - start;
+	cpu = bench_cpu_usec(pid) - cpu;
+	printf("hot: %-4s %8.0f requests/s, %5.1f usec of the peer's CPU each", config[0] == '\0' ? "on" : "off",
+			num / (took / 1e6), (double) cpu / num);
+	if (config[0] == '\0')
+		printf(", %.1f%% found open, %.1f%% sent from memory (%ld KB)", 100.0 * bench_peer_stat(dir, "hot_hits") / num,
+				100.0 * bench_peer_stat(dir, "hot_memory") / num, bench_peer_stat(dir, "hot_bytes") / 1024);
+	printf(", %ld failed\n", z.failed);
+	client_close(c);
+	bench_stop(pid, input);
+	free(records);
+	return z.failed == 0 && cpu > 0 ? (double) cpu / num : 0;
+}
+
+/*
+ * The checks, then with peer=PATH requests=N downloads of files=N files
+ * of size=KB picked with a Zipf distribution (skew=1.0), parallel=N at a
+ * time, from a peer without the hot cache and from one with it.
+ */
+int bench_hot(int argc, char **argv) {
+	char	*peer = bench_sarg(argc, argv, "peer", NULL),
+			*dir = bench_tmpdir(),
+			off_dir[1100],
+			on_dir[1100];
+	int		files = bench_arg(argc, argv, "files", 1000),
+			parallel = bench_arg(argc, argv, "parallel", 16),
+			*picks,
+			bad;
+	long	size = bench_arg(argc, argv, "size", 4) * 1024,
+			num = bench_arg(argc, argv, "requests", 20000);
+	double	skew = atof(bench_sarg(argc, argv, "skew", "1.0")),
+			off,
+			on;
+
+	if (dir == NULL || files < 1 || num < 1 || parallel < 1 || size < HASH_LEN) {
+		fprintf(stderr, "[ERROR] hot needs 1 file and 1 request at least\n");
+		return 1;
+	}
+	bad = check(dir);
+	bad |= race(dir);
+	if (peer != NULL) {
+		picks = zipf(files, num, skew);
+		snprintf(off_dir, sizeof(off_dir), "%s/off", dir);
+		snprintf(on_dir, sizeof(on_dir), "%s/on", dir);
+		mkdir(off_dir, 0755);
+		mkdir(on_dir, 0755);
+		printf("hot: %ld requests for %d files of %ld KB, skew %.2f, %d at a time\n", num, files, size / 1024, skew,
+				parallel);
+		off = serve_zipf(off_dir, peer, "hot-fds=0\n", files, size, picks, num, parallel, 10);
+		on = serve_zipf(on_dir, peer, "", files, size, picks, num, parallel, 11);
+		bad |= off == 0 || on == 0;
+		if (!bad)
+			printf("hot: %.2fx the peer's CPU per request with the cache\n", on / off);
+		free(picks);
+	}
+	printf("hot: %s\n", bad ? "FAILED" : "ok");
+	bench_rmdir(dir);
+	return bad;
+}
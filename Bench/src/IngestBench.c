@@ -0,0 +1,227 @@
+/*
+ ============================================================================
+ Name        : IngestBench.c
+ Author      : Giacomo Persichini
+ Description : Multi-million record hash lists checked, decoded and indexed
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - free() - rand() */
+#include <string.h> /* memset() - memcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - pread() - pwrite() - ftruncate() */
+
+#include "Bench.h"
+#include "Ingest.h"
+#include "Owners.h"
+#include "Search.h"
+
+/* hash_digest() a digit at a time, as it was before SSE2 */
+static int scalar_digest(const char *hash, unsigned char *digest) {
+	int	i,
+		hi,
+		lo;
+
+	for (i = 0; i < DIGEST_LEN; i++) {
+		hi = hash[2 * i];
+		lo = hash[2 * i + 1];
+		hi = hi >= '0' && hi <= '9' ? hi - '0' : hi >= 'a' && hi <= 'f' ? hi - 'a' + 10 : -1;
+		lo = lo >= '0' && lo <= '9' ? lo - '0' : lo >= 'a' && lo <= 'f' ? lo - 'a' + 10 : -1;
+		if (hi == -1 || lo == -1)
+			return -1;
+		digest[i] = hi << 4 | lo;
+	}
+	return 0;
+}
+
+/*
+ * Both decoders agree on every hash, one digit of them changed to any
+ * byte at all every other time. Then how long each takes on good ones.
+ */
+static int check_decode(long num) {
+	static char			hashes[4096][HASH_LEN + 1];
+	unsigned char		a[DIGEST_LEN],
+						b[DIGEST_LEN];
+	unsigned long long	start,
+						took[2];
+	long				i,
+						wrong = 0;
+	int					x,
+						y;
+
+	for (i = 0; i < num; i++) {
+		bench_random_hash(hashes[0]);
+		if (i % 2 == 1)
+			hashes[0][rand() % HASH_LEN] = rand() % 256;
+		x = hash_digest(hashes[0], a);
+		y = scalar_digest(hashes[0], b);
+		wrong += x != y || (x == 0 && memcmp(a, b, DIGEST_LEN) != 0);
+	}
+	for (i = 0; i < 4096; i++)
+		bench_random_hash(hashes[i]);
+	for (x = 0; x < 2; x++) {
+		start = bench_usec();
+		for (i = 0; i < num; i++)
+			wrong += (x == 0 ? hash_digest(hashes[i & 4095], a) : scalar_digest(hashes[i & 4095], a)) != 0;
+		took[x] = bench_usec() - start;
+	}
+	printf("ingest: %ld hashes decoded both ways, %ld different, %.1f ns each with SSE2, %.1f ns digit by digit: %s\n",
+			num, wrong, took[0] * 1000.0 / num, took[1] * 1000.0 / num, wrong ? "FAILED" : "ok");
+	return wrong > 0;
+}
+
+/* num records, one in dups the same file as an earlier one */
+static int write_list(char *path, long num, int dups) {
+	hash_record	*recs = calloc(4096, sizeof(hash_record));
+	long		i;
+	int			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+				n;
+
+	if (fd == -1 || recs == NULL) {
+		free(recs);
+		return -1;
+	}
+	for (i = 0; i < num; i += n) {
+		for (n = 0; n < 4096 && i + n < num; n++) {
+			if (dups > 0 && i + n > 0 && (i + n) % dups == 0)
+				memcpy(recs[n].hash, recs[(n + 4095) % 4096].hash, HASH_LEN + 1);
+			else
+				bench_random_hash(recs[n].hash);
+			snprintf(recs[n].filename, sizeof(recs[n].filename), "/home/user/shared/file%ld.bin", i + n);
+			record_set_size(&recs[n], i + n);
+		}
+		if (write(fd, recs, n * sizeof(hash_record)) != (ssize_t) (n * sizeof(hash_record))) {
+			close(fd);
+			free(recs);
+			return -1;
+		}
+	}
+	close(fd);
+	free(recs);
+	return 0;
+}
+
+/* What a record looks like broken, list_load() must turn the list down */
+static int check_malformed(char *path, long num) {
+	static const char	*what[] = { "a letter past f", "an upper case digit", "no '\\0' after the hash",
+							"a record cut short" };
+	hash_record			rec;
+	hash_list			list;
+	long				at;
+	int					bad = 0,
+						ret,
+						fd,
+						k;
+
+	for (k = 0; k < 4; k++) {
+		at = rand() % num;
+		fd = open(path, O_RDWR);
+		pread(fd, &rec, sizeof(rec), at * sizeof(rec));
+		if (k == 0)
+			rec.hash[rand() % HASH_LEN] = 'g';
+		else if (k == 1)
+			rec.hash[rand() % HASH_LEN] = 'A';
+		else if (k == 2)
+			rec.hash[HASH_LEN] = 'x';
+		pwrite(fd, &rec, sizeof(rec), at * sizeof(rec));
+		if (k == 3)
+			ftruncate(fd, num * sizeof(rec) - 1);
+		ret = list_load(&list, path);
+		if (ret != LIST_MALFORMED || (k < 3 && list.bad != at)) {
+			fprintf(stderr, "[ERROR] ingest: a list with %s was taken\n", what[k]);
+			bad = 1;
+		}
+		list_free(&list);
+		/* Back as it was */
+		if (k == 0 || k == 1)
+			bench_random_hash(rec.hash);
+		rec.hash[HASH_LEN] = '\0';
+		pwrite(fd, &rec, sizeof(rec), at * sizeof(rec));
+		close(fd);
+	}
+	printf("ingest: malformed lists turned down: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
+
+/*
+ * A list of records=N, one in dups=100 listed twice: decoding with SSE2
+ * against a digit at a time, then the list whole through list_load()
+ * against read() a record at a time, then into both of the server's
+ * indexes. Records per second each.
+ */
+int bench_ingest(int argc, char **argv) {
+	hash_record			rec;
+	hash_list			list;
+	owner_index			*o = NULL;
+	search_index		*s = NULL;
+	unsigned char		digest[DIGEST_LEN];
+	unsigned long long	start,
+						took;
+	char				*dir = bench_tmpdir(),
+						path[1024];
+	long				num = bench_arg(argc, argv, "records", 2000000),
+						kept,
+						valid = 0,
+						i;
+	int					dups = bench_arg(argc, argv, "dups", 100),
+						bad,
+						fd;
+
+	if (num < 100 || dups < 0) {
+		fprintf(stderr, "[ERROR] ingest needs 100 records at least\n");
+		return 1;
+	}
+	srand(bench_arg(argc, argv, "seed", 1));
+	bad = check_decode(1000000);
+	snprintf(path, sizeof(path), "%s/list", dir);
+	if (dir == NULL || write_list(path, num, dups) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the list\n");
+		bad = 1;
+		goto out;
+	}
+	kept = dups > 0 ? num - (num - 1) / dups : num;
+
+	/* Twice, the page cache is warm for both */
+	for (i = 0; i < 2; i++) {
+		fd = open(path, O_RDONLY);
+		start = bench_usec();
+		for (valid = 0; read(fd, &rec, sizeof(rec)) == sizeof(rec); )
+			valid += scalar_digest(rec.hash, digest) == 0;
+		took = bench_usec() - start;
+		close(fd);
+	}
+	bad |= valid != num;
+	printf("ingest: %ld records, read() one at a time, digit by digit: %.2f s, %.0f records/s\n", num,
+			took / 1e6, num * 1e6 / took);
+
+	start = bench_usec();
+	if (list_load(&list, path) != 0 || list.num_kept != kept) {
+		fprintf(stderr, "[ERROR] ingest: %ld records kept, %ld expected\n", list.num_kept, kept);
+		bad = 1;
+	}
+	took = bench_usec() - start;
+	printf("ingest: %ld records, list_load() mapped, SSE2, %ld twice: %.2f s, %.0f records/s\n", num,
+			num - list.num_kept, took / 1e6, num * 1e6 / took);
+
+	o = owners_open();
+	s = search_open();
+	start = bench_usec();
+	if (o == NULL || s == NULL || owners_add_list(o, "10.0.0.1", &list) != kept || search_add_list(s, &list) != kept) {
+		fprintf(stderr, "[ERROR] ingest: the list didn't go into the indexes whole\n");
+		bad = 1;
+	}
+	took = bench_usec() - start;
+	printf("ingest: %ld records into the owner and search indexes: %.2f s, %.0f records/s\n", num,
+			took / 1e6, num * 1e6 / took);
+	list_free(&list);
+
+	bad |= check_malformed(path, num);
+	printf("ingest: %s\n", bad ? "FAILED" : "ok");
+out:
+	owners_close(o);
+	search_close(s);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	return bad;
+}
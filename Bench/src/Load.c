@@ -0,0 +1,870 @@
+/*
+ ============================================================================
+ Name        : Load.c
+ Author      : Giacomo Persichini
+ Description : Thousands of simulated peers against the server, or a cluster of them
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() */
+#include <string.h> /* memcpy() - strncmp() */
+#include <time.h> /* nanosleep() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* fcntl() - O_NONBLOCK */
+#include <unistd.h> /* read() - write() - close() */
+#include <sys/stat.h> /* mkdir() */
+#include <dirent.h> /* opendir() - readdir() */
+#include <sys/wait.h> /* waitpid() */
+#include <sys/epoll.h> /* epoll_create1() - epoll_wait() */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <arpa/inet.h> /* inet_addr() - htonl() */
+#include <netinet/tcp.h> /* TCP_NODELAY */
+
+#include "Bench.h"
+#include "Ring.h"
+#include "Codec.h"
+
+#define STATE_CONNECTING 0
+#define STATE_HELLO 1
+#define STATE_UPLOAD 2
+#define STATE_THINK 3
+#define STATE_QUERY 4
+#define STATE_BACKOFF 5		/* Turned away, waiting to try again */
+
+#define STEP_TIMEOUT 5000000ULL	/* A step taking more than 5 s is a failure */
+
+typedef struct sim_peer {
+	int					fd;
+	int					state;
+	int					shard;		/* The server this session talks to */
+	int					queries_left;
+	long				id;
+	int					attempts;	/* Turned away so far */
+	unsigned long long	wake;		/* When to try again */
+	char				*out;		/* Bytes still to be sent */
+	size_t				out_len;
+	size_t				out_off;
+	char				in[32];
+	size_t				in_len;
+	unsigned long long	session;	/* When the session started */
+	unsigned long long	step;		/* When the current step started */
+} sim_peer;
+
+typedef struct load_run {
+	int					epfd;
+	int					port;
+	char				*ip;
+	long				next_id;
+	long				peers;
+	int					files;
+	int					queries;
+	int					pool;
+	int					shards;
+	int					backoff;	/* Wait as the server asks when turned away, or try again at once */
+	unsigned long long	think;
+	char				(*hashes)[HASH_LEN + 1];
+	int					*owned;		/* Indexes of the hashes, grouped by shard */
+	int					first[RING_MAX_SHARDS + 1];
+	long				ok;
+	long				failed;
+	long				found;
+	long				not_found;
+	long				busy;
+	unsigned long long	start;
+	unsigned long long	most_done;	/* usec until 90% of the sessions were done */
+	bench_samples		setup;
+	bench_samples		lookup;
+} load_run;
+
+static double	last_lookup_rate,	/* Of the last run, for bench_shards() */
+				last_goodput;		/* Sessions done per second, for bench_overload() */
+
+static void watch(load_run *run, sim_peer *p, unsigned int events, int op) {
+	struct epoll_event	ev;
+
+	ev.events = events;
+	ev.data.ptr = p;
+	epoll_ctl(run->epfd, op, p->fd, &ev);
+}
+
+static int start_peer(load_run *, sim_peer *);
+
+/*
+ * Every simulated peer gets its own loopback address, like real peers do.
+ * With a cluster a peer is a session with each server, one after another.
+ */
+static int connect_peer(load_run *run, sim_peer *p) {
+	struct sockaddr_in	addr;
+	long				id = p->id / run->shards;
+	int					one = 1;
+
+	p->shard = p->id % run->shards;
+
+	p->fd = socket(AF_INET, SOCK_STREAM, 0);
+	fcntl(p->fd, F_SETFL, O_NONBLOCK);
+	/*
+	 * Messages are written whole. A short list would otherwise hold the
+	 * first query back until the server's delayed ACK, 40 ms later.
+	 */
+	setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl((127U << 24) | (1U << 16) | ((id / 250 % 250) << 8) | (id % 250 + 1));
+	bind(p->fd, (struct sockaddr *) &addr, sizeof(addr));
+
+	addr.sin_addr.s_addr = inet_addr(run->ip);
+	addr.sin_port = htons(run->port + p->shard);
+	p->state = STATE_CONNECTING;
+	p->step = bench_usec();
+	p->in_len = 0;
+	p->queries_left = run->queries;
+	if (connect(p->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+		close(p->fd);
+		p->fd = -1;
+		run->failed++;
+		return start_peer(run, p);
+	}
+	watch(run, p, EPOLLOUT, EPOLL_CTL_ADD);
+	return 0;
+}
+
+static int start_peer(load_run *run, sim_peer *p) {
+	p->fd = -1;
+	p->state = STATE_CONNECTING;
+	if (run->next_id >= run->peers * run->shards)
+		return -1;
+	p->id = run->next_id++;
+	p->attempts = 0;
+	p->session = bench_usec();
+	return connect_peer(run, p);
+}
+
+/*
+ * The server said BUSY: like a peer, wait what it asked plus up to a tenth
+ * of it or, when it couldn't tell, twice as long as the time before plus up
+ * to half of it. Without backoff the peer tries again at once.
+ */
+static void turned_away(load_run *run, sim_peer *p) {
+	uint32_t			hint;
+	unsigned long long	wait;
+
+	memcpy(&hint, p->in + 4, sizeof(hint));
+	run->busy++;
+	close(p->fd);
+	p->fd = -1;
+	if (!run->backoff) {
+		connect_peer(run, p);
+		return;
+	}
+	if (ntohl(hint) > 0) {
+		wait = ntohl(hint) * 1000ULL;
+		wait += rand() % (wait / 10 + 1);
+	}
+	else {
+		wait = 100000ULL << (p->attempts < 8 ? p->attempts++ : 8);
+		wait += rand() % (wait / 2 + 1);
+	}
+	p->state = STATE_BACKOFF;
+	p->wake = bench_usec() + wait;
+}
+
+static void end_peer(load_run *run, sim_peer *p, int ok) {
+	if (ok) {
+		/* Past saturation the last few wait long, 90% tells how fast they went */
+		if (++run->ok == run->peers * run->shards * 9 / 10)
+			run->most_done = bench_usec() - run->start;
+	}
+	else
+		run->failed++;
+	close(p->fd);
+	free(p->out);
+	p->out = NULL;
+	start_peer(run, p);
+}
+
+/* A hash of the pool that shard is in charge of */
+static char *pick_hash(load_run *run, int shard) {
+	int	owned = run->first[shard + 1] - run->first[shard];
+
+	return run->hashes[run->owned[run->first[shard] + rand() % owned]];
+}
+
+/*
+ * The hash list is sent exactly like send_file() does it. In a cluster
+ * each server gets the records it's in charge of, the share of the list
+ * that split_hash_list() would leave it.
+ */
+static void build_list(load_run *run, sim_peer *p) {
+	unsigned long	length;
+	hash_record	*rec;
+	int				files = (run->files + run->shards - 1) / run->shards,
+					i;
+
+	p->out_len = sizeof(length) + files * sizeof(hash_record);
+	p->out = calloc(1, p->out_len);
+	p->out_off = 0;
+	length = htonl((uint32_t) (files * sizeof(hash_record)));
+	memcpy(p->out, &length, sizeof(length));
+	rec = (hash_record *) (p->out + sizeof(length));
+	for (i = 0; i < files; i++) {
+		memcpy(rec[i].hash, pick_hash(run, p->shard), HASH_LEN + 1);
+		snprintf(rec[i].filename, sizeof(rec[i].filename), "/home/user/shared/file-%d.bin", i);
+	}
+}
+
+/* Queries go where a peer's would: to the server in charge of the hash */
+static void ask_query(load_run *run, sim_peer *p) {
+	char	query[QUERY_SIZE];
+
+	memset(query, 0, sizeof(query));
+	memcpy(query, "HASH-", 5);
+	memcpy(query + 5, pick_hash(run, p->shard), HASH_LEN);
+	p->state = STATE_QUERY;
+	p->in_len = 0;
+	p->step = bench_usec();
+	if (write(p->fd, query, sizeof(query)) != sizeof(query))
+		end_peer(run, p, 0);
+}
+
+static void step_peer(load_run *run, sim_peer *p) {
+	ssize_t	bytes;
+	size_t		want;
+	int			err = 0;
+	socklen_t	len = sizeof(err);
+
+	switch (p->state) {
+	case STATE_CONNECTING:
+		getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0 || write(p->fd, "HELLO", 5) != 5) {
+			end_peer(run, p, 0);
+			return;
+		}
+		p->state = STATE_HELLO;
+		watch(run, p, EPOLLIN, EPOLL_CTL_MOD);
+		return;
+	case STATE_HELLO:
+		/* A busy server answers with BUSY and the msec to wait instead */
+		want = p->in_len >= 4 && strncmp(p->in, "BUSY", 4) == 0 ? BUSY_SIZE : 5;
+		bytes = read(p->fd, p->in + p->in_len, want - p->in_len);
+		if (bytes <= 0) {
+			end_peer(run, p, 0);
+			return;
+		}
+		p->in_len += bytes;
+		if (p->in_len >= 4 && strncmp(p->in, "BUSY", 4) == 0) {
+			if (p->in_len == BUSY_SIZE)
+				turned_away(run, p);
+			return;
+		}
+		if (p->in_len < 5)
+			return;
+		if (strncmp(p->in, "HELLO", 5) != 0) {
+			end_peer(run, p, 0);
+			return;
+		}
+		build_list(run, p);
+		p->state = STATE_UPLOAD;
+		watch(run, p, EPOLLOUT, EPOLL_CTL_MOD);
+		/* The socket is most likely writable already, so start sending */
+		/* Fall through */
+	case STATE_UPLOAD:
+		bytes = write(p->fd, p->out + p->out_off, p->out_len - p->out_off);
+		if (bytes < 0 && errno != EAGAIN) {
+			end_peer(run, p, 0);
+			return;
+		}
+		if (bytes > 0)
+			p->out_off += bytes;
+		if (p->out_off < p->out_len)
+			return;
+		bench_sample(&run->setup, bench_usec() - p->session);
+		free(p->out);
+		p->out = NULL;
+		watch(run, p, EPOLLIN, EPOLL_CTL_MOD);
+		/* A real user doesn't ask for a file the instant the list is sent */
+		p->state = STATE_THINK;
+		p->step = bench_usec();
+		return;
+	case STATE_QUERY:
+		bytes = read(p->fd, p->in + p->in_len, sizeof(p->in) - p->in_len);
+		if (bytes <= 0) {
+			end_peer(run, p, 0);
+			return;
+		}
+		p->in_len += bytes;
+		if (p->in_len >= 8 && strncmp(p->in, "NOTFOUND", 8) == 0)
+			run->not_found++;
+		else if (p->in_len >= 21 && strncmp(p->in, "FOUND-", 6) == 0)
+			run->found++;
+		else if (p->in_len < 21)
+			return;
+		else {
+			end_peer(run, p, 0);
+			return;
+		}
+		bench_sample(&run->lookup, bench_usec() - p->step);
+		if (--p->queries_left > 0)
+			ask_query(run, p);
+		else
+			end_peer(run, p, 1);	/* Disconnect, someone else takes the slot */
+		return;
+	}
+}
+
+/* Thinking peers whose time is up ask their first query, stuck ones fail */
+static void check_timers(load_run *run, sim_peer *peers, int num) {
+	unsigned long long	now = bench_usec();
+	int					i;
+
+	for (i = 0; i < num; i++) {
+		/* Its step starts after now, it mustn't be taken for a stuck one */
+		if (peers[i].state == STATE_BACKOFF && now >= peers[i].wake) {
+			connect_peer(run, &peers[i]);
+			continue;
+		}
+		if (peers[i].fd == -1)
+			continue;
+		if (peers[i].state == STATE_THINK && now - peers[i].step >= run->think)
+			ask_query(run, &peers[i]);
+		else if (peers[i].state != STATE_THINK && now - peers[i].step > STEP_TIMEOUT)
+			end_peer(run, &peers[i], 0);
+	}
+}
+
+int bench_load(int argc, char **argv) {
+	load_run			run;
+	sim_peer			*peers;
+	struct epoll_event	events[256];
+	char				*server = bench_sarg(argc, argv, "server", NULL),
+						*address = bench_sarg(argc, argv, "address", "127.0.0.1:1313"),
+						*dir = NULL,
+						config[512],
+						servers[RING_MAX_SHARDS * RING_NAME_SIZE] = "",
+						path[1024],
+						db[1100],
+						ip[64];
+	long				max_failed = bench_arg(argc, argv, "max-failed", -1);
+	int					concurrency = bench_arg(argc, argv, "concurrency", 100),
+						max_connections,
+						input[RING_MAX_SHARDS],
+						active,
+						n,
+						i;
+	pid_t				pid[RING_MAX_SHARDS];
+	ring				*r;
+	unsigned long long	start,
+						elapsed;
+	long				rss = -1,
+						shard_rss;
+
+	memset(&run, 0, sizeof(run));
+	run.peers = bench_arg(argc, argv, "peers", 2000);
+	run.files = bench_arg(argc, argv, "files", 50);
+	run.queries = bench_arg(argc, argv, "queries", 10);
+	run.pool = bench_arg(argc, argv, "pool", 1000);
+	run.think = bench_arg(argc, argv, "think", 1000);
+	run.shards = bench_arg(argc, argv, "shards", 1);
+	run.backoff = strcmp(bench_sarg(argc, argv, "backoff", "on"), "off") != 0;
+	max_connections = bench_arg(argc, argv, "max-connections", concurrency * 2 + 10);
+	srand(bench_arg(argc, argv, "seed", 1));
+	if (run.shards < 1 || run.shards > RING_MAX_SHARDS || run.pool < run.shards * 16) {
+		fprintf(stderr, "[ERROR] shards must be 1 to %d, with 16 hashes of the pool each at least\n", RING_MAX_SHARDS);
+		return 1;
+	}
+
+	if (server != NULL) {
+		run.port = bench_arg(argc, argv, "port", 13130);
+		run.ip = "127.0.0.1";
+	}
+	else {
+		if (sscanf(address, "%63[^:]:%d", ip, &run.port) != 2) {
+			fprintf(stderr, "[ERROR] address must be IP:PORT\n");
+			return 1;
+		}
+		run.ip = ip;
+	}
+	/* A cluster is on consecutive ports, from the first one */
+	for (i = 0; i < run.shards; i++)
+		snprintf(servers + strlen(servers), sizeof(servers) - strlen(servers), "%s%s:%d", i > 0 ? ";" : "",
+				run.ip, run.port + i);
+	if ((r = ring_open(servers)) == NULL)
+		return 1;
+
+	if (server != NULL) {
+		/* Start private servers, configured for this run, each in its own folder */
+		if ((dir = bench_tmpdir()) == NULL) {
+			ring_close(r);
+			return 1;
+		}
+		for (i = 0; i < run.shards; i++) {
+			pid[i] = -1;
+			snprintf(path, sizeof(path), "%s/shard-%d", dir, i);
+			snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=%d\nmax-connections=%d\nlog-level=%s\n",
+					run.port + i, max_connections, bench_sarg(argc, argv, "log", "info"));
+			if (mkdir(path, 0755) == -1 || bench_write_file(path, "config", config) == -1)
+				break;
+			snprintf(db, sizeof(db), "%s/db", path);
+			if (mkdir(db, 0755) == -1 || (pid[i] = bench_spawn(server, path, &input[i])) == -1)
+				break;
+			/* Something else listening on the port would take the lookups */
+			if (bench_wait_port(run.ip, run.port + i, 5000) == -1 || waitpid(pid[i], NULL, WNOHANG) != 0) {
+				fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", path);
+				break;
+			}
+		}
+		if (i < run.shards) {
+			for (n = 0; n <= i && n < run.shards; n++)
+				if (pid[n] != -1)
+					bench_stop(pid[n], input[n]);
+			bench_rmdir(dir);
+			ring_close(r);
+			return 1;
+		}
+	}
+
+	run.hashes = malloc(run.pool * sizeof(*run.hashes));
+	run.owned = malloc(run.pool * sizeof(int));
+	for (i = 0; i < run.pool; i++)
+		bench_random_hash(run.hashes[i]);
+	/* Each server's hashes, where a peer's ring would send them */
+	for (n = 0; n < run.shards; n++) {
+		run.first[n + 1] = run.first[n];
+		for (i = 0; i < run.pool; i++)
+			if (ring_shard(r, run.hashes[i]) == n)
+				run.owned[run.first[n + 1]++] = i;
+		if (run.first[n + 1] == run.first[n]) {
+			/* Unlikely with the points a ring has, but it couldn't be asked anything */
+			fprintf(stderr, "[ERROR] No hash of the pool belongs to %s, use a larger pool\n", r->names[n]);
+			run.failed = 1;
+		}
+	}
+	ring_close(r);
+	peers = calloc(concurrency, sizeof(sim_peer));
+	run.epfd = epoll_create1(0);
+
+	start = run.start = bench_usec();
+	for (i = 0; i < concurrency && run.failed == 0; i++)
+		start_peer(&run, &peers[i]);
+	do {
+		n = epoll_wait(run.epfd, events, 256, 1);
+		for (i = 0; i < n; i++)
+			if (((sim_peer *) events[i].data.ptr)->fd != -1)
+				step_peer(&run, events[i].data.ptr);
+		check_timers(&run, peers, concurrency);
+		for (active = 0, i = 0; i < concurrency; i++)
+			active += peers[i].fd != -1 || peers[i].state == STATE_BACKOFF;
+	} while (active > 0);
+	elapsed = bench_usec() - start;
+
+	if (server != NULL) {
+		for (rss = 0, i = 0; i < run.shards; i++) {
+			shard_rss = bench_peak_rss(pid[i]);
+			rss = shard_rss > rss ? shard_rss : rss;
+			bench_stop(pid[i], input[i]);
+		}
+		bench_rmdir(dir);
+	}
+
+	last_lookup_rate = (run.found + run.not_found) * 1e6 / elapsed;
+	last_goodput = run.most_done > 0 ? run.peers * run.shards * 9 / 10 * 1e6 / run.most_done : run.ok * 1e6 / elapsed;
+	if (run.shards > 1) {
+		for (active = run.pool, n = 0, i = 0; i < run.shards; i++) {
+			active = run.first[i + 1] - run.first[i] < active ? run.first[i + 1] - run.first[i] : active;
+			n = run.first[i + 1] - run.first[i] > n ? run.first[i + 1] - run.first[i] : n;
+		}
+		printf("load: %d servers, %d to %d hashes of the pool each\n", run.shards, active, n);
+	}
+	printf("load: %ld sessions (%ld ok, %ld failed) in %.2f s, %.1f sessions/s\n", run.ok + run.failed,
+			run.ok, run.failed, elapsed / 1e6, (run.ok + run.failed) * 1e6 / elapsed);
+	if (run.busy > 0)
+		printf("load: turned away %ld times, %.1f sessions/s done until 90%% of them were\n", run.busy, last_goodput);
+	printf("load: setup (connect, hand-shake, %d records) p50 %u us, p99 %u us\n", run.files,
+			bench_percentile(&run.setup, 0.5), bench_percentile(&run.setup, 0.99));
+	printf("load: %ld lookups (%ld found), %.1f lookups/s, p50 %u us, p99 %u us\n", run.found + run.not_found,
+			run.found, last_lookup_rate,
+			bench_percentile(&run.lookup, 0.5), bench_percentile(&run.lookup, 0.99));
+	if (rss != -1)
+		printf("load: server peak RSS %ld KB%s\n", rss, run.shards > 1 ? ", the largest of them" : "");
+
+	close(run.epfd);
+	free(peers);
+	free(run.hashes);
+	free(run.owned);
+	free(run.setup.values);
+	free(run.lookup.values);
+	/* By default it only fails if nothing got through */
+	if (max_failed >= 0)
+		return run.failed > max_failed;
+	return run.failed > 0 && run.ok == 0;
+}
+
+/*
+ * The same load against 1, 2, 4... servers, up to max=N: each one keeps
+ * a smaller part of the records and answers fewer lookups, all together
+ * they answer more.
+ */
+int bench_shards(int argc, char **argv) {
+	char	*args[64],
+			shards[32];
+	double	rates[RING_MAX_SHARDS + 1];
+	int		max = bench_arg(argc, argv, "max", 8),
+			bad = 0,
+			num,
+			n,
+			i;
+
+	if (max < 1 || max > RING_MAX_SHARDS || argc > 62) {
+		fprintf(stderr, "[ERROR] max must be 1 to %d\n", RING_MAX_SHARDS);
+		return 1;
+	}
+	for (n = 1; n <= max; n *= 2) {
+		for (num = 0, i = 0; i < argc; i++)
+			if (strncmp(argv[i], "max=", 4) != 0 && strncmp(argv[i], "shards=", 7) != 0)
+				args[num++] = argv[i];
+		snprintf(shards, sizeof(shards), "shards=%d", n);
+		args[num++] = shards;
+		args[num] = NULL;
+		printf("shards: %d server%s\n", n, n > 1 ? "s" : "");
+		bad |= bench_load(num, args);
+		rates[n] = last_lookup_rate;
+		printf("\n");
+	}
+	for (n = 1; n <= max; n *= 2)
+		printf("shards: %d server%s, %.1f lookups/s, %.2fx of one\n", n, n > 1 ? "s" : " ", rates[n],
+				rates[1] > 0 ? rates[n] / rates[1] : 0);
+	return bad;
+}
+
+/*
+ * A peer at ip joining the server on port with a list of records files,
+ * all of them hash; with none the list is left to the caller. Returns
+ * what handshake() did, the connection in c if it got in; busy ones
+ * leave the time they were asked to wait in retry_after.
+ */
+static int join_server(char *ip, int port, char *dir, char *hash, int records, conn **c, unsigned int *retry_after) {
+	struct sockaddr_in	addr;
+	hash_record			rec;
+	char				path[1100];
+	int					fd = socket(AF_INET, SOCK_STREAM, 0),
+						ret = -1,
+						i;
+
+	*c = NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	memset(&rec, 0, sizeof(rec));
+	memcpy(rec.hash, hash, HASH_LEN + 1);
+	snprintf(rec.filename, sizeof(rec.filename), "%s.bin", ip);
+	snprintf(path, sizeof(path), "%s/list", dir);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || (*c = conn_open(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	conn_timeout(*c, 5000);
+	ret = handshake(HANDSHAKE_SERVER, *c, 0);
+	*retry_after = (*c)->retry_after;
+	if (ret == 0 && records > 0) {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			ret = -1;
+		for (i = 0; ret == 0 && i < records; i++)
+			if (write(fd, &rec, sizeof(rec)) != sizeof(rec))
+				ret = -1;
+		if (fd != -1 && close(fd) == -1)
+			ret = -1;
+		if (ret == 0 && send_file(path, *c) != 0)
+			ret = -1;
+	}
+	if (ret != 0) {
+		conn_close(*c);
+		*c = NULL;
+	}
+	return ret;
+}
+
+/* 1 if the server sends a lookup of hash to owner, 0 if it knows nobody, -1 if it didn't answer */
+static int owned_by(conn *requester, char *hash, char *owner) {
+	char	reply[FOUND_SIZE];
+	int		found;
+
+	if (send_query(requester, hash) != 0 || (found = read_reply(requester, reply)) == -1)
+		return -1;
+	return found && strcmp(reply, owner) == 0;
+}
+
+/* Waits up to 5 s for the server's counter name to get to value. Returns 0 or -1 */
+static int wait_metric(int port, char *name, long value) {
+	struct timespec		pause = { 0, 10000000 };
+	unsigned long long	start = bench_usec();
+
+	while (bench_server_metric(port, name) < value)
+		if (bench_usec() - start > 5000000ULL)
+			return -1;
+		else
+			nanosleep(&pause, NULL);
+	return 0;
+}
+
+/*
+ * The admission rules one by one, nothing timed, against a server with
+ * room for 4 peers, 2 from one address: the third from an address is
+ * turned away, and so is the fifth, told when to come back since a slot
+ * was freed just before. A peer joining again before its old connection
+ * is gone is what the server knows of the address, and stays so when the
+ * old one goes. Returns 1 if something went wrong.
+ */
+static int admission(char *server, int port) {
+	char			*dir = bench_tmpdir(),
+					config[256],
+					path[1100],
+					hashes[3][HASH_LEN + 1];
+	conn			*requester = NULL,
+					*first = NULL,
+					*again = NULL,
+					*other[3] = { NULL, NULL, NULL };
+	unsigned int	retry_after = 0;
+	pid_t			pid = -1;
+	int				input,
+					per_ip = 0,
+					hinted = 0,
+					kept = 0,
+					i;
+
+	snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=%d\nmax-connections=4\nmax-per-ip=2\n"
+			"log-level=warn\nmetrics-port=%d\n", port, port + 1);
+	snprintf(path, sizeof(path), "%s/db", dir != NULL ? dir : "");
+	if (dir == NULL || bench_write_file(dir, "config", config) == -1 || mkdir(path, 0755) == -1
+			|| (pid = bench_spawn(server, dir, &input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || bench_wait_port("127.0.0.1", port + 1, 5000) == -1) {
+		fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", dir);
+		goto out;
+	}
+	for (i = 0; i < 3; i++)
+		bench_random_hash(hashes[i]);
+	if (join_server("127.0.0.2", port, dir, hashes[2], 1, &requester, &retry_after) != 0
+			|| join_server("127.0.0.30", port, dir, hashes[0], 1, &first, &retry_after) != 0
+			|| join_server("127.0.0.30", port, dir, hashes[1], 1, &again, &retry_after) != 0)
+		goto out;
+	/* Per address: the third one is turned away, counted as such */
+	per_ip = join_server("127.0.0.30", port, dir, hashes[2], 1, &other[0], &retry_after) == HANDSHAKE_BUSY
+			&& bench_server_metric(port + 1, "fs_connections_rejected_ip_total") == 1;
+	/* The newer list is what the address has, the old connection going doesn't change that */
+	kept = owned_by(requester, hashes[1], "127.0.0.30") == 1 && owned_by(requester, hashes[0], "127.0.0.30") == 0;
+	conn_close(first);
+	first = NULL;
+	kept = kept && wait_metric(port + 1, "fs_connections_closed_total", 1) == 0
+			&& owned_by(requester, hashes[1], "127.0.0.30") == 1;
+	/* Full: the fifth is told to come back when the slot freed suggests */
+	if (join_server("127.0.0.31", port, dir, hashes[2], 1, &other[1], &retry_after) == 0
+			&& join_server("127.0.0.32", port, dir, hashes[2], 1, &other[2], &retry_after) == 0)
+		hinted = join_server("127.0.0.33", port, dir, hashes[2], 1, &other[0], &retry_after) == HANDSHAKE_BUSY
+				&& retry_after > 0 && bench_server_metric(port + 1, "fs_connections_rejected_total") == 1;
+	/* Once the last connection from the address goes, so does what it had */
+	conn_close(again);
+	again = NULL;
+	kept = kept && wait_metric(port + 1, "fs_connections_closed_total", 2) == 0
+			&& owned_by(requester, hashes[1], "127.0.0.30") == 0;
+	printf("overload: a third connection from one address turned away: %s\n", per_ip ? "ok" : "FAILED");
+	printf("overload: the fifth told to come back in %u ms: %s\n", retry_after, hinted ? "ok" : "FAILED");
+	printf("overload: a peer joining again keeps its files when the old connection goes: %s\n", kept ? "ok" : "FAILED");
+out:
+	conn_close(requester);
+	conn_close(first);
+	conn_close(again);
+	for (i = 0; i < 3; i++)
+		conn_close(other[i]);
+	if (pid != -1)
+		bench_stop(pid, input);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	return !per_ip || !hinted || !kept;
+}
+
+/*
+ * Lists are taken a piece at a time: a peer sending its list a byte now
+ * and then doesn't hold up another's lookup, and is dropped once
+ * list-timeout=2 is over; one larger than max-list-records=2 is turned
+ * down before anything of it is kept. Returns 1 if something went wrong.
+ */
+static int slow_lists(char *server, int port) {
+	char				*dir = bench_tmpdir(),
+						config[256],
+						path[1100],
+						hash[HASH_LEN + 1],
+						byte;
+	conn				*requester = NULL,
+						*slow = NULL,
+						*large = NULL;
+	unsigned long long	start,
+						took = 0;
+	unsigned int		retry_after = 0;
+	struct dirent		*e;
+	DIR					*db;
+	pid_t				pid = -1;
+	int					input,
+						answered = 0,
+						dropped = 0,
+						refused = 0;
+
+	snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=%d\nmax-connections=4\nmax-list-records=2\n"
+			"list-timeout=2\nlog-level=error\nmetrics-port=%d\n", port, port + 1);
+	snprintf(path, sizeof(path), "%s/db", dir != NULL ? dir : "");
+	if (dir == NULL || bench_write_file(dir, "config", config) == -1 || mkdir(path, 0755) == -1
+			|| (pid = bench_spawn(server, dir, &input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || bench_wait_port("127.0.0.1", port + 1, 5000) == -1) {
+		fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", dir);
+		goto out;
+	}
+	bench_random_hash(hash);
+	if (join_server("127.0.0.2", port, dir, hash, 1, &requester, &retry_after) != 0
+			|| join_server("127.0.0.40", port, dir, hash, 0, &slow, &retry_after) != 0)
+		goto out;
+	/* The header and a byte of the record, the rest never comes */
+	if (send_file_header(slow, sizeof(hash_record), ENCODING_RAW) == -1 || conn_write(slow, "x", 1) == -1
+			|| conn_flush(slow) == -1)
+		goto out;
+	start = bench_usec();
+	answered = owned_by(requester, hash, "127.0.0.2") == 0;
+	took = (bench_usec() - start) / 1000;
+	/* The server closes on it: the read fails before its own 5 s are over */
+	dropped = conn_read(slow, &byte, 1) == -1 && wait_metric(port + 1, "fs_hash_lists_failed_total", 1) == 0;
+	refused = join_server("127.0.0.41", port, dir, hash, 3, &large, &retry_after) == 0
+			&& conn_read(large, &byte, 1) == -1 && wait_metric(port + 1, "fs_hash_lists_failed_total", 2) == 0;
+	if ((db = opendir(path)) == NULL)
+		refused = 0;
+	else {
+		while ((e = readdir(db)) != NULL)
+			if (strncmp(e->d_name, "127.0.0.41-", 11) == 0)
+				refused = 0;
+		closedir(db);
+	}
+	printf("overload: a lookup while another list trickles in, answered in %llu ms: %s\n", took,
+			answered && took < 1000 ? "ok" : "FAILED");
+	printf("overload: a list not whole after list-timeout dropped: %s\n", dropped ? "ok" : "FAILED");
+	printf("overload: a list over max-list-records turned down unwritten: %s\n", refused ? "ok" : "FAILED");
+out:
+	conn_close(requester);
+	conn_close(slow);
+	conn_close(large);
+	if (pid != -1)
+		bench_stop(pid, input);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	return !answered || took >= 1000 || !dropped || !refused;
+}
+
+/*
+ * A real peer turned away connect-retries=3 times by a server asking for
+ * hint msec, or none (0): it must wait at least that long each time,
+ * without a hint 0.5 s then twice as long each time (BACKOFF_FIRST in
+ * Peer.h). Returns 1 if it came back sooner, or not as many times.
+ */
+static int backoff(char *peer, int port, unsigned int hint) {
+	struct timespec		pause = { 0, 10000000 };
+	unsigned long long	start,
+						least,
+						gap;
+	hash_record			*records = NULL;
+	bench_busy			b;
+	char				*dir = bench_tmpdir(),
+						config[128];
+	int					input = -1,
+						bad = 1,
+						i;
+	pid_t				pid = -1;
+
+	if (dir == NULL || bench_busy_start(&b, port, hint) == -1) {
+		bench_rmdir(dir);
+		return 1;
+	}
+	snprintf(config, sizeof(config), "servers=127.0.0.1:%d\nconnect-retries=3\n", port);
+	if ((pid = bench_share(peer, dir, 1, 4096, config, &input, &records)) == -1)
+		goto out;
+	/* Menu entry 1 connects to the server */
+	write(input, "1\n", 2);
+	start = bench_usec();
+	while (bench_busy_answered(&b) < 4 && bench_usec() - start < 20000000ULL)
+		nanosleep(&pause, NULL);
+	bad = bench_busy_answered(&b) != 4;
+	for (i = 1, least = 0; !bad && i < 4; i++) {
+		gap = (b.at[i] - b.at[i - 1]) / 1000;
+		least = hint > 0 ? hint : 500U << (i - 1);
+		/* Answered as soon as it connected, the time is the peer's to within a few ms */
+		bad = gap + 5 < least;
+		printf("overload: %s, try %d after %llu ms, at least %llu\n", hint > 0 ? "a hint" : "no hint", i + 1, gap, least);
+	}
+	printf("overload: a peer waits as told when turned away, %s: %s\n", hint > 0 ? "with a hint" : "backing off",
+			bad ? "FAILED" : "ok");
+out:
+	bench_busy_stop(&b);
+	if (pid != -1)
+		bench_stop(pid, input);
+	free(records);
+	bench_rmdir(dir);
+	return bad;
+}
+
+/*
+ * More and more peers against a server with room for max-connections=N
+ * of them, from half as many to 8 times as many: turned away, they come
+ * back when the server says. With goodput=P as many sessions a second
+ * must get done at 8 times as many as P% of those at N, timing left to
+ * make bench. backoff=off has them come back at once instead. First the
+ * rules on their own, see admission() and slow_lists(), and with
+ * peer=PATH a real peer's waits, see backoff().
+ */
+int bench_overload(int argc, char **argv) {
+	char	*args[64],
+			*server = bench_sarg(argc, argv, "server", NULL),
+			*peer = bench_sarg(argc, argv, "peer", NULL),
+			concurrency[32],
+			max_connections[32];
+	double	goodput[5];
+	int		max = bench_arg(argc, argv, "max-connections", 16),
+			least = bench_arg(argc, argv, "goodput", 0),
+			port = bench_arg(argc, argv, "admission-port", 13180),
+			bad = 0,
+			num,
+			n,
+			i;
+
+	if (max < 2 || argc > 60) {
+		fprintf(stderr, "[ERROR] max-connections must be 2 at least\n");
+		return 1;
+	}
+	if (server != NULL)
+		bad |= admission(server, port) | slow_lists(server, port + 3);
+	if (peer != NULL)
+		bad |= backoff(peer, port + 2, 300) | backoff(peer, port + 2, 0);
+	for (n = 0; n < 5; n++) {
+		for (num = 0, i = 0; i < argc; i++)
+			if (strncmp(argv[i], "max-connections=", 16) != 0 && strncmp(argv[i], "concurrency=", 12) != 0)
+				args[num++] = argv[i];
+		snprintf(max_connections, sizeof(max_connections), "max-connections=%d", max);
+		snprintf(concurrency, sizeof(concurrency), "concurrency=%d", (max << n) / 2);
+		args[num++] = max_connections;
+		args[num++] = concurrency;
+		args[num] = NULL;
+		printf("overload: %d peers at once, room for %d\n", (max << n) / 2, max);
+		bad |= bench_load(num, args);
+		goodput[n] = last_goodput;
+		printf("\n");
+	}
+	for (n = 0; n < 5; n++)
+		printf("overload: %3d peers at once, %.1f sessions/s, %.2fx of %d at once\n", (max << n) / 2, goodput[n],
+				goodput[1] > 0 ? goodput[n] / goodput[1] : 0, max);
+	/* Past saturation the server must keep getting sessions done */
+	if (least > 0) {
+		bad |= goodput[4] < goodput[1] * least / 100;
+		printf("overload: at 8x, %.0f%% of the sessions/s at 1x, %d%% at least\n",
+				goodput[1] > 0 ? goodput[4] * 100 / goodput[1] : 0, least);
+	}
+	printf("overload: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
@@ -0,0 +1,107 @@
+/*
+ ============================================================================
+ Name        : LogBench.c
+ Author      : Giacomo Persichini
+ Description : Listener throughput with logging off, sync and async
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi() */
+#include <string.h> /* memset() */
+#include <time.h> /* nanosleep() */
+#include <unistd.h> /* pipe() - read() - write() */
+#include <sys/socket.h> /* socketpair() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Log.h"
+
+#define MODE_OFF 0
+#define MODE_SYNC 1
+#define MODE_ASYNC 2
+
+/*
+ * Reads the log pipe like a slow terminal would: 4 KB every millisecond.
+ */
+static void *slow_sink(void *arg) {
+	char			buffer[4096];
+	int				fd = *(int *) arg;
+	struct timespec	pause = { 0, 1000000 };
+
+	while (read(fd, buffer, sizeof(buffer)) > 0)
+		nanosleep(&pause, NULL);
+	return NULL;
+}
+
+/*
+ * The socket work of an accepted connection (hand-shake and a small hash
+ * list) is replaced by a round trip on a socket pair; the four lines are
+ * the ones server_listener() logs for every peer.
+ */
+static double run(int mode, int connections, int log_fd) {
+	FILE				*out = fdopen(dup(log_fd), "w");
+	int					pair[2],
+						i;
+	char				msg[64],
+						ip[] = "192.168.204.128";
+	unsigned long long	start;
+
+	memset(msg, 'x', sizeof(msg));
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	if (mode == MODE_ASYNC)
+		log_init(LOG_INFO, LOG_TEXT, NULL, log_fd);
+
+	start = bench_usec();
+	for (i = 0; i < connections; i++) {
+		write(pair[0], msg, sizeof(msg));
+		read(pair[1], msg, sizeof(msg));
+		if (mode == MODE_SYNC) {
+			fprintf(out, "[INFO] New connection (%s).\n", ip);
+			fprintf(out, "[INFO] File transfer completed (%s).\n", ip);
+			fprintf(out, "[INFO] Peer verified (%s).\n", ip);
+			fprintf(out, "[INFO] Closed connection (%s).\n", ip);
+			fflush(out);	/* stdout is line buffered on a terminal */
+		}
+		else if (mode == MODE_ASYNC) {
+			log_info("New connection (%s).", ip);
+			log_info("File transfer completed (%s).", ip);
+			log_info("Peer verified (%s).", ip);
+			log_info("Closed connection (%s).", ip);
+		}
+	}
+	start = bench_usec() - start;
+
+	if (mode == MODE_ASYNC)
+		log_shutdown();
+	fclose(out);
+	close(pair[0]);
+	close(pair[1]);
+	return connections * 1000000.0 / (start ? start : 1);
+}
+
+int bench_log(int argc, char **argv) {
+	static char	*names[] = { "off", "sync", "async" };
+	int			connections = argc > 0 ? atoi(argv[0]) : 200000,
+				fds[2],
+				mode;
+	pthread_t	sink;
+	double		rate;
+
+	for (mode = MODE_OFF; mode <= MODE_ASYNC; mode++) {
+		if (pipe(fds) == -1) {
+			perror("[ERROR] pipe() call failed");
+			return 1;
+		}
+		pthread_create(&sink, NULL, slow_sink, &fds[0]);
+		rate = run(mode, connections, fds[1]);
+		close(fds[1]);
+		pthread_join(sink, NULL);
+		close(fds[0]);
+		printf("log %-5s %10.0f conn/s", names[mode], rate);
+		if (mode == MODE_ASYNC)
+			printf("  (%lu lines dropped)", log_dropped());
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ ============================================================================
+ Name        : OwnersBench.c
+ Author      : Giacomo Persichini
+ Description : Tens of millions of owners in the server's index, memory and lookups
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* strcmp() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* getpid() */
+
+#include "Bench.h"
+#include "Owners.h"
+
+#define MAX_OWNERS 3
+
+/* A few files are shared by more than one peer, like in bench search */
+static int owners_of(unsigned long f) {
+	return 1 + (f % 7 == 0) + (f % 29 == 0);
+}
+
+/* Owner k of file f */
+static int owner(unsigned long f, int k, int peers) {
+	return (f + k) % peers;
+}
+
+static void peer_ip(int p, char *ip) {
+	snprintf(ip, INET_ADDRSTRLEN, "10.%d.%d.%d", p >> 16 & 255, p >> 8 & 255, p & 255);
+}
+
+static unsigned long long mix(unsigned long long x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void file_hash(unsigned long f, char *hash) {
+	static const char	hex[] = "0123456789abcdef";
+	unsigned long long	bits = 0;
+	int					i;
+
+	for (i = 0; i < HASH_LEN; i++, bits >>= 4) {
+		if (i % 16 == 0)
+			bits = mix(f * 3 + i / 16);
+		hash[i] = hex[bits & 15];
+	}
+	hash[HASH_LEN] = '\0';
+}
+
+static unsigned long long nsec() {
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Every peer's list, one after the other like the server gets them. Returns the entries added */
+static long add_peers(owner_index *o, unsigned long files, int peers, int step) {
+	char			ip[INET_ADDRSTRLEN],
+					hash[HASH_LEN + 1];
+	unsigned long	f;
+	long			num = 0;
+	int				p,
+					k,
+					ret;
+
+	for (p = 0; p < peers; p += step) {
+		peer_ip(p, ip);
+		for (k = 0; k < MAX_OWNERS; k++)
+			for (f = (p - k + (unsigned long) peers * MAX_OWNERS) % peers; f < files; f += peers)
+				if (owners_of(f) > k) {
+					file_hash(f, hash);
+					if ((ret = owners_add(o, ip, hash)) == -1)
+						return -1;
+					num += ret == 0;
+				}
+	}
+	return num;
+}
+
+/*
+ * Lookups of random files against what they should find, with the first
+ * owner skipped now and then; files never added find nobody. Latencies
+ * are in ns.
+ */
+static int lookups(owner_index *o, unsigned long files, int peers, int gone, long num, bench_samples *latency) {
+	char				found[MAX_OWNERS][INET_ADDRSTRLEN],
+						expected[MAX_OWNERS][INET_ADDRSTRLEN],
+						hash[HASH_LEN + 1],
+						skip[INET_ADDRSTRLEN];
+	unsigned long long	start;
+	unsigned long		f;
+	long				q,
+						wrong = 0;
+	int					n,
+						want,
+						i,
+						j,
+						k;
+
+	for (q = 0; q < num; q++) {
+		f = mix(q ^ 0x5bd1e995) % (files + files / 10);
+		file_hash(f, hash);
+		skip[0] = '\0';
+		if (q % 4 == 0 && f < files)
+			peer_ip(owner(f, 0, peers), skip);
+		start = nsec();
+		n = owners_find(o, hash, skip, found, MAX_OWNERS);
+		bench_sample(latency, nsec() - start);
+
+		/* Every other peer gone, when gone is set */
+		for (want = 0, k = 0; f < files && k < owners_of(f); k++)
+			if (!(gone && owner(f, k, peers) % 2 == 0)) {
+				peer_ip(owner(f, k, peers), expected[want]);
+				want += strcmp(expected[want], skip) != 0;
+			}
+		for (i = 0; i < n && n == want; i++) {
+			for (j = 0; j < want && strcmp(found[i], expected[j]) != 0; j++)
+				;
+			n = j < want ? n : -1;
+		}
+		if (n != want && wrong++ == 0)
+			fprintf(stderr, "[ERROR] owners: file %lu has %d owners, %d expected\n", f, n, want);
+	}
+	return wrong > 0;
+}
+
+static void print(char *what, owner_index *o, bench_samples *latency) {
+	printf("owners: %-8s %ld entries, %.1f MB, %.1f bytes per entry, lookups p50 %u ns, p99 %u ns\n", what,
+			owners_count(o), owners_memory(o) / 1048576.0,
+			(double) owners_memory(o) / (owners_count(o) > 0 ? owners_count(o) : 1),
+			bench_percentile(latency, 0.5), bench_percentile(latency, 0.99));
+}
+
+/*
+ * entries peer and file pairs, over files shared by 1 to 3 of the peers:
+ * added list by list, looked up, then every other peer leaves and comes
+ * back. bytes per entry above max-bytes fails, like any wrong lookup.
+ */
+int bench_owners(int argc, char **argv) {
+	owner_index			*o;
+	bench_samples		latency[3];
+	unsigned long long	start;
+	unsigned long		entries = bench_arg(argc, argv, "entries", 10000000),
+						files,
+						f;
+	long				num = bench_arg(argc, argv, "lookups", 1000000),
+						expected,
+						added,
+						removed = 0;
+	int					peers = bench_arg(argc, argv, "peers", 1000),
+						max_bytes = bench_arg(argc, argv, "max-bytes", 48),
+						bad = 0,
+						p;
+	char				ip[INET_ADDRSTRLEN];
+
+	if (peers < MAX_OWNERS * 2 || peers > 1 << 24 || entries < 1000 || num < 1) {
+		fprintf(stderr, "[ERROR] owners needs 1000 entries and %d to %d peers at least\n", MAX_OWNERS * 2, 1 << 24);
+		return 1;
+	}
+	if ((o = owners_open()) == NULL) {
+		fprintf(stderr, "[ERROR] Not enough memory for the owner index\n");
+		return 1;
+	}
+	memset(latency, 0, sizeof(latency));
+	for (files = 0, expected = 0; (unsigned long) expected < entries; files++)
+		expected += owners_of(files);
+	printf("owners: %ld entries, %lu files, %d peers, %zu bytes per entry in the lists on disk\n", expected, files,
+			peers, sizeof(hash_record));
+
+	start = bench_usec();
+	added = add_peers(o, files, peers, 1);
+	printf("owners: added in %.2f s, %.0f ns each\n", (bench_usec() - start) / 1e6,
+			(bench_usec() - start) * 1000.0 / (added > 0 ? added : 1));
+	if (added != expected || owners_count(o) != expected) {
+		fprintf(stderr, "[ERROR] owners: %ld entries indexed, %ld expected\n", owners_count(o), expected);
+		bad = 1;
+	}
+	/* The same again is nothing new */
+	bad |= add_peers(o, files < 1000 ? files : 1000, peers, 1) != 0 || owners_count(o) != expected;
+	bad |= lookups(o, files, peers, 0, num, &latency[0]);
+	print("all:", o, &latency[0]);
+	bad |= (double) owners_memory(o) / expected > max_bytes;
+	printf("owners: peak RSS %ld KB\n", bench_peak_rss(getpid()));
+
+	start = bench_usec();
+	for (p = 0; p < peers; p += 2) {
+		peer_ip(p, ip);
+		removed += owners_remove(o, ip);
+	}
+	printf("owners: half of the peers left in %.2f s\n", (bench_usec() - start) / 1e6);
+	for (f = 0, added = 0; f < files; f++)
+		for (p = 0; p < owners_of(f); p++)
+			added += owner(f, p, peers) % 2 == 0;
+	if (removed != added || owners_count(o) != expected - removed) {
+		fprintf(stderr, "[ERROR] owners: %ld entries removed, %ld expected\n", removed, added);
+		bad = 1;
+	}
+	bad |= lookups(o, files, peers, 1, num, &latency[1]);
+	print("half:", o, &latency[1]);
+
+	/* Back with the same lists: the ids and lists they freed are taken again */
+	bad |= add_peers(o, files, peers, 2) != removed || owners_count(o) != expected;
+	bad |= lookups(o, files, peers, 0, num, &latency[2]);
+	print("again:", o, &latency[2]);
+
+	printf("owners: %s\n", bad ? "FAILED" : "ok");
+	owners_close(o);
+	for (p = 0; p < 3; p++)
+		free(latency[p].values);
+	return bad;
+}
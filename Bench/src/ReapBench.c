@@ -0,0 +1,279 @@
+/*
+ ============================================================================
+ Name        : ReapBench.c
+ Author      : Giacomo Persichini
+ Description : The timer wheel on a million timeouts, then peers that vanish from the server
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() */
+#include <string.h> /* memset() */
+#include <time.h> /* nanosleep() */
+#include <unistd.h> /* close() */
+#include <fcntl.h> /* open() */
+#include <sys/stat.h> /* mkdir() */
+#include <sys/wait.h> /* waitpid() */
+#include <sys/socket.h> /* socket() - connect() */
+#include <arpa/inet.h> /* inet_addr() */
+#include <signal.h> /* signal() - SIGPIPE */
+#include <errno.h> /* errno */
+
+#include "Bench.h"
+#include "Wheel.h"
+
+#define ALIVE 0		/* Sends heartbeats */
+#define VANISHED 1	/* Agreed on heartbeats, then never a word: crashed, or half-open */
+#define OLD 2		/* Offers no options and stays quiet, only idle-timeout drops it */
+
+typedef struct check {
+	wheel_timer			timer;
+	unsigned long long	fired;		/* Last tick it fired on */
+	int					times;		/* It fired */
+	int					again;		/* Times left to add itself back when fired */
+	int					expected;	/* Times it should fire */
+} check;
+
+static void fired(wheel_timer *t, void *arg) {
+	wheel	*w = arg;
+	check	*c = (check *) t;
+
+	c->fired = w->now;
+	c->times++;
+	if (c->again > 0) {
+		c->again--;
+		wheel_add(w, t, w->now + 1 + rand() % 5000);
+	}
+}
+
+/*
+ * Timers from 1 tick to beyond the wheel's reach, some deleted, some moved
+ * and some adding themselves back when they fire: each must fire as many
+ * times as it was set, on the tick it was set for.
+ */
+static int check_wheel(long num) {
+	wheel				*w = malloc(sizeof(wheel));
+	check				*checks = calloc(num, sizeof(check));
+	unsigned long long	start,
+						add_ns,
+						advance_ns,
+						ticks = 0;
+	long				i,
+						wrong = 0,
+						done = 0;
+	int					bad;
+
+	wheel_init(w, 1000);
+	start = bench_usec();
+	for (i = 0; i < num; i++) {
+		checks[i].expected = 1;
+		switch (i % 100) {
+		case 0:		/* Past the last level */
+			wheel_add(w, &checks[i].timer, w->now + (1ULL << 24) + rand() % 100000);
+			break;
+		case 1:
+			checks[i].again = 3;
+			checks[i].expected = 4;
+			/* no break */
+		default:
+			wheel_add(w, &checks[i].timer, w->now + 1 + (unsigned long long) rand() * rand() % (1 << 20));
+		}
+	}
+	/* Moved: removed and added again */
+	for (i = 2; i < num; i += 10)
+		wheel_add(w, &checks[i].timer, w->now + 1 + rand() % 100000);
+	for (i = 3; i < num; i += 10) {
+		wheel_del(w, &checks[i].timer);
+		checks[i].expected = 0;
+	}
+	add_ns = (bench_usec() - start) * 1000 / (num + num / 5);
+
+	start = bench_usec();
+	while (w->count > 0) {
+		/* Now tick by tick, now a jump like after a long select() */
+		ticks = w->now + (rand() % 50 == 0 ? 1 + rand() % 3000 : 1 + rand() % 10);
+		done += wheel_advance(w, ticks, fired, w);
+	}
+	advance_ns = (bench_usec() - start) * 1000 / (done > 0 ? done : 1);
+
+	for (i = 0; i < num; i++)
+		wrong += checks[i].times != checks[i].expected
+				|| (checks[i].expected > 0 && checks[i].fired != checks[i].timer.expires);
+	bad = wrong > 0;
+	printf("reap: %ld timers over %llu ticks, %lld ns to add, %lld ns per timer fired, %ld wrong: %s\n", num,
+			w->now - 1000, (long long) add_ns, (long long) advance_ns, wrong, bad ? "FAILED" : "ok");
+	free(checks);
+	free(w);
+	return bad;
+}
+
+static conn *join(char *ip, int port, char *list, int options) {
+	struct sockaddr_in	addr;
+	conn				*cn = NULL;
+	int					fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || (cn = conn_open(fd)) == NULL
+			|| handshake(HANDSHAKE_SERVER, cn, options) < 0 || send_file(list, cn) != 0) {
+		fprintf(stderr, "[ERROR] %s couldn't join the server\n", ip);
+		if (cn == NULL)
+			close(fd);
+		else
+			conn_close(cn);
+		return NULL;
+	}
+	return cn;
+}
+
+/*
+ * Peers of the three kinds share a file each and the alive ones ping every
+ * 100 ms. The server closing a connection is how it drops the peer: the
+ * vanished ones must be dropped in peer-timeout seconds, the old ones in
+ * idle-timeout, the alive ones never. Then only the alive ones' files
+ * must be found.
+ */
+static int through_server(char *server, int port, int num, int timeout) {
+	struct timespec		pause = { 0, 100000000 };
+	char				*dir = bench_tmpdir(),
+						path[1024],
+						config[256],
+						ip[INET_ADDRSTRLEN],
+						owner[FOUND_SIZE],
+						byte,
+						(*hashes)[HASH_LEN + 1] = malloc(num * sizeof(*hashes));
+	conn				**peers = calloc(num, sizeof(conn *)),
+						*requester = NULL;
+	unsigned long long	start,
+						round = 0,
+						*joined = calloc(num, sizeof(unsigned long long)),
+						*gone = calloc(num, sizeof(unsigned long long));
+	bench_samples		delay[3];
+	hash_record			rec;
+	pid_t				pid = -1;
+	int					input,
+						bad = 1,
+						left,
+						fd,
+						k;
+
+	/* The server hangs up on the peers it drops, writing to them must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	memset(delay, 0, sizeof(delay));
+	snprintf(config, sizeof(config),
+			"server-ip=127.0.0.1\nserver-port=%d\nmax-connections=%d\nlog-level=warn\npeer-timeout=%d\nidle-timeout=%d\n",
+			port, num + 10, timeout, 2 * timeout);
+	snprintf(path, sizeof(path), "%s/db", dir);
+	if (dir == NULL || bench_write_file(dir, "config", config) == -1 || mkdir(path, 0755) == -1
+			|| (pid = bench_spawn(server, dir, &input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || waitpid(pid, NULL, WNOHANG) != 0) {
+		fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", dir);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/list", dir);
+	start = bench_usec();
+	for (k = -1; k < num; k++) {
+		memset(&rec, 0, sizeof(rec));
+		bench_random_hash(rec.hash);
+		snprintf(rec.filename, sizeof(rec.filename), "file%d.bin", k);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		write(fd, &rec, sizeof(rec));
+		close(fd);
+		/* The requester first, it stays the whole time */
+		if (k == -1) {
+			if ((requester = join("127.0.0.2", port, path, OPT_HEARTBEAT)) == NULL)
+				goto out;
+			continue;
+		}
+		memcpy(hashes[k], rec.hash, HASH_LEN + 1);
+		snprintf(ip, sizeof(ip), "127.0.0.%d", 10 + k % 240);	/* num is 240 at most */
+		if ((peers[k] = join(ip, port, path, k % 3 == OLD ? 0 : OPT_HEARTBEAT)) == NULL)
+			goto out;
+		if (k % 3 != OLD && !(peers[k]->options & OPT_HEARTBEAT)) {
+			fprintf(stderr, "[ERROR] The server didn't agree on heartbeats\n");
+			goto out;
+		}
+		joined[k] = bench_usec();
+		/* Joining them all takes a while, the first ones mustn't go quiet meanwhile */
+		if (joined[k] - round >= 100000) {
+			round = joined[k];
+			send_ping(requester);
+			for (fd = 0; fd <= k; fd += 3)
+				send_ping(peers[fd]);
+		}
+	}
+
+	for (left = num - num / 3; left > 0 && bench_usec() - start < 4000000ULL * timeout; ) {
+		nanosleep(&pause, NULL);
+		send_ping(requester);
+		for (k = 0; k < num; k++) {
+			if (gone[k] != 0)
+				continue;
+			if (k % 3 == ALIVE)
+				send_ping(peers[k]);
+			if (recv(peers[k]->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN)
+				continue;
+			gone[k] = bench_usec() - joined[k];
+			bench_sample(&delay[k % 3], gone[k] / 1000);
+			left -= k % 3 != ALIVE;
+		}
+	}
+	for (k = 0; k < num; k++) {
+		if (send_query(requester, hashes[k]) != 0 || (fd = read_reply(requester, owner)) == -1) {
+			fprintf(stderr, "[ERROR] The server stopped answering\n");
+			goto out;
+		}
+		if (fd != (k % 3 == ALIVE)) {
+			fprintf(stderr, "[ERROR] reap: the file of peer %d is %s\n", k, fd ? "still found" : "gone");
+			break;
+		}
+	}
+	bad = k < num || delay[ALIVE].num > 0 || delay[VANISHED].num < (num + 1) / 3 || delay[OLD].num < num / 3
+			|| bench_percentile(&delay[VANISHED], 1.0) > timeout * 1000 + 1500
+			|| bench_percentile(&delay[OLD], 0) < timeout * 2000 - 200;
+	printf("reap: %d peers, %ld alive dropped, vanished ones dropped after %.2f-%.2f s (peer-timeout %d s)\n", num,
+			delay[ALIVE].num, bench_percentile(&delay[VANISHED], 0) / 1000.0,
+			bench_percentile(&delay[VANISHED], 1.0) / 1000.0, timeout);
+	printf("reap: quiet old ones after %.2f-%.2f s (idle-timeout %d s): %s\n", bench_percentile(&delay[OLD], 0) / 1000.0,
+			bench_percentile(&delay[OLD], 1.0) / 1000.0, 2 * timeout, bad ? "FAILED" : "ok");
+out:
+	for (k = 0; k < num; k++)
+		conn_close(peers[k]);
+	conn_close(requester);
+	if (pid != -1)
+		bench_stop(pid, input);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	for (k = 0; k < 3; k++)
+		free(delay[k].values);
+	free(peers);
+	free(hashes);
+	free(joined);
+	free(gone);
+	return bad;
+}
+
+int bench_reap(int argc, char **argv) {
+	char	*server = bench_sarg(argc, argv, "server", NULL);
+	long	timers = bench_arg(argc, argv, "timers", 1000000);
+	int		peers = bench_arg(argc, argv, "peers", 60),
+			timeout = bench_arg(argc, argv, "timeout", 2),
+			bad;
+
+	if (timers < 100 || peers < 3 || peers > 240 || timeout < 1) {
+		fprintf(stderr, "[ERROR] reap needs 100 timers and 3 to 240 peers at least\n");
+		return 1;
+	}
+	srand(bench_arg(argc, argv, "seed", 1));
+	bad = check_wheel(timers);
+	if (server != NULL)
+		bad |= through_server(server, bench_arg(argc, argv, "port", 13170), peers, timeout);
+	printf("reap: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
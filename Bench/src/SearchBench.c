@@ -0,0 +1,407 @@
+/*
+ ============================================================================
+ Name        : SearchBench.c
+ Author      : Giacomo Persichini
+ Description : Checks the search index, then millions of names and queries on it
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* strcmp() - strncmp() */
+#include <unistd.h> /* close() */
+#include <sys/stat.h> /* mkdir() */
+#include <sys/wait.h> /* waitpid() */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <arpa/inet.h> /* inet_addr() */
+
+#include "Bench.h"
+#include "Search.h"
+
+#define VOCABULARY 50000
+#define MAX_WORDS 6
+#define CHECK_NAMES 100000
+
+/* No word is an extension: "pdf" only matches as ext:pdf */
+static const char	*exts[] = { "pdf", "mp3", "mkv", "jpg", "txt", "zip", "iso", "epub", "flac", "doc", "png", "avi" };
+static const char	separators[] = " _-.";
+
+typedef struct corpus {
+	char	(*words)[12];
+} corpus;
+
+/* What name i is made of, the same every time it's asked */
+typedef struct name {
+	int					words[MAX_WORDS];
+	int					num_words;
+	int					ext;
+	unsigned long long	state;
+} name;
+
+static unsigned long long next(unsigned long long *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+/* Some words are in a lot of names, most of them in a few */
+static int popular(unsigned long long *state) {
+	double	u = (next(state) >> 40) / 16777216.0;
+
+	return (int) (VOCABULARY * u * u * u);
+}
+
+static void make_name(unsigned long i, name *n) {
+	int	j;
+
+	n->state = (i + 1) * 0x9e3779b97f4a7c15ULL;
+	next(&n->state);
+	n->num_words = 2 + next(&n->state) % (MAX_WORDS - 1);
+	for (j = 0; j < n->num_words; j++)
+		n->words[j] = popular(&n->state);
+	n->ext = next(&n->state) % (sizeof(exts) / sizeof(exts[0]));
+}
+
+static void make_record(corpus *c, unsigned long i, hash_record *rec) {
+	static const char	hex[] = "0123456789abcdef";
+	unsigned long long	bits = 0;
+	name				n;
+	int					len,
+						j;
+
+	make_name(i, &n);
+	memset(rec, 0, sizeof(*rec));
+	len = snprintf(rec->filename, sizeof(rec->filename), "/home/user/shared/");
+	for (j = 0; j < n.num_words; j++)
+		len += snprintf(rec->filename + len, sizeof(rec->filename) - len, "%s%c", c->words[n.words[j]],
+				j < n.num_words - 1 ? separators[next(&n.state) & 3] : '.');
+	snprintf(rec->filename + len, sizeof(rec->filename) - len, "%s", exts[n.ext]);
+	for (j = 0; j < HASH_LEN; j++, bits >>= 4) {
+		if (j % 16 == 0)
+			bits = next(&n.state);
+		rec->hash[j] = hex[bits & 15];
+	}
+	rec->hash[HASH_LEN] = '\0';
+	record_set_size(rec, next(&n.state) % (1ULL << 32));
+}
+
+/* A few names are shared by more than one peer */
+static int owners_of(unsigned long i) {
+	return 1 + (i % 7 == 0) + (i % 29 == 0);
+}
+
+static void make_vocabulary(corpus *c) {
+	unsigned long long	state = 42;
+	int					i,
+						j,
+						len;
+
+	c->words = malloc(VOCABULARY * sizeof(*c->words));
+	for (i = 0; i < VOCABULARY; i++) {
+		/* The number makes it unique, the letters before it a prefix others share */
+		len = 2 + next(&state) % 4;
+		for (j = 0; j < len; j++)
+			c->words[i][j] = 'a' + next(&state) % 26;
+		snprintf(c->words[i] + len, sizeof(c->words[i]) - len, "%c%hu", 'a' + i % 26, (unsigned short) i);
+	}
+}
+
+/* A query like a user's, about name i */
+static void make_query(corpus *c, unsigned long i, int kind, char *text) {
+	name	n;
+	char	*w;
+
+	make_name(i, &n);
+	w = c->words[n.words[next(&n.state) % n.num_words]];
+	switch (kind) {
+	case 0:
+		sprintf(text, "%s", w);
+		break;
+	case 1:
+		sprintf(text, "%s %s", c->words[n.words[0]], c->words[n.words[1]]);
+		break;
+	case 2:
+		sprintf(text, "%.*s*", (int) (SEARCH_PREFIX + next(&n.state) % 5), w);
+		break;
+	default:
+		sprintf(text, "%s ext:%s", w, exts[n.ext]);
+		break;
+	}
+}
+
+static const char	*kinds[] = { "one word", "two words", "word*", "word ext:" };
+
+/* The same query against every name, the slow way */
+static long brute_force(corpus *c, char *text, char *alive, unsigned long num) {
+	char			first[64],
+					second[64],
+					*t;
+	unsigned long	i;
+	long			total = 0;
+	size_t			len;
+	name			n;
+	int				terms,
+					found,
+					j,
+					k;
+
+	terms = sscanf(text, "%63s %63s", first, second);
+	for (i = 0; i < num; i++) {
+		if (!alive[i])
+			continue;
+		make_name(i, &n);
+		for (found = 0, k = 0; k < terms; k++) {
+			t = k == 0 ? first : second;
+			len = strlen(t);
+			if (strncmp(t, "ext:", 4) == 0) {
+				found += strcmp(t + 4, exts[n.ext]) == 0;
+				continue;
+			}
+			for (j = 0; j < n.num_words; j++)
+				if (t[len - 1] == '*' ? strncmp(c->words[n.words[j]], t, len - 1) == 0
+						: strcmp(c->words[n.words[j]], t) == 0)
+					break;
+			found += j < n.num_words;
+		}
+		total += found == terms;
+	}
+	return total;
+}
+
+/* Best first, and the second page is where the longer one had it */
+static int in_order(search_result *all, int num_all, search_result *page, int num) {
+	int	i;
+
+	for (i = 1; i < num_all; i++)
+		if (search_compare(&all[i - 1], &all[i]) > 0)
+			return 0;
+	if (num != (num_all > 20 ? num_all - 20 : 0))
+		return 0;
+	for (i = 0; i < num; i++)
+		if (strcmp(page[i].hash, all[20 + i].hash) != 0)
+			return 0;
+	return 1;
+}
+
+/* Every query kind against a linear scan, before and after most owners leave */
+static int check(corpus *c) {
+	static search_result	all[40],
+							page[20];
+	search_index			*s = search_open();
+	hash_record				rec;
+	char					*alive = calloc(CHECK_NAMES, 1),
+							text[SEARCH_TEXT_MAX];
+	unsigned long long		state = 7;
+	unsigned long			i;
+	long					expected,
+							total;
+	int						round,
+							bad = 0,
+							num_all,
+							num,
+							q,
+							j;
+
+	for (i = 0; i < CHECK_NAMES; i++) {
+		make_record(c, i, &rec);
+		for (j = 0; j < owners_of(i); j++)
+			search_add(s, &rec);
+		alive[i] = 1;
+	}
+	for (round = 0; round < 3 && !bad; round++) {
+		for (q = 0; q < 200 && !bad; q++) {
+			make_query(c, next(&state) % CHECK_NAMES, q % 4, text);
+			expected = brute_force(c, text, alive, CHECK_NAMES);
+			total = search_query(s, text, 0, 40, all, &num_all);
+			search_query(s, text, 20, 20, page, &num);
+			if (total != expected || num_all != (total < 40 ? total : 40) || !in_order(all, num_all, page, num)) {
+				fprintf(stderr, "[ERROR] search: '%s' matched %ld files, %ld expected\n", text, total, expected);
+				bad = 1;
+			}
+		}
+		if (round == 0) {
+			/* Two thirds leave: more files gone than left, the index is rebuilt */
+			for (i = 0; i < CHECK_NAMES; i++)
+				if (i % 3 != 0) {
+					make_record(c, i, &rec);
+					for (j = 0; j < owners_of(i); j++)
+						search_remove(s, rec.hash);
+					alive[i] = 0;
+				}
+		}
+		else if (round == 1) {
+			/* Some come back */
+			for (i = 1; i < CHECK_NAMES; i += 3) {
+				make_record(c, i, &rec);
+				search_add(s, &rec);
+				alive[i] = 1;
+			}
+		}
+	}
+	for (expected = 0, i = 0; i < CHECK_NAMES; i++)
+		expected += alive[i];
+	if (!bad && search_count(s) != expected) {
+		fprintf(stderr, "[ERROR] search: %ld files indexed, %ld expected\n", search_count(s), expected);
+		bad = 1;
+	}
+	printf("search: %d names, %d queries checked against a linear scan: %s\n", CHECK_NAMES, round * 200,
+			bad ? "FAILED" : "ok");
+	search_close(s);
+	free(alive);
+	return bad;
+}
+
+/* A hash list through a real server, then searches over the connection */
+static int through_server(corpus *c, char *server, int port, int num_queries) {
+	char				*dir = bench_tmpdir(),
+						path[1024],
+						config[256],
+						text[SEARCH_TEXT_MAX];
+	search_result		results[SEARCH_PAGE_MAX];
+	search_index		*s = search_open();
+	bench_samples		latency;
+	hash_record			rec;
+	struct sockaddr_in	addr;
+	unsigned long long	start,
+						state = 11;
+	unsigned long		i;
+	long				total;
+	conn				*cn = NULL;
+	pid_t				pid = -1;
+	FILE				*list;
+	int					input,
+						bad = 1,
+						num,
+						fd,
+						q;
+
+	memset(&latency, 0, sizeof(latency));
+	snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=%d\nmax-connections=10\nlog-level=warn\n", port);
+	snprintf(path, sizeof(path), "%s/db", dir);
+	if (dir == NULL || bench_write_file(dir, "config", config) == -1 || mkdir(path, 0755) == -1
+			|| (pid = bench_spawn(server, dir, &input)) == -1)
+		goto out;
+	if (bench_wait_port("127.0.0.1", port, 5000) == -1 || waitpid(pid, NULL, WNOHANG) != 0) {
+		fprintf(stderr, "[ERROR] The server didn't start, see %s/output\n", dir);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/list", dir);
+	list = fopen(path, "w");
+	for (i = 0; i < 10000; i++) {
+		make_record(c, i, &rec);
+		fwrite(&rec, sizeof(rec), 1, list);
+		search_add(s, &rec);
+	}
+	fclose(list);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	memset(&addr.sin_zero, '\0', sizeof(addr.sin_zero));
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || (cn = conn_open(fd)) == NULL
+			|| handshake(HANDSHAKE_SERVER, cn, OPT_SEARCH) != 0 || !(cn->options & OPT_SEARCH)
+			|| send_file(path, cn) != 0) {
+		fprintf(stderr, "[ERROR] Couldn't hand the hash list to the server\n");
+		if (cn == NULL)
+			close(fd);
+		goto out;
+	}
+	for (bad = 0, q = 0; q < num_queries && !bad; q++) {
+		make_query(c, next(&state) % 10000, q % 4, text);
+		start = bench_usec();
+		total = search_servers(&cn, 1, text, 0, SEARCH_PAGE_MAX, results, &num);
+		bench_sample(&latency, bench_usec() - start);
+		if (total != search_query(s, text, 0, 1, results, &num)) {
+			fprintf(stderr, "[ERROR] search: the server matched %ld files for '%s'\n", total, text);
+			bad = 1;
+		}
+	}
+	printf("search: %d queries through the server, p50 %u us, p99 %u us: %s\n", q,
+			bench_percentile(&latency, 0.5), bench_percentile(&latency, 0.99), bad ? "FAILED" : "ok");
+out:
+	conn_close(cn);
+	if (pid != -1)
+		bench_stop(pid, input);
+	if (dir != NULL)
+		bench_rmdir(dir);
+	search_close(s);
+	free(latency.values);
+	return bad;
+}
+
+int bench_search(int argc, char **argv) {
+	static search_result	results[SEARCH_PAGE_MAX];
+	corpus					c;
+	search_index			*s;
+	bench_samples			latency;
+	hash_record				rec;
+	char					text[SEARCH_TEXT_MAX],
+							*server = bench_sarg(argc, argv, "server", NULL);
+	unsigned long long		start,
+							state = 3,
+							matches;
+	unsigned long			num_names = bench_arg(argc, argv, "names", 1000000),
+							i;
+	long					num_queries = bench_arg(argc, argv, "queries", 1000),
+							q;
+	int						bad,
+							kind,
+							num,
+							j;
+
+	make_vocabulary(&c);
+	bad = check(&c);
+
+	if ((s = search_open()) == NULL) {
+		fprintf(stderr, "[ERROR] Not enough memory for the search index\n");
+		free(c.words);
+		return 1;
+	}
+	start = bench_usec();
+	for (i = 0; i < num_names; i++) {
+		make_record(&c, i, &rec);
+		for (j = 0; j < owners_of(i); j++)
+			if (search_add(s, &rec) == -1) {
+				fprintf(stderr, "[ERROR] Not enough memory for %lu names\n", num_names);
+				num_names = i;
+				bad = 1;
+				break;
+			}
+	}
+	printf("search: %lu names indexed in %.2f s, %.0f names/s, %.1f MB, %.0f bytes per name\n", num_names,
+			(bench_usec() - start) / 1e6, num_names * 1e6 / (bench_usec() - start),
+			search_memory(s) / 1048576.0, (double) search_memory(s) / (num_names ? num_names : 1));
+
+	for (kind = 0; kind < 4 && num_names > 0; kind++) {
+		memset(&latency, 0, sizeof(latency));
+		for (matches = 0, q = 0; q < num_queries; q++) {
+			make_query(&c, next(&state) % num_names, kind, text);
+			start = bench_usec();
+			matches += search_query(s, text, 0, 20, results, &num);
+			bench_sample(&latency, bench_usec() - start);
+		}
+		printf("search: %-9s %ld queries, %.0f matches each, p50 %u us, p99 %u us, max %u us\n", kinds[kind],
+				num_queries, (double) matches / num_queries, bench_percentile(&latency, 0.5),
+				bench_percentile(&latency, 0.99), bench_percentile(&latency, 1.0));
+		free(latency.values);
+	}
+
+	/* Half of the peers leave, the index is rebuilt on the way */
+	start = bench_usec();
+	for (i = 0; i < num_names; i += 2) {
+		make_record(&c, i, &rec);
+		for (j = 0; j < owners_of(i); j++)
+			search_remove(s, rec.hash);
+	}
+	printf("search: %lu names removed in %.2f s, %ld files left, %.1f MB\n", (num_names + 1) / 2,
+			(bench_usec() - start) / 1e6, search_count(s), search_memory(s) / 1048576.0);
+	search_close(s);
+
+	if (server != NULL)
+		bad |= through_server(&c, server, bench_arg(argc, argv, "port", 13150), num_queries);
+	printf("search: %s\n", bad ? "FAILED" : "ok");
+	free(c.words);
+	return bad;
+}
@@ -0,0 +1,257 @@
+/*
+ ============================================================================
+ Name        : ShapeBench.c
+ Author      : Giacomo Persichini
+ Description : Checks the bandwidth limits and the weights on the loopback
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - free() */
+#include <string.h> /* memset() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* ftruncate() - close() - unlink() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Engine.h"
+#include "Protocol.h"
+#include "Shaper.h"
+
+#define MAX_STREAMS 4
+
+/* The transfer must come first, on_done gets it back */
+typedef struct shaped {
+	transfer			t;
+	unsigned long long	end;
+	unsigned long long	at_first;	/* Bytes moved when the first transfer ended */
+} shaped;
+
+typedef struct sink {
+	conn	*c;
+	int		ok;
+} sink;
+
+static shaped	*current;
+static int		current_num,
+				first_done;
+
+static void shaped_done(transfer *t) {
+	int	i;
+
+	((shaped *) t)->end = bench_usec();
+	if (first_done)
+		return;
+	first_done = 1;
+	for (i = 0; i < current_num; i++)
+		current[i].at_first = current[i].t.done;
+}
+
+/* The receiving side isn't limited, it takes whatever comes */
+static void *drain(void *arg) {
+	sink	*s = arg;
+
+	s->ok = receive_file("/dev/null", s->c, FILE_SIZE_MAX);
+	return NULL;
+}
+
+/*
+ * The rate between the first byte and the last: buckets start with a
+ * burst's worth of tokens, and the engine's last chunk goes as soon as
+ * it's paid for, so neither of them took any time.
+ */
+static double steady_rate(unsigned long long bytes, size_t free_bytes, unsigned long long usec) {
+	return (bytes - free_bytes) / (usec / 1e6);
+}
+
+/* Off by more than tolerance percent */
+static int off(double measured, double expected, long tolerance) {
+	return measured < expected * (100 - tolerance) / 100 || measured > expected * (100 + tolerance) / 100;
+}
+
+/*
+ * Sends n files through an engine shaped by s, one connection each. Rates
+ * are checked against the expected ones, in bytes per second; with
+ * weights the bytes each one moved until the first ended are checked too.
+ */
+static int run(char *name, shaper *s, int n, unsigned long long *sizes, int *weights, double *expected,
+		char *source, long tolerance) {
+	conn				*senders[MAX_STREAMS],
+						*receivers[MAX_STREAMS];
+	sink				sinks[MAX_STREAMS];
+	pthread_t			threads[MAX_STREAMS];
+	shaped				jobs[MAX_STREAMS];
+	engine				*e = engine_open(n);
+	unsigned long long	start,
+						total = 0,
+						moved = 0;
+	double				rate;
+	int					bad = 0,
+						weight_sum = 0,
+						fd,
+						i;
+
+	if (e == NULL || bench_tcp_pairs(n, senders, receivers) == -1) {
+		engine_close(e);
+		return 1;
+	}
+	engine_shape(e, s);
+	memset(jobs, 0, sizeof(jobs));
+	current = jobs;
+	current_num = n;
+	first_done = 0;
+	for (i = 0; i < n; i++) {
+		sinks[i].c = receivers[i];
+		pthread_create(&threads[i], NULL, drain, &sinks[i]);
+	}
+	start = bench_usec();
+	for (i = 0; i < n; i++) {
+		fd = open(source, O_RDWR);
+		ftruncate(fd, sizes[i]);
+		close(fd);
+		jobs[i].t.weight = weights != NULL ? weights[i] : 0;
+		jobs[i].t.on_done = shaped_done;
+		if (engine_upload(e, &jobs[i].t, senders[i], source) != 0) {
+			jobs[i].t.file = -1;
+			jobs[i].t.status = ENGINE_FAILED;
+		}
+	}
+	while (engine_active(e) > 0)
+		engine_run(e, 1);
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (jobs[i].t.file != -1)
+			close(jobs[i].t.file);
+		bad |= jobs[i].t.status != ENGINE_DONE || !sinks[i].ok;
+		conn_close(senders[i]);
+		conn_close(receivers[i]);
+		total += sizes[i];
+		moved += jobs[i].at_first;
+		weight_sum += weights != NULL ? weights[i] : 1;
+	}
+	engine_close(e);
+
+	for (i = 0; i < n && !bad; i++) {
+		if (expected[i] == 0)
+			continue;
+		rate = steady_rate(sizes[i], SHAPER_BURST + ENGINE_CHUNK, jobs[i].end - start);
+		bad |= off(rate, expected[i], tolerance);
+		printf("shape: %-9s transfer %d, %8.1f KB/s, expected %8.1f KB/s\n", name, i, rate / 1024, expected[i] / 1024);
+	}
+	/* Until the first one ends they're all running, so that's when shares are fair to compare */
+	for (i = 0; i < n && !bad && weights != NULL; i++) {
+		rate = (double) jobs[i].at_first / moved;
+		bad |= off(rate, (double) weights[i] / weight_sum, tolerance);
+		printf("shape: %-9s transfer %d, weight %d, %5.1f%% of the bandwidth, expected %5.1f%%\n", name, i,
+				weights[i], rate * 100, 100.0 * weights[i] / weight_sum);
+	}
+	printf("shape: %-9s %s, %d transfers, %.1f MB in total\n", name, bad ? "FAILED" : "ok", n, total / 1048576.0);
+	return bad;
+}
+
+/* The plain loop: send_file() paying from the connection's callback */
+static shaper	*sync_shaper;
+static bucket	sync_limit;
+
+static void sync_throttle(size_t bytes) {
+	shaper_throttle(sync_shaper, NULL, &sync_limit, bytes);
+}
+
+static int run_sync(unsigned long long rate, unsigned long long size, char *source, long tolerance) {
+	conn				*sender,
+						*receiver;
+	sink				s;
+	pthread_t			thread;
+	unsigned long long	start,
+						elapsed;
+	double				measured;
+	int					fd,
+						bad;
+
+	if (bench_tcp_pairs(1, &sender, &receiver) == -1)
+		return 1;
+	fd = open(source, O_RDWR);
+	ftruncate(fd, size);
+	close(fd);
+	sync_shaper = shaper_open(0, 0, rate, NULL);
+	bucket_init(&sync_limit, rate);
+	sender->on_write = sync_throttle;
+	s.c = receiver;
+	pthread_create(&thread, NULL, drain, &s);
+	start = bench_usec();
+	bad = send_file(source, sender) != 0;
+	elapsed = bench_usec() - start;
+	pthread_join(thread, NULL);
+	/* Here the sender sleeps after the last write, till it's paid for */
+	measured = steady_rate(size, SHAPER_BURST, elapsed);
+	bad |= !s.ok || off(measured, rate, tolerance);
+	printf("shape: %-9s transfer 0, %8.1f KB/s, expected %8.1f KB/s\n", "sync", measured / 1024, rate / 1024.0);
+	printf("shape: %-9s %s, 1 transfers, %.1f MB in total\n", "sync", bad ? "FAILED" : "ok", size / 1048576.0);
+	conn_close(sender);
+	conn_close(receiver);
+	shaper_close(sync_shaper);
+	return bad;
+}
+
+int bench_shape(int argc, char **argv) {
+	unsigned long long	rate = bench_arg(argc, argv, "rate", 8192) * 1024ULL,
+						seconds = bench_arg(argc, argv, "seconds", 2),
+						size = rate * seconds,
+						sizes[MAX_STREAMS];
+	long				tolerance = bench_arg(argc, argv, "tolerance", 3);
+	int					weights[] = { 1, 1, 2 },
+						bad = 0,
+						fd;
+	double				expected[MAX_STREAMS];
+	char				*dir = bench_tmpdir(),
+						source[1024];
+	shaper				*s;
+	engine				*probe;
+
+	if (dir == NULL)
+		return 1;
+	if ((probe = engine_open(1)) == NULL) {
+		fprintf(stderr, "[ERROR] io_uring isn't available here, only the plain loop can be checked\n");
+		bench_rmdir(dir);
+		return 1;
+	}
+	engine_close(probe);
+	/* Sparse, reading it costs next to nothing */
+	snprintf(source, sizeof(source), "%s/source", dir);
+	fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	close(fd);
+
+	/* The whole peer limited, one transfer takes it all */
+	s = shaper_open(rate, 0, 0, NULL);
+	sizes[0] = size;
+	expected[0] = rate;
+	bad |= run("global", s, 1, sizes, NULL, expected, source, tolerance);
+	shaper_close(s);
+
+	/* Each transfer limited on its own, they don't slow each other down */
+	s = shaper_open(0, 0, rate / 2, NULL);
+	sizes[0] = sizes[1] = size / 2;
+	expected[0] = expected[1] = rate / 2;
+	bad |= run("transfer", s, 2, sizes, NULL, expected, source, tolerance);
+	shaper_close(s);
+
+	/* Both go to the same peer, they share its limit */
+	s = shaper_open(0, rate, 0, NULL);
+	expected[0] = expected[1] = rate / 2;
+	bad |= run("peer", s, 2, sizes, NULL, expected, source, tolerance);
+	shaper_close(s);
+
+	/* Three sharing the whole limit 1:1:2, the heaviest ends first */
+	s = shaper_open(rate, 0, 0, NULL);
+	sizes[0] = sizes[1] = sizes[2] = size / 2;
+	expected[0] = expected[1] = 0;
+	expected[2] = rate / 2;
+	bad |= run("weights", s, 3, sizes, weights, expected, source, tolerance);
+	shaper_close(s);
+
+	bad |= run_sync(rate, size, source, tolerance);
+	unlink(source);
+	bench_rmdir(dir);
+	return bad;
+}
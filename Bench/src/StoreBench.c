@@ -0,0 +1,170 @@
+/*
+ ============================================================================
+ Name        : StoreBench.c
+ Author      : Giacomo Persichini
+ Description : Checks the content-addressed store: dedupe, local downloads, pruning
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - rand() */
+#include <string.h> /* strcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - pwrite() - close() - unlink() */
+#include <dirent.h> /* opendir() - readdir() */
+#include <sys/stat.h> /* mkdir() - stat() */
+
+#include "Bench.h"
+#include "Delta.h"
+#include "Store.h"
+
+#define BLOCK (1 << 20)
+
+static int write_random(char *path, unsigned long long size, char *buffer) {
+	unsigned long long	written;
+	size_t				n,
+						i;
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (written = 0; fd != -1 && written < size; written += n) {
+		n = size - written < BLOCK ? size - written : BLOCK;
+		for (i = 0; i < n; i++)
+			buffer[i] = (char) rand();
+		if (write(fd, buffer, n) != (ssize_t) n)
+			break;
+	}
+	close(fd);
+	return fd != -1 && written == size ? 0 : -1;
+}
+
+static int copy_file(char *from, char *to, char *buffer) {
+	int		in = open(from, O_RDONLY),
+			out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+			bad = in == -1 || out == -1;
+	ssize_t	n;
+
+	while (!bad && (n = read(in, buffer, BLOCK)) > 0)
+		bad = write(out, buffer, n) != n;
+	close(in);
+	close(out);
+	return bad ? -1 : 0;
+}
+
+/* Files in the store's folder, entries left behind included */
+static int entries(char *store) {
+	DIR				*d = opendir(store);
+	struct dirent	*ent;
+	int				num = 0;
+
+	if (d == NULL)
+		return -1;
+	while ((ent = readdir(d)) != NULL)
+		if (ent->d_name[0] != '.')
+			num++;
+	closedir(d);
+	return num;
+}
+
+/*
+ * The same file copied in two shared folders and added to the store like
+ * write_hash_list() does, then a download of that content and what
+ * happens once the files are edited and deleted.
+ */
+static int run(char *dir, int mode, unsigned long long size, int copies, char *buffer) {
+	char				store[1024],
+						path[1110],	/* target.again */
+						first[1100],
+						target[1100],
+						hash[HASH_LEN + 1],
+						other[HASH_LEN + 1];
+	char				*name = mode == STORE_HARDLINK ? "hardlink" : "reflink";
+	manifest			m;
+	unsigned long long	start,
+						took;
+	long long			saved = 0,
+						n;
+	int					bad = 0,
+						placed,
+						i;
+
+	snprintf(store, sizeof(store), "%s/store-%s", dir, name);
+	snprintf(first, sizeof(first), "%s/a/%s-0", dir, name);
+	snprintf(target, sizeof(target), "%s/downloads-%s", dir, name);
+	if (store_init(store) == -1 || write_random(first, size, buffer) == -1
+			|| manifest_build_file(&m, first, hash) == -1)
+		return 1;
+	manifest_free(&m);
+	for (i = 1; i < copies; i++) {
+		snprintf(path, sizeof(path), "%s/%c/%s-%d", dir, i % 2 ? 'b' : 'a', name, i);
+		bad |= copy_file(first, path, buffer) == -1;
+	}
+
+	start = bench_usec();
+	for (i = 0; i < copies && !bad; i++) {
+		snprintf(path, sizeof(path), "%s/%c/%s-%d", dir, i % 2 ? 'b' : 'a', name, i);
+		if ((n = store_add(store, hash, path, mode)) == -1)
+			bad = 1;
+		else
+			saved += n;
+	}
+	took = bench_usec() - start;
+	printf("store: %-8s %d copies of %.1f MB, %.1f MB deduplicated in %.2f s\n", name, copies, size / 1048576.0,
+			saved / 1048576.0, took / 1e6);
+	/* Links always work, clones only where the filesystem shares blocks */
+	if (mode == STORE_HARDLINK)
+		bad |= saved != (long long) size * (copies - 1);
+	else if (saved == 0)
+		printf("store: %-8s not supported by this filesystem, the copies are left alone\n", name);
+
+	start = bench_usec();
+	placed = store_place(store, hash, target, mode);
+	took = bench_usec() - start;
+	bad |= placed != 1 || !bench_same_content(first, target);
+	printf("store: %-8s download of %.1f MB found locally in %.3f s\n", name, size / 1048576.0, took / 1e6);
+	bench_random_hash(other);
+	bad |= store_place(store, other, target, mode) != 0;
+
+	/* Edited in place the entry is stale: no download may get that content */
+	i = open(first, O_WRONLY);
+	bad |= i == -1 || pwrite(i, "edited", 6, size / 2) != 6;
+	close(i);
+	snprintf(path, sizeof(path), "%s.again", target);
+	bad |= store_place(store, hash, path, mode) != 0;
+	printf("store: %-8s edited entry %s\n", name, access(path, F_OK) == 0 ? "served, FAILED" : "refused");
+
+	/* Once every file is gone the store lets go of them */
+	for (i = 0; i < copies; i++) {
+		snprintf(path, sizeof(path), "%s/%c/%s-%d", dir, i % 2 ? 'b' : 'a', name, i);
+		unlink(path);
+	}
+	unlink(target);
+	store_prune(store);
+	bad |= entries(store) != 0;
+	printf("store: %-8s %s\n", name, bad ? "FAILED" : "ok");
+	return bad;
+}
+
+int bench_store(int argc, char **argv) {
+	unsigned long long	size = bench_arg(argc, argv, "size", 64) << 20;
+	int					copies = bench_arg(argc, argv, "copies", 4),
+						bad = 0;
+	char				*dir = bench_tmpdir(),
+						*buffer = malloc(BLOCK),
+						path[1024];
+
+	if (dir == NULL || buffer == NULL || copies < 2) {
+		fprintf(stderr, "[ERROR] copies must be 2 at least\n");
+		free(buffer);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/a", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/b", dir);
+	mkdir(path, 0755);
+	srand(11);
+	bad |= run(dir, STORE_REFLINK, size, copies, buffer);
+	bad |= run(dir, STORE_HARDLINK, size, copies, buffer);
+	free(buffer);
+	bench_rmdir(dir);
+	return bad;
+}
@@ -0,0 +1,264 @@
+/*
+ ============================================================================
+ Name        : TlsBench.c
+ Author      : Giacomo Persichini
+ Description : Transfers in plaintext, with TLS in OpenSSL and with TLS in the kernel
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memcpy() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* write() - close() */
+#include <sys/socket.h> /* shutdown() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Engine.h"
+#include "Protocol.h"
+#include "Tls.h"
+
+#define BLOCK (1 << 20)
+
+/* The side that accepted, sending the file as a peer would */
+typedef struct uploader {
+	conn	*c;
+	char	*path;
+	engine	*e;
+	int		ret;
+	int		engine_used;
+} uploader;
+
+static int write_noise(char *path, unsigned long long size) {
+	unsigned long long	x = 0x2545f4914f6cdd1dULL,
+						written;
+	char				*buffer = malloc(BLOCK);
+	size_t				n,
+						i;
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (written = 0; fd != -1 && buffer != NULL && written < size; written += n) {
+		n = size - written < BLOCK ? size - written : BLOCK;
+		for (i = 0; i < n; i += sizeof(x)) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buffer + i, &x, n - i < sizeof(x) ? n - i : sizeof(x));
+		}
+		if (write(fd, buffer, n) != (ssize_t) n)
+			break;
+	}
+	close(fd);
+	free(buffer);
+	return fd != -1 && written == size ? 0 : -1;
+}
+
+/*
+ * The hand-shake, then the file through the engine if the socket can be
+ * written directly, like Peer's serve(). No path, only the hand-shake.
+ */
+static void *upload(void *arg) {
+	uploader	*u = arg;
+	transfer	t;
+
+	u->engine_used = 0;
+	if ((u->ret = handshake_reply(HANDSHAKE_PEER, u->c, tls_offer())) != 0 || u->path == NULL)
+		return NULL;
+	if (u->e != NULL && tls_raw(u->c, TLS_SEND)) {
+		u->engine_used = 1;
+		memset(&t, 0, sizeof(t));
+		if ((u->ret = engine_upload(u->e, &t, u->c, u->path)) == 0) {
+			u->ret = engine_wait(u->e, &t) == ENGINE_DONE ? 0 : -2;
+			close(t.file);
+		}
+	}
+	else
+		u->ret = send_file(u->path, u->c);
+	return NULL;
+}
+
+/*
+ * One connection over the loopback as tls_init() was last told, the
+ * downloader offering offer. With path set the file is downloaded to
+ * target: returns the MB/s, 0 if it failed. Without, returns 1 if the
+ * uploader took the hand-shake. kernel gets what the kernel did on the
+ * downloader's side, TLS_SEND | TLS_RECV.
+ */
+static double run(engine *e, int offer, char *path, char *target, unsigned long long size, int *kernel,
+		int *engine_used) {
+	conn				*down,
+						*up;
+	uploader			u = { NULL, path, e, -1, 0 };
+	pthread_t			thread;
+	unsigned long long	start,
+						took;
+	int					ok;
+
+	if (bench_tcp_pairs(1, &down, &up) == -1)
+		return 0;
+	u.c = up;
+	start = bench_usec();
+	pthread_create(&thread, NULL, upload, &u);
+	ok = handshake(HANDSHAKE_PEER, down, offer) == 0;
+	*kernel = down->tls_kernel;
+	ok = ok && (path == NULL || receive_file(target, down, FILE_SIZE_MAX) == 1);
+	/* An uploader still waiting on a hand-shake this side gave up sees it closed */
+	if (!ok)
+		shutdown(down->fd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	took = bench_usec() - start;
+	*engine_used = u.engine_used;
+	conn_close(down);
+	conn_close(up);
+	if (path == NULL)
+		return u.ret == 0;
+	return ok && u.ret == 0 ? size / 1048576.0 / (took / 1e6) : 0;
+}
+
+/* Hand-shakes only, num of them, in ms each. -1 if one failed */
+static double handshakes(int num) {
+	unsigned long long	start = bench_usec();
+	int					kernel,
+						engine_used,
+						i;
+
+	for (i = 0; i < num; i++)
+		if (run(NULL, tls_offer(), NULL, NULL, 0, &kernel, &engine_used) != 1)
+			return -1;
+	return (bench_usec() - start) / 1000.0 / num;
+}
+
+/*
+ * After a hand-shake in OpenSSL, on a socket that doesn't block: a whole
+ * record is read, waiting for it, then only the header of the next one
+ * must make conn_fill() say CONN_AGAIN right away, not sit on the socket
+ * until the timeout as a listener would. Returns 1 if it did.
+ */
+static int partial_record() {
+	static const char	header[] = { 0x17, 0x03, 0x03, 0x00, 0x40 };	/* Application data, 64 bytes */
+	conn				*down,
+						*up;
+	uploader			u = { NULL, NULL, NULL, -1, 0 };
+	pthread_t			thread;
+	unsigned long long	start;
+	char				buffer[5];
+	int					ok;
+
+	if (bench_tcp_pairs(1, &down, &up) == -1)
+		return 0;
+	u.c = up;
+	pthread_create(&thread, NULL, upload, &u);
+	ok = handshake(HANDSHAKE_PEER, down, tls_offer()) == 0;
+	if (!ok)
+		shutdown(down->fd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	ok = ok && u.ret == 0 && !tls_raw(down, TLS_RECV) && conn_timeout(down, 2000) == 0 && conn_nonblock(down, 1) == 0
+			&& conn_send(up, "hello", 5) == 0 && conn_read(down, buffer, 5) == 0 && memcmp(buffer, "hello", 5) == 0
+			&& write(up->fd, header, sizeof(header)) == sizeof(header);
+	start = bench_usec();
+	ok = ok && conn_fill(down) == CONN_AGAIN && bench_usec() - start < 1000000;
+	conn_close(down);
+	conn_close(up);
+	return ok;
+}
+
+static char *kernel_name(int kernel) {
+	return kernel == (TLS_SEND | TLS_RECV) ? "both ways" : kernel == TLS_SEND ? "sending only"
+			: kernel == TLS_RECV ? "receiving only" : "neither way";
+}
+
+/*
+ * A file of size=MB downloaded over the loopback as a peer would, the
+ * uploader with the engine when it can: in plaintext, with TLS in
+ * OpenSSL, then asking the kernel to take over (kTLS; without the tls
+ * module it's OpenSSL again). The best of runs=N, and handshakes=N
+ * hand-shakes timed on their own. A peer that doesn't offer TLS must be
+ * turned away when it's required, a certificate the CA didn't sign too;
+ * required without a CA is refused, and see partial_record().
+ */
+int bench_tls(int argc, char **argv) {
+	static const char	*names[] = { "plaintext", "openssl", "kernel" };
+	unsigned long long	size = (unsigned long long) bench_arg(argc, argv, "size", 1024) << 20;
+	int					runs = bench_arg(argc, argv, "runs", 3),
+						num = bench_arg(argc, argv, "handshakes", 200),
+						bad = 0,
+						kernel = 0,
+						engine_used = 0,
+						mode,
+						i;
+	char				*dir = bench_tmpdir(),
+						path[1024],
+						target[1024],
+						cert[1024],
+						key[1024],
+						other[1024],
+						other_key[1024];
+	double				best,
+						rate,
+						ms;
+	engine				*e = engine_open(1);
+
+	if (size == 0 || runs < 1 || num < 1 || dir == NULL) {
+		fprintf(stderr, "[ERROR] tls needs a file of 1 MB at least\n");
+		engine_close(e);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/file", dir);
+	snprintf(target, sizeof(target), "%s/received", dir);
+	snprintf(cert, sizeof(cert), "%s/cert.pem", dir);
+	snprintf(key, sizeof(key), "%s/key.pem", dir);
+	snprintf(other, sizeof(other), "%s/other.pem", dir);
+	snprintf(other_key, sizeof(other_key), "%s/other-key.pem", dir);
+	if (write_noise(path, size) == -1 || bench_make_cert(cert, key, "peer") == -1 || bench_make_cert(other, other_key, "other") == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the file and the certificates\n");
+		bench_rmdir(dir);
+		engine_close(e);
+		return 1;
+	}
+	for (mode = 0; mode < 3; mode++) {
+		if (tls_init(mode == 0 ? TLS_OFF : TLS_ON, cert, key, cert, mode == 2) == -1) {
+			bad = 1;
+			continue;
+		}
+		for (i = 0, best = 0; i < runs; i++) {
+			rate = run(e, tls_offer(), path, target, size, &kernel, &engine_used);
+			bad |= rate == 0 || !bench_same_content(path, target);
+			best = rate > best ? rate : best;
+		}
+		ms = handshakes(num);
+		bad |= ms < 0;
+		printf("tls: %-9s %8.1f MB/s, %s, %.3f ms a hand-shake", names[mode], best,
+				engine_used ? "engine" : "plain loop", ms);
+		if (mode == 2)
+			printf(", the kernel took %s", kernel_name(kernel));
+		printf("\n");
+	}
+
+	/* Required: offering nothing, or only compression, gets a peer turned away */
+	tls_init(TLS_REQUIRED, cert, key, cert, 0);
+	i = run(NULL, 0, NULL, NULL, 0, &kernel, &engine_used) + run(NULL, OPT_ZLIB, NULL, NULL, 0, &kernel, &engine_used);
+	bad |= i != 0;
+	printf("tls: a peer without TLS when it's required: %s\n", i == 0 ? "turned away" : "FAILED, let in");
+	/* Required, but with no CA anybody would do: it mustn't start */
+	i = tls_init(TLS_REQUIRED, cert, key, "", 0) == -1;
+	bad |= !i;
+	printf("tls: required without tls-ca: %s\n", i ? "refused" : "FAILED, accepted");
+	/* Part of a record doesn't stop the reader */
+	tls_init(TLS_ON, cert, key, cert, 0);
+	i = partial_record();
+	bad |= !i;
+	printf("tls: part of a record on a socket that doesn't block: %s\n", i ? "waits for the rest" : "FAILED, blocked");
+	/* Both sides trust a CA that didn't sign their certificates */
+	tls_init(TLS_ON, cert, key, other, 0);
+	i = run(NULL, tls_offer(), NULL, NULL, 0, &kernel, &engine_used);
+	bad |= i != 0;
+	printf("tls: a certificate the CA didn't sign: %s\n", i == 0 ? "turned away" : "FAILED, let in");
+
+	tls_init(TLS_OFF, NULL, NULL, NULL, 0);
+	printf("tls: %s\n", bad ? "FAILED" : "ok");
+	engine_close(e);
+	bench_rmdir(dir);
+	return bad;
+}
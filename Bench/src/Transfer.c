@@ -0,0 +1,312 @@
+/*
+ ============================================================================
+ Name        : Transfer.c
+ Author      : Giacomo Persichini
+ Description : Downloads from a real peer listener
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memset() - strncmp() */
+#include <time.h> /* nanosleep() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - close() */
+#include <sys/stat.h> /* mkdir() - stat() */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <arpa/inet.h> /* inet_addr() - ntohl() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Codec.h"
+#include "Delta.h"
+#include "Tls.h"
+
+typedef struct transfer_run {
+	char				*ip;
+	char				hash[HASH_LEN + 1];
+	unsigned long long	think;
+	int					options;	/* Offered in the hand-shake, the plain one if none */
+	char				payload[1024];	/* The shared file, when the peer has been started here */
+	long				remaining;
+	long				ok;
+	long				failed;
+	unsigned long long	bytes;
+	bench_samples		latency;
+	pthread_mutex_t		lock;
+} transfer_run;
+
+static int read_full(int fd, void *buffer, size_t len) {
+	size_t	got = 0;
+	ssize_t	bytes;
+
+	while (got < len) {
+		if ((bytes = read(fd, (char *) buffer + got, len - got)) <= 0)
+			return -1;
+		got += bytes;
+	}
+	return 0;
+}
+
+/*
+ * The downloader has the shared file with one block edited: the delta
+ * must bring it back as it was, fetching little more than that block.
+ */
+static long download_delta(transfer_run *run, conn *c) {
+	char		target[1100],
+				block[65536];
+	delta_stats	ds;
+	int			from = open(run->payload, O_RDONLY),
+				to,
+				ok;
+	ssize_t		n;
+
+	snprintf(target, sizeof(target), "%s.%lx", run->payload, (unsigned long) pthread_self());
+	to = open(target, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	while ((n = read(from, block, sizeof(block))) > 0)
+		write(to, block, n);
+	bench_random_hash(block);
+	pwrite(to, block, HASH_LEN, lseek(to, 0, SEEK_END) / 2);
+	close(from);
+	close(to);
+	ok = handshake(HANDSHAKE_PEER, c, run->options) == 0 && (c->options & OPT_DELTA)
+			&& send_delta_query(c, run->hash) == 0 && delta_receive(c, run->hash, target, &ds) == 0
+			&& bench_same_content(target, run->payload);
+	unlink(target);
+	conn_close(c);
+	return ok ? (long) ds.fetched : -1;
+}
+
+/* With options the hand-shake and the file go through the protocol library */
+static long download_negotiated(transfer_run *run, int fd) {
+	conn				*c = conn_open(fd);
+	char				buffer[TRANSFER_CHUNK];
+	unsigned long long	length = 0,
+						got = 0;
+	long				n;
+	int					encoding = -1,
+						null;
+
+	if (run->options & OPT_DELTA)
+		return download_delta(run, c);
+	null = open("/dev/null", O_WRONLY);
+	if (handshake(HANDSHAKE_PEER, c, run->options) == 0 && send_query(c, run->hash) == 0)
+		encoding = read_file_header(c, &length);
+	while (encoding != -1 && got < length) {
+		if (encoding == ENCODING_RAW)
+			n = conn_read(c, buffer, length - got < sizeof(buffer) ? length - got : sizeof(buffer)) == -1 ? -1
+					: (long) (length - got < sizeof(buffer) ? length - got : sizeof(buffer));
+		else
+			n = receive_frame(c, null, got, buffer, length - got);
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close(null);
+	conn_close(c);
+	return encoding != -1 && got == length ? (long) got : -1;
+}
+
+/* One download, the same steps download_file() takes */
+static long download(transfer_run *run) {
+	struct sockaddr_in	addr;
+	struct timespec		pause = { 0, run->think * 1000 };
+	char				buffer[65536],
+						query[46];
+	unsigned long		length = 0,
+						got = 0;
+	ssize_t				bytes;
+	int					fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(run->ip);
+	addr.sin_port = htons(PEER_PORT);
+	if (run->options != 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+		return download_negotiated(run, fd);
+	if (run->options != 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+			|| write(fd, "HELLOPEER", 9) != 9 || read_full(fd, buffer, 9) == -1
+			|| strncmp(buffer, "HELLOPEER", 9) != 0) {
+		close(fd);
+		return -1;
+	}
+	nanosleep(&pause, NULL);
+	memset(query, 0, sizeof(query));
+	snprintf(query, sizeof(query), "HASH-%s", run->hash);
+	if (write(fd, query, sizeof(query)) != sizeof(query) || read_full(fd, &length, sizeof(length)) == -1) {
+		close(fd);
+		return -1;
+	}
+	length = ntohl(length);
+	while (got < length && (bytes = read(fd, buffer, sizeof(buffer))) > 0)
+		got += bytes;
+	close(fd);
+	return got == length ? (long) got : -1;
+}
+
+static void *downloader(void *arg) {
+	transfer_run		*run = arg;
+	unsigned long long	start;
+	long				got;
+
+	while (1) {
+		pthread_mutex_lock(&run->lock);
+		if (run->remaining == 0) {
+			pthread_mutex_unlock(&run->lock);
+			return NULL;
+		}
+		run->remaining--;
+		pthread_mutex_unlock(&run->lock);
+
+		start = bench_usec();
+		got = download(run);
+		pthread_mutex_lock(&run->lock);
+		if (got < 0)
+			run->failed++;
+		else {
+			run->ok++;
+			run->bytes += got;
+			bench_sample(&run->latency, bench_usec() - start);
+		}
+		pthread_mutex_unlock(&run->lock);
+	}
+}
+
+/*
+ * Fills dir/shared with one random file and lets the peer hash it. With
+ * tls set the peer only talks TLS, trusting its own certificate, and so
+ * does this side.
+ */
+static pid_t start_peer(char *binary, char *dir, long size_mb, long limit, int tls, char *hash, int *input) {
+	char			path[1024],
+					config[4096],
+					cert[1024],
+					key[1024],
+					block[65536];
+	hash_record	rec;
+	struct timespec	pause = { 0, 50000000 };
+	long			i;
+	int				fd,
+					waited;
+	pid_t			pid;
+
+	snprintf(path, sizeof(path), "%s/shared", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/shared/payload.bin", dir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	for (i = 0; i < size_mb * 16; i++) {
+		bench_random_hash(block);
+		memset(block + HASH_LEN, i & 0xff, sizeof(block) - HASH_LEN);
+		write(fd, block, sizeof(block));
+	}
+	close(fd);
+
+	snprintf(config, sizeof(config), "server-ip=127.0.0.1\nserver-port=1\nshared-folder=%s/shared\nupload-limit=%ld\n",
+			dir, limit);
+	if (tls) {
+		snprintf(cert, sizeof(cert), "%s/cert.pem", dir);
+		snprintf(key, sizeof(key), "%s/key.pem", dir);
+		if (bench_make_cert(cert, key, "peer") == -1 || tls_init(TLS_REQUIRED, cert, key, cert, 1) == -1)
+			return -1;
+		snprintf(config + strlen(config), sizeof(config) - strlen(config),
+				"tls=required\ntls-cert=%s\ntls-key=%s\ntls-ca=%s\n", cert, key, cert);
+	}
+	if (bench_write_file(dir, "config", config) == -1 || (pid = bench_spawn(binary, dir, input)) == -1)
+		return -1;
+	/* Menu entry 3 generates the hash list, then any key goes back */
+	write(*input, "3\nx\n", 4);
+	snprintf(path, sizeof(path), "%s/hash", dir);
+	for (waited = 0; waited < 600; waited++) {
+		fd = open(path, O_RDONLY);
+		if (fd != -1 && read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+			close(fd);
+			memcpy(hash, rec.hash, HASH_LEN + 1);
+			return pid;
+		}
+		if (fd != -1)
+			close(fd);
+		nanosleep(&pause, NULL);
+	}
+	fprintf(stderr, "[ERROR] The peer didn't generate its hash list, see %s/output\n", dir);
+	bench_stop(pid, *input);
+	return -1;
+}
+
+int bench_transfer(int argc, char **argv) {
+	transfer_run		run;
+	pthread_t			*threads;
+	char				*peer = bench_sarg(argc, argv, "peer", NULL),
+						*dir = NULL;
+	int					parallel = bench_arg(argc, argv, "parallel", 1),
+						input = -1,
+						i;
+	pid_t				pid = -1;
+	unsigned long long	start,
+						elapsed;
+	long				rss = -1,
+						max_failed = bench_arg(argc, argv, "max-failed", -1);
+
+	memset(&run, 0, sizeof(run));
+	pthread_mutex_init(&run.lock, NULL);
+	run.ip = bench_sarg(argc, argv, "address", "127.0.0.1");
+	run.remaining = bench_arg(argc, argv, "count", 20);
+	run.think = bench_arg(argc, argv, "think", 1000);
+	run.options = strcmp(bench_sarg(argc, argv, "compression", "off"), "zlib") == 0 ? OPT_ZLIB : 0;
+	if (strcmp(bench_sarg(argc, argv, "delta", "off"), "on") == 0) {
+		if (peer == NULL) {
+			fprintf(stderr, "[ERROR] delta=on needs peer=, the old version is made from the shared file\n");
+			return 1;
+		}
+		run.options |= OPT_DELTA;
+	}
+
+	if (peer != NULL) {
+		if ((dir = bench_tmpdir()) == NULL)
+			return 1;
+		snprintf(run.payload, sizeof(run.payload), "%s/shared/payload.bin", dir);
+		if ((pid = start_peer(peer, dir, bench_arg(argc, argv, "size", 64), bench_arg(argc, argv, "limit", 0),
+				strcmp(bench_sarg(argc, argv, "tls", "off"), "on") == 0, run.hash, &input)) == -1)
+			return 1;
+		run.options |= tls_offer();
+		if (bench_wait_port(run.ip, PEER_PORT, 5000) == -1) {
+			fprintf(stderr, "[ERROR] The peer isn't listening, see %s/output\n", dir);
+			bench_stop(pid, input);
+			return 1;
+		}
+	}
+	else {
+		strncpy(run.hash, bench_sarg(argc, argv, "hash", ""), HASH_LEN);
+		if (strlen(run.hash) != HASH_LEN) {
+			fprintf(stderr, "[ERROR] hash= is needed when downloading from a running peer\n");
+			return 1;
+		}
+	}
+
+	threads = malloc(parallel * sizeof(pthread_t));
+	start = bench_usec();
+	for (i = 0; i < parallel; i++)
+		pthread_create(&threads[i], NULL, downloader, &run);
+	for (i = 0; i < parallel; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = bench_usec() - start;
+
+	if (pid != -1) {
+		rss = bench_peak_rss(pid);
+		bench_stop(pid, input);
+		bench_rmdir(dir);
+	}
+
+	printf("transfer: %ld downloads (%ld ok, %ld failed), %d in parallel, %.2f s\n", run.ok + run.failed,
+			run.ok, run.failed, parallel, elapsed / 1e6);
+	printf("transfer: %.1f MB/s, per download p50 %u us, p99 %u us\n", run.bytes / (elapsed / 1e6) / 1048576,
+			bench_percentile(&run.latency, 0.5), bench_percentile(&run.latency, 0.99));
+	if (rss != -1)
+		printf("transfer: peer peak RSS %ld KB\n", rss);
+	free(threads);
+	free(run.latency.values);
+	/* By default it only fails if nothing got through */
+	if (max_failed >= 0)
+		return run.failed > max_failed;
+	return run.ok == 0;
+}
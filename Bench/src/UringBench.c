@@ -0,0 +1,231 @@
+/*
+ ============================================================================
+ Name        : UringBench.c
+ Author      : Giacomo Persichini
+ Description : Transfers through the io_uring engine against the plain loop
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memset() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* write() - close() - unlink() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Engine.h"
+#include "Protocol.h"
+
+typedef struct side {
+	conn				**conns;
+	int					streams;
+	char				*dir;
+	char				*source;
+	unsigned long long	size;		/* Of every transfer */
+	int					failed;
+	unsigned long		syscalls;
+} side;
+
+typedef struct pair_job {
+	side	*s;
+	int		index;
+} pair_job;
+
+static unsigned long	socket_calls;
+
+static void count_call(size_t bytes) {
+	(void) bytes;
+	__atomic_add_fetch(&socket_calls, 1, __ATOMIC_RELAXED);
+}
+
+/* The received files aren't needed, they're gone once closed */
+static char *target(side *s, int i, char *path, size_t size) {
+	snprintf(path, size, "%s/received-%d", s->dir, i);
+	return path;
+}
+
+static void *engine_sender(void *arg) {
+	side		*s = arg;
+	engine		*e = engine_open(s->streams);
+	transfer	*t = calloc(s->streams, sizeof(transfer));
+	int			i;
+
+	for (i = 0; i < s->streams; i++)
+		if (engine_upload(e, &t[i], s->conns[i], s->source) != 0)
+			t[i].file = -1;
+	while (engine_active(e) > 0)
+		engine_run(e, 1);
+	for (i = 0; i < s->streams; i++) {
+		s->failed += t[i].file == -1 || t[i].status != ENGINE_DONE;
+		if (t[i].file != -1)
+			close(t[i].file);
+	}
+	s->syscalls = engine_syscalls(e);
+	engine_close(e);
+	free(t);
+	return NULL;
+}
+
+static void *engine_receiver(void *arg) {
+	side		*s = arg;
+	engine		*e = engine_open(s->streams);
+	transfer	*t = calloc(s->streams, sizeof(transfer));
+	char		path[1024];
+	int			i;
+
+	for (i = 0; i < s->streams; i++) {
+		if (engine_download(e, &t[i], s->conns[i], target(s, i, path, sizeof(path))) != 0)
+			t[i].file = -1;
+		unlink(path);
+		/* Send and receive meanwhile, the sender is waiting on us */
+		engine_run(e, 0);
+	}
+	while (engine_active(e) > 0)
+		engine_run(e, 1);
+	for (i = 0; i < s->streams; i++) {
+		s->failed += t[i].file == -1 || t[i].status != ENGINE_DONE || t[i].offset != s->size;
+		if (t[i].file != -1)
+			close(t[i].file);
+	}
+	s->syscalls = engine_syscalls(e);
+	engine_close(e);
+	free(t);
+	return NULL;
+}
+
+static void *sync_sender(void *arg) {
+	pair_job	*job = arg;
+
+	if (send_file(job->s->source, job->s->conns[job->index]) != 0)
+		__atomic_add_fetch(&job->s->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *sync_receiver(void *arg) {
+	pair_job	*job = arg;
+	char		path[1024];
+
+	if (!receive_file(target(job->s, job->index, path, sizeof(path)), job->s->conns[job->index], FILE_SIZE_MAX))
+		__atomic_add_fetch(&job->s->failed, 1, __ATOMIC_RELAXED);
+	unlink(path);
+	return NULL;
+}
+
+/*
+ * One run: every stream moves the same file. The plain loop needs one
+ * thread per transfer and side, the engine one thread per side.
+ */
+static int run(int use_engine, int streams, unsigned long long size, char *dir, char *source) {
+	side				sender,
+						receiver;
+	pthread_t			*threads = malloc(2 * streams * sizeof(pthread_t));
+	pair_job			*jobs = malloc(2 * streams * sizeof(pair_job));
+	conn				**senders = calloc(streams, sizeof(conn *)),
+						**receivers = calloc(streams, sizeof(conn *));
+	unsigned long long	start,
+						elapsed,
+						chunks = (size + TRANSFER_CHUNK - 1) / TRANSFER_CHUNK;
+	unsigned long		calls;
+	double				gigabytes = (double) size * streams / (1 << 30);
+	int					i;
+
+	memset(&sender, 0, sizeof(sender));
+	socket_calls = 0;
+	if (bench_tcp_pairs(streams, senders, receivers) == -1)
+		return 1;
+	for (i = 0; i < streams; i++)
+		senders[i]->on_write = receivers[i]->on_read = count_call;
+	sender.conns = senders;
+	sender.streams = streams;
+	sender.source = source;
+	sender.size = size;
+	receiver = sender;
+	receiver.conns = receivers;
+	receiver.dir = dir;
+
+	start = bench_usec();
+	if (use_engine) {
+		pthread_create(&threads[0], NULL, engine_sender, &sender);
+		pthread_create(&threads[1], NULL, engine_receiver, &receiver);
+		pthread_join(threads[0], NULL);
+		pthread_join(threads[1], NULL);
+		/*
+		 * The sizes still go through the connections, and the receiver
+		 * writes what came with them before handing over to the engine
+		 */
+		calls = sender.syscalls + receiver.syscalls + socket_calls + streams;
+	}
+	else {
+		for (i = 0; i < streams; i++) {
+			jobs[i].s = &sender;
+			jobs[i].index = i;
+			pthread_create(&threads[i], NULL, sync_sender, &jobs[i]);
+		}
+		for (i = 0; i < streams; i++) {
+			jobs[streams + i].s = &receiver;
+			jobs[streams + i].index = i;
+			pthread_create(&threads[streams + i], NULL, sync_receiver, &jobs[streams + i]);
+		}
+		for (i = 0; i < 2 * streams; i++)
+			pthread_join(threads[i], NULL);
+		/* Plus a read() per chunk on one side and a write() per chunk on the other */
+		calls = socket_calls + streams * (2 * chunks + 1);
+	}
+	elapsed = bench_usec() - start;
+
+	printf("uring: %-6s %3d transfers, %8.1f MB/s, %8.0f syscalls/GB, %d failed\n", use_engine ? "engine" : "loop",
+			streams, size * streams / (elapsed / 1e6) / 1048576, calls / gigabytes, sender.failed + receiver.failed);
+	for (i = 0; i < streams; i++) {
+		conn_close(senders[i]);
+		conn_close(receivers[i]);
+	}
+	free(senders);
+	free(receivers);
+	free(threads);
+	free(jobs);
+	return sender.failed + receiver.failed > 0;
+}
+
+int bench_uring(int argc, char **argv) {
+	unsigned long long	total = bench_arg(argc, argv, "size", 256) << 20;
+	int					streams[] = { 1, 64 },
+						bad = 0,
+						fd,
+						i;
+	char				*dir = bench_tmpdir(),
+						source[1024],
+						*block;
+	unsigned long long	size,
+						written;
+	engine				*probe;
+
+	if (dir == NULL)
+		return 1;
+	if ((probe = engine_open(1)) == NULL) {
+		fprintf(stderr, "[ERROR] io_uring isn't available here, only the plain loop would run\n");
+		bench_rmdir(dir);
+		return 1;
+	}
+	engine_close(probe);
+
+	block = malloc(TRANSFER_CHUNK);
+	for (i = 0; i < 2; i++) {
+		/* The same amount of data in total, split among the transfers */
+		size = total / streams[i];
+		snprintf(source, sizeof(source), "%s/source", dir);
+		fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		for (written = 0; written < size; written += TRANSFER_CHUNK) {
+			bench_random_hash(block);
+			memset(block + HASH_LEN, (int) written, TRANSFER_CHUNK - HASH_LEN);
+			write(fd, block, size - written < TRANSFER_CHUNK ? size - written : TRANSFER_CHUNK);
+		}
+		close(fd);
+		bad |= run(0, streams[i], size, dir, source);
+		bad |= run(1, streams[i], size, dir, source);
+	}
+	free(block);
+	bench_rmdir(dir);
+	return bad;
+}
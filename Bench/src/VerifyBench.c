@@ -0,0 +1,337 @@
+/*
+ ============================================================================
+ Name        : VerifyBench.c
+ Author      : Giacomo Persichini
+ Description : Downloads hashed as they're received, what it costs and what it catches
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memcpy() - memset() */
+#include <time.h> /* clock_gettime() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - close() - access() */
+#include <poll.h> /* poll() */
+#include <sys/socket.h> /* shutdown() */
+#include <pthread.h> /* stuff with threads */
+/* Non-standard header files */
+#include <gcrypt.h> /* gcry_md_hash_buffer() */
+
+#include "Bench.h"
+#include "Conn.h"
+#include "Delta.h"
+#include "Engine.h"
+#include "Protocol.h"
+#include "Verify.h"
+
+#define BLOCK (1 << 20)
+#define EDIT 4096	/* Bytes overwritten in the downloader's old copy, each time */
+
+typedef struct sender {
+	conn		*c;
+	char		*path;
+	char		*manifest_path;		/* Answers a delta query if set */
+	long long	sent;
+} sender;
+
+/* Copies both ways between two connections, one byte of the uploader's flipped on the way */
+typedef struct relay {
+	int					up;		/* The uploader's end */
+	int					down;	/* The downloader's */
+	unsigned long long	flip;	/* Offset of the byte in what the uploader sends */
+} relay;
+
+/* A download through the engine, the transfer must come first */
+typedef struct hashed {
+	transfer	t;
+	verifier	v;
+} hashed;
+
+static unsigned long long	state = 0x2545f4914f6cdd1dULL;
+
+static unsigned long long next() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static int write_noise(char *path, unsigned long long size, char *buffer) {
+	unsigned long long	written,
+						x;
+	size_t				n,
+						i;
+	int					fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (written = 0; fd != -1 && written < size; written += n) {
+		n = size - written < BLOCK ? size - written : BLOCK;
+		for (i = 0; i < n; i += sizeof(x)) {
+			x = next();
+			memcpy(buffer + i, &x, n - i < sizeof(x) ? n - i : sizeof(x));
+		}
+		if (write(fd, buffer, n) != (ssize_t) n)
+			break;
+	}
+	close(fd);
+	return fd != -1 && written == size ? 0 : -1;
+}
+
+/* The downloader's old version: the same file, edits blocks of it overwritten */
+static int write_old(char *from, char *to, unsigned long long size, int edits, char *buffer) {
+	ssize_t	n;
+	int		in = open(from, O_RDONLY),
+			out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+			bad = in == -1 || out == -1,
+			i;
+
+	while (!bad && (n = read(in, buffer, BLOCK)) > 0)
+		bad = write(out, buffer, n) != n;
+	for (i = 0; i < edits && !bad; i++) {
+		memset(buffer, i + 1, EDIT);
+		bad = pwrite(out, buffer, EDIT, next() % (size - EDIT)) != EDIT;
+	}
+	close(in);
+	close(out);
+	return bad ? -1 : 0;
+}
+
+static void *serve(void *arg) {
+	sender	*s = arg;
+
+	if (s->manifest_path != NULL)
+		s->sent = delta_serve(s->c, s->path, s->manifest_path);
+	else
+		s->sent = send_file(s->path, s->c);
+	return NULL;
+}
+
+static void *forward(void *arg) {
+	relay				*r = arg;
+	struct pollfd		fds[2] = { { r->up, POLLIN, 0 }, { r->down, POLLIN, 0 } };
+	unsigned long long	passed = 0;
+	char				buffer[TRANSFER_CHUNK];
+	ssize_t				n;
+	int					i;
+
+	while (poll(fds, 2, -1) > 0)
+		for (i = 0; i < 2; i++) {
+			if (fds[i].revents == 0)
+				continue;
+			if ((n = read(fds[i].fd, buffer, sizeof(buffer))) <= 0) {
+				shutdown(fds[1 - i].fd, SHUT_WR);
+				return NULL;
+			}
+			if (i == 0 && r->flip >= passed && r->flip < passed + n)
+				buffer[r->flip - passed] ^= 0x5a;
+			if (i == 0)
+				passed += n;
+			if (write(fds[1 - i].fd, buffer, n) != n)
+				return NULL;
+		}
+	return NULL;
+}
+
+static void hash_chunk(transfer *t, const char *data, size_t len) {
+	verify_data(&((hashed *) t)->v, data, len);
+}
+
+/* The whole process's, hashing isn't on the receiving thread past VERIFY_INLINE */
+static unsigned long long cpu_usec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * One download of path over the loopback: with the plain loop, or the
+ * engine if e is set, hashed if on is. Returns the MB/s, 0 if it failed,
+ * and the CPU time the process took in cpu.
+ */
+static double run(engine *e, int on, char *path, char *target, char *hash, unsigned long long size,
+		unsigned long long *cpu) {
+	conn				*out,
+						*in;
+	sender				s = { NULL, path, NULL, 0 };
+	pthread_t			thread;
+	hashed				d;
+	unsigned long long	start,
+						took;
+	int					ok = 0;
+
+	if (bench_tcp_pairs(1, &out, &in) == -1)
+		return 0;
+	memset(&d, 0, sizeof(d));
+	s.c = out;
+	start = bench_usec();
+	*cpu = cpu_usec();
+	pthread_create(&thread, NULL, serve, &s);
+	if (e == NULL)
+		ok = on ? receive_verified(target, in, hash) == 1 : receive_file(target, in, FILE_SIZE_MAX);
+	else {
+		d.t.on_data = on && verify_open(&d.v) == 0 ? hash_chunk : NULL;
+		if ((!on || d.t.on_data != NULL) && engine_download(e, &d.t, in, target) == 0) {
+			ok = engine_wait(e, &d.t) == ENGINE_DONE && (!on || verify_match(&d.v, hash));
+			close(d.t.file);
+		}
+	}
+	verify_close(&d.v);
+	*cpu = cpu_usec() - *cpu;
+	pthread_join(thread, NULL);
+	took = bench_usec() - start;
+	conn_close(out);
+	conn_close(in);
+	return ok && s.sent == 0 ? size / 1048576.0 / (took / 1e6) : 0;
+}
+
+/*
+ * The uploader's side goes through a relay that flips one byte at flip.
+ * A plain download must be thrown away, a delta must only fetch the
+ * broken chunk again. Returns 0 if both went as they should.
+ */
+static int check_broken(char *path, char *old, char *target, char *manifest_path, manifest *m, char *hash) {
+	conn				*out[2],
+						*in[2];
+	sender				s = { NULL, path, NULL, 0 };
+	relay				r;
+	delta_stats			ds;
+	pthread_t			threads[2];
+	char				*buffer = malloc(BLOCK);
+	int					bad = 0,
+						ret,
+						from,
+						to,
+						k;
+	ssize_t				n;
+
+	for (k = 0; k < 2 && buffer != NULL; k++) {
+		if (bench_tcp_pairs(2, out, in) == -1) {
+			free(buffer);
+			return 1;
+		}
+		/* Both ends have asked for deltas, nothing compressed: the flipped byte is the file's */
+		out[0]->options = in[1]->options = OPT_DELTA;
+		s.c = out[0];
+		s.sent = 0;
+		r.up = in[0]->fd;
+		r.down = out[1]->fd;
+		r.flip = FILE_HEADER_SIZE + m->size / 3;
+		if (k == 1) {
+			/* Past the manifest and the header of the ranges, in the first one */
+			s.manifest_path = manifest_path;
+			r.flip = FILE_HEADER_SIZE + 4 + m->count * MANIFEST_ENTRY + FILE_HEADER_SIZE + EDIT / 2;
+			from = open(old, O_RDONLY);
+			to = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			while ((n = read(from, buffer, BLOCK)) > 0)
+				write(to, buffer, n);
+			close(from);
+			close(to);
+		}
+		pthread_create(&threads[0], NULL, serve, &s);
+		pthread_create(&threads[1], NULL, forward, &r);
+		if (k == 0) {
+			ret = receive_verified(target, in[1], hash);
+			bad |= ret != VERIFY_MISMATCH || access(target, F_OK) == 0;
+			printf("verify: plain download, a byte flipped: %s\n",
+					ret == VERIFY_MISMATCH ? "thrown away" : ret == 1 ? "taken" : "failed");
+		}
+		else {
+			ret = delta_receive(in[1], hash, target, &ds);
+			bad |= ret != 0 || ds.refetched == 0 || ds.refetched > DELTA_MAX_CHUNK || !bench_same_content(path, target);
+			printf("verify: delta, a byte flipped: %.1f KB fetched, %.1f KB of it again, %s\n", ds.fetched / 1024.0,
+					ds.refetched / 1024.0, ret == 0 ? "rebuilt" : "failed");
+		}
+		shutdown(in[1]->fd, SHUT_WR);
+		pthread_join(threads[0], NULL);
+		shutdown(out[0]->fd, SHUT_WR);
+		pthread_join(threads[1], NULL);
+		bad |= s.sent < 0 && k == 1;
+		for (n = 0; n < 2; n++) {
+			conn_close(out[n]);
+			conn_close(in[n]);
+		}
+	}
+	free(buffer);
+	return bad || buffer == NULL;
+}
+
+/*
+ * A file of size=MB downloaded over the loopback as it is, then hashed
+ * as it's received, the best of runs=N each; the same through the engine
+ * when io_uring is there. Sender and receiver share the machine here,
+ * the CPU time hashing adds tells what it costs on its own, wherever it
+ * ran. Then a byte flipped on the way.
+ */
+int bench_verify(int argc, char **argv) {
+	unsigned long long	size = bench_arg(argc, argv, "size", 256) << 20,
+						start;
+	int					runs = bench_arg(argc, argv, "runs", 3),
+						edits = bench_arg(argc, argv, "edits", 8),
+						bad = 1,
+						i;
+	char				*dir = bench_tmpdir(),
+						*buffer = malloc(BLOCK),
+						path[1024],
+						old[1024],
+						target[1024],
+						manifest_path[1024],
+						hash[HASH_LEN + 1];
+	unsigned char		digest[DIGEST_LEN];
+	unsigned long long	least[4] = { 0, 0, 0, 0 },
+						cpu;
+	double				best[4] = { 0, 0, 0, 0 },
+						extra,
+						mbs;
+	manifest			m;
+	engine				*e;
+
+	memset(&m, 0, sizeof(m));
+	if (dir == NULL || buffer == NULL || size < (1 << 20) || runs < 1 || edits < 1) {
+		fprintf(stderr, "[ERROR] verify needs 1 MB, a run and an edit at least\n");
+		free(buffer);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/file", dir);
+	snprintf(old, sizeof(old), "%s/old", dir);
+	snprintf(target, sizeof(target), "%s/target", dir);
+	snprintf(manifest_path, sizeof(manifest_path), "%s/manifest", dir);
+	if (write_noise(path, size, buffer) == -1 || write_old(path, old, size, edits, buffer) == -1
+			|| manifest_build_file(&m, path, hash) == -1 || manifest_save(&m, manifest_path) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't write the files\n");
+		goto out;
+	}
+
+	start = bench_usec();
+	for (i = 0; i < 64; i++)
+		gcry_md_hash_buffer(GCRY_MD_SHA1, digest, buffer, BLOCK);
+	printf("verify: SHA-1 alone at %.0f MB/s\n", 64 / ((bench_usec() - start) / 1e6));
+
+	/* Taking turns, so that neither gets the quieter moments */
+	bad = 0;
+	e = engine_open(1);
+	for (i = 0; i < runs * 4; i++) {
+		if (i % 4 >= 2 && e == NULL)
+			continue;
+		mbs = run(i % 4 >= 2 ? e : NULL, i % 2, path, target, hash, size, &cpu);
+		best[i % 4] = mbs > best[i % 4] ? mbs : best[i % 4];
+		least[i % 4] = i < 4 || cpu < least[i % 4] ? cpu : least[i % 4];
+		bad |= mbs == 0;
+	}
+	bad |= !bench_same_content(path, target);
+	for (i = 0; i < (e != NULL ? 4 : 2); i += 2) {
+		/* What hashing adds per MB, the sender's share is the same both times */
+		extra = ((double) least[i + 1] - least[i]) / (size / 1048576.0);
+		printf("verify: %s %.0f MB/s, hashed %.0f MB/s; CPU %.2f s, hashed %.2f s: %.0f us per MB\n",
+				i == 0 ? "plain loop" : "engine", best[i], best[i + 1], least[i] / 1e6, least[i + 1] / 1e6, extra);
+	}
+	engine_close(e);
+
+	bad |= check_broken(path, old, target, manifest_path, &m, hash);
+	printf("verify: %s\n", bad ? "FAILED" : "ok");
+out:
+	manifest_free(&m);
+	free(buffer);
+	bench_rmdir(dir);
+	return bad;
+}
@@ -0,0 +1,179 @@
+/*
+ ============================================================================
+ Name        : Cache.c
+ Author      : Giacomo Persichini
+ Description : Large files read and written without filling the page cache
+ ============================================================================
+ */
+
+#define _GNU_SOURCE /* O_DIRECT - sync_file_range() */
+
+#include <stdio.h>
+#include <stdlib.h> /* posix_memalign() */
+#include <string.h> /* strcmp() - memset() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() - fcntl() - posix_fadvise() - sync_file_range() */
+#include <unistd.h> /* read() - pwrite() - close() */
+#include <sys/stat.h> /* fstat() */
+
+#include "Cache.h"
+#include "Config.h"
+#include "Log.h"
+
+static int					policy = CACHE_NORMAL;
+static unsigned long long	min_size = (unsigned long long) CACHE_MIN << 20,
+							read_ahead = 0;	/* Bytes, 0 leaves it to the kernel */
+
+/* page-cache=normal, the default, sequential, dontneed or direct */
+int cache_mode() {
+	char	value[CONFIG_LINE_SIZE];
+
+	c_read_config_default(value, "page-cache", "normal");
+	if (strcmp(value, "sequential") == 0)
+		return CACHE_SEQUENTIAL;
+	if (strcmp(value, "dontneed") == 0)
+		return CACHE_DONTNEED;
+	if (strcmp(value, "direct") == 0)
+		return CACHE_DIRECT;
+	if (strcmp(value, "normal") != 0)
+		log_warn("Unknown page-cache '%s', using normal.", value);
+	return CACHE_NORMAL;
+}
+
+/* For the whole program: mode for files of min bytes or more, ahead bytes read ahead */
+void cache_init(int mode, unsigned long long min, unsigned long long ahead) {
+	policy = mode;
+	min_size = min;
+	read_ahead = ahead;
+}
+
+/* If a file of size bytes goes through the page cache as usual, what cache_open() would make of it */
+int cache_normal(unsigned long long size) {
+	return policy == CACHE_NORMAL || size < min_size;
+}
+
+/*
+ * Opens path with flags, O_RDONLY or to write it whole. Files being read
+ * are sized here, size tells what's coming for the others. Without
+ * direct set O_DIRECT is out of the question, the caller's writes can't
+ * be aligned: the cache is dropped behind it instead. Returns the
+ * descriptor, -1 with errno as open() left it.
+ */
+int cache_open(cache_file *f, char *path, int flags, unsigned long long size, int direct) {
+	struct stat	st;
+	int			fl;
+
+	memset(f, 0, sizeof(cache_file));
+	f->writing = (flags & O_ACCMODE) != O_RDONLY;
+	if ((f->fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1)
+		return -1;
+	if (!f->writing && fstat(f->fd, &st) == 0)
+		size = st.st_size;
+	f->mode = size >= min_size ? policy : CACHE_NORMAL;
+	if (f->mode == CACHE_DIRECT && !direct)
+		f->mode = CACHE_DONTNEED;
+	if (f->mode == CACHE_DIRECT
+			&& ((fl = fcntl(f->fd, F_GETFL)) == -1 || fcntl(f->fd, F_SETFL, fl | O_DIRECT) == -1)) {
+		/* tmpfs and a few others */
+		log_warn("%s can't be opened with O_DIRECT (%s), dropping the cache behind it instead.", path, strerror(errno));
+		f->mode = CACHE_DONTNEED;
+	}
+	if (f->mode == CACHE_SEQUENTIAL || f->mode == CACHE_DONTNEED)
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return f->fd;
+}
+
+/*
+ * n more bytes read or written. Read ahead is asked for in halves of
+ * the window. With CACHE_DONTNEED what's behind goes a step at a time:
+ * pages still dirty can't be dropped, so a step is written back first,
+ * while the next one is being written.
+ */
+void cache_advance(cache_file *f, size_t n) {
+	f->done += n;
+	if (f->mode == CACHE_NORMAL || f->mode == CACHE_DIRECT)
+		return;
+	if (!f->writing && read_ahead > 0 && f->ahead < f->done + read_ahead / 2) {
+		if (f->ahead < f->done)
+			f->ahead = f->done;
+		posix_fadvise(f->fd, f->ahead, f->done + read_ahead - f->ahead, POSIX_FADV_WILLNEED);
+		f->ahead = f->done + read_ahead;
+	}
+	if (f->mode != CACHE_DONTNEED)
+		return;
+	if (!f->writing) {
+		if (f->done - f->dropped >= CACHE_STEP) {
+			posix_fadvise(f->fd, f->dropped, f->done - f->dropped, POSIX_FADV_DONTNEED);
+			f->dropped = f->done;
+		}
+		return;
+	}
+	if (f->done - f->flushed >= CACHE_STEP) {
+		sync_file_range(f->fd, f->flushed, f->done - f->flushed, SYNC_FILE_RANGE_WRITE);
+		f->flushed = f->done;
+	}
+	while (f->flushed - f->dropped >= 2 * CACHE_STEP) {
+		sync_file_range(f->fd, f->dropped, CACHE_STEP,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, f->dropped, CACHE_STEP, POSIX_FADV_DONTNEED);
+		f->dropped += CACHE_STEP;
+	}
+}
+
+/* The end of the file: whatever's left in the cache goes too, O_DIRECT's unaligned tail included */
+void cache_finish(cache_file *f) {
+	if (f->mode != CACHE_DONTNEED && f->mode != CACHE_DIRECT)
+		return;
+	if (f->writing)
+		sync_file_range(f->fd, f->dropped, 0,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(f->fd, f->dropped, 0, POSIX_FADV_DONTNEED);
+	f->dropped = f->flushed = f->done;
+}
+
+int cache_close(cache_file *f) {
+	int	ret;
+
+	if (f->fd == -1)
+		return 0;
+	cache_finish(f);
+	ret = close(f->fd);
+	f->fd = -1;
+	return ret;
+}
+
+/* With O_DIRECT buffer comes from cache_alloc() and len is a multiple of CACHE_ALIGN */
+ssize_t cache_read(cache_file *f, void *buffer, size_t len) {
+	ssize_t	n;
+
+	if ((n = read(f->fd, buffer, len)) > 0)
+		cache_advance(f, n);
+	return n;
+}
+
+/*
+ * pwrite() in order. With O_DIRECT what isn't aligned, the last piece of
+ * a file most of the time, goes through the cache and cache_finish()
+ * drops it.
+ */
+ssize_t cache_pwrite(cache_file *f, const void *buffer, size_t len, unsigned long long offset) {
+	ssize_t	n;
+	int		fl = 0,
+			unaligned = f->mode == CACHE_DIRECT
+					&& (((unsigned long) buffer | len | offset) & (CACHE_ALIGN - 1)) != 0;
+
+	if (unaligned && ((fl = fcntl(f->fd, F_GETFL)) == -1 || fcntl(f->fd, F_SETFL, fl & ~O_DIRECT) == -1))
+		return -1;
+	if ((n = pwrite(f->fd, buffer, len, offset)) > 0)
+		cache_advance(f, n);
+	if (unaligned)
+		fcntl(f->fd, F_SETFL, fl);
+	return n;
+}
+
+/* Aligned for O_DIRECT, free() it */
+void *cache_alloc(size_t len) {
+	void	*p;
+
+	return posix_memalign(&p, CACHE_ALIGN, len) == 0 ? p : NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * Cache.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h> /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+/*
+ * How large files treat the page cache while they're hashed, sent or
+ * received, from start to end. Smaller ones always go through it as
+ * usual, they don't push anything out.
+ */
+#define CACHE_NORMAL 0		/* Whatever the kernel does: what's read or written stays cached */
+#define CACHE_SEQUENTIAL 1	/* The kernel reads further ahead */
+#define CACHE_DONTNEED 2	/* Sequential, and the cache lets go of what's behind us */
+#define CACHE_DIRECT 3		/* O_DIRECT, the cache isn't used at all */
+#define CACHE_MIN 64		/* MB, files below it are CACHE_NORMAL */
+#define CACHE_ALIGN 4096	/* O_DIRECT buffers, offsets and lengths */
+#define CACHE_BLOCK (1 << 20)	/* Read at once with O_DIRECT, nothing reads ahead for us */
+#define CACHE_STEP (8 << 20)	/* Bytes the cache is told to drop at a time */
+
+/* A file going from start to end, see cache_open() */
+typedef struct cache_file {
+	int					fd;
+	int					mode;		/* CACHE_*, for this file */
+	int					writing;
+	unsigned long long	done;		/* Bytes read or written */
+	unsigned long long	flushed;	/* Written back up to here, or on its way */
+	unsigned long long	dropped;	/* The cache has let go of what's below */
+	unsigned long long	ahead;		/* Read ahead asked for up to here */
+} cache_file;
+
+int cache_mode();
+void cache_init(int, unsigned long long, unsigned long long);
+int cache_normal(unsigned long long);
+int cache_open(cache_file *, char *, int, unsigned long long, int);
+void cache_advance(cache_file *, size_t);
+void cache_finish(cache_file *);
+int cache_close(cache_file *);
+ssize_t cache_read(cache_file *, void *, size_t);
+ssize_t cache_pwrite(cache_file *, const void *, size_t, unsigned long long);
+void *cache_alloc(size_t);
+
+#endif /* CACHE_H_ */
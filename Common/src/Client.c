@@ -0,0 +1,1066 @@
+/*
+ ============================================================================
+ Name        : Client.c
+ Author      : Giacomo Persichini
+ Description : Lookups and downloads driven by one event loop, for other programs
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - calloc() - realloc() - free() */
+#include <string.h> /* memcpy() - memmove() - strncmp() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <sys/stat.h> /* S_IRUSR - S_IWUSR */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* pwrite() - write() - read() - close() - unlink() */
+#include <pthread.h> /* pthread_create() - pthread_join() - pthread_cond_wait() */
+#include <sys/epoll.h> /* epoll_create1() - epoll_ctl() - epoll_wait() */
+#include <sys/eventfd.h> /* eventfd() */
+#include <sys/socket.h> /* socket() - connect() - send() - recv() */
+#include <arpa/inet.h> /* inet_pton() - htonl() - ntohl() - INET_ADDRSTRLEN */
+/* Non-standard header files */
+#include <gcrypt.h> /* gcry_check_version() - gcry_control() */
+
+#include "Client.h"
+#include "Codec.h"
+#include "Verify.h"
+
+#define IN_SIZE (2 * CODEC_FRAME_MAX)	/* A whole frame always fits, whatever came before it */
+#define EVENTS 256						/* Handled per epoll_wait() */
+#define BUNDLE_BUFFER (1 << 20)			/* A bundle's files this small are handed to the writers */
+
+/* Where a connection is at */
+#define STATE_WAITING 0		/* A download waiting for a free slot */
+#define STATE_CONNECTING 1
+#define STATE_GREETING 2	/* The greeting back, and the options */
+#define STATE_READY 3		/* The server: answers to lookups */
+#define STATE_HEADER 4		/* A download: the file's header */
+#define STATE_BODY 5
+
+/* What the server and downloads have in common, the first member of both */
+typedef struct endpoint {
+	int					fd;
+	int					is_server;
+	int					state;
+	char				*in;
+	size_t				in_len;
+	char				*out;
+	size_t				out_len;
+	size_t				out_sent;
+	size_t				out_size;
+	unsigned long long	last;		/* msec, when it last moved */
+} endpoint;
+
+typedef struct lookup {
+	char				hash[HASH_LEN + 1];
+	client_lookup_cb	cb;
+	void				*arg;
+	struct lookup		*next;
+} lookup;
+
+/* The files of a bundle, in the order the peer sends them */
+typedef struct bundle {
+	int					num;
+	int					next;		/* The one being received */
+	char				(*hashes)[HASH_LEN + 1];
+	char				**paths;	/* NULL for those only checked */
+	char				*data;		/* The one being received when it's small, for the writers */
+} bundle;
+
+typedef struct download {
+	endpoint			ep;
+	char				hash[HASH_LEN + 1];
+	char				owner[INET_ADDRSTRLEN];
+	char				*path;
+	bundle				*b;			/* NULL for a single file */
+	int					file;
+	int					offer;		/* Options offered to the peer */
+	int					options;	/* Agreed on with the peer */
+	int					encoding;
+	unsigned long long	size;
+	unsigned long long	received;
+	verifier			v;
+	client_download_cb	cb;
+	void				*arg;
+	struct download		*prev;
+	struct download		*next;
+} download;
+
+/* A bundle's file whole and checked, for a writer to put on disk */
+typedef struct written {
+	char				hash[HASH_LEN + 1];
+	char				*path;
+	char				*data;
+	unsigned long long	size;
+	int					status;
+	client_download_cb	cb;
+	void				*arg;
+	struct written		*next;
+} written;
+
+/* client_fetch(): the download to start once the lookup is answered */
+typedef struct fetch {
+	client				*c;
+	char				*path;
+	client_download_cb	cb;
+	void				*arg;
+} fetch;
+
+struct client {
+	int					epfd;
+	int					max_downloads;
+	int					options;	/* Offered to peers, OPT_ZLIB or none */
+	endpoint			server;
+	client_ready_cb		on_ready;
+	void				*ready_arg;
+	lookup				*lookups;	/* Sent, answered in this order */
+	lookup				*lookups_tail;
+	long				num_lookups;
+	download			*waiting;	/* For a free slot, in this order */
+	download			*waiting_tail;
+	long				num_waiting;
+	download			*active;
+	long				num_active;
+	unsigned long long	last_check;
+	char				scratch[TRANSFER_CHUNK];	/* Frames are unpacked here, one at a time */
+	/* Bundles' files are written by these, callbacks still come from client_run() */
+	pthread_t			writers[CLIENT_WRITERS];
+	int					num_writers;
+	int					stopping;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	written				*todo;
+	written				*todo_tail;
+	written				*done;
+	long				num_writing;	/* Handed over, callback not called yet */
+	int					wake;			/* An eventfd, readable when there's something done */
+};
+
+static unsigned long long now_msec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static pthread_once_t	gcrypt_once = PTHREAD_ONCE_INIT;
+
+/* libgcrypt must be set up before the first hash, once: unless the program did it already */
+static void gcrypt_init() {
+	if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P))
+		return;
+	gcry_check_version(NULL);
+	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+}
+
+/*
+ * max_downloads at once, the others wait. options are offered to the
+ * peers, OPT_ZLIB for compressed transfers or 0. NULL if there's no memory.
+ */
+client *client_open(int max_downloads, int options) {
+	struct epoll_event	ev;
+	client				*c;
+
+	pthread_once(&gcrypt_once, gcrypt_init);
+	if ((c = calloc(1, sizeof(client))) == NULL)
+		return NULL;
+	if ((c->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		free(c);
+		return NULL;
+	}
+	/* Told apart from the connections by its NULL pointer */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if ((c->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+			|| epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wake, &ev) == -1) {
+		if (c->wake != -1)
+			close(c->wake);
+		close(c->epfd);
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->work, NULL);
+	c->max_downloads = max_downloads > 0 ? max_downloads : 1;
+	c->options = options & OPT_ZLIB;
+	c->server.fd = -1;
+	c->server.is_server = 1;
+	return c;
+}
+
+/* The descriptor to wait on when the client is part of another loop: client_run() when it's readable */
+int client_fd(client *c) {
+	return c->epfd;
+}
+
+/* Pending lookups and downloads, the connection to the server still being made counts too */
+long client_pending(client *c) {
+	return c->num_lookups + c->num_waiting + c->num_active + c->num_writing
+			+ (c->server.fd != -1 && c->server.state != STATE_READY);
+}
+
+static int endpoint_init(endpoint *ep, size_t out_size) {
+	ep->in = malloc(IN_SIZE);
+	ep->out = malloc(out_size);
+	ep->in_len = ep->out_len = ep->out_sent = 0;
+	ep->out_size = out_size;
+	if (ep->in == NULL || ep->out == NULL) {
+		free(ep->in);
+		free(ep->out);
+		ep->in = ep->out = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void endpoint_free(client *c, endpoint *ep) {
+	if (ep->fd != -1) {
+		epoll_ctl(c->epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+		close(ep->fd);
+	}
+	ep->fd = -1;
+	free(ep->in);
+	free(ep->out);
+	ep->in = ep->out = NULL;
+}
+
+/* What epoll should tell: always readable, writable while something's left to send or it's connecting */
+static int watch(client *c, endpoint *ep, int op) {
+	struct epoll_event	ev;
+
+	ev.events = EPOLLIN | (ep->state == STATE_CONNECTING || ep->out_sent < ep->out_len ? EPOLLOUT : 0);
+	ev.data.ptr = ep;
+	return epoll_ctl(c->epfd, op, ep->fd, &ev);
+}
+
+static int queue(endpoint *ep, const void *data, size_t len) {
+	char	*tmp;
+	size_t	size = ep->out_size;
+
+	if (ep->out_sent > 0 && ep->out_sent == ep->out_len)
+		ep->out_sent = ep->out_len = 0;
+	while (ep->out_len + len > size)
+		size *= 2;
+	if (size != ep->out_size) {
+		if ((tmp = realloc(ep->out, size)) == NULL)
+			return -1;
+		ep->out = tmp;
+		ep->out_size = size;
+	}
+	memcpy(ep->out + ep->out_len, data, len);
+	ep->out_len += len;
+	return 0;
+}
+
+/* Sends what the socket takes. Returns -1 if it failed */
+static int flush(client *c, endpoint *ep) {
+	ssize_t	n;
+
+	while (ep->out_sent < ep->out_len) {
+		n = send(ep->fd, ep->out + ep->out_sent, ep->out_len - ep->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return -1;
+		ep->out_sent += n;
+		ep->last = now_msec();
+	}
+	/* Written out, epoll mustn't keep waking us up for it */
+	if (ep->out_sent == ep->out_len)
+		watch(c, ep, EPOLL_CTL_MOD);
+	return 0;
+}
+
+/* A non-blocking connection to ip:port, epoll tells when it's made */
+static int dial(client *c, endpoint *ep, char *ip, int port) {
+	struct sockaddr_in	addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+		return -1;
+	if ((ep->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if (connect(ep->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+		close(ep->fd);
+		ep->fd = -1;
+		return -1;
+	}
+	ep->state = STATE_CONNECTING;
+	ep->last = now_msec();
+	if (watch(c, ep, EPOLL_CTL_ADD) == -1) {
+		close(ep->fd);
+		ep->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Every lookup waiting on the server ends with status, and so does the connection */
+static void server_failed(client *c, int status) {
+	lookup	*l;
+	int		was_ready = c->server.state == STATE_READY;
+
+	endpoint_free(c, &c->server);
+	c->server.state = STATE_CONNECTING;
+	if (!was_ready && c->on_ready != NULL)
+		c->on_ready(c->ready_arg, status);
+	while ((l = c->lookups) != NULL) {
+		c->lookups = l->next;
+		c->num_lookups--;
+		l->cb(l->arg, l->hash, status, NULL);
+		free(l);
+	}
+	c->lookups_tail = NULL;
+}
+
+/*
+ * Connects to the server at ip:port: the plain greeting and an empty
+ * list, nothing is shared from here. on_ready is called once the server
+ * has answered, with CLIENT_BUSY if it had no room. Lookups may be asked
+ * for right away, they go in behind. Returns 0 or -1.
+ */
+int client_connect(client *c, char *ip, int port, client_ready_cb on_ready, void *arg) {
+	char	list[FILE_HEADER_SIZE];
+
+	if (c->server.fd != -1 || endpoint_init(&c->server, 4096) == -1)
+		return -1;
+	c->on_ready = on_ready;
+	c->ready_arg = arg;
+	memset(list, 0, sizeof(list));
+	queue(&c->server, "HELLO", 5);
+	queue(&c->server, list, sizeof(list));
+	if (dial(c, &c->server, ip, port) == -1) {
+		endpoint_free(c, &c->server);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Asks the server who has hash, cb tells. Lookups asked for between two
+ * client_run() calls go out together and the server answers them in
+ * order. Returns 0, or -1 without a server or memory.
+ */
+int client_lookup(client *c, char *hash, client_lookup_cb cb, void *arg) {
+	char	query[QUERY_SIZE];
+	lookup	*l;
+
+	if (c->server.in == NULL || strlen(hash) != HASH_LEN || (l = malloc(sizeof(lookup))) == NULL)
+		return -1;
+	memset(query, 0, sizeof(query));
+	snprintf(query, sizeof(query), "HASH-%s", hash);
+	if (queue(&c->server, query, sizeof(query)) == -1) {
+		free(l);
+		return -1;
+	}
+	strcpy(l->hash, hash);
+	l->cb = cb;
+	l->arg = arg;
+	l->next = NULL;
+	if (c->lookups_tail != NULL)
+		c->lookups_tail->next = l;
+	else
+		c->lookups = l;
+	c->lookups_tail = l;
+	c->num_lookups++;
+	/* Sent when the socket's writable, with every lookup asked for until then */
+	if (c->server.state != STATE_CONNECTING)
+		watch(c, &c->server, EPOLL_CTL_MOD);
+	return 0;
+}
+
+/* The greeting, then as many answers as there are in the buffer */
+static int server_read(client *c, endpoint *ep) {
+	char	owner[FOUND_SIZE - 5];
+	size_t	used = 0;
+	lookup	*l;
+
+	if (ep->state == STATE_GREETING) {
+		if (ep->in_len >= 4 && strncmp(ep->in, "BUSY", 4) == 0)
+			return ep->in_len >= BUSY_SIZE ? CLIENT_BUSY : 0;
+		if (ep->in_len < 5)
+			return 0;
+		if (strncmp(ep->in, "HELLO", 5) != 0)
+			return CLIENT_FAILED;
+		used = 5;
+		ep->state = STATE_READY;
+		if (c->on_ready != NULL)
+			c->on_ready(c->ready_arg, CLIENT_OK);
+	}
+	while (ep->in_len - used >= NOTFOUND_SIZE && c->lookups != NULL) {
+		l = c->lookups;
+		if (strncmp(ep->in + used, "NOTFOUND", NOTFOUND_SIZE) == 0) {
+			used += NOTFOUND_SIZE;
+			owner[0] = '\0';
+		}
+		else if (strncmp(ep->in + used, "FOUND-", 6) != 0)
+			return CLIENT_FAILED;
+		else if (ep->in_len - used < FOUND_SIZE)
+			break;
+		else {
+			memcpy(owner, ep->in + used + 6, FOUND_SIZE - 6);
+			owner[FOUND_SIZE - 6] = '\0';
+			used += FOUND_SIZE;
+		}
+		c->lookups = l->next;
+		if (c->lookups == NULL)
+			c->lookups_tail = NULL;
+		c->num_lookups--;
+		l->cb(l->arg, l->hash, owner[0] != '\0' ? CLIENT_OK : CLIENT_NOTFOUND, owner[0] != '\0' ? owner : NULL);
+		free(l);
+	}
+	memmove(ep->in, ep->in + used, ep->in_len - used);
+	ep->in_len -= used;
+	return 0;
+}
+
+static void start_download(client *c, download *d);
+
+static void bundle_free(bundle *b) {
+	int	i;
+
+	for (i = 0; b->paths != NULL && i < b->num; i++)
+		free(b->paths[i]);
+	free(b->paths);
+	free(b->hashes);
+	free(b->data);
+	free(b);
+}
+
+/* d is over: out of the active ones, the next waiting one takes its place */
+static void download_end(client *c, download *d, int status) {
+	bundle	*b = d->b;
+	int		i;
+
+	if (d->file != -1)
+		close(d->file);
+	if (b == NULL && status == CLIENT_OK && !verify_match(&d->v, d->hash))
+		status = CLIENT_MISMATCH;
+	if (status != CLIENT_OK && d->file != -1)
+		unlink(b != NULL ? b->paths[b->next] : d->path);
+	verify_close(&d->v);
+	endpoint_free(c, &d->ep);
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		c->active = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	c->num_active--;
+	/* A bundle ends well once every file has had its callback, those left fail */
+	if (b == NULL)
+		d->cb(d->arg, d->hash, status, d->received);
+	else {
+		for (i = b->next; i < b->num; i++)
+			d->cb(d->arg, b->hashes[i], status == CLIENT_OK ? CLIENT_FAILED : status, i == b->next ? d->received : 0);
+		bundle_free(b);
+	}
+	free(d->path);
+	free(d);
+	while (c->num_active < c->max_downloads && (d = c->waiting) != NULL) {
+		c->waiting = d->next;
+		if (c->waiting == NULL)
+			c->waiting_tail = NULL;
+		c->num_waiting--;
+		start_download(c, d);
+	}
+}
+
+/* The greeting, the options and the query all go at once, the peer reads them exactly */
+static void start_download(client *c, download *d) {
+	char		greeting[10] = "HELLOPEER",
+				opts[OPTIONS_SIZE],
+				query[QUERY_SIZE];
+	uint32_t	offer = htonl((uint32_t) d->offer);
+
+	d->prev = NULL;
+	d->next = c->active;
+	if (c->active != NULL)
+		c->active->prev = d;
+	c->active = d;
+	c->num_active++;
+	d->file = -1;
+	if (endpoint_init(&d->ep, 64) == -1 || verify_open(&d->v) == -1) {
+		download_end(c, d, CLIENT_FAILED);
+		return;
+	}
+	if (d->offer != 0)
+		greeting[8] = PROTOCOL_VERSION;
+	queue(&d->ep, greeting, 9);
+	if (d->offer != 0) {
+		memcpy(opts, "OPTS", 4);
+		memcpy(opts + 4, &offer, sizeof(offer));
+		queue(&d->ep, opts, sizeof(opts));
+	}
+	/* A bundle waits for the options, to know whether the peer takes it */
+	if (d->b == NULL) {
+		memset(query, 0, sizeof(query));
+		snprintf(query, sizeof(query), "HASH-%s", d->hash);
+		queue(&d->ep, query, sizeof(query));
+	}
+	if (dial(c, &d->ep, d->owner, PEER_PORT) == -1)
+		download_end(c, d, CLIENT_FAILED);
+}
+
+/* Started now if there's a free slot, when one ends otherwise */
+static void enqueue(client *c, download *d) {
+	d->ep.fd = -1;
+	if (c->num_active < c->max_downloads) {
+		start_download(c, d);
+		return;
+	}
+	d->ep.state = STATE_WAITING;
+	if (c->waiting_tail != NULL)
+		c->waiting_tail->next = d;
+	else
+		c->waiting = d;
+	c->waiting_tail = d;
+	c->num_waiting++;
+}
+
+/*
+ * Downloads hash from the peer at owner into path, cb tells how it went.
+ * Without a path the file is only checked against its hash. It starts
+ * right away if fewer than max_downloads are running, when one ends
+ * otherwise. Returns 0 or -1 if there's no memory.
+ */
+int client_download(client *c, char *hash, char *owner, char *path, client_download_cb cb, void *arg) {
+	download	*d;
+
+	if (strlen(hash) != HASH_LEN || strlen(owner) >= INET_ADDRSTRLEN || (d = calloc(1, sizeof(download))) == NULL)
+		return -1;
+	if (path != NULL && (d->path = strdup(path)) == NULL) {
+		free(d);
+		return -1;
+	}
+	strcpy(d->hash, hash);
+	strcpy(d->owner, owner);
+	d->offer = c->options;
+	d->cb = cb;
+	d->arg = arg;
+	enqueue(c, d);
+	return 0;
+}
+
+static void fetched(void *arg, char *hash, int status, char *owner) {
+	fetch	*f = arg;
+
+	if (status != CLIENT_OK || client_download(f->c, hash, owner, f->path, f->cb, f->arg) == -1)
+		f->cb(f->arg, hash, status == CLIENT_OK ? CLIENT_FAILED : status, 0);
+	free(f->path);
+	free(f);
+}
+
+/* client_lookup(), then client_download() from the peer the server picked */
+int client_fetch(client *c, char *hash, char *path, client_download_cb cb, void *arg) {
+	fetch	*f;
+
+	if ((f = malloc(sizeof(fetch))) == NULL)
+		return -1;
+	f->c = c;
+	f->path = path != NULL ? strdup(path) : NULL;
+	f->cb = cb;
+	f->arg = arg;
+	if ((path != NULL && f->path == NULL) || client_lookup(c, hash, fetched, f) == -1) {
+		free(f->path);
+		free(f);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Downloads the num files of hashes from the peer at owner into paths,
+ * like client_download() but on one connection per BUNDLE_MAX of them:
+ * the peer sends them back to back. Files not wanted on disk have a NULL
+ * path, or paths is NULL. cb tells how each went, CLIENT_NOTFOUND for
+ * those the peer doesn't have; small ones are written by the writer
+ * threads while the next ones arrive, those over BUNDLE_FILE_MAX are
+ * downloaded on their own. Peers that don't take bundles get
+ * a download per file instead. Returns 0 or -1 if there's no memory,
+ * nothing is downloaded then.
+ */
+int client_bundle(client *c, char *owner, char **hashes, char **paths, int num, client_download_cb cb, void *arg) {
+	download	**ds;
+	bundle		*b;
+	int			parts = (num + BUNDLE_MAX - 1) / BUNDLE_MAX,
+				bad = num < 1 || strlen(owner) >= INET_ADDRSTRLEN,
+				i,
+				k;
+
+	for (i = 0; i < num && !bad; i++)
+		bad = strlen(hashes[i]) != HASH_LEN;
+	if (bad || (ds = calloc(parts, sizeof(download *))) == NULL)
+		return -1;
+	for (k = 0; k < parts && !bad; k++) {
+		if ((ds[k] = calloc(1, sizeof(download))) == NULL || (b = ds[k]->b = calloc(1, sizeof(bundle))) == NULL) {
+			bad = 1;
+			break;
+		}
+		b->num = num - k * BUNDLE_MAX < BUNDLE_MAX ? num - k * BUNDLE_MAX : BUNDLE_MAX;
+		b->hashes = malloc(b->num * sizeof(*b->hashes));
+		b->paths = calloc(b->num, sizeof(char *));
+		bad = b->hashes == NULL || b->paths == NULL;
+		for (i = 0; i < b->num && !bad; i++) {
+			strcpy(b->hashes[i], hashes[k * BUNDLE_MAX + i]);
+			if (paths != NULL && paths[k * BUNDLE_MAX + i] != NULL)
+				bad = (b->paths[i] = strdup(paths[k * BUNDLE_MAX + i])) == NULL;
+		}
+	}
+	for (k = 0; k < parts; k++) {
+		if (ds[k] == NULL)
+			break;
+		if (bad) {
+			if (ds[k]->b != NULL)
+				bundle_free(ds[k]->b);
+			free(ds[k]);
+			continue;
+		}
+		strcpy(ds[k]->owner, owner);
+		strcpy(ds[k]->hash, ds[k]->b->hashes[0]);
+		ds[k]->offer = c->options | OPT_BUNDLE;
+		ds[k]->cb = cb;
+		ds[k]->arg = arg;
+		enqueue(c, ds[k]);
+	}
+	free(ds);
+	return bad ? -1 : 0;
+}
+
+/* What a writer does with a file: it's there whole, or not at all */
+static int write_whole(written *w) {
+	size_t	done;
+	ssize_t	n = 0;
+	int		fd;
+
+	if ((fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1)
+		return CLIENT_FAILED;
+	for (done = 0; done < w->size; done += n)
+		if ((n = write(fd, w->data + done, w->size - done)) <= 0)
+			break;
+	if (close(fd) == -1 || done < w->size) {
+		unlink(w->path);
+		return CLIENT_FAILED;
+	}
+	return CLIENT_OK;
+}
+
+static void *writer(void *arg) {
+	client		*c = arg;
+	written		*w;
+	uint64_t	one = 1;
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		while (c->todo == NULL && !c->stopping)
+			pthread_cond_wait(&c->work, &c->lock);
+		if (c->stopping)
+			break;
+		w = c->todo;
+		if ((c->todo = w->next) == NULL)
+			c->todo_tail = NULL;
+		pthread_mutex_unlock(&c->lock);
+		w->status = write_whole(w);
+		pthread_mutex_lock(&c->lock);
+		w->next = c->done;
+		c->done = w;
+		write(c->wake, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/*
+ * The bundle's file in d->b->data, whole and checked, to a writer. They
+ * start with the first one; without any the file is written here.
+ */
+static void hand_over(client *c, download *d) {
+	bundle	*b = d->b;
+	written	*w;
+	int		status;
+
+	if ((w = malloc(sizeof(written))) == NULL) {
+		d->cb(d->arg, b->hashes[b->next], CLIENT_FAILED, d->received);
+		return;
+	}
+	strcpy(w->hash, b->hashes[b->next]);
+	w->path = b->paths[b->next];
+	w->data = b->data;
+	w->size = d->received;
+	w->cb = d->cb;
+	w->arg = d->arg;
+	w->next = NULL;
+	b->paths[b->next] = NULL;
+	b->data = NULL;
+	pthread_mutex_lock(&c->lock);
+	while (c->num_writers < CLIENT_WRITERS
+			&& pthread_create(&c->writers[c->num_writers], NULL, writer, c) == 0)
+		c->num_writers++;
+	if (c->num_writers == 0) {
+		pthread_mutex_unlock(&c->lock);
+		status = write_whole(w);
+		w->cb(w->arg, w->hash, status, w->size);
+		free(w->path);
+		free(w->data);
+		free(w);
+		return;
+	}
+	if (c->todo_tail != NULL)
+		c->todo_tail->next = w;
+	else
+		c->todo = w;
+	c->todo_tail = w;
+	c->num_writing++;
+	pthread_cond_signal(&c->work);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* The writers' files, their callbacks */
+static void written_out(client *c) {
+	uint64_t	count;
+	written		*w,
+				*next;
+
+	if (read(c->wake, &count, sizeof(count)) == -1)
+		return;
+	pthread_mutex_lock(&c->lock);
+	w = c->done;
+	c->done = NULL;
+	pthread_mutex_unlock(&c->lock);
+	for (; w != NULL; w = next) {
+		next = w->next;
+		c->num_writing--;
+		w->cb(w->arg, w->hash, w->status, w->size);
+		free(w->path);
+		free(w->data);
+		free(w);
+	}
+}
+
+/*
+ * The bundle's current file is over with status: checked, then handed
+ * to a writer or its callback called. With BUNDLE_SEPARATE it's too
+ * large for bundles and gets a download of its own instead. Returns how
+ * many files are left.
+ */
+static int bundle_next(client *c, download *d, int status) {
+	bundle	*b = d->b;
+
+	if (status == CLIENT_OK && !verify_match(&d->v, b->hashes[b->next]))
+		status = CLIENT_MISMATCH;
+	if (d->file != -1) {
+		close(d->file);
+		d->file = -1;
+		if (status != CLIENT_OK)
+			unlink(b->paths[b->next]);
+	}
+	if (status == BUNDLE_SEPARATE) {
+		if (client_download(c, b->hashes[b->next], d->owner, b->paths[b->next], d->cb, d->arg) == -1)
+			d->cb(d->arg, b->hashes[b->next], CLIENT_FAILED, 0);
+	}
+	else if (status == CLIENT_OK && b->data != NULL && b->paths[b->next] != NULL)
+		hand_over(c, d);
+	else
+		d->cb(d->arg, b->hashes[b->next], status, d->received);
+	free(b->data);
+	b->data = NULL;
+	verify_close(&d->v);
+	d->received = d->size = 0;
+	b->next++;
+	/* A fresh hash for the next one */
+	if (b->next < b->num && verify_open(&d->v) == -1)
+		return -1;
+	return b->num - b->next;
+}
+
+/* The peer doesn't take bundles: a download each, this connection is done */
+static void unbundle(client *c, download *d) {
+	bundle	*b = d->b;
+
+	for (; b->next < b->num; b->next++)
+		if (client_download(c, b->hashes[b->next], d->owner, b->paths[b->next], d->cb, d->arg) == -1)
+			d->cb(d->arg, b->hashes[b->next], CLIENT_FAILED, 0);
+}
+
+/* The bundle's request, once the peer has said it takes them */
+static void ask_bundle(client *c, download *d) {
+	char		frame[BUNDLE_SIZE];
+	uint32_t	count = htonl((uint32_t) d->b->num);
+	int			i;
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, "BNDL-", 5);
+	memcpy(frame + 5, &count, sizeof(count));
+	queue(&d->ep, frame, sizeof(frame));
+	for (i = 0; i < d->b->num; i++)
+		queue(&d->ep, d->b->hashes[i], HASH_LEN);
+	watch(c, &d->ep, EPOLL_CTL_MOD);
+}
+
+/* n bytes of the file: into it and into the hash */
+static int store(download *d, const char *data, size_t n) {
+	if (d->file != -1 && pwrite(d->file, data, n, d->received) != (ssize_t) n)
+		return -1;
+	if (d->b != NULL && d->b->data != NULL)
+		memcpy(d->b->data + d->received, data, n);
+	verify_data(&d->v, data, n);
+	d->received += n;
+	return 0;
+}
+
+/* The file's header is in: where it goes, if anywhere. Returns -1 if it can't be created */
+static int open_file(download *d) {
+	char	*path = d->b != NULL ? d->b->paths[d->b->next] : d->path;
+
+	if (path == NULL)
+		return 0;
+	if (d->b != NULL && d->size <= BUNDLE_BUFFER)
+		return (d->b->data = malloc(d->size > 0 ? d->size : 1)) != NULL ? 0 : -1;
+	d->file = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	return d->file != -1 ? 0 : -1;
+}
+
+/*
+ * What's in the buffer: the greeting, the header, the file, and with a
+ * bundle the next header and file until they've all come. Returns
+ * CLIENT_OK once it's all there, 1 before.
+ */
+static int download_read(client *c, download *d) {
+	endpoint	*ep = &d->ep;
+	size_t		used = 0,
+				n;
+	uint32_t	theirs;
+	long		payload,
+				len;
+	int			is_stored,
+				left,
+				greeting = d->offer != 0 ? 9 + OPTIONS_SIZE : 9;
+
+	if (ep->state == STATE_GREETING) {
+		if (ep->in_len < (size_t) greeting)
+			return 1;
+		/* The same greeting back: peers from before the options close on it */
+		if (strncmp(ep->in, "HELLOPEE", 8) != 0 || ep->in[8] != (d->offer != 0 ? PROTOCOL_VERSION : 'R')
+				|| (d->offer != 0 && strncmp(ep->in + 9, "OPTS", 4) != 0))
+			return CLIENT_FAILED;
+		if (d->offer != 0) {
+			memcpy(&theirs, ep->in + 13, sizeof(theirs));
+			d->options = d->offer & ntohl(theirs);
+		}
+		used = greeting;
+		ep->state = STATE_HEADER;
+		if (d->b != NULL && !(d->options & OPT_BUNDLE)) {
+			unbundle(c, d);
+			return CLIENT_OK;
+		}
+		if (d->b != NULL)
+			ask_bundle(c, d);
+	}
+	while (1) {
+		if (ep->state == STATE_HEADER) {
+			if (ep->in_len - used < FILE_HEADER_SIZE)
+				break;
+			d->size = unpack_file_header(ep->in + used);
+			d->encoding = ep->in[used + 4];
+			used += FILE_HEADER_SIZE;
+			if (d->b != NULL && (d->encoding == BUNDLE_MISSING || d->encoding == BUNDLE_SEPARATE) && d->size == 0) {
+				if ((left = bundle_next(c, d, d->encoding == BUNDLE_MISSING ? CLIENT_NOTFOUND : BUNDLE_SEPARATE)) <= 0)
+					return left == 0 ? CLIENT_OK : CLIENT_FAILED;
+				continue;
+			}
+			if ((d->encoding != ENCODING_RAW && !(d->encoding == ENCODING_ZLIB && (d->options & OPT_ZLIB)))
+					|| open_file(d) == -1)
+				return CLIENT_FAILED;
+			ep->state = STATE_BODY;
+		}
+		while (d->received < d->size && used < ep->in_len) {
+			if (d->encoding == ENCODING_RAW) {
+				n = ep->in_len - used < d->size - d->received ? ep->in_len - used : d->size - d->received;
+				if (store(d, ep->in + used, n) == -1)
+					return CLIENT_FAILED;
+				used += n;
+				continue;
+			}
+			if (ep->in_len - used < CODEC_HEADER)
+				break;
+			if ((payload = codec_payload(ep->in + used, &is_stored)) == -1)
+				return CLIENT_FAILED;
+			if (ep->in_len - used < CODEC_HEADER + (size_t) payload)
+				break;
+			n = d->size - d->received < TRANSFER_CHUNK ? d->size - d->received : TRANSFER_CHUNK;
+			if ((len = codec_unpack(ep->in + used + CODEC_HEADER, payload, is_stored, c->scratch, n)) <= 0
+					|| store(d, c->scratch, len) == -1)
+				return CLIENT_FAILED;
+			used += CODEC_HEADER + payload;
+		}
+		if (d->received < d->size)
+			break;
+		if (d->b == NULL)
+			return CLIENT_OK;
+		if ((left = bundle_next(c, d, CLIENT_OK)) <= 0)
+			return left == 0 ? CLIENT_OK : CLIENT_FAILED;
+		ep->state = STATE_HEADER;
+	}
+	memmove(ep->in, ep->in + used, ep->in_len - used);
+	ep->in_len -= used;
+	return 1;
+}
+
+/* What came on ep, handed on. Returns 1 while it goes on, the status it ended with otherwise */
+static int receive(client *c, endpoint *ep) {
+	ssize_t	n;
+	int		ret;
+
+	do
+		n = recv(ep->fd, ep->in + ep->in_len, IN_SIZE - ep->in_len, MSG_DONTWAIT);
+	while (n == -1 && errno == EINTR);
+	if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return CLIENT_FAILED;
+	if (n > 0) {
+		ep->in_len += n;
+		ep->last = now_msec();
+	}
+	/* A peer closes once it's sent the file, what came with the end still counts */
+	if (ep->is_server) {
+		if ((ret = server_read(c, ep)) != 0)
+			return ret;
+	}
+	else if ((ret = download_read(c, (download *) ep)) != 1)
+		return ret;
+	return n == 0 ? CLIENT_FAILED : 1;
+}
+
+/* One event on ep. A download is gone once it's ended */
+static void handle(client *c, endpoint *ep, unsigned int events) {
+	socklen_t	len = sizeof(int);
+	int			err = 0,
+				ret = 1;
+
+	if (ep->state == STATE_CONNECTING) {
+		if (getsockopt(ep->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+			ret = CLIENT_FAILED;
+		else {
+			ep->state = STATE_GREETING;
+			watch(c, ep, EPOLL_CTL_MOD);
+		}
+	}
+	if (ret == 1 && (events & EPOLLOUT) && flush(c, ep) == -1)
+		ret = CLIENT_FAILED;
+	if (ret == 1 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		ret = receive(c, ep);
+	if (ret == 1)
+		return;
+	if (ep->is_server)
+		server_failed(c, ret);
+	else
+		download_end(c, (download *) ep, ret);
+}
+
+/* Connections that haven't moved in CLIENT_TIMEOUT msec fail, checked once a second */
+static void expire(client *c) {
+	unsigned long long	now = now_msec();
+	download			*d,
+						*next;
+
+	if (now - c->last_check < 1000)
+		return;
+	c->last_check = now;
+	/* The server may stay quiet while there's nothing to answer */
+	if (c->server.fd != -1 && (c->server.state != STATE_READY || c->num_lookups > 0)
+			&& now - c->server.last > CLIENT_TIMEOUT)
+		server_failed(c, CLIENT_FAILED);
+	for (d = c->active; d != NULL; d = next) {
+		next = d->next;
+		if (now - d->ep.last > CLIENT_TIMEOUT)
+			download_end(c, d, CLIENT_FAILED);
+	}
+}
+
+/*
+ * Waits up to timeout msec (-1 for ever) for something to happen, then
+ * moves everything it can on: callbacks are called from here. Returns
+ * how much is still pending, 0 when it's all done, or -1 if epoll
+ * failed. Callbacks may ask for more, but not close the client.
+ */
+int client_run(client *c, int timeout) {
+	struct epoll_event	events[EVENTS];
+	int					n,
+						i;
+
+	if (client_pending(c) == 0)
+		return 0;
+	if ((n = epoll_wait(c->epfd, events, EVENTS, timeout)) == -1 && errno != EINTR)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (events[i].data.ptr == NULL)
+			written_out(c);
+		else
+			handle(c, events[i].data.ptr, events[i].events);
+	expire(c);
+	return client_pending(c);
+}
+
+/*
+ * Whatever's pending is dropped without its callbacks, files half
+ * downloaded deleted. Writers finish the file they're writing, those
+ * waiting for one aren't written.
+ */
+void client_close(client *c) {
+	lookup		*l;
+	download	*d;
+	written		*w;
+	int			i;
+
+	if (c == NULL)
+		return;
+	pthread_mutex_lock(&c->lock);
+	c->stopping = 1;
+	pthread_cond_broadcast(&c->work);
+	pthread_mutex_unlock(&c->lock);
+	for (i = 0; i < c->num_writers; i++)
+		pthread_join(c->writers[i], NULL);
+	while ((w = c->todo) != NULL || (w = c->done) != NULL) {
+		if (w == c->todo)
+			c->todo = w->next;
+		else
+			c->done = w->next;
+		free(w->path);
+		free(w->data);
+		free(w);
+	}
+	endpoint_free(c, &c->server);
+	while ((l = c->lookups) != NULL) {
+		c->lookups = l->next;
+		free(l);
+	}
+	while ((d = c->waiting) != NULL) {
+		c->waiting = d->next;
+		if (d->b != NULL)
+			bundle_free(d->b);
+		free(d->path);
+		free(d);
+	}
+	while ((d = c->active) != NULL) {
+		c->active = d->next;
+		if (d->file != -1) {
+			close(d->file);
+			unlink(d->b != NULL ? d->b->paths[d->b->next] : d->path);
+		}
+		if (d->b != NULL)
+			bundle_free(d->b);
+		verify_close(&d->v);
+		endpoint_free(c, &d->ep);
+		free(d->path);
+		free(d);
+	}
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->work);
+	close(c->wake);
+	close(c->epfd);
+	free(c);
+}
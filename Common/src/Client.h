@@ -0,0 +1,59 @@
+/*
+ * Client.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include "Protocol.h"
+
+/*
+ * Lookups and downloads for programs other than the peer, without its
+ * menus or threads. Everything is asked for up front and moves on in
+ * client_run(), a single epoll loop: lookups queued together go to the
+ * server in one write and are answered in order, downloads run side by
+ * side up to the limit given to client_open(), the others wait their
+ * turn. Each one ends with its callback, from inside client_run().
+ *
+ * Downloads are checked against their hash as they arrive, like the
+ * peer's; one without a path is only checked, nothing is written. Many
+ * small files from one peer go quicker as a bundle, see
+ * client_bundle(): one connection, and CLIENT_WRITERS threads putting
+ * them on disk. TLS isn't offered: servers and peers that require it
+ * turn the client away.
+ *
+ * The first client_open() sets up libgcrypt, which hashes the downloads,
+ * unless the program has finished doing so itself. One that wants its
+ * own settings must make them before that.
+ */
+#define CLIENT_OK 0
+#define CLIENT_NOTFOUND 1	/* The server knows nobody with the file, or the peer of a bundle doesn't have it */
+#define CLIENT_FAILED -1	/* Couldn't connect, the other side went away or timed out, or the disk failed */
+#define CLIENT_MISMATCH -2	/* The file didn't match its hash, it's been deleted */
+#define CLIENT_BUSY -3		/* The server had no room, see client_connect() */
+#define CLIENT_TIMEOUT 30000	/* msec a connection may go without moving */
+#define CLIENT_WRITERS 4		/* Threads writing bundles' files, started with the first one */
+
+typedef struct client client;
+
+/* owner is the peer's address when status is CLIENT_OK */
+typedef void (*client_lookup_cb)(void *, char *, int, char *);
+/* The hash, the status and the bytes of the file received */
+typedef void (*client_download_cb)(void *, char *, int, unsigned long long);
+/* The status of the connection to the server */
+typedef void (*client_ready_cb)(void *, int);
+
+client *client_open(int, int);
+void client_close(client *);
+int client_fd(client *);
+int client_connect(client *, char *, int, client_ready_cb, void *);
+int client_lookup(client *, char *, client_lookup_cb, void *);
+int client_download(client *, char *, char *, char *, client_download_cb, void *);
+int client_fetch(client *, char *, char *, client_download_cb, void *);
+int client_bundle(client *, char *, char **, char **, int, client_download_cb, void *);
+int client_run(client *, int);
+long client_pending(client *);
+
+#endif /* CLIENT_H_ */
@@ -0,0 +1,102 @@
+/*
+ ============================================================================
+ Name        : Codec.c
+ Author      : Giacomo Persichini
+ Description : Compressed frames for file transfers
+ ============================================================================
+ */
+
+#include <string.h> /* memcpy() */
+#include <unistd.h> /* pread() */
+#include <arpa/inet.h> /* htonl() - ntohl() */
+#include <zlib.h> /* compress2() - uncompress() */
+
+#include "Codec.h"
+#include "Cache.h"
+
+#define CODEC_LEVEL 1		/* Fast: the point is to beat the network, not to win on ratio */
+#define CODEC_MIN_GAIN 16	/* A chunk must shrink by 1/16th at least, or it goes as it is */
+#define CODEC_MAX_SKIP 128	/* Chunks, 8 MB, before trying an incompressible file again */
+
+/*
+ * The encoding a file goes with: framed if compression has been agreed
+ * on and its first chunk shrinks, raw otherwise. Already compressed
+ * files keep the plain path and cost nothing.
+ */
+int codec_choose(int fd, int allowed) {
+	/* The file may have been opened with O_DIRECT */
+	char	sample[TRANSFER_CHUNK] __attribute__((aligned(CACHE_ALIGN))),
+			packed[TRANSFER_CHUNK];
+	uLongf	packed_len;
+	ssize_t	len;
+
+	if (!allowed || (len = pread(fd, sample, sizeof(sample), 0)) <= 0)
+		return ENCODING_RAW;
+	packed_len = len - len / CODEC_MIN_GAIN;
+	if (compress2((Bytef *) packed, &packed_len, (Bytef *) sample, len, CODEC_LEVEL) != Z_OK)
+		return ENCODING_RAW;
+	return ENCODING_ZLIB;
+}
+
+static size_t stored(const char *in, size_t len, char *frame) {
+	uint32_t	header = htonl(CODEC_STORED | (uint32_t) len);
+
+	memcpy(frame, &header, CODEC_HEADER);
+	memcpy(frame + CODEC_HEADER, in, len);
+	return CODEC_HEADER + len;
+}
+
+/*
+ * One chunk, at most TRANSFER_CHUNK bytes, into frame (CODEC_FRAME_MAX
+ * bytes). Returns the frame's length, header included.
+ */
+size_t codec_pack(codec *cd, const char *in, size_t len, char *frame) {
+	uLongf		packed_len = len - len / CODEC_MIN_GAIN;
+	uint32_t	header;
+	int			skip;
+
+	if (cd->skip > 0) {
+		cd->skip--;
+		return stored(in, len, frame);
+	}
+	/* A buffer too small for the result means it isn't worth it */
+	if (len == 0 || compress2((Bytef *) frame + CODEC_HEADER, &packed_len, (Bytef *) in, len, CODEC_LEVEL) != Z_OK) {
+		/* Twice in a row, then 8, 16, ... chunks without trying */
+		if (++cd->misses >= 2) {
+			skip = 8 << (cd->misses - 2 < 4 ? cd->misses - 2 : 4);
+			cd->skip = skip < CODEC_MAX_SKIP ? skip : CODEC_MAX_SKIP;
+		}
+		return stored(in, len, frame);
+	}
+	cd->misses = 0;
+	header = htonl((uint32_t) packed_len);
+	memcpy(frame, &header, CODEC_HEADER);
+	return CODEC_HEADER + packed_len;
+}
+
+/* The payload length from a frame's header, -1 if it can't be one */
+long codec_payload(const char *header, int *is_stored) {
+	uint32_t	h;
+	long		len;
+
+	memcpy(&h, header, CODEC_HEADER);
+	h = ntohl(h);
+	*is_stored = (h & CODEC_STORED) != 0;
+	len = h & ~CODEC_STORED;
+	return len <= TRANSFER_CHUNK ? len : -1;
+}
+
+/* Restores a payload into out, at most size bytes. Returns its length or -1 */
+long codec_unpack(const char *payload, size_t len, int is_stored, char *out, size_t size) {
+	uLongf	out_len = size;
+
+	if (is_stored) {
+		if (len > size)
+			return -1;
+		memcpy(out, payload, len);
+		return len;
+	}
+	if (uncompress((Bytef *) out, &out_len, (const Bytef *) payload, len) != Z_OK)
+		return -1;
+	return out_len;
+}
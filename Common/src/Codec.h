@@ -0,0 +1,36 @@
+/*
+ * Codec.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stddef.h> /* size_t */
+
+#include "Protocol.h"
+
+#define ENCODING_RAW 0		/* The file's bytes as they are, like it's always been */
+#define ENCODING_ZLIB 1		/* Chunks in frames, each one compressed if it's worth it */
+
+/*
+ * A frame is a 4 bytes header, in network order, then the payload: the
+ * top bit tells a chunk stored as it is, the rest is the payload length.
+ */
+#define CODEC_HEADER 4
+#define CODEC_STORED 0x80000000U
+#define CODEC_FRAME_MAX (CODEC_HEADER + TRANSFER_CHUNK)
+
+/* Chunks that don't shrink make the next ones skip the compressor for a while */
+typedef struct codec {
+	int	misses;		/* In a row */
+	int	skip;
+} codec;
+
+int codec_choose(int, int);
+size_t codec_pack(codec *, const char *, size_t, char *);
+long codec_payload(const char *, int *);
+long codec_unpack(const char *, size_t, int, char *, size_t);
+
+#endif /* CODEC_H_ */
@@ -0,0 +1,167 @@
+/*
+ ============================================================================
+ Name        : Config.c
+ Author      : Giacomo Persichini
+ Description : Reads the configuration file, shared by server and peer
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h> /* strcmp() - strcpy() */
+#include <sys/stat.h> /* creat() */
+#include <fcntl.h> /* creat() */
+#include <unistd.h> /* write() - close() */
+#include <errno.h> /* errno */
+
+#include "Config.h"
+
+char *config_example = "";
+
+int create_config_file() {
+	int		config_file;
+
+	if ((config_file = creat(CONFIG_FILE, S_IREAD | S_IWRITE)) == -1) {
+		switch(errno) {
+		case EACCES:	/* Insufficient permissions */
+			fprintf(stderr, "[ERROR] Not enough permission to create an example configuration file.\n");
+			break;
+		default:		/* Generic error */
+			fprintf(stderr, "[ERROR] An error has occured while creating an example configuration file.\n");
+			break;
+		}
+		return -1;
+	}
+	else {
+		if (write(config_file, config_example, strlen(config_example)) == -1) {
+			close(config_file);
+			fprintf(stderr, "[ERROR] Not enough permission to write an example configuration file.\n");
+			return -1;
+		}
+		else
+			close(config_file);
+	}
+	printf("[INFO] An example configuration file has been created. Please edit it.\n");
+	return 0;
+}
+
+/* Read only positive integers **/
+int i_read_config(char *field) {
+	char	buffer[CONFIG_LINE_SIZE],
+			a[CONFIG_LINE_SIZE];
+	int		ret = 0,
+			found = 0;
+	FILE	*config_file = NULL;
+
+	/* TOCTOU bug avoidance, use fopen(), not access() */
+	config_file = fopen(CONFIG_FILE, "r");
+	if (config_file == NULL) {
+		switch (errno) {
+		case ENOENT:	/* The file does not exist */
+			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
+			create_config_file();
+			break;
+		case EACCES:	/* The file is not accessible to the current user */
+			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
+			break;
+		default:		/* Generic error */
+			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
+			break;
+		}
+		return -1;
+	}
+	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
+		if (sscanf(buffer, "%[^=]=%d", a, &ret) == 2 && strcmp(field, a) == 0)
+			found = 1;	/* The requested field has been found */
+	fclose(config_file);
+	if (found) {
+		if (ret < 0) {
+			fprintf(stderr, "[ERROR] '%s' can't be negative!\n", field);	/* 'Not a positive integer' error */
+			return -1;
+		}
+		else
+			return ret;
+	}
+	else { /* Field not found */
+		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", field);
+		return -1;
+	}
+}
+
+/* Like i_read_config(), but a missing field is not an error */
+int i_read_config_default(char *field, int def) {
+	char	buffer[CONFIG_LINE_SIZE],
+			a[CONFIG_LINE_SIZE];
+	int		ret = def,
+			value;
+	FILE	*config_file = NULL;
+
+	config_file = fopen(CONFIG_FILE, "r");
+	if (config_file == NULL)
+		return def;
+	while (fgets(buffer, sizeof buffer, config_file) != NULL)
+		if (sscanf(buffer, "%[^=]=%d", a, &value) == 2 && strcmp(field, a) == 0) {
+			ret = value;
+			break;
+		}
+	fclose(config_file);
+	return ret;
+}
+
+void c_read_config(char *var, char *field, int *err) {
+	char	buffer[CONFIG_LINE_SIZE],
+			a[CONFIG_LINE_SIZE],
+			b[CONFIG_LINE_SIZE];
+	FILE	*config_file = NULL;
+	int		found = 0;
+
+	*err = 0;
+	config_file = fopen(CONFIG_FILE, "r");
+	if (config_file == NULL) {
+		switch (errno) {
+		case ENOENT:	/* The file does not exist */
+			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
+			create_config_file();
+			break;
+		case EACCES:	/* The file is not accessible to the current user */
+			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
+			break;
+		default:		/* Generic error */
+			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
+			break;
+		}
+		*err = -1;
+		return;
+	}
+	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
+		if (sscanf(buffer, "%[^=]=%[^\n]", a, b) == 2 && strcmp(field, a) == 0) {
+			/* The requested field has been found, without its new-line */
+			strcpy(var, b);
+			found = 1;
+		}
+	fclose(config_file);
+	/* If the field has not been found it returns an empty string */
+	if (!found || strcmp(var, "") == 0) {
+		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", field);
+		*err = -1;
+	}
+	return;
+}
+
+/* Like c_read_config(), but a missing field gets the default value */
+void c_read_config_default(char *var, char *field, char *def) {
+	char	buffer[CONFIG_LINE_SIZE],
+			a[CONFIG_LINE_SIZE],
+			b[CONFIG_LINE_SIZE];
+	FILE	*config_file = NULL;
+
+	strcpy(var, def);
+	config_file = fopen(CONFIG_FILE, "r");
+	if (config_file == NULL)
+		return;
+	while (fgets(buffer, sizeof buffer, config_file) != NULL)
+		if (sscanf(buffer, "%[^=]=%[^\n]", a, b) == 2 && strcmp(field, a) == 0) {
+			strcpy(var, b);
+			break;
+		}
+	fclose(config_file);
+}
@@ -0,0 +1,22 @@
+/*
+ * Config.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#define CONFIG_FILE "config"
+#define CONFIG_LINE_SIZE 1024
+
+/* Written by create_config_file() when there's no configuration file yet */
+extern char *config_example;
+
+int create_config_file();
+int i_read_config(char *);
+int i_read_config_default(char *, int);
+void c_read_config(char *, char *, int *);
+void c_read_config_default(char *, char *, char *);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,246 @@
+/*
+ ============================================================================
+ Name        : Conn.c
+ Author      : Giacomo Persichini
+ Description : Buffered connections with exact reads and batched writes
+ ============================================================================
+ */
+
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memcpy() - memmove() */
+#include <unistd.h> /* read() - write() - close() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* fcntl() */
+#include <poll.h> /* poll() */
+#include <sys/time.h> /* struct timeval */
+#include <sys/socket.h> /* setsockopt() */
+
+#include "Conn.h"
+#include "Tls.h"
+
+conn *conn_open(int fd) {
+	conn	*c;
+
+	if ((c = calloc(1, sizeof(conn))) == NULL)
+		return NULL;
+	c->in = malloc(CONN_BUFFER_SIZE);
+	c->out = malloc(CONN_BUFFER_SIZE);
+	if (c->in == NULL || c->out == NULL) {
+		free(c->in);
+		free(c->out);
+		free(c);
+		return NULL;
+	}
+	c->fd = fd;
+	return c;
+}
+
+/* Closes the socket too, unwritten data is lost */
+void conn_close(conn *c) {
+	if (c == NULL)
+		return;
+	tls_end(c);
+	if (c->fd != -1)
+		close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/* Reads and writes blocking longer than msec fail, 0 waits forever */
+int conn_timeout(conn *c, int msec) {
+	struct timeval	tv;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	c->timeout = msec;
+	if (setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+			|| setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * With on set, reads and writes don't block: conn_fill() returns
+ * CONN_AGAIN when nothing whole has come, the others wait for the socket
+ * up to the timeout instead. For TLS through OpenSSL, where a readable
+ * socket may hold only part of a record. Returns 0 or -1.
+ */
+int conn_nonblock(conn *c, int on) {
+	int	flags;
+
+	if ((flags = fcntl(c->fd, F_GETFL)) == -1)
+		return -1;
+	return fcntl(c->fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+/* A non-blocking socket isn't ready for what's wanted: waits for it. Returns 0 or -1 */
+static int wait_ready(conn *c, short events) {
+	struct pollfd	p;
+	int				n;
+
+	p.fd = c->fd;
+	p.events = !tls_raw(c, events == POLLIN ? TLS_RECV : TLS_SEND) ? tls_wants(c) : events;
+	do
+		n = poll(&p, 1, c->timeout > 0 ? c->timeout : -1);
+	while (n == -1 && errno == EINTR);
+	return n > 0 ? 0 : -1;
+}
+
+/* Bytes already read from the socket but not consumed */
+size_t conn_buffered(conn *c) {
+	return c->in_end - c->in_start;
+}
+
+/* read() or write() on the socket, through OpenSSL unless the kernel does TLS */
+static ssize_t sys_read(conn *c, void *p, size_t len) {
+	ssize_t	bytes;
+
+	if (!tls_raw(c, TLS_RECV))
+		return tls_read(c, p, len);
+	do
+		bytes = read(c->fd, p, len);
+	while (bytes == -1 && errno == EINTR);
+	return bytes;
+}
+
+static ssize_t sys_write(conn *c, const void *p, size_t len) {
+	ssize_t	bytes;
+
+	if (!tls_raw(c, TLS_SEND))
+		return tls_write(c, p, len);
+	do
+		bytes = write(c->fd, p, len);
+	while (bytes == -1 && errno == EINTR);
+	return bytes;
+}
+
+/*
+ * One read() into the free part of the buffer. Returns the bytes read, 0
+ * when the other side closed the connection, -1 on errors and CONN_AGAIN
+ * if it doesn't block and nothing whole has come, see conn_nonblock().
+ */
+ssize_t conn_fill(conn *c) {
+	ssize_t	bytes;
+
+	/* Move what's left to the front, so a whole message always fits */
+	if (c->in_start > 0) {
+		memmove(c->in, c->in + c->in_start, c->in_end - c->in_start);
+		c->in_end -= c->in_start;
+		c->in_start = 0;
+	}
+	if (c->in_end == CONN_BUFFER_SIZE)
+		return -1;
+	bytes = sys_read(c, c->in + c->in_end, CONN_BUFFER_SIZE - c->in_end);
+	if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return CONN_AGAIN;
+	if (bytes > 0) {
+		c->in_end += bytes;
+		if (c->on_read != NULL)
+			c->on_read(bytes);
+	}
+	return bytes;
+}
+
+/*
+ * Consumes a len bytes message if it's entirely in the buffer, without
+ * touching the socket. The pointer is valid until the next call.
+ */
+char *conn_frame(conn *c, size_t len) {
+	char	*frame;
+
+	if (conn_buffered(c) < len)
+		return NULL;
+	frame = c->in + c->in_start;
+	c->in_start += len;
+	return frame;
+}
+
+/* The same, but the bytes stay in the buffer */
+char *conn_peek(conn *c, size_t len) {
+	return conn_buffered(c) < len ? NULL : c->in + c->in_start;
+}
+
+/* Exactly len bytes, waiting for them if needed. Returns 0 or -1 */
+int conn_read(conn *c, void *buffer, size_t len) {
+	char	*p = buffer;
+	size_t	n;
+	ssize_t	bytes;
+
+	while (len > 0) {
+		if (conn_buffered(c) > 0) {
+			n = conn_buffered(c) < len ? conn_buffered(c) : len;
+			memcpy(p, c->in + c->in_start, n);
+			c->in_start += n;
+			p += n;
+			len -= n;
+		}
+		else if (len >= CONN_BUFFER_SIZE) {
+			/* Big reads go straight to the caller, one copy less */
+			bytes = sys_read(c, p, len);
+			if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(c, POLLIN) == 0)
+				continue;
+			if (bytes <= 0)
+				return -1;
+			if (c->on_read != NULL)
+				c->on_read(bytes);
+			p += bytes;
+			len -= bytes;
+		}
+		else {
+			c->in_start = c->in_end = 0;
+			if ((bytes = conn_fill(c)) == CONN_AGAIN && wait_ready(c, POLLIN) == 0)
+				continue;
+			if (bytes <= 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_all(conn *c, const char *p, size_t len) {
+	ssize_t	bytes;
+
+	while (len > 0) {
+		bytes = sys_write(c, p, len);
+		if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(c, POLLOUT) == 0)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		if (c->on_write != NULL)
+			c->on_write(bytes);
+		p += bytes;
+		len -= bytes;
+	}
+	return 0;
+}
+
+/* Queues len bytes, they're sent when the buffer fills up or on conn_flush() */
+int conn_write(conn *c, const void *buffer, size_t len) {
+	if (c->out_len + len <= CONN_BUFFER_SIZE) {
+		memcpy(c->out + c->out_len, buffer, len);
+		c->out_len += len;
+		return 0;
+	}
+	if (conn_flush(c) == -1)
+		return -1;
+	if (len >= CONN_BUFFER_SIZE)
+		return write_all(c, buffer, len);
+	memcpy(c->out, buffer, len);
+	c->out_len = len;
+	return 0;
+}
+
+int conn_flush(conn *c) {
+	size_t	len = c->out_len;
+
+	c->out_len = 0;
+	return write_all(c, c->out, len);
+}
+
+/* A whole message, sent right away */
+int conn_send(conn *c, const void *buffer, size_t len) {
+	if (conn_write(c, buffer, len) == -1)
+		return -1;
+	return conn_flush(c);
+}
@@ -0,0 +1,51 @@
+/*
+ * Conn.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef CONN_H_
+#define CONN_H_
+
+#include <stddef.h> /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+#define CONN_BUFFER_SIZE 65536
+#define CONN_AGAIN -2	/* conn_fill() on a non-blocking connection: nothing whole to read yet */
+
+/*
+ * A socket with a read and a write buffer. Messages are read exactly, so
+ * whatever the other side sent after them stays in the buffer for the
+ * next read instead of being thrown away with the current one.
+ */
+typedef struct conn {
+	int				fd;
+	char			*in;
+	size_t			in_start;		/* First byte not consumed yet */
+	size_t			in_end;			/* One past the last byte read from the socket */
+	char			*out;
+	size_t			out_len;
+	int				options;		/* Agreed on in the hand-shake, OPT_* */
+	unsigned int	retry_after;	/* msec a busy server asked to wait, see handshake(), 0 if it can't tell */
+	void			*tls;			/* An OpenSSL SSL, NULL in plaintext, see Tls.h */
+	int				tls_kernel;		/* TLS_SEND | TLS_RECV, what the kernel does for it */
+	int				timeout;		/* msec, see conn_timeout() */
+	/* Called with every amount of bytes moved, for the programs' counters */
+	void			(*on_read)(size_t);
+	void			(*on_write)(size_t);
+} conn;
+
+conn *conn_open(int);
+void conn_close(conn *);
+int conn_timeout(conn *, int);
+int conn_nonblock(conn *, int);
+size_t conn_buffered(conn *);
+ssize_t conn_fill(conn *);
+char *conn_frame(conn *, size_t);
+char *conn_peek(conn *, size_t);
+int conn_read(conn *, void *, size_t);
+int conn_write(conn *, const void *, size_t);
+int conn_flush(conn *);
+int conn_send(conn *, const void *, size_t);
+
+#endif /* CONN_H_ */
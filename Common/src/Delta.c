@@ -0,0 +1,677 @@
+/*
+ ============================================================================
+ Name        : Delta.c
+ Author      : Giacomo Persichini
+ Description : Content-defined chunks, so that updated files move only what changed
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - qsort() - bsearch() */
+#include <string.h> /* memcpy() - memcmp() - memmove() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* pread() - pwrite() - close() */
+#include <endian.h> /* htobe64() - be64toh() */
+#include <pthread.h> /* pthread_once() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <arpa/inet.h> /* htonl() - ntohl() */
+/* Non-standard header files */
+#include <gcrypt.h> /* gcry_md_hash_buffer() - gcry_md_open() */
+
+#include "Delta.h"
+#include "Codec.h"
+#include "Cache.h"
+#include "Protocol.h"
+#include "Log.h"
+
+/*
+ * Normalized cut points: before the average size a cut needs more zero
+ * bits than after it, which keeps chunks close to the average.
+ */
+#define MASK_SMALL (~0ULL << (64 - 18))
+#define MASK_LARGE (~0ULL << (64 - 14))
+
+#define MANIFEST_MAX (64 << 20)	/* Bytes, a 170 GB file's worth of chunks */
+#define RANGE_SIZE 16			/* Offset and length, 64 bits each in network order */
+
+static unsigned long long	gear[256];
+static pthread_once_t		gear_once = PTHREAD_ONCE_INIT;
+
+/* Every peer must cut at the same places: the table comes from a fixed seed */
+static void gear_init() {
+	unsigned long long	x = 0x9e3779b97f4a7c15ULL,
+						z;
+	int					i;
+
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* The length of the chunk starting at p, len bytes are left in the file */
+size_t delta_cut(const unsigned char *p, size_t len) {
+	unsigned long long	h = 0;
+	size_t				i = DELTA_MIN_CHUNK,
+						normal = len < DELTA_AVG_CHUNK ? len : DELTA_AVG_CHUNK,
+						max = len < DELTA_MAX_CHUNK ? len : DELTA_MAX_CHUNK;
+
+	if (len <= DELTA_MIN_CHUNK)
+		return len;
+	pthread_once(&gear_once, gear_init);
+	/* The hash only remembers the last 64 bytes, no need to start earlier */
+	for (; i < normal; i++) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & MASK_SMALL) == 0)
+			return i + 1;
+	}
+	for (; i < max; i++) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & MASK_LARGE) == 0)
+			return i + 1;
+	}
+	return max;
+}
+
+static void hex(char *out, const unsigned char *digest) {
+	int	i;
+
+	for (i = 0; i < DELTA_DIGEST; i++)
+		sprintf(out + i * 2, "%02x", digest[i]);
+}
+
+/* One more chunk, len bytes at p, into m and whole. Returns 0 or -1 */
+static int add_chunk(manifest *m, size_t *room, const unsigned char *p, size_t len, gcry_md_hd_t whole) {
+	chunk	*tmp;
+
+	if (m->count == *room) {
+		if ((tmp = realloc(m->chunks, *room * 2 * sizeof(chunk))) == NULL)
+			return -1;
+		m->chunks = tmp;
+		*room *= 2;
+	}
+	m->chunks[m->count].offset = m->size;
+	m->chunks[m->count].len = len;
+	gcry_md_hash_buffer(GCRY_MD_SHA1, m->chunks[m->count].digest, p, len);
+	if (whole != NULL)
+		gcry_md_write(whole, p, len);
+	m->count++;
+	m->size += len;
+	return 0;
+}
+
+/* Ready to add chunks to, size bytes of them expected */
+static int manifest_start(manifest *m, size_t *room, unsigned long long size, char *hash, gcry_md_hd_t *whole) {
+	memset(m, 0, sizeof(*m));
+	*whole = NULL;
+	*room = size / DELTA_AVG_CHUNK + 16;
+	if ((m->chunks = malloc(*room * sizeof(chunk))) == NULL
+			|| (hash != NULL && gcry_md_open(whole, GCRY_MD_SHA1, 0) != 0)) {
+		free(m->chunks);
+		m->chunks = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int manifest_end(manifest *m, char *hash, gcry_md_hd_t whole, int ret) {
+	if (whole != NULL) {
+		if (ret == 0)
+			hex(hash, gcry_md_read(whole, GCRY_MD_SHA1));
+		gcry_md_close(whole);
+	}
+	if (ret == -1)
+		manifest_free(m);
+	return ret;
+}
+
+/*
+ * Cuts size bytes at buffer in chunks. The SHA-1 of the whole file goes in
+ * hash (HASH_LEN + 1 bytes) unless it's NULL. Returns 0 or -1.
+ */
+int manifest_build(manifest *m, const char *buffer, size_t size, char *hash) {
+	const unsigned char	*p = (const unsigned char *) buffer;
+	gcry_md_hd_t		whole;
+	size_t				room,
+						len;
+	int					ret = 0;
+
+	if (manifest_start(m, &room, size, hash, &whole) == -1)
+		return -1;
+	while (ret == 0 && m->size < size) {
+		len = delta_cut(p + m->size, size - m->size);
+		ret = add_chunk(m, &room, p + m->size, len, whole);
+	}
+	return manifest_end(m, hash, whole, ret);
+}
+
+/*
+ * A file too large to go through the page cache as usual is read a
+ * block at a time instead. What's left of a block, less than the largest
+ * chunk, is moved right before the next one: cuts only look that far, so
+ * they're where they would be with the whole file mapped.
+ */
+static int manifest_stream(manifest *m, cache_file *f, unsigned long long size, char *hash) {
+	unsigned char	*buffer,
+					*p;
+	gcry_md_hd_t	whole;
+	size_t			room,
+					left = 0,
+					len;
+	ssize_t			n = 1;
+	int				ret = 0;
+
+	/* DELTA_MAX_CHUNK is a multiple of CACHE_ALIGN, blocks are read aligned */
+	if ((buffer = cache_alloc(DELTA_MAX_CHUNK + CACHE_BLOCK)) == NULL)
+		return -1;
+	if (manifest_start(m, &room, size, hash, &whole) == -1) {
+		free(buffer);
+		return -1;
+	}
+	while (ret == 0 && n > 0) {
+		if ((n = cache_read(f, buffer + DELTA_MAX_CHUNK, CACHE_BLOCK)) == -1) {
+			ret = -1;
+			break;
+		}
+		p = buffer + DELTA_MAX_CHUNK - left;
+		left += n;
+		while (ret == 0 && left > 0 && (left >= DELTA_MAX_CHUNK || n == 0)) {
+			len = delta_cut(p, left);
+			ret = add_chunk(m, &room, p, len, whole);
+			p += len;
+			left -= len;
+		}
+		memmove(buffer + DELTA_MAX_CHUNK - left, p, left);
+	}
+	free(buffer);
+	return manifest_end(m, hash, whole, ret);
+}
+
+/* The same for a file on disk, mapped unless it's large, see cache_init() */
+int manifest_build_file(manifest *m, char *path, char *hash) {
+	struct stat	st;
+	char		*buffer = NULL;
+	cache_file	f;
+	int			ret;
+
+	if (cache_open(&f, path, O_RDONLY, 0, 1) == -1)
+		return -1;
+	if (fstat(f.fd, &st) == -1) {
+		cache_close(&f);
+		return -1;
+	}
+	if (f.mode != CACHE_NORMAL) {
+		ret = manifest_stream(m, &f, st.st_size, hash);
+		cache_close(&f);
+		return ret;
+	}
+	if (st.st_size > 0 && (buffer = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f.fd, 0)) == MAP_FAILED) {
+		cache_close(&f);
+		return -1;
+	}
+	if (buffer != NULL)
+		madvise(buffer, st.st_size, MADV_SEQUENTIAL);
+	ret = manifest_build(m, buffer, st.st_size, hash);
+	if (buffer != NULL)
+		munmap(buffer, st.st_size);
+	cache_close(&f);
+	return ret;
+}
+
+void manifest_free(manifest *m) {
+	free(m->chunks);
+	memset(m, 0, sizeof(*m));
+}
+
+/* From the on-wire form, len bytes at buffer. Returns 0 or -1 */
+static int manifest_parse(manifest *m, const char *buffer, size_t len) {
+	uint32_t	chunk_len;
+	size_t		i;
+
+	memset(m, 0, sizeof(*m));
+	if (len < 4 || memcmp(buffer, MANIFEST_MAGIC, 4) != 0 || (len - 4) % MANIFEST_ENTRY != 0)
+		return -1;
+	m->count = (len - 4) / MANIFEST_ENTRY;
+	if (m->count > 0 && (m->chunks = malloc(m->count * sizeof(chunk))) == NULL)
+		return -1;
+	for (i = 0, buffer += 4; i < m->count; i++, buffer += MANIFEST_ENTRY) {
+		memcpy(&chunk_len, buffer, 4);
+		chunk_len = ntohl(chunk_len);
+		/* Nothing else can have made it, the receiver relies on it */
+		if (chunk_len == 0 || chunk_len > DELTA_MAX_CHUNK) {
+			manifest_free(m);
+			return -1;
+		}
+		m->chunks[i].offset = m->size;
+		m->chunks[i].len = chunk_len;
+		memcpy(m->chunks[i].digest, buffer + 4, DELTA_DIGEST);
+		m->size += chunk_len;
+	}
+	return 0;
+}
+
+/* The on-wire form, malloc()-ed, its length in len */
+static char *manifest_format(manifest *m, size_t *len) {
+	char		*buffer,
+				*p;
+	uint32_t	chunk_len;
+	size_t		i;
+
+	*len = 4 + m->count * MANIFEST_ENTRY;
+	if ((buffer = malloc(*len)) == NULL)
+		return NULL;
+	memcpy(buffer, MANIFEST_MAGIC, 4);
+	for (i = 0, p = buffer + 4; i < m->count; i++, p += MANIFEST_ENTRY) {
+		chunk_len = htonl(m->chunks[i].len);
+		memcpy(p, &chunk_len, 4);
+		memcpy(p + 4, m->chunks[i].digest, DELTA_DIGEST);
+	}
+	return buffer;
+}
+
+/* Written aside and renamed, a reader never sees half of it */
+int manifest_save(manifest *m, char *path) {
+	char	tmp[1024],
+			*buffer;
+	size_t	len;
+	int		fd,
+			ret = -1;
+
+	if ((buffer = manifest_format(m, &len)) == NULL)
+		return -1;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) != -1) {
+		if (write(fd, buffer, len) == (ssize_t) len && close(fd) == 0)
+			ret = rename(tmp, path);
+		else
+			close(fd);
+		if (ret == -1)
+			unlink(tmp);
+	}
+	free(buffer);
+	return ret;
+}
+
+int manifest_load(manifest *m, char *path) {
+	struct stat	st;
+	char		*buffer;
+	int			fd,
+				ret = -1;
+
+	memset(m, 0, sizeof(*m));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == 0 && st.st_size <= MANIFEST_MAX && (buffer = malloc(st.st_size + 1)) != NULL) {
+		if (read(fd, buffer, st.st_size) == st.st_size)
+			ret = manifest_parse(m, buffer, st.st_size);
+		free(buffer);
+	}
+	close(fd);
+	return ret;
+}
+
+static int send_manifest(conn *c, manifest *m) {
+	char	*buffer;
+	size_t	len;
+	int		ret = -1;
+
+	if ((buffer = manifest_format(m, &len)) == NULL)
+		return -1;
+	if (send_file_header(c, len, ENCODING_RAW) == 0 && conn_write(c, buffer, len) == 0 && conn_flush(c) == 0)
+		ret = 0;
+	free(buffer);
+	return ret;
+}
+
+static int receive_manifest(conn *c, manifest *m) {
+	unsigned long long	len;
+	char				*buffer;
+	int					ret = -1;
+
+	if (read_file_header(c, &len) != ENCODING_RAW || len > MANIFEST_MAX || (buffer = malloc(len + 1)) == NULL)
+		return -1;
+	if (conn_read(c, buffer, len) == 0)
+		ret = manifest_parse(m, buffer, len);
+	free(buffer);
+	return ret;
+}
+
+/*
+ * One request of the downloader: the ranges it asks for, then their
+ * content in order, framed if compression has been agreed on. There
+ * can't be more ranges than chunks. With again set, past the first one,
+ * an empty request isn't answered. Returns the bytes sent, -1 on errors
+ * and -2 if the downloader sent nothing more.
+ */
+static long long serve_ranges(conn *c, int file, unsigned long long size, size_t chunks, int again) {
+	unsigned long long	len,
+						total = 0,
+						offset,
+						left;
+	uint64_t			*ranges = NULL;
+	char				buffer[TRANSFER_CHUNK],
+						frame[CODEC_FRAME_MAX];
+	codec				cd = { 0, 0 };
+	size_t				i,
+						count,
+						n;
+	int					encoding;
+	long long			ret = -1;
+
+	if (read_file_header(c, &len) != ENCODING_RAW)
+		return -2;
+	if (again && len == 0)
+		return 0;
+	if (len % RANGE_SIZE != 0 || len / RANGE_SIZE > chunks || (ranges = malloc(len + 1)) == NULL
+			|| conn_read(c, ranges, len) == -1)
+		goto out;
+	count = len / RANGE_SIZE;
+	for (i = 0; i < count * 2; i++)
+		ranges[i] = be64toh(ranges[i]);
+	for (i = 0; i < count; i++) {
+		if (ranges[i * 2] > size || ranges[i * 2 + 1] > size - ranges[i * 2])
+			goto out;
+		total += ranges[i * 2 + 1];
+	}
+
+	encoding = codec_choose(file, c->options & OPT_ZLIB);
+	if (send_file_header(c, total, encoding) == -1)
+		goto out;
+	/* A frame never spans two ranges, the receiver writes each one somewhere else */
+	for (i = 0; i < count; i++)
+		for (offset = ranges[i * 2], left = ranges[i * 2 + 1]; left > 0; offset += n, left -= n) {
+			n = left < sizeof(buffer) ? left : sizeof(buffer);
+			if (pread(file, buffer, n, offset) != (ssize_t) n)
+				goto out;
+			if (encoding == ENCODING_RAW ? conn_write(c, buffer, n) == -1
+					: conn_write(c, frame, codec_pack(&cd, buffer, n, frame)) == -1)
+				goto out;
+		}
+	if (conn_flush(c) == 0)
+		ret = total;
+out:
+	free(ranges);
+	return ret;
+}
+
+/*
+ * Answers a delta query for filepath: its manifest goes first, then the
+ * ranges the downloader asks for. Chunks that came broken are asked for
+ * again, up to DELTA_RETRIES times, and an empty request ends it. The
+ * manifest is kept in manifest_path, it's made again if it's missing or
+ * doesn't match the file. Returns the bytes of the file sent, -1 on
+ * errors.
+ */
+long long delta_serve(conn *c, char *filepath, char *manifest_path) {
+	manifest			m;
+	struct stat			st;
+	long long			sent,
+						ret = -1;
+	int					file,
+						round;
+
+	if ((file = open(filepath, O_RDONLY)) == -1 || fstat(file, &st) == -1) {
+		if (file != -1)
+			close(file);
+		return -1;
+	}
+	if (manifest_load(&m, manifest_path) == -1 || m.size != (unsigned long long) st.st_size) {
+		manifest_free(&m);
+		if (manifest_build_file(&m, filepath, NULL) == -1) {
+			close(file);
+			return -1;
+		}
+		if (manifest_save(&m, manifest_path) == -1)
+			log_warn("Couldn't save the manifest of %s.", filepath);
+	}
+	if (send_manifest(c, &m) == -1 || (ret = serve_ranges(c, file, st.st_size, m.count, 0)) < 0) {
+		ret = -1;
+		goto out;
+	}
+	/* Older downloaders just hang up, that's the end of it too */
+	for (round = 0; round < DELTA_RETRIES && (sent = serve_ranges(c, file, st.st_size, m.count, 1)) > 0; round++)
+		ret += sent;
+	if (round < DELTA_RETRIES && sent == -1)
+		ret = -1;
+out:
+	manifest_free(&m);
+	close(file);
+	return ret;
+}
+
+static int by_digest(const void *a, const void *b) {
+	return memcmp(((const chunk *) a)->digest, ((const chunk *) b)->digest, DELTA_DIGEST);
+}
+
+/* A delta download on its way: what comes from the wire is checked as it comes */
+typedef struct fetch {
+	conn				*c;
+	int					out;
+	int					encoding;
+	manifest			*m;
+	char				*buffer;	/* The chunk being received, and a frame's worth past it */
+	char				*missing;	/* One per chunk of m, set while it has to come from the wire */
+	size_t				num_missing;
+	size_t				first_bad;	/* m->count if none, the whole file's hash stops before it */
+	gcry_md_hd_t		whole;
+	unsigned long long	bytes;
+} fetch;
+
+/*
+ * Chunk i is all in p: checked against its digest in the manifest, it's
+ * no longer missing if it matches. It goes into the whole file's hash
+ * if no chunk before it came broken.
+ */
+static void check_chunk(fetch *f, size_t i, const char *p) {
+	unsigned char	digest[DELTA_DIGEST];
+
+	gcry_md_hash_buffer(GCRY_MD_SHA1, digest, p, f->m->chunks[i].len);
+	if (memcmp(digest, f->m->chunks[i].digest, DELTA_DIGEST) == 0) {
+		f->missing[i] = 0;
+		f->num_missing--;
+	}
+	else if (i < f->first_bad)
+		f->first_bad = i;
+	if (i < f->first_bad)
+		gcry_md_write(f->whole, p, f->m->chunks[i].len);
+}
+
+/*
+ * A range of len bytes, the chunks from i on, written in place as it
+ * comes. Each chunk is checked as soon as it's whole in the buffer.
+ * Returns the chunk after the range, -1 on errors.
+ */
+static long fetch_range(fetch *f, size_t i, unsigned long long len) {
+	unsigned long long	offset = f->m->chunks[i].offset;
+	size_t				have = 0,
+						used;
+	long				n;
+
+	while (len > 0) {
+		if (f->encoding == ENCODING_ZLIB)
+			n = receive_frame(f->c, f->out, offset, f->buffer + have, len);
+		else {
+			n = len < TRANSFER_CHUNK ? len : TRANSFER_CHUNK;
+			if (conn_read(f->c, f->buffer + have, n) == -1 || pwrite(f->out, f->buffer + have, n, offset) != n)
+				n = -1;
+		}
+		if (n <= 0)
+			return -1;
+		offset += n;
+		len -= n;
+		have += n;
+		f->bytes += n;
+		for (used = 0; i < f->m->count && have - used >= f->m->chunks[i].len; used += f->m->chunks[i].len, i++)
+			check_chunk(f, i, f->buffer + used);
+		memmove(f->buffer, f->buffer + used, have - used);
+		have -= used;
+	}
+	/* Ranges end where a chunk does */
+	return have == 0 ? (long) i : -1;
+}
+
+/* Runs of the chunks still missing, one range each. Returns how many */
+static size_t missing_ranges(fetch *f, uint64_t *ranges) {
+	size_t	i,
+			count = 0;
+
+	for (i = 0; i < f->m->count; i++) {
+		if (!f->missing[i])
+			continue;
+		if (count > 0 && be64toh(ranges[count * 2 - 2]) + be64toh(ranges[count * 2 - 1]) == f->m->chunks[i].offset)
+			ranges[count * 2 - 1] = htobe64(be64toh(ranges[count * 2 - 1]) + f->m->chunks[i].len);
+		else {
+			ranges[count * 2] = htobe64(f->m->chunks[i].offset);
+			ranges[count * 2 + 1] = htobe64(f->m->chunks[i].len);
+			count++;
+		}
+	}
+	return count;
+}
+
+static int send_ranges(conn *c, uint64_t *ranges, size_t count) {
+	if (send_file_header(c, count * RANGE_SIZE, ENCODING_RAW) == -1 || conn_write(c, ranges, count * RANGE_SIZE) == -1
+			|| conn_flush(c) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * After a delta query: rebuilds the file in target from the chunks its
+ * old version already has and the ones that changed, which are the only
+ * ones asked for. Those are checked against the manifest as they come,
+ * the ones that don't match are asked for again. The result must hash to
+ * hash, otherwise target is left as it was. Returns 0 or -1.
+ */
+int delta_receive(conn *c, char *hash, char *target, delta_stats *stats) {
+	manifest			theirs,
+						mine;
+	chunk				*sorted = NULL,
+						*found;
+	uint64_t			*ranges = NULL;
+	fetch				f;
+	unsigned long long	len,
+						offset;
+	char				tmp[1024] = "",
+						got[HASH_LEN + 1];
+	long				next;
+	ssize_t				n;
+	size_t				i,
+						j,
+						count = 0;
+	int					old = -1,
+						round,
+						ret = -1;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&mine, 0, sizeof(mine));
+	memset(&f, 0, sizeof(f));
+	f.out = -1;
+	if (receive_manifest(c, &theirs) == -1)
+		return -1;
+	f.c = c;
+	f.m = &theirs;
+	f.first_bad = theirs.count;
+	if (manifest_build_file(&mine, target, NULL) == -1 || (old = open(target, O_RDONLY)) == -1
+			|| (f.buffer = malloc(DELTA_MAX_CHUNK + TRANSFER_CHUNK)) == NULL
+			|| (f.missing = calloc(theirs.count + 1, 1)) == NULL
+			|| (mine.count > 0 && (sorted = malloc(mine.count * sizeof(chunk))) == NULL)
+			|| (ranges = malloc(theirs.count * RANGE_SIZE + 1)) == NULL)
+		goto out;
+	if (mine.count > 0)
+		memcpy(sorted, mine.chunks, mine.count * sizeof(chunk));
+	qsort(sorted, mine.count, sizeof(chunk), by_digest);
+
+	/* Whatever the old file doesn't have */
+	for (i = 0; i < theirs.count; i++) {
+		f.missing[i] = mine.count == 0 || bsearch(&theirs.chunks[i], sorted, mine.count, sizeof(chunk), by_digest) == NULL;
+		f.num_missing += f.missing[i];
+	}
+	count = missing_ranges(&f, ranges);
+	if (send_ranges(c, ranges, count) == -1 || (f.encoding = read_file_header(c, &len)) == -1)
+		goto out;
+
+	snprintf(tmp, sizeof(tmp), "%s.delta", target);
+	if ((f.out = open(tmp, O_RDWR | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1
+			|| gcry_md_open(&f.whole, GCRY_MD_SHA1, 0) != 0)
+		goto out;
+	/* In the file's order: copies from the old one, the ranges as they come */
+	for (i = 0, j = 0; i < theirs.count; ) {
+		if (j < count && be64toh(ranges[j * 2]) == theirs.chunks[i].offset) {
+			if ((next = fetch_range(&f, i, be64toh(ranges[j * 2 + 1]))) == -1)
+				goto out;
+			i = next;
+			j++;
+			continue;
+		}
+		found = bsearch(&theirs.chunks[i], sorted, mine.count, sizeof(chunk), by_digest);
+		if (pread(old, f.buffer, found->len, found->offset) != found->len
+				|| pwrite(f.out, f.buffer, found->len, theirs.chunks[i].offset) != found->len)
+			goto out;
+		if (i < f.first_bad)
+			gcry_md_write(f.whole, f.buffer, found->len);
+		stats->reused += found->len;
+		i++;
+	}
+	if ((stats->fetched = f.bytes) != len)
+		goto out;
+
+	/* Only the chunks that came broken, again */
+	for (round = 0; f.num_missing > 0 && round < DELTA_RETRIES; round++) {
+		log_warn("%lu chunks of %s don't match the manifest, asking for them again.", (unsigned long) f.num_missing,
+				target);
+		count = missing_ranges(&f, ranges);
+		f.bytes = 0;
+		if (send_ranges(c, ranges, count) == -1 || (f.encoding = read_file_header(c, &len)) == -1)
+			goto out;
+		for (i = 0, j = 0; j < count; j++) {
+			while (i < theirs.count && theirs.chunks[i].offset != be64toh(ranges[j * 2]))
+				i++;
+			if (i == theirs.count || (next = fetch_range(&f, i, be64toh(ranges[j * 2 + 1]))) == -1)
+				goto out;
+			i = next;
+		}
+		if (f.bytes != len)
+			goto out;
+		stats->refetched += f.bytes;
+	}
+	/* Nothing more to ask, older uploaders have hung up already */
+	send_ranges(c, ranges, 0);
+	if (f.num_missing > 0) {
+		log_error("%lu chunks of %s still don't match the manifest.", (unsigned long) f.num_missing, target);
+		goto out;
+	}
+	/* The whole file's hash went as far as the first broken chunk, the rest is read back */
+	for (offset = f.first_bad < theirs.count ? theirs.chunks[f.first_bad].offset : theirs.size;
+			offset < theirs.size; offset += n) {
+		if ((n = pread(f.out, f.buffer, DELTA_MAX_CHUNK, offset)) <= 0)
+			goto out;
+		gcry_md_write(f.whole, f.buffer, n);
+	}
+	hex(got, gcry_md_read(f.whole, GCRY_MD_SHA1));
+	if (strcmp(got, hash) != 0) {
+		log_error("Delta of %s doesn't match its hash.", target);
+		goto out;
+	}
+	if (close(f.out) == 0 && rename(tmp, target) == 0)
+		ret = 0;
+	f.out = -1;
+out:
+	if (f.out != -1)
+		close(f.out);
+	if (ret == -1 && tmp[0] != '\0')
+		unlink(tmp);
+	if (old != -1)
+		close(old);
+	gcry_md_close(f.whole);
+	free(ranges);
+	free(sorted);
+	free(f.missing);
+	free(f.buffer);
+	manifest_free(&mine);
+	manifest_free(&theirs);
+	return ret;
+}
@@ -0,0 +1,61 @@
+/*
+ * Delta.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+#include "Conn.h"
+
+/*
+ * Files are cut where their content says so, not every N bytes: an edit
+ * only changes the chunks around it, the rest keep their digests even if
+ * the bytes after it have moved.
+ */
+#define DELTA_MIN_CHUNK 16384
+#define DELTA_AVG_CHUNK 65536
+#define DELTA_MAX_CHUNK 262144
+#define DELTA_DIGEST 20		/* SHA-1 */
+#define DELTA_RETRIES 2		/* Times the chunks that came broken are asked for again */
+
+/*
+ * The manifest on disk and on the wire: "CDC1", then every chunk in
+ * order as its length in network order and its digest.
+ */
+#define MANIFEST_MAGIC "CDC1"
+#define MANIFEST_ENTRY (4 + DELTA_DIGEST)
+
+typedef struct chunk {
+	unsigned long long	offset;
+	uint32_t			len;
+	unsigned char		digest[DELTA_DIGEST];
+} chunk;
+
+typedef struct manifest {
+	chunk				*chunks;
+	size_t				count;
+	unsigned long long	size;	/* Of the whole file */
+} manifest;
+
+/* What a delta download took from the old file and from the wire */
+typedef struct delta_stats {
+	unsigned long long	reused;
+	unsigned long long	fetched;
+	unsigned long long	refetched;	/* Chunks that didn't match the manifest, again */
+} delta_stats;
+
+size_t delta_cut(const unsigned char *, size_t);
+int manifest_build(manifest *, const char *, size_t, char *);
+int manifest_build_file(manifest *, char *, char *);
+int manifest_save(manifest *, char *);
+int manifest_load(manifest *, char *);
+void manifest_free(manifest *);
+long long delta_serve(conn *, char *, char *);
+int delta_receive(conn *, char *, char *, delta_stats *);
+
+#endif /* DELTA_H_ */
@@ -0,0 +1,805 @@
+/*
+ ============================================================================
+ Name        : Dht.c
+ Author      : Giacomo Persichini
+ Description : Peers find who has a hash among themselves, without the server
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - free() */
+#include <string.h> /* memcpy() - memcmp() - strtok_r() */
+#include <errno.h> /* errno */
+#include <time.h> /* time() */
+#include <poll.h> /* poll() */
+#include <unistd.h> /* close() */
+#include <pthread.h> /* pthread_mutex_lock() */
+#include <sys/random.h> /* getrandom() */
+#include <sys/socket.h> /* AF_INET - SOCK_DGRAM */
+#include <arpa/inet.h> /* inet_pton() - htonl() */
+
+#include "Dht.h"
+#include "Log.h"
+
+/*
+ * Every message is one datagram: "FSK1", its type, a transaction id
+ * echoed by the answer, the sender's id and the port it serves on (0 if
+ * it doesn't), then the payload. Contacts are sent as id, IPv4 address
+ * and port, addresses and ports in network order.
+ */
+#define MAGIC "FSK1"
+#define HEADER_SIZE 31
+#define CONTACT_SIZE 26
+#define OWNER_SIZE 6
+#define MSG_SIZE 512
+
+#define MSG_PING 1
+#define MSG_PONG 2
+#define MSG_FIND_NODE 3		/* target */
+#define MSG_NODES 4			/* count, contacts */
+#define MSG_FIND_VALUE 5	/* key */
+#define MSG_VALUES 6		/* count, owners, count, contacts */
+#define MSG_STORE 7			/* key, owner's port: the address is the sender's */
+#define MSG_STORED 8
+
+#define BUCKETS (DHT_ID_LEN * 8)
+#define SHORTLIST (DHT_K * 4)	/* Candidates a lookup keeps track of */
+#define MAX_FAILS 2				/* Unanswered requests before a contact can be replaced */
+#define VALUE_SLOTS 1024
+
+#define NEW 0
+#define ASKED 1
+#define ANSWERED 2
+#define FAILED 3
+
+typedef struct contact {
+	unsigned char		id[DHT_ID_LEN];
+	struct sockaddr_in	addr;
+	int					fails;
+} contact;
+
+/* Somebody has the content with key as hash */
+typedef struct value {
+	unsigned char		key[DHT_ID_LEN];
+	struct sockaddr_in	owner;
+	time_t				expires;
+	struct value		*next,
+						*older,		/* By expiry, every record of the node */
+						*newer;
+} value;
+
+struct dht {
+	int				fd;
+	unsigned short	port;
+	unsigned char	id[DHT_ID_LEN];
+	unsigned int	txid;
+	pthread_mutex_t	lock;	/* Requests are served and lookups run from different threads */
+	contact			table[BUCKETS][DHT_K];	/* By distance from id, least recently seen first */
+	int				counts[BUCKETS];
+	value			*values[VALUE_SLOTS];
+	value			*oldest,	/* Expires first */
+					*newest;
+	int				num_values;
+};
+
+typedef struct candidate {
+	contact				c;
+	int					state;
+	int					depth;		/* Hops it took to hear of it */
+	unsigned int		txid;
+	unsigned long long	deadline;	/* Of the request it was sent */
+} candidate;
+
+typedef struct lookup {
+	dht					*d;
+	int					sock;	/* Its own, answers don't get mixed with the node's requests */
+	int					type;
+	unsigned char		target[DHT_ID_LEN];
+	candidate			list[SHORTLIST];	/* Closest first */
+	int					num;
+	struct sockaddr_in	*owners;
+	int					max_owners;
+	int					found;
+	dht_stats			*stats;
+} lookup;
+
+static unsigned long long now_usec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void put32(unsigned char *p, unsigned int x) {
+	x = htonl(x);
+	memcpy(p, &x, 4);
+}
+
+static unsigned int get32(const unsigned char *p) {
+	unsigned int	x;
+
+	memcpy(&x, p, 4);
+	return ntohl(x);
+}
+
+/* A hash's 40 hex digits as a key */
+static int key_of(const char *hash, unsigned char *key) {
+	unsigned int	byte;
+	int				i;
+
+	for (i = 0; i < DHT_ID_LEN; i++)
+		if (sscanf(hash + i * 2, "%2x", &byte) != 1)
+			return -1;
+		else
+			key[i] = byte;
+	return 0;
+}
+
+/* The bucket of id: how many bits the distance from ours takes, less one */
+static int bucket_of(dht *d, const unsigned char *id) {
+	int	i,
+		x;
+
+	for (i = 0; i < DHT_ID_LEN; i++)
+		if ((x = d->id[i] ^ id[i]) != 0)
+			return (DHT_ID_LEN - 1 - i) * 8 + 31 - __builtin_clz(x);
+	return -1;
+}
+
+/* Negative if a is closer to target than b */
+static int closer(const unsigned char *target, const unsigned char *a, const unsigned char *b) {
+	int	i,
+		x,
+		y;
+
+	for (i = 0; i < DHT_ID_LEN; i++)
+		if ((x = a[i] ^ target[i]) != (y = b[i] ^ target[i]))
+			return x < y ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Somebody serving at addr talked to us. Known contacts move to the end
+ * of their bucket; new ones get in if there's room or if somebody there
+ * stopped answering. Nodes that have been up for long tend to stay up,
+ * so they're kept over newcomers.
+ */
+static void seen(dht *d, const unsigned char *id, struct sockaddr_in *addr) {
+	contact	*bucket,
+			c;
+	int		b = bucket_of(d, id),
+			i;
+
+	if (b == -1)
+		return;
+	pthread_mutex_lock(&d->lock);
+	bucket = d->table[b];
+	for (i = 0; i < d->counts[b] && memcmp(bucket[i].id, id, DHT_ID_LEN) != 0; i++)
+		;
+	if (i == d->counts[b] && d->counts[b] == DHT_K)
+		for (i = 0; i < DHT_K && bucket[i].fails < MAX_FAILS; i++)
+			;
+	if (i < d->counts[b]) {
+		memmove(&bucket[i], &bucket[i + 1], (d->counts[b] - i - 1) * sizeof(contact));
+		d->counts[b]--;
+	}
+	if (i < DHT_K) {
+		memcpy(c.id, id, DHT_ID_LEN);
+		c.addr = *addr;
+		c.fails = 0;
+		bucket[d->counts[b]++] = c;
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void failed(dht *d, const unsigned char *id) {
+	int	b = bucket_of(d, id),
+		i;
+
+	if (b == -1)
+		return;
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->counts[b]; i++)
+		if (memcmp(d->table[b][i].id, id, DHT_ID_LEN) == 0)
+			d->table[b][i].fails++;
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* The max contacts closest to target that still answer, but not exclude */
+static int closest(dht *d, const unsigned char *target, const unsigned char *exclude, contact *out, int max) {
+	contact	*c;
+	int		num = 0,
+			b,
+			i,
+			j;
+
+	pthread_mutex_lock(&d->lock);
+	for (b = 0; b < BUCKETS; b++)
+		for (i = 0; i < d->counts[b]; i++) {
+			c = &d->table[b][i];
+			if (c->fails >= MAX_FAILS || (exclude != NULL && memcmp(c->id, exclude, DHT_ID_LEN) == 0))
+				continue;
+			for (j = num; j > 0 && closer(target, c->id, out[j - 1].id) < 0; j--)
+				if (j < max)
+					out[j] = out[j - 1];
+			if (j < max) {
+				out[j] = *c;
+				if (num < max)
+					num++;
+			}
+		}
+	pthread_mutex_unlock(&d->lock);
+	return num;
+}
+
+static value **slot_of(dht *d, const unsigned char *key) {
+	return &d->values[(key[0] << 8 | key[1]) % VALUE_SLOTS];
+}
+
+/* Every record lives DHT_TTL from its last store: the newest goes last */
+static void age_append(dht *d, value *x) {
+	x->older = d->newest;
+	x->newer = NULL;
+	if (d->newest != NULL)
+		d->newest->newer = x;
+	else
+		d->oldest = x;
+	d->newest = x;
+}
+
+static void age_unlink(dht *d, value *x) {
+	if (x->older != NULL)
+		x->older->newer = x->newer;
+	else
+		d->oldest = x->newer;
+	if (x->newer != NULL)
+		x->newer->older = x->older;
+	else
+		d->newest = x->older;
+}
+
+static void drop_value(dht *d, value *x) {
+	value	**v;
+
+	for (v = slot_of(d, x->key); *v != x; v = &(*v)->next)
+		;
+	*v = x->next;
+	age_unlink(d, x);
+	free(x);
+	d->num_values--;
+}
+
+/*
+ * Anybody can send a store, with any owner's port: a key keeps
+ * DHT_MAX_OWNERS records and the node DHT_MAX_VALUES, those expiring
+ * first make room for the new ones.
+ */
+static void store_value(dht *d, const unsigned char *key, struct sockaddr_in *owner) {
+	value	**v = slot_of(d, key),
+			*x,
+			*soonest = NULL;
+	time_t	now = time(NULL);
+	int		owners = 0;
+
+	pthread_mutex_lock(&d->lock);
+	while ((x = *v) != NULL) {
+		if (x->expires < now) {
+			drop_value(d, x);
+			continue;
+		}
+		if (memcmp(x->key, key, DHT_ID_LEN) == 0) {
+			if (x->owner.sin_addr.s_addr == owner->sin_addr.s_addr && x->owner.sin_port == owner->sin_port)
+				break;
+			if (soonest == NULL || x->expires < soonest->expires)
+				soonest = x;
+			owners++;
+		}
+		v = &x->next;
+	}
+	if (x == NULL) {
+		if (owners >= DHT_MAX_OWNERS)
+			drop_value(d, soonest);
+		else if (d->num_values >= DHT_MAX_VALUES)
+			drop_value(d, d->oldest);
+		if ((x = calloc(1, sizeof(value))) != NULL) {
+			memcpy(x->key, key, DHT_ID_LEN);
+			x->owner = *owner;
+			x->next = *slot_of(d, key);
+			*slot_of(d, key) = x;
+			d->num_values++;
+		}
+	}
+	else
+		age_unlink(d, x);
+	if (x != NULL) {
+		x->expires = now + DHT_TTL;
+		age_append(d, x);
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int get_values(dht *d, const unsigned char *key, struct sockaddr_in *owners, int max) {
+	value	*x;
+	time_t	now = time(NULL);
+	int		num = 0;
+
+	pthread_mutex_lock(&d->lock);
+	for (x = d->values[(key[0] << 8 | key[1]) % VALUE_SLOTS]; x != NULL && num < max; x = x->next)
+		if (x->expires >= now && memcmp(x->key, key, DHT_ID_LEN) == 0)
+			owners[num++] = x->owner;
+	pthread_mutex_unlock(&d->lock);
+	return num;
+}
+
+static size_t header(dht *d, unsigned char *msg, int type, unsigned int txid) {
+	memcpy(msg, MAGIC, 4);
+	msg[4] = type;
+	put32(msg + 5, txid);
+	memcpy(msg + 9, d->id, DHT_ID_LEN);
+	msg[29] = d->port >> 8;
+	msg[30] = d->port & 0xff;
+	return HEADER_SIZE;
+}
+
+static size_t put_nodes(dht *d, unsigned char *msg, const unsigned char *target, const unsigned char *exclude) {
+	contact	nodes[DHT_K];
+	int		num = closest(d, target, exclude, nodes, DHT_K),
+			i;
+
+	msg[0] = num;
+	for (i = 0; i < num; i++) {
+		memcpy(msg + 1 + i * CONTACT_SIZE, nodes[i].id, DHT_ID_LEN);
+		memcpy(msg + 1 + i * CONTACT_SIZE + 20, &nodes[i].addr.sin_addr.s_addr, 4);
+		memcpy(msg + 1 + i * CONTACT_SIZE + 24, &nodes[i].addr.sin_port, 2);
+	}
+	return 1 + num * CONTACT_SIZE;
+}
+
+static size_t put_values(dht *d, unsigned char *msg, const unsigned char *key) {
+	struct sockaddr_in	owners[DHT_MAX_OWNERS];
+	int					num = get_values(d, key, owners, DHT_MAX_OWNERS),
+						i;
+
+	msg[0] = num;
+	for (i = 0; i < num; i++) {
+		memcpy(msg + 1 + i * OWNER_SIZE, &owners[i].sin_addr.s_addr, 4);
+		memcpy(msg + 1 + i * OWNER_SIZE + 4, &owners[i].sin_port, 2);
+	}
+	return 1 + num * OWNER_SIZE;
+}
+
+/* port 0 takes any free one, dht_port() tells which */
+dht *dht_open(unsigned short port) {
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	dht					*d = calloc(1, sizeof(dht));
+
+	if (d == NULL)
+		return NULL;
+	if (getrandom(d->id, DHT_ID_LEN, 0) != DHT_ID_LEN || (d->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		free(d);
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	if (bind(d->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+			|| getsockname(d->fd, (struct sockaddr *) &addr, &len) == -1) {
+		log_error("DHT: couldn't bind UDP port %d: %s", port, strerror(errno));
+		close(d->fd);
+		free(d);
+		return NULL;
+	}
+	d->port = ntohs(addr.sin_port);
+	d->txid = get32(d->id);
+	pthread_mutex_init(&d->lock, NULL);
+	return d;
+}
+
+void dht_close(dht *d) {
+	value	*x;
+	int		i;
+
+	if (d == NULL)
+		return;
+	close(d->fd);
+	for (i = 0; i < VALUE_SLOTS; i++)
+		while ((x = d->values[i]) != NULL) {
+			d->values[i] = x->next;
+			free(x);
+		}
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+/* Readable when a request is waiting for dht_handle() */
+int dht_fd(dht *d) {
+	return d->fd;
+}
+
+unsigned short dht_port(dht *d) {
+	return d->port;
+}
+
+int dht_contacts(dht *d) {
+	int	num = 0,
+		b;
+
+	pthread_mutex_lock(&d->lock);
+	for (b = 0; b < BUCKETS; b++)
+		num += d->counts[b];
+	pthread_mutex_unlock(&d->lock);
+	return num;
+}
+
+/* Kept for others, expired ones included until a store comes across them */
+int dht_records(dht *d) {
+	int	num;
+
+	pthread_mutex_lock(&d->lock);
+	num = d->num_values;
+	pthread_mutex_unlock(&d->lock);
+	return num;
+}
+
+/*
+ * Answers one request, if one is waiting. Returns 1 if it did, 0 for
+ * datagrams that aren't requests and -1 if there's nothing to read.
+ */
+int dht_handle(dht *d) {
+	unsigned char		in[MSG_SIZE],
+						out[MSG_SIZE];
+	struct sockaddr_in	from,
+						node;
+	socklen_t			len = sizeof(from);
+	ssize_t				n = recvfrom(d->fd, in, sizeof(in), MSG_DONTWAIT, (struct sockaddr *) &from, &len);
+	size_t				size;
+
+	if (n < 0)
+		return -1;
+	if (n < HEADER_SIZE || memcmp(in, MAGIC, 4) != 0)
+		return 0;
+	/* Requests come from a lookup's socket, the node itself serves elsewhere */
+	if (in[29] != 0 || in[30] != 0) {
+		node = from;
+		node.sin_port = htons(in[29] << 8 | in[30]);
+		seen(d, in + 9, &node);
+	}
+	switch (in[4]) {
+	case MSG_PING:
+		size = header(d, out, MSG_PONG, get32(in + 5));
+		break;
+	case MSG_FIND_NODE:
+		if (n < HEADER_SIZE + DHT_ID_LEN)
+			return 0;
+		size = header(d, out, MSG_NODES, get32(in + 5));
+		size += put_nodes(d, out + size, in + HEADER_SIZE, in + 9);
+		break;
+	case MSG_FIND_VALUE:
+		if (n < HEADER_SIZE + DHT_ID_LEN)
+			return 0;
+		size = header(d, out, MSG_VALUES, get32(in + 5));
+		size += put_values(d, out + size, in + HEADER_SIZE);
+		size += put_nodes(d, out + size, in + HEADER_SIZE, in + 9);
+		break;
+	case MSG_STORE:
+		if (n < HEADER_SIZE + DHT_ID_LEN + 2)
+			return 0;
+		node = from;
+		memcpy(&node.sin_port, in + HEADER_SIZE + DHT_ID_LEN, 2);
+		store_value(d, in + HEADER_SIZE, &node);
+		size = header(d, out, MSG_STORED, get32(in + 5));
+		break;
+	default:
+		return 0;
+	}
+	sendto(d->fd, out, size, 0, (struct sockaddr *) &from, len);
+	return 1;
+}
+
+static void add_candidate(lookup *l, contact *c, int depth) {
+	int	i;
+
+	if (memcmp(c->id, l->d->id, DHT_ID_LEN) == 0)
+		return;
+	for (i = 0; i < l->num; i++)
+		if (memcmp(l->list[i].c.id, c->id, DHT_ID_LEN) == 0)
+			return;
+	for (i = l->num; i > 0 && closer(l->target, c->id, l->list[i - 1].c.id) < 0; i--)
+		if (i < SHORTLIST)
+			l->list[i] = l->list[i - 1];
+	if (i == SHORTLIST)
+		return;
+	l->list[i].c = *c;
+	l->list[i].c.fails = 0;
+	l->list[i].state = NEW;
+	l->list[i].depth = depth;
+	if (l->num < SHORTLIST)
+		l->num++;
+}
+
+static void add_nodes(lookup *l, const unsigned char *msg, size_t len, int depth) {
+	contact	c;
+	int		num,
+			i;
+
+	if (len < 1 || len < 1 + (size_t) msg[0] * CONTACT_SIZE)
+		return;
+	num = msg[0];
+	memset(&c, 0, sizeof(c));
+	c.addr.sin_family = AF_INET;
+	for (i = 0; i < num; i++) {
+		memcpy(c.id, msg + 1 + i * CONTACT_SIZE, DHT_ID_LEN);
+		memcpy(&c.addr.sin_addr.s_addr, msg + 1 + i * CONTACT_SIZE + 20, 4);
+		memcpy(&c.addr.sin_port, msg + 1 + i * CONTACT_SIZE + 24, 2);
+		add_candidate(l, &c, depth);
+	}
+}
+
+static void add_owners(lookup *l, const unsigned char *msg) {
+	struct sockaddr_in	owner;
+	int					i,
+						j;
+
+	memset(&owner, 0, sizeof(owner));
+	owner.sin_family = AF_INET;
+	for (i = 0; i < msg[0] && l->found < l->max_owners; i++) {
+		memcpy(&owner.sin_addr.s_addr, msg + 1 + i * OWNER_SIZE, 4);
+		memcpy(&owner.sin_port, msg + 1 + i * OWNER_SIZE + 4, 2);
+		for (j = 0; j < l->found; j++)
+			if (l->owners[j].sin_addr.s_addr == owner.sin_addr.s_addr && l->owners[j].sin_port == owner.sin_port)
+				break;
+		if (j == l->found)
+			l->owners[l->found++] = owner;
+	}
+}
+
+static void send_request(lookup *l, candidate *x, int type, const unsigned char *payload, size_t len) {
+	unsigned char	msg[MSG_SIZE];
+	size_t			size;
+
+	pthread_mutex_lock(&l->d->lock);
+	x->txid = l->d->txid++;
+	pthread_mutex_unlock(&l->d->lock);
+	size = header(l->d, msg, type, x->txid);
+	memcpy(msg + size, payload, len);
+	sendto(l->sock, msg, size + len, 0, (struct sockaddr *) &x->c.addr, sizeof(x->c.addr));
+	x->state = ASKED;
+	x->deadline = now_usec() + DHT_TIMEOUT * 1000ULL;
+	l->stats->rpcs++;
+}
+
+/*
+ * Waits for the next answer, until the first request in flight runs out
+ * of time at most. Requests that did are taken as failed. Returns 2 if an
+ * answer came, 1 if none did and 0 once nothing is in flight any more.
+ */
+static int receive(lookup *l, int expected) {
+	unsigned char		msg[MSG_SIZE];
+	unsigned long long	deadline = 0,
+						now = now_usec();
+	struct pollfd		pfd;
+	ssize_t				n;
+	size_t				values;
+	candidate			*x = NULL;
+	int					i;
+
+	for (i = 0; i < l->num; i++)
+		if (l->list[i].state == ASKED && (deadline == 0 || l->list[i].deadline < deadline))
+			deadline = l->list[i].deadline;
+	if (deadline == 0)
+		return 0;
+	pfd.fd = l->sock;
+	pfd.events = POLLIN;
+	if (deadline > now && poll(&pfd, 1, (deadline - now + 999) / 1000) == 1
+			&& (n = recv(l->sock, msg, sizeof(msg), 0)) >= HEADER_SIZE && memcmp(msg, MAGIC, 4) == 0
+			&& msg[4] == expected) {
+		for (i = 0, x = NULL; i < l->num && x == NULL; i++)
+			if (l->list[i].state == ASKED && l->list[i].txid == get32(msg + 5))
+				x = &l->list[i];
+		if (x != NULL) {
+			x->state = ANSWERED;
+			if (x->depth > l->stats->hops)
+				l->stats->hops = x->depth;
+			seen(l->d, msg + 9, &x->c.addr);
+			if (expected == MSG_NODES)
+				add_nodes(l, msg + HEADER_SIZE, n - HEADER_SIZE, x->depth + 1);
+			else if (expected == MSG_VALUES && n > HEADER_SIZE
+					&& (size_t) n >= HEADER_SIZE + (values = 1 + msg[HEADER_SIZE] * OWNER_SIZE)) {
+				add_owners(l, msg + HEADER_SIZE);
+				add_nodes(l, msg + HEADER_SIZE + values, n - HEADER_SIZE - values, x->depth + 1);
+			}
+		}
+	}
+	now = now_usec();
+	for (i = 0; i < l->num; i++)
+		if (l->list[i].state == ASKED && l->list[i].deadline <= now) {
+			l->list[i].state = FAILED;
+			failed(l->d, l->list[i].c.id);
+			l->stats->timeouts++;
+		}
+	return x != NULL ? 2 : 1;
+}
+
+/* Every answer to the requests in flight, or their timeouts. Returns how many answered. */
+static int wait_answers(lookup *l, int expected) {
+	int	answered = 0,
+		ret;
+
+	while ((ret = receive(l, expected)) != 0)
+		answered += ret == 2;
+	return answered;
+}
+
+/*
+ * Keeps DHT_ALPHA requests in flight to the closest candidates not asked
+ * yet, among the DHT_K closest that didn't fail: a node that doesn't
+ * answer only holds its own place up. Over once they have all answered,
+ * or owners are found if they're asked for.
+ */
+static int lookup_run(lookup *l, dht *d, const unsigned char *target, int type, struct sockaddr_in *owners, int max,
+		dht_stats *stats) {
+	contact	start[DHT_K];
+	int		flying,
+			live,
+			num,
+			i;
+
+	memset(l, 0, sizeof(*l));
+	l->d = d;
+	l->type = type;
+	l->owners = owners;
+	l->max_owners = max;
+	l->stats = stats;
+	memcpy(l->target, target, DHT_ID_LEN);
+	if ((l->sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	num = closest(d, target, NULL, start, DHT_K);
+	for (i = 0; i < num; i++)
+		add_candidate(l, &start[i], 1);
+	while (l->owners == NULL || l->found == 0) {
+		for (flying = 0, i = 0; i < l->num; i++)
+			flying += l->list[i].state == ASKED;
+		for (live = 0, i = 0; i < l->num && live < DHT_K && flying < DHT_ALPHA; i++) {
+			if (l->list[i].state == FAILED)
+				continue;
+			live++;
+			if (l->list[i].state == NEW) {
+				send_request(l, &l->list[i], type, target, DHT_ID_LEN);
+				flying++;
+			}
+		}
+		if (receive(l, type == MSG_FIND_NODE ? MSG_NODES : MSG_VALUES) == 0)
+			break;
+	}
+	return 0;
+}
+
+/* An id b bits away from ours: it falls in bucket b */
+static void id_in_bucket(dht *d, int b, unsigned char *id) {
+	unsigned char	noise[DHT_ID_LEN];
+	int				byte = DHT_ID_LEN - 1 - b / 8,
+					mask = (1 << b % 8) - 1,
+					i;
+
+	if (getrandom(noise, DHT_ID_LEN, 0) != DHT_ID_LEN)
+		memset(noise, 0, DHT_ID_LEN);
+	memcpy(id, d->id, byte);
+	id[byte] = ((d->id[byte] ^ (mask + 1)) & ~mask) | (noise[byte] & mask);
+	for (i = byte + 1; i < DHT_ID_LEN; i++)
+		id[i] = noise[i];
+}
+
+/* The bucket of our closest contact, -1 if there's none */
+static int nearest_bucket(dht *d) {
+	int	b;
+
+	pthread_mutex_lock(&d->lock);
+	for (b = 0; b < BUCKETS && d->counts[b] == 0; b++)
+		;
+	pthread_mutex_unlock(&d->lock);
+	return b < BUCKETS ? b : -1;
+}
+
+/*
+ * Bootstrap is "IP:PORT;IP:PORT;..." of nodes already in the DHT. Then a
+ * lookup of our own id fills the table with our neighbours, and tells
+ * them about us; one in every bucket farther than them fills the rest.
+ * Returns the contacts known.
+ */
+int dht_join(dht *d, char *bootstrap) {
+	lookup			l;
+	dht_stats		stats;
+	unsigned char	none = 0,
+					target[DHT_ID_LEN];
+	char			list[1024],
+					ip[INET_ADDRSTRLEN],
+					*save,
+					*tok;
+	int				port,
+					b;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&l, 0, sizeof(l));
+	l.d = d;
+	l.stats = &stats;
+	if ((l.sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	snprintf(list, sizeof(list), "%s", bootstrap);
+	for (tok = strtok_r(list, "; ,", &save); tok != NULL && l.num < SHORTLIST; tok = strtok_r(NULL, "; ,", &save)) {
+		memset(&l.list[l.num], 0, sizeof(candidate));
+		l.list[l.num].c.addr.sin_family = AF_INET;
+		if (sscanf(tok, "%15[^:]:%d", ip, &port) != 2 || port <= 0 || port > 65535
+				|| inet_pton(AF_INET, ip, &l.list[l.num].c.addr.sin_addr) != 1) {
+			log_error("DHT: bad bootstrap address '%s'.", tok);
+			continue;
+		}
+		l.list[l.num].c.addr.sin_port = htons(port);
+		send_request(&l, &l.list[l.num++], MSG_PING, &none, 0);
+	}
+	/* Their ids come with the answers, seen() adds them */
+	wait_answers(&l, MSG_PONG);
+	close(l.sock);
+	if (lookup_run(&l, d, d->id, MSG_FIND_NODE, NULL, 0, &stats) == 0)
+		close(l.sock);
+	for (b = nearest_bucket(d) + 1; b > 0 && b < BUCKETS; b++) {
+		id_in_bucket(d, b, target);
+		if (lookup_run(&l, d, target, MSG_FIND_NODE, NULL, 0, &stats) == 0)
+			close(l.sock);
+	}
+	return dht_contacts(d);
+}
+
+/*
+ * Tells the DHT_K nodes closest to hash that we have it, to be fetched on
+ * port. Returns how many of them stored the record.
+ */
+int dht_announce(dht *d, const char *hash, unsigned short port, dht_stats *stats) {
+	lookup				l;
+	unsigned char		payload[DHT_ID_LEN + 2];
+	unsigned long long	start = now_usec();
+	int					stored,
+						asked = 0,
+						i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (key_of(hash, payload) == -1 || lookup_run(&l, d, payload, MSG_FIND_NODE, NULL, 0, stats) == -1)
+		return -1;
+	payload[DHT_ID_LEN] = port >> 8;
+	payload[DHT_ID_LEN + 1] = port & 0xff;
+	for (i = 0; i < l.num && asked < DHT_K; i++)
+		if (l.list[i].state == ANSWERED) {
+			send_request(&l, &l.list[i], MSG_STORE, payload, sizeof(payload));
+			asked++;
+		}
+	stored = wait_answers(&l, MSG_STORED);
+	close(l.sock);
+	stats->usec = now_usec() - start;
+	return stored;
+}
+
+/*
+ * Who has hash, up to max of them in owners: the address they announced
+ * it from and the port they gave. Returns how many were found.
+ */
+int dht_find(dht *d, const char *hash, struct sockaddr_in *owners, int max, dht_stats *stats) {
+	lookup				l;
+	unsigned char		key[DHT_ID_LEN];
+	unsigned long long	start = now_usec();
+	int					found;
+
+	memset(stats, 0, sizeof(*stats));
+	if (key_of(hash, key) == -1)
+		return -1;
+	/* We may be one of the nodes keeping it */
+	if ((found = get_values(d, key, owners, max)) > 0) {
+		stats->usec = now_usec() - start;
+		return found;
+	}
+	if (lookup_run(&l, d, key, MSG_FIND_VALUE, owners, max, stats) == -1)
+		return -1;
+	close(l.sock);
+	stats->usec = now_usec() - start;
+	return l.found;
+}
@@ -0,0 +1,48 @@
+/*
+ * Dht.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef DHT_H_
+#define DHT_H_
+
+#include <netinet/in.h> /* struct sockaddr_in */
+
+#define DHT_PORT 25547		/* UDP, next to PEER_PORT */
+#define DHT_ID_LEN 20		/* Node ids and keys live in the same space as SHA-1 hashes */
+#define DHT_K 8				/* Contacts per bucket, and nodes keeping each record */
+#define DHT_ALPHA 3			/* Requests in flight during a lookup */
+#define DHT_TIMEOUT 250		/* msec a node has to answer */
+#define DHT_MAX_OWNERS 16	/* Per answer, and records kept for a key */
+#define DHT_MAX_VALUES 65536	/* Records a node keeps for others, the soonest to expire go first */
+#define DHT_TTL 86400		/* Seconds a record lives without being announced again */
+#define DHT_REANNOUNCE (DHT_TTL / 4)	/* Seconds between a peer's announcements, records outlive a few missed ones */
+
+/*
+ * Kademlia: every peer is a node with a random id, records of who has a
+ * hash are kept by the DHT_K nodes whose ids are closest to it (XOR
+ * distance), and a lookup gets closer by about one bit per hop.
+ */
+typedef struct dht dht;
+
+/* What a lookup took */
+typedef struct dht_stats {
+	int					hops;		/* Rounds of requests */
+	int					rpcs;
+	int					timeouts;
+	unsigned long long	usec;
+} dht_stats;
+
+dht *dht_open(unsigned short);
+void dht_close(dht *);
+int dht_fd(dht *);
+unsigned short dht_port(dht *);
+int dht_contacts(dht *);
+int dht_records(dht *);
+int dht_handle(dht *);
+int dht_join(dht *, char *);
+int dht_announce(dht *, const char *, unsigned short, dht_stats *);
+int dht_find(dht *, const char *, struct sockaddr_in *, int, dht_stats *);
+
+#endif /* DHT_H_ */
@@ -0,0 +1,719 @@
+/*
+ ============================================================================
+ Name        : Engine.c
+ Author      : Giacomo Persichini
+ Description : io_uring transfers, many files moved by a single thread
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - free() */
+#include <string.h> /* memset() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* syscall() - close() - write() */
+#include <sys/mman.h> /* mmap() - munmap() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/uio.h> /* struct iovec */
+#include <sys/socket.h> /* MSG_WAITALL */
+#include <sys/syscall.h> /* __NR_io_uring_setup - __NR_io_uring_enter */
+#include <arpa/inet.h> /* htonl() - ntohl() - inet_ntop() */
+#include <linux/io_uring.h>
+
+#include "Engine.h"
+#include "Log.h"
+
+#define OP_READ 1	/* File read, linked to the send that follows it */
+#define OP_SEND 2
+#define OP_RECV 3
+#define OP_WRITE 4
+#define OP_TIMER 5	/* Tokens are due, the slot field is the timer's */
+#define OP_HEADER 6	/* A frame's header, then its payload */
+#define OP_BODY 7
+
+/*
+ * The rings are shared with the kernel: we fill submission entries and
+ * move the tail, the kernel moves the completion tail and we follow it.
+ */
+struct engine {
+	int					fd;
+	unsigned			*sq_head;
+	unsigned			*sq_tail;
+	unsigned			*sq_mask;
+	unsigned			*sq_array;
+	unsigned			*cq_head;
+	unsigned			*cq_tail;
+	unsigned			*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void				*sq_ring;
+	void				*cq_ring;
+	size_t				sq_ring_size;
+	size_t				cq_ring_size;
+	size_t				sqes_size;
+	unsigned			queued;		/* Entries not submitted yet */
+	char				*buffers;	/* One ENGINE_CHUNK per slot */
+	char				*frames;	/* One CODEC_FRAME_MAX per slot, for framed transfers */
+	int					fixed;		/* The buffers are registered with the kernel */
+	int					slots;
+	int					active;
+	transfer			**transfers;
+	unsigned long		syscalls;
+	shaper				*shaper;
+	transfer			*waiting;	/* Ready for their next chunk, out of tokens */
+	unsigned long long	vclock;		/* vtime of the last chunk sent, new transfers start here */
+	unsigned long long	deadlines[ENGINE_TIMERS];	/* 0 for the free ones */
+	struct __kernel_timespec	timeouts[ENGINE_TIMERS];
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(engine *e, unsigned submit, unsigned wait) {
+	int	ret;
+
+	e->syscalls++;
+	do
+		ret = (int) syscall(__NR_io_uring_enter, e->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+/*
+ * Returns NULL when io_uring can't be used (old kernel, seccomp, ...), the
+ * caller then falls back to the plain read/write loop.
+ */
+engine *engine_open(int slots) {
+	struct io_uring_params	p;
+	struct iovec			*iov;
+	engine					*e;
+	int						i;
+
+	if ((e = calloc(1, sizeof(engine))) == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	/* Two entries in flight per transfer at most: a read and its send */
+	if ((e->fd = ring_setup(slots * 2 + ENGINE_TIMERS, &p)) == -1) {
+		log_warn("io_uring isn't available (%s), transfers use read() and write().", strerror(errno));
+		free(e);
+		return NULL;
+	}
+	e->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	e->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	e->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	e->sq_ring = mmap(NULL, e->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->fd, IORING_OFF_SQ_RING);
+	e->cq_ring = mmap(NULL, e->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->fd, IORING_OFF_CQ_RING);
+	e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->fd, IORING_OFF_SQES);
+	e->slots = slots;
+	e->buffers = mmap(NULL, (size_t) slots * ENGINE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	/* Pages are only touched by compressed transfers */
+	e->frames = mmap(NULL, (size_t) slots * CODEC_FRAME_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	e->transfers = calloc(slots, sizeof(transfer *));
+	if (e->sq_ring == MAP_FAILED || e->cq_ring == MAP_FAILED || e->sqes == MAP_FAILED
+			|| e->buffers == MAP_FAILED || e->frames == MAP_FAILED || e->transfers == NULL) {
+		log_warn("Couldn't map the io_uring rings, transfers use read() and write().");
+		e->buffers = e->buffers == MAP_FAILED ? NULL : e->buffers;
+		e->frames = e->frames == MAP_FAILED ? NULL : e->frames;
+		e->sq_ring = e->sq_ring == MAP_FAILED ? NULL : e->sq_ring;
+		e->cq_ring = e->cq_ring == MAP_FAILED ? NULL : e->cq_ring;
+		e->sqes = e->sqes == MAP_FAILED ? NULL : e->sqes;
+		engine_close(e);
+		return NULL;
+	}
+	e->sq_head = (unsigned *) ((char *) e->sq_ring + p.sq_off.head);
+	e->sq_tail = (unsigned *) ((char *) e->sq_ring + p.sq_off.tail);
+	e->sq_mask = (unsigned *) ((char *) e->sq_ring + p.sq_off.ring_mask);
+	e->sq_array = (unsigned *) ((char *) e->sq_ring + p.sq_off.array);
+	e->cq_head = (unsigned *) ((char *) e->cq_ring + p.cq_off.head);
+	e->cq_tail = (unsigned *) ((char *) e->cq_ring + p.cq_off.tail);
+	e->cq_mask = (unsigned *) ((char *) e->cq_ring + p.cq_off.ring_mask);
+	e->cqes = (struct io_uring_cqe *) ((char *) e->cq_ring + p.cq_off.cqes);
+
+	/* Registered buffers are pinned once, not at every read and write */
+	if ((iov = calloc(slots, sizeof(struct iovec))) != NULL) {
+		for (i = 0; i < slots; i++) {
+			iov[i].iov_base = e->buffers + (size_t) i * ENGINE_CHUNK;
+			iov[i].iov_len = ENGINE_CHUNK;
+		}
+		e->fixed = syscall(__NR_io_uring_register, e->fd, IORING_REGISTER_BUFFERS, iov, slots) == 0;
+		if (!e->fixed)
+			log_debug("Couldn't register the transfer buffers (%s), using plain ones.", strerror(errno));
+		free(iov);
+	}
+	return e;
+}
+
+void engine_close(engine *e) {
+	if (e == NULL)
+		return;
+	if (e->sqes != NULL)
+		munmap(e->sqes, e->sqes_size);
+	if (e->cq_ring != NULL)
+		munmap(e->cq_ring, e->cq_ring_size);
+	if (e->sq_ring != NULL)
+		munmap(e->sq_ring, e->sq_ring_size);
+	if (e->buffers != NULL)
+		munmap(e->buffers, (size_t) e->slots * ENGINE_CHUNK);
+	if (e->frames != NULL)
+		munmap(e->frames, (size_t) e->slots * CODEC_FRAME_MAX);
+	free(e->transfers);
+	close(e->fd);
+	free(e);
+}
+
+/*
+ * Transfers started from now on are shaped: chunks wait for the tokens
+ * of the shaper, the peer and the transfer, and when several could go
+ * the one with the lowest bytes over weight does. The shaper stays the
+ * caller's, it must outlive the engine.
+ */
+void engine_shape(engine *e, shaper *s) {
+	e->shaper = shaper_limited(s) ? s : NULL;
+}
+
+/* Readable when there are completions, so it can go in a select() set */
+int engine_fd(engine *e) {
+	return e->fd;
+}
+
+int engine_active(engine *e) {
+	return e->active;
+}
+
+int engine_free_slots(engine *e) {
+	return e->slots - e->active;
+}
+
+/* io_uring_enter() calls so far, for the benchmarks */
+unsigned long engine_syscalls(engine *e) {
+	return e->syscalls;
+}
+
+static struct io_uring_sqe *next_sqe(engine *e) {
+	unsigned			tail = *e->sq_tail + e->queued,
+						index = tail & *e->sq_mask;
+	struct io_uring_sqe	*sqe = &e->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	e->sq_array[index] = index;
+	e->queued++;
+	return sqe;
+}
+
+static char *chunk_buffer(engine *e, transfer *t) {
+	return e->buffers + (size_t) t->slot * ENGINE_CHUNK;
+}
+
+static char *frame_buffer(engine *e, transfer *t) {
+	return e->frames + (size_t) t->slot * CODEC_FRAME_MAX;
+}
+
+static struct io_uring_sqe *queue_at(engine *e, int op, transfer *t, int opcode, int fd, char *addr, size_t len,
+		unsigned long long off) {
+	struct io_uring_sqe	*sqe = next_sqe(e);
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = ((unsigned long long) t->slot << 8) | op;
+	if (e->fixed && (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED))
+		sqe->buf_index = t->slot;
+	return sqe;
+}
+
+/* The chunk's buffer, from the first byte not moved yet */
+static struct io_uring_sqe *queue(engine *e, int op, transfer *t, int opcode, int fd, size_t len, unsigned long long off) {
+	return queue_at(e, op, t, opcode, fd, chunk_buffer(e, t) + t->moved, len, off);
+}
+
+/* What's left of the frame being sent, or of the chunk when raw */
+static void send_rest(engine *e, transfer *t) {
+	struct io_uring_sqe	*sqe;
+
+	if (t->encoding == ENCODING_RAW)
+		sqe = queue(e, OP_SEND, t, IORING_OP_SEND, t->sock, t->chunk - t->moved, 0);
+	else
+		sqe = queue_at(e, OP_SEND, t, IORING_OP_SEND, t->sock, frame_buffer(e, t) + t->moved, t->frame - t->moved, 0);
+	sqe->msg_flags = MSG_WAITALL;
+}
+
+/*
+ * Framed downloads read a frame's header, then its payload, both into
+ * the frame buffer; with the header's bytes counted in t->frame first.
+ */
+static void receive_header(engine *e, transfer *t) {
+	struct io_uring_sqe	*sqe;
+
+	sqe = queue_at(e, OP_HEADER, t, IORING_OP_RECV, t->sock, frame_buffer(e, t) + t->frame, CODEC_HEADER - t->frame, 0);
+	sqe->msg_flags = MSG_WAITALL;
+}
+
+static void receive_body(engine *e, transfer *t) {
+	struct io_uring_sqe	*sqe;
+
+	sqe = queue_at(e, OP_BODY, t, IORING_OP_RECV, t->sock, frame_buffer(e, t) + CODEC_HEADER + t->moved,
+			t->frame - t->moved, 0);
+	sqe->msg_flags = MSG_WAITALL;
+}
+
+/* Makes the queued entries visible to the kernel, it sees them at the next enter */
+static unsigned publish(engine *e) {
+	unsigned	n = e->queued;
+
+	__atomic_store_n(e->sq_tail, *e->sq_tail + n, __ATOMIC_RELEASE);
+	e->queued = 0;
+	return n;
+}
+
+/*
+ * A chunk is two linked entries: the second starts as soon as the first
+ * is done, without a trip back to us. MSG_WAITALL makes the socket side
+ * move the whole chunk, a short read breaks the link and we finish it.
+ * Only the second one tells us it's done, the first one only if it went
+ * wrong or came short.
+ */
+static void next_chunk(engine *e, transfer *t) {
+	struct io_uring_sqe	*sqe;
+
+	t->chunk = t->remaining < ENGINE_CHUNK ? t->remaining : ENGINE_CHUNK;
+	t->moved = 0;
+	if (t->encoding != ENCODING_RAW) {
+		if (t->upload) {
+			/* On its own: the chunk is packed before it's sent */
+			queue(e, OP_READ, t, e->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, t->file, t->chunk, t->offset);
+			return;
+		}
+		if (t->stored_left == 0) {
+			t->frame = 0;
+			receive_header(e, t);
+			return;
+		}
+		/* A stored frame's payload goes to the file like a raw chunk */
+		t->chunk = t->stored_left;
+	}
+	if (t->upload) {
+		sqe = queue(e, OP_READ, t, e->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, t->file, t->chunk, t->offset);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe = queue(e, OP_SEND, t, IORING_OP_SEND, t->sock, t->chunk, 0);
+		sqe->msg_flags = MSG_WAITALL;
+	}
+	else {
+		sqe = queue(e, OP_RECV, t, IORING_OP_RECV, t->sock, t->chunk, 0);
+		sqe->msg_flags = MSG_WAITALL;
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		queue(e, OP_WRITE, t, e->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, t->file, t->chunk, t->offset);
+	}
+}
+
+/*
+ * A timeout entry, so a thread waiting on the ring wakes up when the
+ * tokens are there. A timer due earlier is good enough.
+ */
+static void arm(engine *e, unsigned long long now, unsigned long long delay) {
+	struct io_uring_sqe	*sqe;
+	int					i,
+						free_timer = -1;
+
+	for (i = 0; i < ENGINE_TIMERS; i++) {
+		if (e->deadlines[i] == 0)
+			free_timer = i;
+		else if (e->deadlines[i] <= now + delay)
+			return;
+	}
+	if (free_timer == -1)
+		return;	/* The one due first brings us back here anyway */
+	e->deadlines[free_timer] = now + delay;
+	e->timeouts[free_timer].tv_sec = delay / 1000000;
+	e->timeouts[free_timer].tv_nsec = (delay % 1000000) * 1000;
+	sqe = next_sqe(e);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) &e->timeouts[free_timer];
+	sqe->len = 1;
+	sqe->user_data = ((unsigned long long) free_timer << 8) | OP_TIMER;
+}
+
+/*
+ * Sends the waiting transfers' chunks while every bucket involved has
+ * tokens, the lowest vtime first: over time each one gets a share of the
+ * bandwidth proportional to its weight.
+ */
+static void dispatch(engine *e) {
+	transfer			**pp,
+						**best,
+						*t;
+	unsigned long long	now,
+						wake,
+						d;
+	size_t				chunk;
+
+	if (e->shaper == NULL)
+		return;
+	now = shaper_now();
+	while (e->waiting != NULL) {
+		best = NULL;
+		if ((wake = bucket_delay(&e->shaper->global, now)) == 0) {
+			wake = ~0ULL;
+			for (pp = &e->waiting; (t = *pp) != NULL; pp = &t->next) {
+				if ((d = bucket_delay(t->peer, now)) == 0)
+					d = bucket_delay(&t->limit, now);
+				if (d > 0) {
+					wake = d < wake ? d : wake;
+					continue;
+				}
+				if (best == NULL || t->vtime < (*best)->vtime)
+					best = pp;
+			}
+		}
+		if (best == NULL) {
+			arm(e, now, wake);
+			return;
+		}
+		t = *best;
+		*best = t->next;
+		chunk = t->remaining < ENGINE_CHUNK ? t->remaining : ENGINE_CHUNK;
+		bucket_spend(&e->shaper->global, chunk);
+		bucket_spend(t->peer, chunk);
+		bucket_spend(&t->limit, chunk);
+		e->vclock = t->vtime;
+		t->vtime += (unsigned long long) chunk * SHAPER_MAX_WEIGHT / t->weight;
+		next_chunk(e, t);
+	}
+}
+
+/* Straight to the ring, or in line for tokens when shaping */
+static void advance(engine *e, transfer *t) {
+	if (e->shaper == NULL) {
+		next_chunk(e, t);
+		return;
+	}
+	t->next = e->waiting;
+	e->waiting = t;
+}
+
+/* The weight and the peer's bucket come from the address on the other side */
+static void shape(engine *e, transfer *t) {
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	char				ip[INET_ADDRSTRLEN] = "";
+
+	if (getpeername(t->sock, (struct sockaddr *) &addr, &len) == 0 && addr.sin_family == AF_INET)
+		inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+	if (t->weight <= 0)
+		t->weight = shaper_weight(e->shaper, ip);
+	else if (t->weight > SHAPER_MAX_WEIGHT)
+		t->weight = SHAPER_MAX_WEIGHT;
+	t->peer = shaper_peer(e->shaper, ip);
+	bucket_init(&t->limit, e->shaper->transfer_rate);
+	t->vtime = e->vclock;
+}
+
+static void finish(engine *e, transfer *t, int status) {
+	if (e->shaper != NULL) {
+		shaper_release(e->shaper, t->peer);
+		t->peer = NULL;
+	}
+	t->status = status;
+	if (status == ENGINE_DONE)
+		cache_finish(&t->cache);
+	e->transfers[t->slot] = NULL;
+	e->active--;
+	if (t->on_done != NULL)
+		t->on_done(t);
+}
+
+/* Takes a free slot and queues the first chunk. Returns -1 if they're all busy */
+int engine_start(engine *e, transfer *t) {
+	int	i;
+
+	if (e->active == e->slots)
+		return -1;
+	for (i = 0; e->transfers[i] != NULL; i++)
+		;
+	e->transfers[i] = t;
+	e->active++;
+	t->slot = i;
+	t->status = ENGINE_RUNNING;
+	t->done = 0;
+	if (e->shaper != NULL)
+		shape(e, t);
+	if (t->remaining == 0) {
+		finish(e, t, ENGINE_DONE);
+		return 0;
+	}
+	advance(e, t);
+	return 0;
+}
+
+/* A frame's header is in: a stored payload goes to the file, a packed one is read */
+static void frame_header(engine *e, transfer *t) {
+	long	payload;
+	int		is_stored;
+
+	if ((payload = codec_payload(frame_buffer(e, t), &is_stored)) <= 0 || (unsigned long long) payload > t->remaining) {
+		log_error("Received a broken frame.");
+		finish(e, t, ENGINE_FAILED);
+		return;
+	}
+	if (is_stored) {
+		t->stored_left = payload;
+		next_chunk(e, t);
+		return;
+	}
+	t->frame = payload;
+	t->moved = 0;
+	receive_body(e, t);
+}
+
+/* A packed payload is in, unpacked it's written like any chunk */
+static void frame_body(engine *e, transfer *t) {
+	long	len;
+
+	len = codec_unpack(frame_buffer(e, t) + CODEC_HEADER, t->frame, 0, chunk_buffer(e, t),
+			t->remaining < ENGINE_CHUNK ? t->remaining : ENGINE_CHUNK);
+	if (len <= 0) {
+		log_error("Received a frame that can't be unpacked.");
+		finish(e, t, ENGINE_FAILED);
+		return;
+	}
+	t->chunk = len;
+	t->moved = 0;
+	queue(e, OP_WRITE, t, e->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, t->file, t->chunk, t->offset);
+}
+
+/* One completion: the chunk moves on, or the next one starts */
+static void complete(engine *e, struct io_uring_cqe *cqe) {
+	transfer	*t;
+	int			op = cqe->user_data & 0xff,
+				res = cqe->res;
+	size_t		total;
+
+	if (op == OP_TIMER) {
+		e->deadlines[cqe->user_data >> 8] = 0;
+		return;	/* dispatch() sees what's due */
+	}
+	t = e->transfers[cqe->user_data >> 8];
+	if (t == NULL || t->status != ENGINE_RUNNING)
+		return;	/* The send linked to a read that failed */
+	switch (op) {
+	case OP_READ:
+	case OP_RECV:
+		if (res <= 0) {
+			finish(e, t, ENGINE_FAILED);
+			return;
+		}
+		/* A short read cancels the linked entry, it's queued again below */
+		t->chunk = res;
+		if (op == OP_READ && t->encoding != ENCODING_RAW) {
+			t->frame = codec_pack(&t->cd, chunk_buffer(e, t), res, frame_buffer(e, t));
+			send_rest(e, t);
+		}
+		return;
+	case OP_HEADER:
+	case OP_BODY:
+		if (res <= 0) {
+			finish(e, t, ENGINE_FAILED);
+			return;
+		}
+		if (op == OP_HEADER && (t->frame += res) < CODEC_HEADER)
+			receive_header(e, t);
+		else if (op == OP_HEADER)
+			frame_header(e, t);
+		else if ((t->moved += res) < t->frame)
+			receive_body(e, t);
+		else
+			frame_body(e, t);
+		return;
+	case OP_SEND:
+	case OP_WRITE:
+		if (res == -ECANCELED)
+			res = 0;
+		else if (res < 0) {
+			finish(e, t, ENGINE_FAILED);
+			return;
+		}
+		t->moved += res;
+		total = op == OP_SEND && t->encoding != ENCODING_RAW ? t->frame : t->chunk;
+		if (t->moved < total) {
+			/* The rest of this chunk, the socket or the disk took only a part */
+			if (op == OP_SEND)
+				send_rest(e, t);
+			else
+				queue(e, OP_WRITE, t, IORING_OP_WRITE, t->file, t->chunk - t->moved, t->offset + t->moved);
+			return;
+		}
+		if (t->stored_left > 0)
+			t->stored_left -= t->chunk;
+		t->offset += t->chunk;
+		t->remaining -= t->chunk;
+		t->done += t->chunk;
+		cache_advance(&t->cache, t->chunk);
+		if (t->on_progress != NULL)
+			t->on_progress(t->chunk);
+		if (op == OP_WRITE && t->on_data != NULL)
+			t->on_data(t, chunk_buffer(e, t), t->chunk);
+		if (t->remaining == 0)
+			finish(e, t, ENGINE_DONE);
+		else
+			advance(e, t);
+		return;
+	}
+}
+
+/* Every completion already posted, no system call needed */
+static int reap(engine *e) {
+	unsigned	head = *e->cq_head,
+				tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+	int			handled = 0;
+
+	while (head != tail) {
+		complete(e, &e->cqes[head & *e->cq_mask]);
+		head++;
+		handled++;
+		if (head == tail) {
+			__atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+			tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+	__atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+	return handled;
+}
+
+/*
+ * Handles every completion available and submits what they queued, all
+ * with a single system call. With wait set it blocks until something
+ * completes, and the follow-ups of the last batch go in with the next
+ * call: callers that wait call again until their transfers are over.
+ * Returns the number of completions handled, -1 on errors.
+ */
+int engine_run(engine *e, int wait) {
+	int	handled = reap(e),
+		waiting;
+
+	/* Chunks out of tokens arm a timer, so there's always something to wait for */
+	dispatch(e);
+	waiting = wait && handled == 0 && e->active > 0;
+	if (e->queued > 0 || waiting) {
+		if (ring_enter(e, publish(e), waiting) == -1) {
+			log_error("io_uring_enter() call failed: %s", strerror(errno));
+			return -1;
+		}
+		handled += reap(e);
+		dispatch(e);
+	}
+	/* Without wait the caller may not be back soon, so they go now */
+	if (!wait && e->queued > 0 && ring_enter(e, publish(e), 0) == -1) {
+		log_error("io_uring_enter() call failed: %s", strerror(errno));
+		return -1;
+	}
+	return handled;
+}
+
+/*
+ * Same as send_file(): the size goes on the connection first, then the
+ * engine sends the content. The file is closed by the caller when done.
+ * Chunks are linked to their send with their length set, a short one at
+ * the end included, which O_DIRECT won't read: large files drop the
+ * cache behind them instead, see cache_open(). The socket is written
+ * directly: with TLS, only if the kernel does it (tls_raw()).
+ */
+int engine_upload(engine *e, transfer *t, conn *c, char *filepath) {
+	struct stat	st;
+	int			ret;
+
+	if ((t->file = cache_open(&t->cache, filepath, O_RDONLY, 0, 0)) == -1)
+		return -1;
+	if (fstat(t->file, &st) == -1) {
+		close(t->file);
+		return -1;
+	}
+	if ((ret = engine_send(e, t, c, st.st_size, codec_choose(t->file, c->options & OPT_ZLIB))) != 0)
+		close(t->file);
+	return ret;
+}
+
+/*
+ * engine_upload() for a file the caller keeps open, in t->file with
+ * t->cache set: its encoding has been chosen already. The file is only
+ * read at offsets, several uploads may share it. Returns 0 or -2.
+ */
+int engine_send(engine *e, transfer *t, conn *c, unsigned long long size, int encoding) {
+	t->encoding = encoding;
+	memset(&t->cd, 0, sizeof(t->cd));
+	if (send_file_header(c, size, t->encoding) == -1 || conn_flush(c) == -1)
+		return -2;
+	t->sock = c->fd;
+	t->upload = 1;
+	t->offset = 0;
+	t->remaining = size;
+	if (engine_start(e, t) == -1)
+		return -2;
+	return 0;
+}
+
+/*
+ * Same as receive_file(). What the connection has already buffered is
+ * written here, the engine takes care of the rest. Like uploads, TLS
+ * needs the kernel to do it.
+ */
+int engine_download(engine *e, transfer *t, conn *c, char *filepath) {
+	unsigned long long	length = 0;
+	size_t				n;
+	long				got;
+	char				*p,
+						buffer[TRANSFER_CHUNK];
+
+	if ((t->encoding = read_file_header(c, &length)) == -1)
+		return -1;
+	t->file = cache_open(&t->cache, filepath, O_WRONLY | O_TRUNC | O_CREAT, length, 0);
+	if (t->file == -1) {
+		log_error("An error has occurred while opening the file: %s.", strerror(errno));
+		return -1;
+	}
+	t->offset = 0;
+	t->stored_left = 0;
+	if (t->encoding == ENCODING_RAW) {
+		n = conn_buffered(c) < length ? conn_buffered(c) : length;
+		p = conn_frame(c, n);
+		/* The connection has counted these bytes already */
+		if (n > 0 && cache_pwrite(&t->cache, p, n, 0) != (ssize_t) n) {
+			close(t->file);
+			return -1;
+		}
+		if (n > 0 && t->on_data != NULL)
+			t->on_data(t, p, n);
+		t->offset = n;
+	}
+	/* Frames already buffered, even partly, are finished here: the engine starts at the next one */
+	while (t->encoding != ENCODING_RAW && conn_buffered(c) > 0 && t->offset < length) {
+		if ((got = receive_frame(c, -1, t->offset, buffer, length - t->offset)) == -1
+				|| cache_pwrite(&t->cache, buffer, got, t->offset) != got) {
+			close(t->file);
+			return -1;
+		}
+		if (t->on_data != NULL)
+			t->on_data(t, buffer, got);
+		t->offset += got;
+	}
+	t->sock = c->fd;
+	t->upload = 0;
+	t->remaining = length - t->offset;
+	if (engine_start(e, t) == -1) {
+		close(t->file);
+		return -1;
+	}
+	return 0;
+}
+
+/* Runs the engine until t is over, other transfers move meanwhile */
+int engine_wait(engine *e, transfer *t) {
+	while (t->status == ENGINE_RUNNING)
+		if (engine_run(e, 1) == -1)
+			return ENGINE_FAILED;
+	/* The others' follow-ups mustn't wait for the next call */
+	engine_run(e, 0);
+	return t->status;
+}
@@ -0,0 +1,72 @@
+/*
+ * Engine.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stddef.h> /* size_t */
+
+#include "Conn.h"
+#include "Codec.h"
+#include "Shaper.h"
+#include "Cache.h"
+
+#define ENGINE_CHUNK 65536
+#define ENGINE_RUNNING 0
+#define ENGINE_DONE 1
+#define ENGINE_FAILED -1
+#define ENGINE_TIMERS 2	/* Wake-ups for transfers waiting on tokens, in flight at once */
+
+/*
+ * One file going to or coming from a socket. The engine moves it a chunk
+ * at a time and calls on_done once it's over, status tells how it went.
+ */
+typedef struct transfer {
+	int					sock;
+	int					file;
+	cache_file			cache;		/* file is its descriptor */
+	int					upload;		/* File to socket if set, socket to file otherwise */
+	int					status;
+	unsigned long long	offset;		/* Where the next chunk goes in the file */
+	unsigned long long	remaining;
+	unsigned long long	done;
+	size_t				chunk;		/* Bytes of the chunk in flight */
+	size_t				moved;		/* How many of them have been sent or written */
+	int					slot;
+	/* Framed transfers, see Codec.h */
+	int					encoding;
+	codec				cd;
+	size_t				frame;		/* Bytes of the frame in flight, header included */
+	size_t				stored_left;	/* Of a stored frame's payload, still to receive */
+	/* Shaping, when the engine has a shaper */
+	int					weight;		/* Share against the others, the remote peer's by default */
+	bucket				*peer;		/* Shared with the other transfers to the same peer */
+	bucket				limit;		/* This transfer's own */
+	unsigned long long	vtime;		/* Bytes moved over weight, the lowest goes next */
+	struct transfer		*next;		/* Waiting for tokens */
+	void				(*on_progress)(size_t);
+	/* Downloads: each chunk once it's in the file, before the next one takes its buffer */
+	void				(*on_data)(struct transfer *, const char *, size_t);
+	void				(*on_done)(struct transfer *);
+} transfer;
+
+typedef struct engine engine;
+
+engine *engine_open(int);
+void engine_close(engine *);
+void engine_shape(engine *, shaper *);
+int engine_fd(engine *);
+int engine_active(engine *);
+int engine_free_slots(engine *);
+unsigned long engine_syscalls(engine *);
+int engine_start(engine *, transfer *);
+int engine_run(engine *, int);
+int engine_upload(engine *, transfer *, conn *, char *);
+int engine_send(engine *, transfer *, conn *, unsigned long long, int);
+int engine_download(engine *, transfer *, conn *, char *);
+int engine_wait(engine *, transfer *);
+
+#endif /* ENGINE_H_ */
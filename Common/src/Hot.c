@@ -0,0 +1,343 @@
+/*
+ ============================================================================
+ Name        : Hot.c
+ Author      : Giacomo Persichini
+ Description : The files served most, kept open and small ones in memory
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - malloc() - realloc() - free() */
+#include <string.h> /* strcmp() - strcpy() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* pread() - close() */
+#include <sys/stat.h> /* fstat() - S_ISREG() */
+
+#include "Hot.h"
+#include "Config.h"
+
+/* FNV-1a, hashes are spread well enough already */
+static unsigned int bucket_of(hot_cache *h, const char *hash) {
+	unsigned int	x = 2166136261U;
+
+	while (*hash != '\0')
+		x = (x ^ (unsigned char) *hash++) * 16777619U;
+	return x & h->mask;
+}
+
+/*
+ * At most max_fds files open, budget bytes of contents in memory, from
+ * files of file_max bytes or less. NULL if max_fds is 0 or there's no
+ * memory.
+ */
+hot_cache *hot_open(size_t budget, size_t file_max, int max_fds) {
+	hot_cache		*h;
+	unsigned int	size = 1;
+
+	if (max_fds <= 0 || (h = calloc(1, sizeof(hot_cache))) == NULL)
+		return NULL;
+	while (size < 2 * (unsigned int) max_fds)
+		size <<= 1;
+	if ((h->buckets = calloc(size, sizeof(hot_entry *))) == NULL) {
+		free(h);
+		return NULL;
+	}
+	h->mask = size - 1;
+	h->max_fds = max_fds;
+	h->budget = budget;
+	h->file_max = file_max;
+	pthread_mutex_init(&h->lock, NULL);
+	return h;
+}
+
+/* hot_open() from the config: hot-cache (MB), hot-file-max (KB) and hot-fds */
+hot_cache *hot_setup() {
+	long	budget = i_read_config_default("hot-cache", HOT_CACHE),
+			file_max = i_read_config_default("hot-file-max", HOT_FILE_MAX);
+
+	return hot_open(budget > 0 ? (size_t) budget << 20 : 0, file_max > 0 ? (size_t) file_max << 10 : 0,
+			i_read_config_default("hot-fds", HOT_FDS));
+}
+
+static void unlink_used(hot_cache *h, hot_entry *e) {
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		h->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		h->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void push_used(hot_cache *h, hot_entry *e) {
+	e->prev = NULL;
+	e->next = h->head;
+	if (h->head != NULL)
+		h->head->prev = e;
+	else
+		h->tail = e;
+	h->head = e;
+}
+
+static void free_images(hot_cache *h, hot_entry *e) {
+	int	i;
+
+	for (i = 0; i < 2; i++) {
+		h->bytes -= e->image_len[i];
+		free(e->image[i]);
+		e->image[i] = NULL;
+		e->image_len[i] = 0;
+	}
+}
+
+static void destroy(hot_cache *h, hot_entry *e) {
+	free_images(h, e);
+	close(e->fd);
+	free(e);
+}
+
+/* Out of the table: freed now, or once the last upload using it lets go */
+static void drop(hot_cache *h, hot_entry *e) {
+	hot_entry	**p = &h->buckets[bucket_of(h, e->hash)];
+
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	unlink_used(h, e);
+	h->num--;
+	if (e->pins > 0)
+		e->dropped = 1;
+	else
+		destroy(h, e);
+}
+
+static hot_entry *find(hot_cache *h, char *hash) {
+	hot_entry	*e;
+
+	for (e = h->buckets[bucket_of(h, hash)]; e != NULL; e = e->chain)
+		if (strcmp(e->hash, hash) == 0)
+			return e;
+	return NULL;
+}
+
+/* The least recently used that nothing is using goes, until there are max_fds files open */
+static void trim(hot_cache *h) {
+	hot_entry	*e,
+				*prev;
+
+	for (e = h->tail; e != NULL && h->num > h->max_fds; e = prev) {
+		prev = e->prev;
+		if (e->pins == 0) {
+			drop(h, e);
+			h->evicted++;
+		}
+	}
+}
+
+/* e is asked for again, with h->lock held */
+static void hit(hot_cache *h, hot_entry *e) {
+	h->hits++;
+	e->requests++;
+	e->pins++;
+	unlink_used(h, e);
+	push_used(h, e);
+}
+
+/*
+ * The file with hash, at path if it has to be opened. It stays open
+ * until hot_release(), whatever happens to the cache meanwhile. NULL if
+ * it can't be opened or isn't a regular file.
+ */
+hot_entry *hot_get(hot_cache *h, char *hash, char *path) {
+	hot_entry	*e,
+				*x;
+	struct stat	st;
+	int			fd;
+
+	pthread_mutex_lock(&h->lock);
+	if ((e = find(h, hash)) != NULL) {
+		hit(h, e);
+		pthread_mutex_unlock(&h->lock);
+		return e;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (e = calloc(1, sizeof(hot_entry))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	strcpy(e->hash, hash);
+	e->fd = fd;
+	e->size = st.st_size;
+	e->requests = 1;
+	e->pins = 1;
+	e->encoding[0] = e->encoding[1] = -1;
+
+	pthread_mutex_lock(&h->lock);
+	/* Another upload opened it meanwhile: one entry per file, this one goes */
+	if ((x = find(h, hash)) != NULL) {
+		hit(h, x);
+		pthread_mutex_unlock(&h->lock);
+		close(fd);
+		free(e);
+		return x;
+	}
+	h->misses++;
+	e->chain = h->buckets[bucket_of(h, hash)];
+	h->buckets[bucket_of(h, hash)] = e;
+	push_used(h, e);
+	h->num++;
+	trim(h);
+	pthread_mutex_unlock(&h->lock);
+	return e;
+}
+
+/*
+ * The encoding to send e with, zlib allowed or not: codec_choose() the
+ * first time, without the lock since it reads the file. Uploads choosing
+ * at once get the same, the first one kept.
+ */
+int hot_encoding(hot_cache *h, hot_entry *e, int zlib) {
+	int	encoding;
+
+	zlib = zlib != 0;
+	pthread_mutex_lock(&h->lock);
+	encoding = e->encoding[zlib];
+	pthread_mutex_unlock(&h->lock);
+	if (encoding != -1)
+		return encoding;
+	encoding = codec_choose(e->fd, zlib);
+	pthread_mutex_lock(&h->lock);
+	if (e->encoding[zlib] == -1)
+		e->encoding[zlib] = encoding;
+	else
+		encoding = e->encoding[zlib];
+	pthread_mutex_unlock(&h->lock);
+	return encoding;
+}
+
+/* Header and content of e as they go on the wire, in len. NULL if it can't be read */
+static char *build_image(hot_entry *e, int encoding, size_t *len) {
+	char				*raw = malloc(e->size > 0 ? e->size : 1),
+						*image = NULL,
+						*tmp;
+	unsigned long long	got;
+	ssize_t				n;
+	size_t				chunk;
+	codec				cd = { 0, 0 };
+
+	for (got = 0; raw != NULL && got < e->size; got += n)
+		if ((n = pread(e->fd, raw + got, e->size - got, got)) <= 0)
+			break;
+	if (raw == NULL || got < e->size)
+		goto out;
+	if (encoding == ENCODING_RAW) {
+		if ((image = malloc(FILE_HEADER_SIZE + e->size)) == NULL)
+			goto out;
+		memcpy(image + FILE_HEADER_SIZE, raw, e->size);
+		*len = FILE_HEADER_SIZE + e->size;
+	}
+	else {
+		if ((image = malloc(FILE_HEADER_SIZE + (e->size / TRANSFER_CHUNK + 1) * CODEC_FRAME_MAX)) == NULL)
+			goto out;
+		for (*len = FILE_HEADER_SIZE, got = 0; got < e->size; got += chunk) {
+			chunk = e->size - got < TRANSFER_CHUNK ? e->size - got : TRANSFER_CHUNK;
+			*len += codec_pack(&cd, raw + got, chunk, image + *len);
+		}
+		if ((tmp = realloc(image, *len)) != NULL)
+			image = tmp;
+	}
+	pack_file_header(image, e->size, encoding);
+out:
+	free(raw);
+	return image;
+}
+
+/*
+ * What to send for e, header included, when it's kept in memory: built
+ * the second time the file is asked for, if it's small enough. Contents
+ * of the least recently used files nothing is using make room. NULL if
+ * it's not kept, the file has to be sent from its descriptor.
+ */
+char *hot_image(hot_cache *h, hot_entry *e, int zlib, size_t *len) {
+	hot_entry		*x;
+	char			*image;
+	size_t			built;
+	unsigned long	requests;
+	int				encoding = hot_encoding(h, e, zlib);
+
+	pthread_mutex_lock(&h->lock);
+	if ((image = e->image[encoding]) != NULL) {
+		h->memory++;
+		*len = e->image_len[encoding];
+		pthread_mutex_unlock(&h->lock);
+		return image;
+	}
+	requests = e->requests;
+	pthread_mutex_unlock(&h->lock);
+	if (requests < 2 || e->size > h->file_max || (image = build_image(e, encoding, &built)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&h->lock);
+	for (x = h->tail; x != NULL && h->bytes + built > h->budget; x = x->prev)
+		if (x != e && x->pins == 0)
+			free_images(h, x);
+	if (h->bytes + built > h->budget || e->dropped || e->image[encoding] != NULL) {
+		pthread_mutex_unlock(&h->lock);
+		free(image);
+		return NULL;
+	}
+	e->image[encoding] = image;
+	e->image_len[encoding] = built;
+	h->bytes += built;
+	h->memory++;
+	*len = built;
+	pthread_mutex_unlock(&h->lock);
+	return image;
+}
+
+void hot_release(hot_cache *h, hot_entry *e) {
+	pthread_mutex_lock(&h->lock);
+	if (--e->pins == 0 && e->dropped)
+		destroy(h, e);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* Forgets every file, when the shared ones may have changed */
+void hot_clear(hot_cache *h) {
+	pthread_mutex_lock(&h->lock);
+	while (h->head != NULL)
+		drop(h, h->head);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* "name value" lines, like the peer's other stats */
+int hot_format(hot_cache *h, char *out, int size) {
+	int	len;
+
+	pthread_mutex_lock(&h->lock);
+	len = snprintf(out, size,
+			"hot_files %d\n"
+			"hot_bytes %zu\n"
+			"hot_hits %llu\n"
+			"hot_misses %llu\n"
+			"hot_memory %llu\n"
+			"hot_evicted %llu\n",
+			h->num, h->bytes, h->hits, h->misses, h->memory, h->evicted);
+	pthread_mutex_unlock(&h->lock);
+	return len < size ? len : size;
+}
+
+/* Nothing may be using it anymore */
+void hot_close(hot_cache *h) {
+	if (h == NULL)
+		return;
+	hot_clear(h);
+	pthread_mutex_destroy(&h->lock);
+	free(h->buckets);
+	free(h);
+}
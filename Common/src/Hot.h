@@ -0,0 +1,71 @@
+/*
+ * Hot.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef HOT_H_
+#define HOT_H_
+
+#include <stddef.h> /* size_t */
+#include <pthread.h> /* pthread_mutex_t */
+
+#include "Protocol.h"
+#include "Codec.h"
+
+/*
+ * The files a peer serves most, by hash: kept open with their size and
+ * the encoding chosen for them, so that uploading one again opens and
+ * samples nothing. Files of hot-file-max or less asked for more than
+ * once are also kept whole in memory the way they go on the wire,
+ * header included, up to hot-cache bytes for all of them. The least
+ * recently used go first, descriptors past hot-fds and contents past
+ * the budget. Descriptors stay below FD_SETSIZE with the default.
+ */
+#define HOT_CACHE 64		/* MB of contents in memory, 0 for none */
+#define HOT_FILE_MAX 64		/* KB, larger files only stay open */
+#define HOT_FDS 256			/* Files kept open, 0 turns the cache off */
+
+typedef struct hot_entry {
+	char				hash[HASH_LEN + 1];
+	int					fd;
+	unsigned long long	size;
+	unsigned long		requests;
+	int					encoding[2];	/* Chosen without and with zlib allowed, -1 until it's known */
+	char				*image[2];		/* What's sent, by encoding, NULL until it's kept */
+	size_t				image_len[2];
+	int					pins;			/* Uploads still using it */
+	int					dropped;		/* Out of the cache, freed at the last hot_release() */
+	struct hot_entry	*prev;			/* The most recently used first */
+	struct hot_entry	*next;
+	struct hot_entry	*chain;			/* Same bucket */
+} hot_entry;
+
+typedef struct hot_cache {
+	hot_entry			**buckets;
+	unsigned int		mask;
+	hot_entry			*head;
+	hot_entry			*tail;
+	int					num;
+	int					max_fds;
+	size_t				bytes;			/* In images */
+	size_t				budget;
+	size_t				file_max;
+	unsigned long long	hits;			/* Found open */
+	unsigned long long	misses;			/* Opened */
+	unsigned long long	memory;			/* Sent from memory */
+	unsigned long long	evicted;
+	pthread_mutex_t		lock;
+} hot_cache;
+
+hot_cache *hot_open(size_t, size_t, int);
+hot_cache *hot_setup();
+hot_entry *hot_get(hot_cache *, char *, char *);
+int hot_encoding(hot_cache *, hot_entry *, int);
+char *hot_image(hot_cache *, hot_entry *, int, size_t *);
+void hot_release(hot_cache *, hot_entry *);
+void hot_clear(hot_cache *);
+int hot_format(hot_cache *, char *, int);
+void hot_close(hot_cache *);
+
+#endif /* HOT_H_ */
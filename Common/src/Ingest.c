@@ -0,0 +1,106 @@
+/*
+ ============================================================================
+ Name        : Ingest.c
+ Author      : Giacomo Persichini
+ Description : A hash list read, checked and decoded in one go
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - calloc() - free() */
+#include <string.h> /* memset() - memcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* close() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/mman.h> /* mmap() - munmap() - madvise() */
+
+#include "Ingest.h"
+
+/*
+ * Every hash of the records decoded and checked, the files listed more
+ * than once kept the first time. Returns LIST_MALFORMED at the first bad
+ * one, -1 if there's no memory.
+ */
+int list_parse(hash_list *list, hash_record *records, long num) {
+	unsigned int	*slots,
+					size = 1024,
+					h,
+					i;
+	long			r;
+
+	list->records = records;
+	list->num = num;
+	list->num_kept = 0;
+	list->bad = -1;
+	while (size < 2 * num)
+		size *= 2;
+	list->digests = malloc((num > 0 ? num : 1) * sizeof(*list->digests));
+	list->kept = malloc((num > 0 ? num : 1) * sizeof(unsigned int));
+	/* Which digests were seen, open addressing on their index + 1 */
+	slots = calloc(size, sizeof(unsigned int));
+	if (list->digests == NULL || list->kept == NULL || slots == NULL) {
+		free(slots);
+		return -1;
+	}
+
+	for (r = 0; r < num; r++) {
+		if (records[r].hash[HASH_LEN] != '\0' || hash_digest(records[r].hash, list->digests[list->num_kept]) == -1) {
+			list->bad = r;
+			free(slots);
+			return LIST_MALFORMED;
+		}
+		memcpy(&h, list->digests[list->num_kept], sizeof(h));
+		for (i = h & (size - 1); slots[i] != 0; i = (i + 1) & (size - 1))
+			if (memcmp(list->digests[slots[i] - 1], list->digests[list->num_kept], DIGEST_LEN) == 0)
+				break;
+		if (slots[i] != 0)
+			continue;
+		slots[i] = list->num_kept + 1;
+		list->kept[list->num_kept++] = r;
+	}
+	free(slots);
+	return 0;
+}
+
+/*
+ * The list at path, mapped rather than read a record at a time. Returns
+ * LIST_MALFORMED if it isn't a list, -1 if it can't be read. list_free()
+ * it either way.
+ */
+int list_load(hash_list *list, char *path) {
+	struct stat	st;
+	int			fd;
+
+	memset(list, 0, sizeof(hash_list));
+	list->bad = -1;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size % sizeof(hash_record) != 0) {
+		close(fd);
+		return LIST_MALFORMED;
+	}
+	if (st.st_size > 0) {
+		list->records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (list->records == MAP_FAILED) {
+			list->records = NULL;
+			close(fd);
+			return -1;
+		}
+		list->size = st.st_size;
+		madvise(list->records, list->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return list_parse(list, list->records, st.st_size / sizeof(hash_record));
+}
+
+void list_free(hash_list *list) {
+	if (list->size > 0)
+		munmap(list->records, list->size);
+	free(list->digests);
+	free(list->kept);
+	memset(list, 0, sizeof(hash_list));
+}
@@ -0,0 +1,35 @@
+/*
+ * Ingest.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef INGEST_H_
+#define INGEST_H_
+
+#include <stddef.h> /* size_t */
+
+#include "Protocol.h"
+
+#define LIST_MALFORMED -2	/* Not whole records, or a hash that isn't 40 hex digits */
+#define LIST_RECORDS_MAX 100000	/* Files a peer may list unless max-list-records says, more is turned down before it's written */
+
+/*
+ * A peer's hash list, checked whole before anything in it is indexed.
+ * Every hash is decoded once, a file listed twice is kept the first time.
+ */
+typedef struct hash_list {
+	hash_record		*records;	/* The list file, mapped */
+	size_t			size;
+	long			num;		/* Records */
+	unsigned char	(*digests)[DIGEST_LEN];	/* Of the records kept, in their order */
+	unsigned int	*kept;		/* The record each digest is of */
+	long			num_kept;
+	long			bad;		/* The first malformed record, -1 if none */
+} hash_list;
+
+int list_load(hash_list *, char *);
+int list_parse(hash_list *, hash_record *, long);
+void list_free(hash_list *);
+
+#endif /* INGEST_H_ */
@@ -0,0 +1,222 @@
+/*
+ ============================================================================
+ Name        : Log.c
+ Author      : Giacomo Persichini
+ Description : Asynchronous logger, sockets never wait for the terminal
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdarg.h> /* va_list */
+#include <string.h> /* strcmp() - memcpy() */
+#include <strings.h> /* strcasecmp() */
+#include <time.h> /* clock_gettime() - nanosleep() - gmtime_r() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* write() - close() */
+#include <pthread.h> /* stuff with threads */
+
+#include "Log.h"
+
+/*
+ * Bounded multi-producer queue: every slot carries a sequence number that
+ * tells producers and the flusher whose turn it is, so claiming a slot is
+ * a single compare-and-swap and nobody ever waits on a lock.
+ */
+typedef struct log_slot {
+	unsigned long	seq;
+	long			sec;
+	long			nsec;
+	int				level;
+	char			msg[LOG_MSG_SIZE];
+} log_slot;
+
+static log_slot			ring[LOG_RING_SIZE];
+static unsigned long	tail,		/* Next slot to claim, shared by producers */
+						head,		/* Next slot to flush, flusher only */
+						dropped;
+static int				level = LOG_INFO,
+						format = LOG_TEXT,
+						out = 2,
+						running = 0,
+						stopping = 0;
+static pthread_t		flusher;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static int format_slot(char *buffer, int size, log_slot *slot) {
+	struct tm	tm;
+	time_t		sec = slot->sec;
+	char		*p;
+	int			len;
+
+	gmtime_r(&sec, &tm);
+	if (format == LOG_TEXT)
+		return snprintf(buffer, size, "%02d:%02d:%02d.%03ld [%s] %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+				slot->nsec / 1000000, level_names[slot->level], slot->msg);
+
+	len = snprintf(buffer, size, "{\"ts\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ\",\"level\":\"%s\",\"msg\":\"",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+			slot->nsec / 1000, level_names[slot->level]);
+	/* Quotes, backslashes and control characters have to be escaped */
+	for (p = slot->msg; *p != '\0' && len < size - 8; p++) {
+		if (*p == '"' || *p == '\\') {
+			buffer[len++] = '\\';
+			buffer[len++] = *p;
+		}
+		else if ((unsigned char) *p < 0x20)
+			len += snprintf(buffer + len, size - len, "\\u%04x", *p);
+		else
+			buffer[len++] = *p;
+	}
+	len += snprintf(buffer + len, size - len, "\"}\n");
+	return len;
+}
+
+/* Takes every message currently in the ring and writes it with one syscall */
+static int drain(char *buffer) {
+	log_slot		*slot;
+	unsigned long	seq;
+	int				len = 0,
+					num = 0;
+
+	while (1) {
+		slot = &ring[head & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != head + 1)
+			break;	/* Empty, or the producer has not finished yet */
+		if (len > LOG_FLUSH_SIZE - LOG_MSG_SIZE * 2) {
+			write(out, buffer, len);
+			len = 0;
+		}
+		len += format_slot(buffer + len, LOG_FLUSH_SIZE - len, slot);
+		/* Give the slot back to producers, one lap later */
+		__atomic_store_n(&slot->seq, head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		head++;
+		num++;
+	}
+	if (len > 0)
+		write(out, buffer, len);
+	return num;
+}
+
+static void *flush_loop(void *arg) {
+	static char		buffer[LOG_FLUSH_SIZE];
+	struct timespec	pause = { 0, 2000000 };
+
+	(void) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+		if (drain(buffer) == 0)
+			nanosleep(&pause, NULL);
+	drain(buffer);
+	return NULL;
+}
+
+/*
+ * Starts the flusher. Messages go to path, or to default_fd when path is
+ * empty or "-".
+ */
+int log_init(int lvl, int fmt, char *path, int default_fd) {
+	unsigned long	i;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq = i;
+	head = tail = dropped = 0;
+	level = lvl;
+	format = fmt;
+	out = default_fd;
+	if (path != NULL && path[0] != '\0' && strcmp(path, "-") != 0) {
+		if ((out = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+			perror("[ERROR] Couldn't open the log file");
+			out = default_fd;
+		}
+	}
+	stopping = 0;
+	if (pthread_create(&flusher, NULL, flush_loop, NULL) != 0) {
+		perror("[ERROR] Couldn't start the log thread");
+		return -1;
+	}
+	running = 1;
+	return 0;
+}
+
+/* Writes whatever is left and stops the flusher */
+void log_shutdown() {
+	if (!running)
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(flusher, NULL);
+	running = 0;
+	if (out > 2)
+		close(out);
+}
+
+int log_enabled(int lvl) {
+	return lvl >= level;
+}
+
+void log_write(int lvl, const char *fmt, ...) {
+	log_slot		*slot;
+	unsigned long	pos,
+					seq;
+	struct timespec	ts;
+	va_list			args;
+	char			line[LOG_MSG_SIZE + 16];
+
+	if (lvl < level || lvl >= LOG_OFF)
+		return;
+
+	/* Before log_init() there is nobody to flush, just write it */
+	if (!running) {
+		va_start(args, fmt);
+		vsnprintf(line, LOG_MSG_SIZE, fmt, args);
+		va_end(args);
+		fprintf(stderr, "[%s] %s\n", level_names[lvl], line);
+		return;
+	}
+
+	pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;	/* The slot is ours */
+		}
+		else if ((long) (seq - pos) < 0) {
+			/* The ring is full: losing a line is better than stalling a socket */
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot->sec = ts.tv_sec;
+	slot->nsec = ts.tv_nsec;
+	slot->level = lvl;
+	va_start(args, fmt);
+	vsnprintf(slot->msg, LOG_MSG_SIZE, fmt, args);
+	va_end(args);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+int log_level_parse(char *name) {
+	if (strcasecmp(name, "debug") == 0)
+		return LOG_DEBUG;
+	if (strcasecmp(name, "warn") == 0)
+		return LOG_WARN;
+	if (strcasecmp(name, "error") == 0)
+		return LOG_ERROR;
+	if (strcasecmp(name, "off") == 0)
+		return LOG_OFF;
+	return LOG_INFO;
+}
+
+int log_format_parse(char *name) {
+	return strcasecmp(name, "json") == 0 ? LOG_JSON : LOG_TEXT;
+}
+
+unsigned long log_dropped() {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
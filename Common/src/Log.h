@@ -0,0 +1,36 @@
+/*
+ * Log.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#define LOG_RING_SIZE 4096	/* Must be a power of two */
+#define LOG_MSG_SIZE 240
+#define LOG_FLUSH_SIZE 65536
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_OFF 4
+
+#define LOG_TEXT 0
+#define LOG_JSON 1
+
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+int log_init(int, int, char *, int);
+void log_shutdown();
+void log_write(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+int log_enabled(int);
+int log_level_parse(char *);
+int log_format_parse(char *);
+unsigned long log_dropped();
+
+#endif /* LOG_H_ */
@@ -0,0 +1,570 @@
+/*
+ ============================================================================
+ Name        : Owners.c
+ Author      : Giacomo Persichini
+ Description : Who has each file, in a few tens of bytes per owner
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - realloc() - free() */
+#include <string.h> /* memcpy() - memmove() - memcmp() */
+
+#include "Owners.h"
+
+#define LIST 0x80000000U	/* A file's owners are the list at the index in the rest */
+#define NONE 0xffffffffU	/* No file, no list */
+#define SLOTS_FIRST 1024
+#define CHUNK_FIRST 256		/* Bytes of a peer's first chunk, then twice as many each */
+#define CHUNK_MAX 65536
+#define VARINT_MAX 5
+
+typedef struct owner_file {
+	unsigned char	digest[DIGEST_LEN];	/* While free: the next free id + 1, in the first bytes */
+	unsigned int	owners;		/* The peer's id + 1, LIST | the list's index, 0 if free */
+} owner_file;
+
+/* Ascending peer ids */
+typedef struct owner_list {
+	unsigned int	num;
+	unsigned int	len;
+	unsigned int	size;
+	unsigned char	bytes[];
+} owner_list;
+
+/* File ids, each a varint of the zigzagged difference with the one before */
+typedef struct owner_chunk {
+	struct owner_chunk	*next;
+	unsigned int		len;
+	unsigned int		size;
+	unsigned char		bytes[];
+} owner_chunk;
+
+typedef struct owner_peer {
+	char			ip[INET_ADDRSTRLEN];	/* "" if the id is free */
+	owner_chunk		*first;
+	owner_chunk		*last;
+	unsigned int	last_file;
+	long			entries;
+} owner_peer;
+
+struct owner_index {
+	owner_file			*files;		/* By id */
+	unsigned int		num_files;	/* Ids given, free ones too */
+	unsigned int		size_files;
+	unsigned int		free_file;	/* Id + 1 of a free one, 0 if none */
+	unsigned int		*slots;		/* Open addressing, linear probing, file id + 1 */
+	unsigned int		mask;
+	unsigned int		used;
+	owner_list			**lists;
+	unsigned int		num_lists;
+	unsigned int		size_lists;
+	unsigned int		*free_lists;
+	unsigned int		num_free_lists;
+	unsigned int		size_free_lists;
+	owner_peer			*peers;		/* By id, the lowest free one is given first */
+	unsigned int		num_peers;
+	unsigned int		size_peers;
+	unsigned int		last_peer;	/* Lists come one record after the other */
+	long				entries;
+	unsigned long long	list_bytes;
+	unsigned long long	chunk_bytes;
+};
+
+static int grow(void **array, unsigned int *size, size_t item, unsigned int first) {
+	unsigned int	bigger = *size ? *size * 2 : first;
+	void			*p = realloc(*array, bigger * item);
+
+	if (p == NULL)
+		return -1;
+	*array = p;
+	*size = bigger;
+	return 0;
+}
+
+static unsigned int put_varint(unsigned char *p, unsigned int v) {
+	unsigned int	n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static unsigned int get_varint(const unsigned char *p, unsigned int *v) {
+	unsigned int	n = 0,
+					shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (p[n] & 0x7fU) << shift;
+		shift += 7;
+	} while (p[n++] & 0x80);
+	return n;
+}
+
+static unsigned int home(owner_index *o, const unsigned char *digest) {
+	unsigned int	h;
+
+	memcpy(&h, digest, sizeof(h));
+	return h & o->mask;
+}
+
+/* The file's slot, or the empty one it would go in */
+static unsigned int slot_of(owner_index *o, const unsigned char *digest) {
+	unsigned int	i,
+					id;
+
+	for (i = home(o, digest); (id = o->slots[i]) != 0; i = (i + 1) & o->mask)
+		if (memcmp(o->files[id - 1].digest, digest, DIGEST_LEN) == 0)
+			break;
+	return i;
+}
+
+static int rehash(owner_index *o) {
+	unsigned int	*old = o->slots,
+					size = o->mask + 1,
+					i;
+
+	if ((o->slots = calloc(size * 2, sizeof(unsigned int))) == NULL) {
+		o->slots = old;
+		return -1;
+	}
+	o->mask = size * 2 - 1;
+	for (i = 0; i < size; i++)
+		if (old[i] != 0)
+			o->slots[slot_of(o, o->files[old[i] - 1].digest)] = old[i];
+	free(old);
+	return 0;
+}
+
+/* Out of the table: the files after it in the run move back, no tombstones */
+static void unslot(owner_index *o, unsigned int i) {
+	unsigned int	j = i,
+					k;
+
+	for (;;) {
+		o->slots[i] = 0;
+		do {
+			j = (j + 1) & o->mask;
+			if (o->slots[j] == 0)
+				return;
+			k = home(o, o->files[o->slots[j] - 1].digest);
+		} while (i <= j ? i < k && k <= j : i < k || k <= j);
+		o->slots[i] = o->slots[j];
+		i = j;
+	}
+}
+
+/* By half, not twice: it's most of the memory */
+static unsigned int new_file(owner_index *o, const unsigned char *digest) {
+	unsigned int	id,
+					bigger;
+	owner_file		*p;
+
+	if (o->free_file != 0) {
+		id = o->free_file - 1;
+		memcpy(&o->free_file, o->files[id].digest, sizeof(o->free_file));
+	}
+	else {
+		if (o->num_files == o->size_files) {
+			bigger = o->size_files + o->size_files / 2;
+			if (bigger >= LIST || (p = realloc(o->files, (size_t) bigger * sizeof(owner_file))) == NULL)
+				return NONE;
+			o->files = p;
+			o->size_files = bigger;
+		}
+		id = o->num_files++;
+	}
+	memcpy(o->files[id].digest, digest, DIGEST_LEN);
+	o->files[id].owners = 0;
+	return id;
+}
+
+static void drop_file(owner_index *o, unsigned int id) {
+	unslot(o, slot_of(o, o->files[id].digest));
+	o->used--;
+	memcpy(o->files[id].digest, &o->free_file, sizeof(o->free_file));
+	o->free_file = id + 1;
+}
+
+static unsigned int new_list(owner_index *o) {
+	if (o->num_free_lists > 0)
+		return o->free_lists[--o->num_free_lists];
+	if (o->num_lists == o->size_lists
+			&& grow((void **) &o->lists, &o->size_lists, sizeof(owner_list *), 1024) == -1)
+		return NONE;
+	o->lists[o->num_lists] = NULL;
+	return o->num_lists++;
+}
+
+static void drop_list(owner_index *o, unsigned int n) {
+	o->list_bytes -= sizeof(owner_list) + o->lists[n]->size;
+	free(o->lists[n]);
+	o->lists[n] = NULL;
+	/* With no memory for the stack the index isn't given again, that's all */
+	if (o->num_free_lists == o->size_free_lists)
+		grow((void **) &o->free_lists, &o->size_free_lists, sizeof(unsigned int), 1024);
+	if (o->num_free_lists < o->size_free_lists)
+		o->free_lists[o->num_free_lists++] = n;
+}
+
+/* Room for more bytes in list n, NULL if there's no memory */
+static owner_list *list_room(owner_index *o, unsigned int n, unsigned int more) {
+	owner_list		*l = o->lists[n];
+	unsigned int	size = l->size;
+
+	if (l->len + more <= size)
+		return l;
+	while (l->len + more > size)
+		size *= 2;
+	if ((l = realloc(l, sizeof(owner_list) + size)) == NULL)
+		return NULL;
+	o->list_bytes += size - l->size;
+	l->size = size;
+	o->lists[n] = l;
+	return l;
+}
+
+/* Returns 1 if the peer is an owner now, 0 if it was already, -1 if there's no memory */
+static int add_owner(owner_index *o, owner_file *f, unsigned int peer) {
+	unsigned char	buf[2 * VARINT_MAX];
+	unsigned int	n,
+					i,
+					off,
+					step = 0,
+					delta = 0,
+					prev = 0,
+					len;
+	owner_list		*l;
+
+	if (f->owners == 0) {
+		f->owners = peer + 1;
+		return 1;
+	}
+	if (!(f->owners & LIST)) {
+		if (f->owners == peer + 1)
+			return 0;
+		if ((l = malloc(sizeof(owner_list) + 2 * VARINT_MAX)) == NULL || (n = new_list(o)) == NONE) {
+			free(l);
+			return -1;
+		}
+		l->size = 2 * VARINT_MAX;
+		o->list_bytes += sizeof(owner_list) + l->size;
+		o->lists[n] = l;
+		prev = f->owners - 1 < peer ? f->owners - 1 : peer;
+		l->len = put_varint(l->bytes, prev);
+		l->len += put_varint(l->bytes + l->len, (f->owners - 1 < peer ? peer : f->owners - 1) - prev);
+		l->num = 2;
+		f->owners = LIST | n;
+		return 1;
+	}
+
+	n = f->owners & ~LIST;
+	l = o->lists[n];
+	for (i = 0, off = 0; i < l->num; i++, off += step) {
+		step = get_varint(l->bytes + off, &delta);
+		if (prev + delta == peer)
+			return 0;
+		if (prev + delta > peer)
+			break;
+		prev += delta;
+	}
+	/* Between prev and the one at off, if any: it's two differences instead of one */
+	len = put_varint(buf, peer - prev);
+	if (i < l->num)
+		len += put_varint(buf + len, prev + delta - peer);
+	else
+		step = 0;
+	if ((l = list_room(o, n, len - step)) == NULL)
+		return -1;
+	memmove(l->bytes + off + len, l->bytes + off + step, l->len - off - step);
+	memcpy(l->bytes + off, buf, len);
+	l->len += len - step;
+	l->num++;
+	return 1;
+}
+
+/* Returns 1 if the peer was an owner */
+static int remove_owner(owner_index *o, owner_file *f, unsigned int peer) {
+	unsigned char	buf[VARINT_MAX];
+	unsigned int	n,
+					i,
+					off,
+					step = 0,
+					next = 0,
+					delta = 0,
+					prev = 0,
+					len = 0;
+	owner_list		*l;
+
+	if (!(f->owners & LIST)) {
+		if (f->owners != peer + 1)
+			return 0;
+		f->owners = 0;
+		return 1;
+	}
+
+	n = f->owners & ~LIST;
+	l = o->lists[n];
+	for (i = 0, off = 0; i < l->num; i++, off += step) {
+		step = get_varint(l->bytes + off, &delta);
+		if (prev + delta >= peer)
+			break;
+		prev += delta;
+	}
+	if (i == l->num || prev + delta != peer)
+		return 0;
+	if (l->num == 2) {
+		/* The other one keeps the file by itself */
+		if (i == 0)
+			get_varint(l->bytes + step, &next);
+		f->owners = (i == 0 ? peer + next : prev) + 1;
+		drop_list(o, n);
+		return 1;
+	}
+	/* The one after it is that much further from prev */
+	if (i + 1 < l->num) {
+		step += get_varint(l->bytes + off + step, &next);
+		len = put_varint(buf, delta + next);
+	}
+	memcpy(l->bytes + off, buf, len);
+	memmove(l->bytes + off + len, l->bytes + off + step, l->len - off - step);
+	l->len -= step - len;
+	l->num--;
+	return 1;
+}
+
+static int remember(owner_index *o, owner_peer *p, unsigned int file) {
+	unsigned char	buf[VARINT_MAX];
+	unsigned int	diff = file - p->last_file,
+					size,
+					len;
+	owner_chunk		*c = p->last;
+
+	len = put_varint(buf, diff << 1 ^ -(diff >> 31));
+	if (c == NULL || c->len + len > c->size) {
+		size = c == NULL ? CHUNK_FIRST : c->size < CHUNK_MAX ? c->size * 2 : CHUNK_MAX;
+		if ((c = malloc(sizeof(owner_chunk) + size)) == NULL)
+			return -1;
+		c->next = NULL;
+		c->len = 0;
+		c->size = size;
+		if (p->last == NULL)
+			p->first = c;
+		else
+			p->last->next = c;
+		p->last = c;
+		o->chunk_bytes += sizeof(owner_chunk) + size;
+	}
+	memcpy(c->bytes + c->len, buf, len);
+	c->len += len;
+	p->last_file = file;
+	p->entries++;
+	return 0;
+}
+
+/* The peer's id, a new one if asked for and it has none. -1 otherwise */
+static int peer_id(owner_index *o, char *ip, int create) {
+	unsigned int	i,
+					unused = NONE;
+
+	if (o->last_peer < o->num_peers && strcmp(o->peers[o->last_peer].ip, ip) == 0)
+		return o->last_peer;
+	for (i = 0; i < o->num_peers; i++) {
+		if (strcmp(o->peers[i].ip, ip) == 0)
+			return o->last_peer = i;
+		if (unused == NONE && o->peers[i].ip[0] == '\0')
+			unused = i;
+	}
+	if (!create || ip[0] == '\0')
+		return -1;
+	if (unused == NONE) {
+		if (o->num_peers == o->size_peers && grow((void **) &o->peers, &o->size_peers, sizeof(owner_peer), 64) == -1)
+			return -1;
+		unused = o->num_peers++;
+	}
+	memset(&o->peers[unused], 0, sizeof(owner_peer));
+	snprintf(o->peers[unused].ip, INET_ADDRSTRLEN, "%s", ip);
+	return o->last_peer = unused;
+}
+
+owner_index *owners_open() {
+	owner_index	*o = calloc(1, sizeof(owner_index));
+
+	if (o == NULL)
+		return NULL;
+	o->size_files = SLOTS_FIRST;
+	o->mask = SLOTS_FIRST - 1;
+	if ((o->files = malloc(o->size_files * sizeof(owner_file))) == NULL
+			|| (o->slots = calloc(SLOTS_FIRST, sizeof(unsigned int))) == NULL) {
+		owners_close(o);
+		return NULL;
+	}
+	return o;
+}
+
+void owners_close(owner_index *o) {
+	owner_chunk		*c,
+					*next;
+	unsigned int	i;
+
+	if (o == NULL)
+		return;
+	for (i = 0; i < o->num_lists; i++)
+		free(o->lists[i]);
+	for (i = 0; i < o->num_peers; i++)
+		for (c = o->peers[i].first; c != NULL; c = next) {
+			next = c->next;
+			free(c);
+		}
+	free(o->files);
+	free(o->slots);
+	free(o->lists);
+	free(o->free_lists);
+	free(o->peers);
+	free(o);
+}
+
+static int add_digest(owner_index *o, int peer, const unsigned char *digest) {
+	unsigned int	i,
+					id;
+	int				added;
+
+	if (o->used + 1 > (o->mask + 1) / 4 * 3 && rehash(o) == -1)
+		return -1;
+	if ((id = o->slots[i = slot_of(o, digest)]) == 0) {
+		if ((id = new_file(o, digest)) == NONE)
+			return -1;
+		o->slots[i] = id + 1;
+		o->used++;
+	}
+	else
+		id--;
+
+	if ((added = add_owner(o, &o->files[id], peer)) == 1 && remember(o, &o->peers[peer], id) == -1) {
+		remove_owner(o, &o->files[id], peer);
+		added = -1;
+	}
+	if (o->files[id].owners == 0)
+		drop_file(o, id);
+	if (added != 1)
+		return added == 0 ? 1 : -1;
+	o->entries++;
+	return 0;
+}
+
+/*
+ * The peer at ip has the file. Returns 0 if it's added, 1 if it was
+ * there already, -1 if the hash is wrong or there's no memory.
+ */
+int owners_add(owner_index *o, char *ip, char *hash) {
+	unsigned char	digest[DIGEST_LEN];
+	int				peer;
+
+	if (hash_digest(hash, digest) == -1 || (peer = peer_id(o, ip, 1)) == -1)
+		return -1;
+	return add_digest(o, peer, digest);
+}
+
+/*
+ * A hash list, list_load() did the checking and decoding, is everything
+ * the peer at ip has: what it had before goes. Returns how many were
+ * added, -1 if there was no memory for all of them.
+ */
+long owners_add_list(owner_index *o, char *ip, hash_list *list) {
+	long	num = 0,
+			i;
+	int		peer,
+			ret = 0;
+
+	owners_remove(o, ip);
+	if ((peer = peer_id(o, ip, 1)) == -1)
+		return -1;
+	for (i = 0; i < list->num_kept && ret != -1; i++)
+		if ((ret = add_digest(o, peer, list->digests[i])) == 0)
+			num++;
+	return ret == -1 ? -1 : num;
+}
+
+/* The peer at ip has nothing any more. Returns how many files it had */
+long owners_remove(owner_index *o, char *ip) {
+	owner_peer		*p;
+	owner_chunk		*c,
+					*next;
+	unsigned int	file = 0,
+					zigzag,
+					off;
+	long			num = 0;
+	int				peer;
+
+	if ((peer = peer_id(o, ip, 0)) == -1)
+		return 0;
+	p = &o->peers[peer];
+	for (c = p->first; c != NULL; c = next) {
+		for (off = 0; off < c->len; ) {
+			off += get_varint(c->bytes + off, &zigzag);
+			file += zigzag >> 1 ^ -(zigzag & 1);
+			if (remove_owner(o, &o->files[file], peer) == 1) {
+				num++;
+				if (o->files[file].owners == 0)
+					drop_file(o, file);
+			}
+		}
+		next = c->next;
+		o->chunk_bytes -= sizeof(owner_chunk) + c->size;
+		free(c);
+	}
+	o->entries -= num;
+	memset(p, 0, sizeof(owner_peer));
+	while (o->num_peers > 0 && o->peers[o->num_peers - 1].ip[0] == '\0')
+		o->num_peers--;
+	return num;
+}
+
+static int take(owner_index *o, unsigned int peer, char *skip, char (*found)[INET_ADDRSTRLEN], int num) {
+	if (strcmp(o->peers[peer].ip, skip) == 0)
+		return num;
+	memcpy(found[num], o->peers[peer].ip, INET_ADDRSTRLEN);
+	return num + 1;
+}
+
+/* The addresses of max peers at most having the file, skip not among them. Returns how many */
+int owners_find(owner_index *o, char *hash, char *skip, char (*found)[INET_ADDRSTRLEN], int max) {
+	unsigned char	digest[DIGEST_LEN];
+	unsigned int	id,
+					owners,
+					off,
+					i,
+					delta,
+					peer = 0;
+	owner_list		*l;
+	int				num = 0;
+
+	if (max < 1 || hash_digest(hash, digest) == -1 || (id = o->slots[slot_of(o, digest)]) == 0)
+		return 0;
+	owners = o->files[id - 1].owners;
+	if (!(owners & LIST))
+		return take(o, owners - 1, skip, found, 0);
+	l = o->lists[owners & ~LIST];
+	for (i = 0, off = 0; i < l->num && num < max; i++) {
+		off += get_varint(l->bytes + off, &delta);
+		peer += delta;
+		num = take(o, peer, skip, found, num);
+	}
+	return num;
+}
+
+/* Peer and file pairs */
+long owners_count(owner_index *o) {
+	return o->entries;
+}
+
+unsigned long long owners_memory(owner_index *o) {
+	return sizeof(owner_index) + (unsigned long long) o->size_files * sizeof(owner_file)
+			+ (o->mask + 1ULL) * sizeof(unsigned int) + (unsigned long long) o->size_lists * sizeof(owner_list *)
+			+ (unsigned long long) o->size_free_lists * sizeof(unsigned int)
+			+ (unsigned long long) o->size_peers * sizeof(owner_peer) + o->list_bytes + o->chunk_bytes;
+}
@@ -0,0 +1,34 @@
+/*
+ * Owners.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef OWNERS_H_
+#define OWNERS_H_
+
+#include <arpa/inet.h> /* INET_ADDRSTRLEN */
+
+#include "Protocol.h"
+#include "Ingest.h"
+
+/*
+ * Which peers have which file, what HASH- queries are answered from.
+ * Files are their digest in an open addressing table, peers a small id
+ * for their address. A file with one owner keeps its id, more owners
+ * are a list of ascending ids, each a varint of the difference with the
+ * one before. What a peer shared is in chunks of its own, the same way,
+ * and they go all together when it leaves.
+ */
+typedef struct owner_index owner_index;
+
+owner_index *owners_open();
+void owners_close(owner_index *);
+int owners_add(owner_index *, char *, char *);
+long owners_add_list(owner_index *, char *, hash_list *);
+long owners_remove(owner_index *, char *);
+int owners_find(owner_index *, char *, char *, char (*)[INET_ADDRSTRLEN], int);
+long owners_count(owner_index *);
+unsigned long long owners_memory(owner_index *);
+
+#endif /* OWNERS_H_ */
@@ -0,0 +1,736 @@
+/*
+ ============================================================================
+ Name        : Protocol.c
+ Author      : Giacomo Persichini
+ Description : The messages server and peers exchange
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* free() */
+#include <string.h> /* strlen() - strncmp() */
+#include <sys/stat.h> /* fstat() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - write() - close() - lseek() - pread() */
+#include <sys/socket.h> /* send() */
+#include <arpa/inet.h> /* htonl() - ntohl() */
+#include <errno.h> /* errno */
+#ifdef __SSE2__
+#include <emmintrin.h> /* _mm_loadu_si128() - and the rest of SSE2 */
+#endif
+
+#include "Protocol.h"
+#include "Codec.h"
+#include "Cache.h"
+#include "Config.h"
+#include "Tls.h"
+#include "Log.h"
+
+void record_set_size(hash_record *rec, unsigned long long size) {
+	int	i;
+
+	for (i = 7; i >= 0; i--, size >>= 8)
+		rec->size[i] = (unsigned char) size;
+}
+
+unsigned long long record_size(hash_record *rec) {
+	unsigned long long	size = 0;
+	int					i;
+
+	for (i = 0; i < 8; i++)
+		size = size << 8 | rec->size[i];
+	return size;
+}
+
+#ifdef __SSE2__
+/* 16 hex digits into 8 bytes at once. Returns -1 if one isn't 0-9 or a-f */
+static int hex16(const char *hex, unsigned char *out) {
+	__m128i	c = _mm_loadu_si128((const __m128i *) hex),
+			digit = _mm_sub_epi8(c, _mm_set1_epi8('0')),
+			letter = _mm_sub_epi8(c, _mm_set1_epi8('a')),
+			is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit),
+			is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter),
+			v;
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff)
+		return -1;
+	v = _mm_or_si128(_mm_and_si128(is_digit, digit),
+			_mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+	/* Each pair of digits is a 16 bit lane, the first one in the low byte */
+	v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(v, 8));
+	_mm_storel_epi64((__m128i *) out, _mm_packus_epi16(v, v));
+	return 0;
+}
+
+/* The 40 hex digits of a hash in 20 bytes, all 40 are read. Returns -1 if they aren't */
+int hash_digest(const char *hash, unsigned char *digest) {
+	/* The last 16 digits overlap the 16 before, the 4 bytes they share come out the same */
+	return hex16(hash, digest) | hex16(hash + 16, digest + 8) | hex16(hash + 24, digest + 12);
+}
+#else
+/* The 40 hex digits of a hash in 20 bytes, all 40 are read. Returns -1 if they aren't */
+int hash_digest(const char *hash, unsigned char *digest) {
+	int	i,
+		hi,
+		lo;
+
+	for (i = 0; i < DIGEST_LEN; i++) {
+		hi = hash[2 * i];
+		lo = hash[2 * i + 1];
+		hi = hi >= '0' && hi <= '9' ? hi - '0' : hi >= 'a' && hi <= 'f' ? hi - 'a' + 10 : -1;
+		lo = lo >= '0' && lo <= '9' ? lo - '0' : lo >= 'a' && lo <= 'f' ? lo - 'a' + 10 : -1;
+		if (hi == -1 || lo == -1)
+			return -1;
+		digest[i] = hi << 4 | lo;
+	}
+	return 0;
+}
+#endif
+
+void digest_hash(const unsigned char *digest, char *hash) {
+	static const char	hex[] = "0123456789abcdef";
+	int					i;
+
+	for (i = 0; i < DIGEST_LEN; i++) {
+		hash[2 * i] = hex[digest[i] >> 4];
+		hash[2 * i + 1] = hex[digest[i] & 15];
+	}
+	hash[HASH_LEN] = '\0';
+}
+
+int is_connected(int socket) {
+	if (send(socket, NULL, 0, 0) == -1)
+		return -1;
+	else
+		return 0;
+}
+
+/* Swaps the options offered and keeps the ones both sides have */
+static int swap_options(conn *c, int offer) {
+	char		buffer[OPTIONS_SIZE];
+	uint32_t	theirs = htonl((uint32_t) offer);
+
+	memcpy(buffer, "OPTS", 4);
+	memcpy(buffer + 4, &theirs, sizeof(theirs));
+	if (conn_send(c, buffer, OPTIONS_SIZE) == -1 || conn_read(c, buffer, OPTIONS_SIZE) == -1
+			|| strncmp(buffer, "OPTS", 4) != 0)
+		return -1;
+	memcpy(&theirs, buffer + 4, sizeof(theirs));
+	c->options = offer & ntohl(theirs);
+	return 0;
+}
+
+/*
+ * Both sides offered OPT_TLS: the side that accepted says it's ready, so
+ * that the other's TLS hello can't end up in its buffer, and the TLS
+ * hand-shake follows. A side that requires TLS drops those that didn't
+ * offer it.
+ */
+static int secure(conn *c, int accepted) {
+	char	buffer[TLS_READY_SIZE];
+
+	if (!(c->options & OPT_TLS)) {
+		if (!tls_required())
+			return 0;
+		log_error("The other side doesn't use TLS, it's required.");
+		return -1;
+	}
+	if (accepted ? conn_send(c, "TLS1", TLS_READY_SIZE) == -1
+			: conn_read(c, buffer, TLS_READY_SIZE) == -1 || strncmp(buffer, "TLS1", TLS_READY_SIZE) != 0)
+		return -1;
+	return tls_start(c, accepted);
+}
+
+/*
+ * The side that connected sends the greeting and expects the same one
+ * back. Exactly its length is read: a quick peer may already have sent
+ * what comes next.
+ *
+ * Offering options (OPT_*) the greeting ends with the protocol version
+ * instead, e.g. "HELLOPEE2", then both sides swap what they offer and
+ * c->options gets the ones in common. Programs from before the options
+ * answer with the plain greeting and drop the connection: that's
+ * HANDSHAKE_OLD, connect again offering nothing.
+ *
+ * A server with no room answers BUSY instead: that's HANDSHAKE_BUSY and
+ * c->retry_after tells how many msec it asked to wait.
+ *
+ * With OPT_TLS agreed on, the rest of the connection is encrypted.
+ */
+int handshake(int type, conn *c, int offer) {
+	char		buffer[16],
+				mine[16],
+				*msg = type == HANDSHAKE_SERVER ? "HELLO" : "HELLOPEER";
+	size_t		len = strlen(msg);
+	uint32_t	wait;
+
+	if (is_connected(c->fd) == -1)
+		return -1;
+
+	c->options = 0;
+	c->retry_after = 0;
+	strcpy(mine, msg);
+	if (offer != 0)
+		mine[len - 1] = PROTOCOL_VERSION;
+	if (conn_send(c, mine, len) == -1 || conn_read(c, buffer, len) == -1)
+		return -1;
+	if (type == HANDSHAKE_SERVER && strncmp(buffer, "BUSY", 4) == 0) {
+		if (conn_read(c, buffer + len, BUSY_SIZE - len) == -1)
+			return -1;
+		memcpy(&wait, buffer + 4, sizeof(wait));
+		c->retry_after = ntohl(wait);
+		return HANDSHAKE_BUSY;
+	}
+	if (offer != 0 && strncmp(buffer, msg, len) == 0)
+		return HANDSHAKE_OLD;
+	if (strncmp(buffer, mine, len) != 0) {
+		conn_send(c, "NO", 2); /* No need to check, it's failed anyway */
+		return -1;
+	}
+	if (offer != 0 && swap_options(c, offer) == -1)
+		return -1;
+	return secure(c, 0);
+}
+
+/*
+ * The server's answer to a greeting when it has no room for the peer, in
+ * place of the greeting: it should try again in msec, 0 if the server
+ * can't tell when. The greeting isn't
+ * waited for, whatever arrived of it is read so that closing the socket
+ * doesn't reset the connection before the peer reads this.
+ */
+int send_busy(int fd, unsigned int msec) {
+	char		frame[BUSY_SIZE],
+				junk[16];
+	uint32_t	wait = htonl(msec);
+
+	memcpy(frame, "BUSY", 4);
+	memcpy(frame + 4, &wait, sizeof(wait));
+	if (send(fd, frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(frame))
+		return -1;
+	shutdown(fd, SHUT_WR);
+	while (recv(fd, junk, sizeof(junk), MSG_DONTWAIT) > 0)
+		;
+	return 0;
+}
+
+/*
+ * The side that accepted the connection waits for the greeting and
+ * answers the same way, so programs from before the options still get
+ * the plain one. The options offered may be none.
+ */
+int handshake_reply(int type, conn *c, int offer) {
+	char	buffer[16],
+			*msg = type == HANDSHAKE_SERVER ? "HELLO" : "HELLOPEER";
+	size_t	len = strlen(msg);
+
+	if (is_connected(c->fd) == -1)
+		return -1;
+
+	c->options = 0;
+	if (conn_read(c, buffer, len) == -1)
+		return -1;
+	if (strncmp(buffer, msg, len - 1) != 0 || (buffer[len - 1] != msg[len - 1] && buffer[len - 1] != PROTOCOL_VERSION)) {
+		conn_send(c, "NO", 2); /* No need to check, it's failed anyway */
+		return -1;
+	}
+	if (conn_send(c, buffer, len) == -1)
+		return -1;
+	if (buffer[len - 1] == PROTOCOL_VERSION && swap_options(c, offer) == -1)
+		return -1;
+	return secure(c, 1);
+}
+
+/*
+ * What to offer in hand-shakes: compression=zlib, the default, or off,
+ * delta-sync=on, the default, or off, bundles always and TLS once
+ * tls_setup() is done.
+ */
+int handshake_options() {
+	char	value[CONFIG_LINE_SIZE];
+	int		offer = OPT_ZLIB | OPT_DELTA | OPT_BUNDLE;
+
+	c_read_config_default(value, "compression", "zlib");
+	if (strcmp(value, "off") == 0)
+		offer &= ~OPT_ZLIB;
+	else if (strcmp(value, "zlib") != 0)
+		log_warn("Unknown compression '%s', using zlib.", value);
+	c_read_config_default(value, "delta-sync", "on");
+	if (strcmp(value, "off") == 0)
+		offer &= ~OPT_DELTA;
+	else if (strcmp(value, "on") != 0)
+		log_warn("Unknown delta-sync '%s', using on.", value);
+	return offer | tls_offer();
+}
+
+static int parse_hash(char *frame, char *prefix, char *hash) {
+	if (strncmp(frame, prefix, 5) != 0 || strnlen(frame + 5, HASH_LEN) != HASH_LEN)
+		return -1;
+	memcpy(hash, frame + 5, HASH_LEN);
+	hash[HASH_LEN] = '\0';
+	return 0;
+}
+
+/* Copies the hash out of a QUERY_SIZE bytes message, -1 if it isn't one */
+int parse_query(char *frame, char *hash) {
+	return parse_hash(frame, "HASH-", hash);
+}
+
+/* The same for a delta query, see Delta.h */
+int parse_delta_query(char *frame, char *hash) {
+	return parse_hash(frame, "DIFF-", hash);
+}
+
+static int send_hash(conn *c, char *prefix, char *hash) {
+	char	query[QUERY_SIZE];
+
+	memset(query, 0, sizeof(query));
+	snprintf(query, sizeof(query), "%s%s", prefix, hash);
+	return conn_send(c, query, sizeof(query));
+}
+
+int send_query(conn *c, char *hash) {
+	return send_hash(c, "HASH-", hash);
+}
+
+/* Only to peers that agreed on OPT_DELTA, older ones would hang up */
+int send_delta_query(conn *c, char *hash) {
+	return send_hash(c, "DIFF-", hash);
+}
+
+/*
+ * Only to peers that agreed on OPT_BUNDLE: the files come back in the
+ * same order, each with its header, BUNDLE_MISSING for those the peer
+ * doesn't have. num is BUNDLE_MAX at most.
+ */
+int send_bundle(conn *c, char **hashes, int num) {
+	char		frame[BUNDLE_SIZE];
+	uint32_t	count = htonl((uint32_t) num);
+	int			i;
+
+	if (num < 1 || num > BUNDLE_MAX)
+		return -1;
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, "BNDL-", 5);
+	memcpy(frame + 5, &count, sizeof(count));
+	if (conn_write(c, frame, sizeof(frame)) == -1)
+		return -1;
+	for (i = 0; i < num; i++)
+		if (strlen(hashes[i]) != HASH_LEN || conn_write(c, hashes[i], HASH_LEN) == -1)
+			return -1;
+	return conn_flush(c);
+}
+
+/* How many hashes follow the BUNDLE_SIZE bytes message, -1 if it isn't a bundle */
+int parse_bundle(char *frame) {
+	uint32_t	count;
+
+	if (strncmp(frame, "BNDL-", 5) != 0)
+		return -1;
+	memcpy(&count, frame + 5, sizeof(count));
+	count = ntohl(count);
+	return count >= 1 && count <= BUNDLE_MAX ? (int) count : -1;
+}
+
+int read_query(conn *c, char *hash) {
+	char	query[QUERY_SIZE];
+
+	if (conn_read(c, query, sizeof(query)) == -1)
+		return -1;
+	return parse_query(query, hash);
+}
+
+/* Only to servers that agreed on OPT_LOAD, older ones would log every one */
+int send_load(conn *c, load_report *r) {
+	char		frame[LOAD_SIZE];
+	uint32_t	fields[4] = { htonl(r->free_slots), htonl(r->active), htonl(r->rate), htonl(r->limit) };
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, "LOAD-", 5);
+	memcpy(frame + 5, fields, sizeof(fields));
+	return conn_send(c, frame, sizeof(frame));
+}
+
+/* Copies the report out of a LOAD_SIZE bytes message, -1 if it isn't one */
+int parse_load(char *frame, load_report *r) {
+	uint32_t	fields[4];
+
+	if (strncmp(frame, "LOAD-", 5) != 0)
+		return -1;
+	memcpy(fields, frame + 5, sizeof(fields));
+	r->free_slots = ntohl(fields[0]);
+	r->active = ntohl(fields[1]);
+	r->rate = ntohl(fields[2]);
+	r->limit = ntohl(fields[3]);
+	return 0;
+}
+
+/* Only to servers that agreed on OPT_HEARTBEAT, it says the peer is still there */
+int send_ping(conn *c) {
+	char	frame[PING_SIZE];
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, "PING-", 5);
+	return conn_send(c, frame, sizeof(frame));
+}
+
+/* 0 if the PING_SIZE bytes message is a ping, -1 otherwise */
+int parse_ping(char *frame) {
+	return strncmp(frame, "PING-", 5) == 0 ? 0 : -1;
+}
+
+/* The owner's IP address, or NOTFOUND if owner is NULL */
+int send_reply(conn *c, char *owner) {
+	char	reply[FOUND_SIZE];
+
+	if (owner == NULL)
+		return conn_send(c, "NOTFOUND", NOTFOUND_SIZE);
+	memset(reply, 0, sizeof(reply));
+	snprintf(reply, sizeof(reply), "FOUND-%s", owner);
+	return conn_send(c, reply, sizeof(reply));
+}
+
+/*
+ * Returns 1 and the owner's IP address if the server found the hash, 0 if
+ * it didn't and -1 on errors. owner needs FOUND_SIZE - 5 bytes.
+ */
+int read_reply(conn *c, char *owner) {
+	char	reply[FOUND_SIZE + 1];
+
+	memset(reply, 0, sizeof(reply));
+	if (conn_read(c, reply, NOTFOUND_SIZE) == -1)
+		return -1;
+	if (strncmp(reply, "NOTFOUND", NOTFOUND_SIZE) == 0)
+		return 0;
+	if (strncmp(reply, "FOUND-", 6) != 0
+			|| conn_read(c, reply + NOTFOUND_SIZE, FOUND_SIZE - NOTFOUND_SIZE) == -1)
+		return -1;
+	strcpy(owner, reply + 6);
+	return 1;
+}
+
+/*
+ * What goes before every file. It used to be an unsigned long holding
+ * the size in network order: readers from back then only look at the
+ * first 4 bytes, so the encoding can go in the one after and the size's
+ * next 24 bits, up to FILE_SIZE_MAX, in the last 3.
+ */
+void pack_file_header(char *header, unsigned long long size, int encoding) {
+	uint32_t	length = htonl((uint32_t) size);
+
+	memset(header, 0, FILE_HEADER_SIZE);
+	memcpy(header, &length, sizeof(length));
+	header[4] = (char) encoding;
+	header[5] = (char) (size >> 48);
+	header[6] = (char) (size >> 40);
+	header[7] = (char) (size >> 32);
+}
+
+/* The size in a header, its encoding is header[4] */
+unsigned long long unpack_file_header(const char *header) {
+	uint32_t	length;
+
+	memcpy(&length, header, sizeof(length));
+	return (unsigned long long) (unsigned char) header[5] << 48 | (unsigned long long) (unsigned char) header[6] << 40
+			| (unsigned long long) (unsigned char) header[7] << 32 | ntohl(length);
+}
+
+/* Returns -1 for a file too large for the header, FILE_SIZE_MAX */
+int send_file_header(conn *c, unsigned long long size, int encoding) {
+	char	header[FILE_HEADER_SIZE];
+
+	if (size > FILE_SIZE_MAX) {
+		log_error("A file of %llu bytes is too large to send.", size);
+		return -1;
+	}
+	pack_file_header(header, size, encoding);
+	return conn_write(c, header, sizeof(header));
+}
+
+/* The encoding in a header, -1 if it isn't one c may be sent */
+static int file_encoding(conn *c, const char *header) {
+	switch (header[4]) {
+	case ENCODING_RAW:
+		return ENCODING_RAW;
+	case ENCODING_ZLIB:
+		/* Only sent to those who asked for it */
+		if (c->options & OPT_ZLIB)
+			return ENCODING_ZLIB;
+		/* no break */
+	default:
+		log_error("Unknown file encoding %d.", header[4]);
+		return -1;
+	}
+}
+
+/* Returns the file's encoding and its size, -1 on errors */
+int read_file_header(conn *c, unsigned long long *size) {
+	char	header[FILE_HEADER_SIZE];
+
+	if (conn_read(c, header, sizeof(header)) == -1)
+		return -1;
+	*size = unpack_file_header(header);
+	return file_encoding(c, header);
+}
+
+/*
+ * Reads a frame and writes its content at offset in fd, unless fd is -1:
+ * it's left in buffer for the caller to write. buffer needs
+ * TRANSFER_CHUNK bytes, at most left of them are expected. Returns how
+ * many there were, -1 on errors.
+ */
+long receive_frame(conn *c, int fd, unsigned long long offset, char *buffer, size_t left) {
+	char	frame[CODEC_FRAME_MAX];
+	long	payload,
+			len;
+	int		is_stored;
+
+	if (conn_read(c, frame, CODEC_HEADER) == -1 || (payload = codec_payload(frame, &is_stored)) == -1
+			|| conn_read(c, frame + CODEC_HEADER, payload) == -1)
+		return -1;
+	len = codec_unpack(frame + CODEC_HEADER, payload, is_stored, buffer, left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK);
+	if (len <= 0 || (fd != -1 && pwrite(fd, buffer, len, offset) != len))
+		return -1;
+	return len;
+}
+
+/*
+ * The header and the size bytes of the file open at fd, read at offsets so
+ * that others can share it. Nothing is flushed: files can follow each
+ * other in one stream. Returns 0, or -1 if the file couldn't be read or
+ * the connection failed: the stream is broken either way.
+ */
+int send_descriptor(conn *c, int fd, unsigned long long size, int encoding) {
+	char				buffer[TRANSFER_CHUNK],
+						frame[CODEC_FRAME_MAX];
+	unsigned long long	offset;
+	ssize_t				n;
+	codec				cd = { 0, 0 };
+
+	if (send_file_header(c, size, encoding) == -1)
+		return -1;
+	for (offset = 0; offset < size; offset += n) {
+		n = size - offset < sizeof(buffer) ? size - offset : sizeof(buffer);
+		if ((n = pread(fd, buffer, n, offset)) <= 0 || (encoding == ENCODING_RAW ? conn_write(c, buffer, n) == -1
+				: conn_write(c, frame, codec_pack(&cd, buffer, n, frame)) == -1))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * The size goes first, in network order, then the content. Returns -1 if
+ * the file can't be opened and -2 if the connection fails. Large files
+ * are read as cache_init() says; with O_DIRECT a block at a time, since
+ * nothing reads ahead.
+ */
+int send_file(char *filepath, conn *c) {
+	char			*buffer,
+					frame[CODEC_FRAME_MAX];
+	ssize_t			bytes,
+					sent,
+					n;
+	size_t			size;
+	int				encoding,
+					ret = 0;
+	codec			cd = { 0, 0 };
+	cache_file		file;
+
+	if (is_connected(c->fd) == -1)
+		return -2;
+
+	if (cache_open(&file, filepath, O_RDONLY, 0, 1) == -1)
+		return -1;
+	size = file.mode == CACHE_DIRECT ? CACHE_BLOCK : TRANSFER_CHUNK;
+	if ((buffer = cache_alloc(size)) == NULL) {
+		cache_close(&file);
+		return -1;
+	}
+	encoding = codec_choose(file.fd, c->options & OPT_ZLIB);
+	if (send_file_header(c, lseek(file.fd, 0, SEEK_END), encoding) == -1)
+		ret = -2;
+	lseek(file.fd, 0, SEEK_SET);
+	while (ret == 0 && (bytes = cache_read(&file, buffer, size)) > 0)
+		for (sent = 0; ret == 0 && sent < bytes; sent += n) {
+			n = bytes - sent < TRANSFER_CHUNK ? bytes - sent : TRANSFER_CHUNK;
+			if (encoding == ENCODING_RAW ? conn_write(c, buffer + sent, n) == -1
+					: conn_write(c, frame, codec_pack(&cd, buffer + sent, n, frame)) == -1)
+				ret = -2;
+		}
+	if (ret == 0 && conn_flush(c) == -1)
+		ret = -2;
+	cache_close(&file);
+	free(buffer);
+	return ret;
+}
+
+/*
+ * Returns 1 if the whole file has been received, 0 otherwise. One the
+ * sender says is larger than max bytes is turned down before anything is
+ * written: FILE_SIZE_MAX for downloads, what's sensible for the rest.
+ */
+int receive_file(char *filepath, conn *c, unsigned long long max) {
+	return receive_stream(filepath, c, max, NULL, NULL);
+}
+
+/*
+ * receive_file(), every piece handed to on_data with arg as soon as it's
+ * been written, while it's still in the cache: nothing has to read the
+ * file again to check it.
+ */
+int receive_stream(char *filepath, conn *c, unsigned long long max, void (*on_data)(void *, const char *, size_t),
+		void *arg) {
+	char				buffer[TRANSFER_CHUNK] __attribute__((aligned(CACHE_ALIGN)));
+	cache_file			file;
+	int					encoding;
+	long				n;
+	unsigned long long	length = 0,
+						offset = 0;
+
+	if (is_connected(c->fd) == -1)
+		return 0;
+
+	if ((encoding = read_file_header(c, &length)) == -1)
+		return 0;
+	if (length > max) {
+		log_error("The file would be %llu bytes, %llu at most: turned down.", length, max);
+		return 0;
+	}
+
+	if (cache_open(&file, filepath, O_WRONLY | O_TRUNC | O_CREAT, length, 1) == -1) {
+		switch (errno) {
+		case EACCES:			/* Insufficient permissions */
+			log_error("Not enough permissions to create the received file.");
+			break;
+		default:				/* Generic error */
+			log_error("An error has occurred while opening the file.");
+			break;
+		}
+		return 0;
+	}
+
+	/* Not a byte more than the file: what follows is the next message */
+	while (length > 0) {
+		if (encoding == ENCODING_ZLIB)
+			n = receive_frame(c, -1, offset, buffer, length);
+		else {
+			n = length < sizeof(buffer) ? length : sizeof(buffer);
+			n = conn_read(c, buffer, n) == -1 ? -1 : n;
+		}
+		if (n == -1 || cache_pwrite(&file, buffer, n, offset) != n)
+			break;
+		if (on_data != NULL)
+			on_data(arg, buffer, n);
+		offset += n;
+		length -= n;
+	}
+	cache_close(&file);
+	return length == 0;
+}
+
+/*
+ * A file received as its bytes come, by someone who can't wait for them
+ * all: nothing but what's already in the connection's buffer is read.
+ */
+struct file_receiver {
+	cache_file			file;
+	char				*path;
+	unsigned long long	max,
+						length,
+						offset;
+	int					encoding,	/* -1 until the header has come */
+						is_open;
+	size_t				have;		/* Bytes of the frame gathered so far */
+	char				frame[CODEC_FRAME_MAX],	/* One can be larger than the connection's buffer */
+						buffer[TRANSFER_CHUNK];
+};
+
+/* Nothing is created before the header says how large the file is, at most max bytes */
+file_receiver *receiver_open(const char *filepath, unsigned long long max) {
+	file_receiver	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL || (r->path = strdup(filepath)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->max = max;
+	r->encoding = -1;
+	return r;
+}
+
+/*
+ * Takes what's buffered in c. Returns 1 once the whole file has been
+ * written, 0 if more is needed and -1 on errors: the stream is broken
+ * and the file incomplete.
+ */
+int receiver_take(file_receiver *r, conn *c) {
+	const char	*p;
+	size_t		n,
+				want;
+	long		payload = 0;
+	int			is_stored = 0;
+
+	if (r->encoding == -1) {
+		if ((p = conn_frame(c, FILE_HEADER_SIZE)) == NULL)
+			return 0;
+		r->length = unpack_file_header(p);
+		if ((r->encoding = file_encoding(c, p)) == -1)
+			return -1;
+		if (r->length > r->max) {
+			log_error("The file would be %llu bytes, %llu at most: turned down.", r->length, r->max);
+			return -1;
+		}
+		if (cache_open(&r->file, r->path, O_WRONLY | O_TRUNC | O_CREAT, r->length, 1) == -1) {
+			log_error("An error has occurred while opening the file.");
+			return -1;
+		}
+		r->is_open = 1;
+	}
+
+	while (r->offset < r->length) {
+		if (r->encoding == ENCODING_RAW) {
+			n = r->length - r->offset < conn_buffered(c) ? r->length - r->offset : conn_buffered(c);
+			if (n == 0)
+				return 0;
+			p = conn_frame(c, n);
+		}
+		else {
+			for (;;) {
+				want = CODEC_HEADER;
+				if (r->have >= CODEC_HEADER) {
+					if ((payload = codec_payload(r->frame, &is_stored)) == -1)
+						return -1;
+					if (r->have == (want += payload))
+						break;
+				}
+				n = want - r->have < conn_buffered(c) ? want - r->have : conn_buffered(c);
+				if (n == 0)
+					return 0;
+				memcpy(r->frame + r->have, conn_frame(c, n), n);
+				r->have += n;
+			}
+			n = r->length - r->offset < TRANSFER_CHUNK ? r->length - r->offset : TRANSFER_CHUNK;
+			if ((payload = codec_unpack(r->frame + CODEC_HEADER, payload, is_stored, r->buffer, n)) <= 0)
+				return -1;
+			p = r->buffer;
+			n = payload;
+			r->have = 0;
+		}
+		if (cache_pwrite(&r->file, p, n, r->offset) != (ssize_t) n)
+			return -1;
+		r->offset += n;
+	}
+	if (r->is_open) {
+		cache_close(&r->file);
+		r->is_open = 0;
+	}
+	return 1;
+}
+
+/* Whatever was written stays, it's up to the caller */
+void receiver_close(file_receiver *r) {
+	if (r->is_open)
+		cache_close(&r->file);
+	free(r->path);
+	free(r);
+}
@@ -0,0 +1,108 @@
+/*
+ * Protocol.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include "Conn.h"
+
+#define PEER_PORT 25546
+#define HASH_LEN 40
+#define DIGEST_LEN 20		/* The hash in binary */
+#define HANDSHAKE_SERVER 0	/* A peer talking to the server */
+#define HANDSHAKE_PEER 1	/* A peer talking to another peer */
+#define HANDSHAKE_OLD -2	/* The other side doesn't know about options */
+#define HANDSHAKE_BUSY -3	/* The server has no room, try again later */
+#define PROTOCOL_VERSION '2'	/* Replaces the greeting's last letter when options are offered */
+#define OPT_ZLIB 1			/* Compressed transfers */
+#define OPT_DELTA 2			/* Updated files by their changed chunks, between peers */
+#define OPT_SEARCH 4		/* The server answers SRCH- messages, see Search.h */
+#define OPT_LOAD 8			/* The server takes LOAD- reports into account */
+#define OPT_HEARTBEAT 16	/* The server drops peers it doesn't hear from, they send PING- */
+#define OPT_TLS 32			/* The rest of the connection goes over TLS, see Tls.h */
+#define OPT_BUNDLE 64		/* Many files asked for at once and sent back to back, between peers */
+#define LOAD_INTERVAL 2		/* Seconds between a peer's reports */
+#define HEARTBEAT_INTERVAL 10	/* Seconds a peer may stay silent, 3 of them and it's dropped */
+
+/* Every message has a fixed size, that's how they're told apart */
+#define QUERY_SIZE 46		/* "HASH-" or "DIFF-" + 40 hex digits + '\0' */
+#define LOAD_SIZE QUERY_SIZE	/* "LOAD-" + a load_report in network order, '\0' padded */
+#define PING_SIZE QUERY_SIZE	/* "PING-", '\0' padded */
+#define NOTFOUND_SIZE 8		/* "NOTFOUND" */
+#define FOUND_SIZE 21		/* "FOUND-" + the owner's IP, padded with '\0' */
+#define OPTIONS_SIZE 8		/* "OPTS" + the options offered, in network order */
+#define BUSY_SIZE 8			/* "BUSY" + msec to wait before trying again, in network order */
+#define TLS_READY_SIZE 4	/* "TLS1", from the side that accepted: the TLS hand-shake can start */
+#define FILE_HEADER_SIZE 8	/* The size's low 32 bits in network order, the encoding, its next 24 bits */
+#define FILE_SIZE_MAX ((1ULL << 56) - 1)
+#define SEARCH_SIZE 269		/* "SRCH-" + offset and limit in network order + the text, '\0' padded */
+#define RESULTS_SIZE 12		/* "RSLT" + how many matched and how many follow, in network order */
+#define RESULT_SIZE 180		/* The hash, size and owners in network order, the name '\0' padded */
+#define BUNDLE_SIZE QUERY_SIZE	/* "BNDL-" + how many hashes follow in network order, '\0' padded */
+#define BUNDLE_MAX 1024		/* Hashes in a bundle, the request fits in a connection's buffer */
+#define BUNDLE_MISSING 127	/* In place of the encoding, size 0: a file of the bundle the peer doesn't have */
+#define BUNDLE_SEPARATE 126	/* In place of the encoding, size 0: too large for a bundle, to be asked for on its own */
+#define BUNDLE_FILE_MAX (1 << 20)	/* Bytes of the largest file sent in a bundle */
+#define TRANSFER_CHUNK 65536
+
+/*
+ * The last 8 bytes of the name used to be part of it: records keep their
+ * size, lists from older peers have whatever was left there.
+ */
+typedef struct hash_record {
+	char hash[41];
+	char filename[1016];
+	unsigned char size[8];	/* The file's, in network order */
+} hash_record;
+
+void record_set_size(hash_record *, unsigned long long);
+unsigned long long record_size(hash_record *);
+int hash_digest(const char *, unsigned char *);
+void digest_hash(const unsigned char *, char *);
+
+/* How busy a peer's uploads are, nothing is answered to it */
+typedef struct load_report {
+	unsigned int	free_slots;
+	unsigned int	active;
+	unsigned int	rate;		/* Bytes per second sent lately */
+	unsigned int	limit;		/* Its upload limit in bytes per second, 0 if none */
+} load_report;
+
+/* A file taken from a connection as it comes, see receiver_take() */
+typedef struct file_receiver file_receiver;
+
+int is_connected(int);
+int handshake(int, conn *, int);
+int handshake_reply(int, conn *, int);
+int send_busy(int, unsigned int);
+int handshake_options();
+int parse_query(char *, char *);
+int parse_delta_query(char *, char *);
+int send_query(conn *, char *);
+int send_delta_query(conn *, char *);
+int send_bundle(conn *, char **, int);
+int parse_bundle(char *);
+int read_query(conn *, char *);
+int send_load(conn *, load_report *);
+int parse_load(char *, load_report *);
+int send_ping(conn *);
+int parse_ping(char *);
+int send_reply(conn *, char *);
+int read_reply(conn *, char *);
+void pack_file_header(char *, unsigned long long, int);
+unsigned long long unpack_file_header(const char *);
+int send_file_header(conn *, unsigned long long, int);
+int read_file_header(conn *, unsigned long long *);
+long receive_frame(conn *, int, unsigned long long, char *, size_t);
+int send_descriptor(conn *, int, unsigned long long, int);
+int send_file(char *, conn *);
+int receive_file(char *, conn *, unsigned long long);
+int receive_stream(char *, conn *, unsigned long long, void (*)(void *, const char *, size_t), void *);
+file_receiver *receiver_open(const char *, unsigned long long);
+int receiver_take(file_receiver *, conn *);
+void receiver_close(file_receiver *);
+
+#endif /* PROTOCOL_H_ */
@@ -0,0 +1,139 @@
+/*
+ ============================================================================
+ Name        : Ring.c
+ Author      : Giacomo Persichini
+ Description : Which server of a cluster keeps which hashes
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() - qsort() - strtoul() */
+#include <string.h> /* strtok_r() - strlen() */
+#include <arpa/inet.h> /* inet_pton() - htons() */
+
+#include "Ring.h"
+#include "Log.h"
+
+typedef struct point {
+	unsigned int	pos;
+	int				owner;
+} point;
+
+/* FNV-1a, then mixed: FNV alone leaves similar names close on the circle */
+static unsigned int position(const char *s) {
+	unsigned long long	h = 14695981039346656037ULL;
+
+	for (; *s; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return (unsigned int) (h >> 32);
+}
+
+static int by_position(const void *a, const void *b) {
+	const point	*x = a,
+				*y = b;
+
+	if (x->pos != y->pos)
+		return x->pos < y->pos ? -1 : 1;
+	return x->owner - y->owner;
+}
+
+/*
+ * servers is "IP:PORT;IP:PORT;...", the same list on every peer: points
+ * depend on the addresses only, so the order they're listed in doesn't
+ * matter. Returns NULL if the list is malformed.
+ */
+ring *ring_open(char *servers) {
+	ring	*r = calloc(1, sizeof(ring));
+	point	*points;
+	char	list[RING_MAX_SHARDS * RING_NAME_SIZE],
+			name[RING_NAME_SIZE + 8],
+			ip[INET_ADDRSTRLEN],
+			*save,
+			*tok;
+	int		port,
+			i,
+			j;
+
+	if (r == NULL)
+		return NULL;
+	snprintf(list, sizeof(list), "%s", servers);
+	for (tok = strtok_r(list, "; ,", &save); tok != NULL; tok = strtok_r(NULL, "; ,", &save)) {
+		if (r->shards == RING_MAX_SHARDS || strlen(tok) >= RING_NAME_SIZE
+				|| sscanf(tok, "%15[^:]:%d", ip, &port) != 2 || port <= 0 || port > 65535
+				|| inet_pton(AF_INET, ip, &r->addrs[r->shards].sin_addr) != 1) {
+			log_error("Bad server address '%s'.", tok);
+			free(r);
+			return NULL;
+		}
+		r->addrs[r->shards].sin_family = AF_INET;
+		r->addrs[r->shards].sin_port = htons(port);
+		snprintf(r->names[r->shards], RING_NAME_SIZE, "%s:%d", ip, port);
+		r->shards++;
+	}
+	if (r->shards == 0) {
+		free(r);
+		return NULL;
+	}
+
+	r->num_points = r->shards * RING_POINTS;
+	points = malloc(r->num_points * sizeof(point));
+	r->points = malloc(r->num_points * sizeof(unsigned int));
+	r->owners = malloc(r->num_points * sizeof(int));
+	if (points == NULL || r->points == NULL || r->owners == NULL) {
+		free(points);
+		ring_close(r);
+		return NULL;
+	}
+	for (i = 0; i < r->shards; i++)
+		for (j = 0; j < RING_POINTS; j++) {
+			snprintf(name, sizeof(name), "%s#%d", r->names[i], j);
+			points[i * RING_POINTS + j].pos = position(name);
+			points[i * RING_POINTS + j].owner = i;
+		}
+	qsort(points, r->num_points, sizeof(point), by_position);
+	for (i = 0; i < r->num_points; i++) {
+		r->points[i] = points[i].pos;
+		r->owners[i] = points[i].owner;
+	}
+	free(points);
+	return r;
+}
+
+void ring_close(ring *r) {
+	if (r == NULL)
+		return;
+	free(r->points);
+	free(r->owners);
+	free(r);
+}
+
+/* The shard in charge of hash, by its first 8 hex digits */
+int ring_shard(ring *r, const char *hash) {
+	char			prefix[9];
+	unsigned int	key;
+	int				lo = 0,
+					hi = r->num_points,
+					mid;
+
+	if (r->shards == 1)
+		return 0;
+	memcpy(prefix, hash, 8);
+	prefix[8] = '\0';
+	key = (unsigned int) strtoul(prefix, NULL, 16);
+	/* First point at key or after it, the circle wraps around */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (r->points[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return r->owners[lo == r->num_points ? 0 : lo];
+}
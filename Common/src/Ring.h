@@ -0,0 +1,34 @@
+/*
+ * Ring.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <netinet/in.h> /* struct sockaddr_in */
+
+#define RING_MAX_SHARDS 64
+#define RING_POINTS 128		/* Per shard, more of them spread the hashes more evenly */
+#define RING_NAME_SIZE 32	/* "IP:PORT" */
+
+/*
+ * Consistent hashing of the hash space over the servers: every server has
+ * RING_POINTS points on a circle, a hash belongs to the first point after
+ * its 32 bits prefix. Adding a server only moves the hashes it takes.
+ */
+typedef struct ring {
+	unsigned int	*points;
+	int				*owners;
+	int				num_points;
+	int				shards;
+	char			names[RING_MAX_SHARDS][RING_NAME_SIZE];
+	struct sockaddr_in	addrs[RING_MAX_SHARDS];
+} ring;
+
+ring *ring_open(char *);
+void ring_close(ring *);
+int ring_shard(ring *, const char *);
+
+#endif /* RING_H_ */
@@ -0,0 +1,828 @@
+/*
+ ============================================================================
+ Name        : Search.c
+ Author      : Giacomo Persichini
+ Description : Finding shared files by name, on the server and through it
+ ============================================================================
+ */
+
+#define _GNU_SOURCE /* memrchr() */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - realloc() - free() - qsort() */
+#include <string.h> /* memcpy() - memcmp() - memrchr() */
+#include <arpa/inet.h> /* htonl() - ntohl() */
+
+#include "Search.h"
+#include "Log.h"
+
+#define TERM_KEY_MAX (SEARCH_TOKEN_MAX + 1)	/* A word, or a mark and a prefix or an extension */
+#define MARK_PREFIX '*'
+#define MARK_EXT '.'
+
+typedef struct file_entry {
+	unsigned char		digest[DIGEST_LEN];
+	unsigned int		owners;		/* None: skipped, until the next rebuild */
+	unsigned long long	size;
+	unsigned long		name;		/* Offset in the names */
+	unsigned int		name_len;
+} file_entry;
+
+/* A word, prefix or extension and the files having it, by id */
+typedef struct term {
+	unsigned long	key;		/* Offset in the keys */
+	unsigned int	hash;
+	unsigned int	len;
+	unsigned int	*ids;		/* Ascending, an id is there once */
+	unsigned int	num;
+	unsigned int	size;
+} term;
+
+/* Open addressing, slots hold the index of the entry plus one */
+typedef struct table {
+	unsigned int	*slots;
+	unsigned int	mask;
+} table;
+
+struct search_index {
+	file_entry			*files;
+	unsigned long long	*ranks;		/* By id as well, see set_rank() */
+	unsigned int		num_files;
+	unsigned int		size_files;
+	table				by_digest;
+	term				*terms;
+	unsigned int		num_terms;
+	unsigned int		size_terms;
+	table				by_key;
+	char				*names;
+	unsigned long		names_len;
+	unsigned long		names_size;
+	char				*keys;
+	unsigned long		keys_len;
+	unsigned long		keys_size;
+	long				alive;
+	long				dead;
+	unsigned long long	posting_bytes;
+	unsigned int		*heap;		/* Best matches of the query running */
+};
+
+/* A word of the query, all of them must match */
+typedef struct query_term {
+	char			key[TERM_KEY_MAX];
+	unsigned int	len;
+	char			prefix[SEARCH_TOKEN_MAX];	/* word*: checked on the names, past SEARCH_PREFIX_MAX */
+	unsigned int	prefix_len;
+	term			*t;
+	unsigned int	pos;
+} query_term;
+
+static unsigned int fnv(const char *s, unsigned int len) {
+	unsigned int	h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int grow(void **array, unsigned int *size, size_t item, unsigned int first) {
+	unsigned int	bigger = *size ? *size * 2 : first;
+	void			*p = realloc(*array, bigger * item);
+
+	if (p == NULL)
+		return -1;
+	*array = p;
+	*size = bigger;
+	return 0;
+}
+
+static int append(char **arena, unsigned long *len, unsigned long *size, const char *s, unsigned int n) {
+	unsigned long	bigger = *size ? *size : 65536;
+	char			*p;
+
+	while (*len + n > bigger)
+		bigger *= 2;
+	if (bigger != *size) {
+		if ((p = realloc(*arena, bigger)) == NULL)
+			return -1;
+		*arena = p;
+		*size = bigger;
+	}
+	memcpy(*arena + *len, s, n);
+	*len += n;
+	return 0;
+}
+
+static int table_init(table *t, unsigned int slots) {
+	if ((t->slots = calloc(slots, sizeof(unsigned int))) == NULL)
+		return -1;
+	t->mask = slots - 1;
+	return 0;
+}
+
+static int is_word_char(unsigned char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static char lower(char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static unsigned int digest_slot(search_index *s, const unsigned char *digest) {
+	unsigned int	h,
+					i,
+					id;
+
+	memcpy(&h, digest, sizeof(h));
+	for (i = h & s->by_digest.mask; (id = s->by_digest.slots[i]) != 0; i = (i + 1) & s->by_digest.mask)
+		if (memcmp(s->files[id - 1].digest, digest, DIGEST_LEN) == 0)
+			break;
+	return i;
+}
+
+static unsigned int key_slot(search_index *s, const char *key, unsigned int len, unsigned int hash) {
+	unsigned int	i,
+					n;
+	term			*t;
+
+	for (i = hash & s->by_key.mask; (n = s->by_key.slots[i]) != 0; i = (i + 1) & s->by_key.mask) {
+		t = &s->terms[n - 1];
+		if (t->hash == hash && t->len == len && memcmp(s->keys + t->key, key, len) == 0)
+			break;
+	}
+	return i;
+}
+
+/* Twice as many slots, the entries stay where they are */
+static int rehash(search_index *s, table *t, int digests) {
+	table			old = *t;
+	unsigned int	i,
+					j,
+					h;
+
+	if (table_init(t, (old.mask + 1) * 2) == -1) {
+		*t = old;
+		return -1;
+	}
+	for (i = 0; i <= old.mask; i++)
+		if (old.slots[i] != 0) {
+			if (digests)
+				memcpy(&h, s->files[old.slots[i] - 1].digest, sizeof(h));
+			else
+				h = s->terms[old.slots[i] - 1].hash;
+			for (j = h & t->mask; t->slots[j] != 0; j = (j + 1) & t->mask)
+				;
+			t->slots[j] = old.slots[i];
+		}
+	free(old.slots);
+	return 0;
+}
+
+static term *find_term(search_index *s, const char *key, unsigned int len) {
+	unsigned int	n = s->by_key.slots[key_slot(s, key, len, fnv(key, len))];
+
+	return n != 0 ? &s->terms[n - 1] : NULL;
+}
+
+/* Ids only grow while a name is indexed: its words seen twice are there already */
+static int add_posting(search_index *s, const char *key, unsigned int len, unsigned int id) {
+	unsigned int	hash = fnv(key, len),
+					slot = key_slot(s, key, len, hash);
+	term			*t;
+
+	if (s->by_key.slots[slot] == 0) {
+		if (s->num_terms == s->size_terms && grow((void **) &s->terms, &s->size_terms, sizeof(term), 1024) == -1)
+			return -1;
+		t = &s->terms[s->num_terms];
+		memset(t, 0, sizeof(term));
+		t->key = s->keys_len;
+		t->hash = hash;
+		t->len = len;
+		if (append(&s->keys, &s->keys_len, &s->keys_size, key, len) == -1)
+			return -1;
+		s->by_key.slots[slot] = ++s->num_terms;
+		if (s->num_terms * 2 > s->by_key.mask && rehash(s, &s->by_key, 0) == -1)
+			return -1;
+	}
+	else
+		t = &s->terms[s->by_key.slots[slot] - 1];
+	if (t->num > 0 && t->ids[t->num - 1] == id)
+		return 0;
+	if (t->num == t->size) {
+		/* Most words are in a few names only */
+		s->posting_bytes += (t->size ? t->size : 4) * sizeof(unsigned int);
+		if (grow((void **) &t->ids, &t->size, sizeof(unsigned int), 4) == -1)
+			return -1;
+	}
+	t->ids[t->num++] = id;
+	return 0;
+}
+
+/*
+ * The next word of name from *pos on, lowercase and cut at
+ * SEARCH_TOKEN_MAX letters. Returns its length, 0 at the end.
+ */
+static unsigned int next_word(const char *name, unsigned int len, unsigned int *pos, char *word) {
+	unsigned int	n = 0;
+
+	while (*pos < len && !is_word_char(name[*pos]))
+		(*pos)++;
+	for (; *pos < len && is_word_char(name[*pos]); (*pos)++)
+		if (n < SEARCH_TOKEN_MAX)
+			word[n++] = lower(name[*pos]);
+	return n;
+}
+
+/* The letters after the last '.', if they make an extension */
+static unsigned int extension(const char *name, unsigned int len, char *ext) {
+	unsigned int	i = len,
+					n;
+
+	while (i > 0 && name[i - 1] != '.')
+		i--;
+	if (i <= 1 || len - i == 0 || len - i > SEARCH_EXT_MAX)
+		return 0;
+	for (n = 0; i < len; i++, n++)
+		if (!is_word_char(name[i]))
+			return 0;
+		else
+			ext[n] = lower(name[i]);
+	return n;
+}
+
+static int index_name(search_index *s, unsigned int id, const char *name, unsigned int len) {
+	char			key[TERM_KEY_MAX];
+	unsigned int	pos = 0,
+					n,
+					p;
+
+	while ((n = next_word(name, len, &pos, key + 1)) > 0) {
+		if (add_posting(s, key + 1, n, id) == -1)
+			return -1;
+		key[0] = MARK_PREFIX;
+		for (p = SEARCH_PREFIX; p <= n && p <= SEARCH_PREFIX_MAX; p++)
+			if (add_posting(s, key, p + 1, id) == -1)
+				return -1;
+	}
+	key[0] = MARK_EXT;
+	if ((n = extension(name, len, key + 1)) > 0 && add_posting(s, key, n + 1, id) == -1)
+		return -1;
+	return 0;
+}
+
+/* Longer names tie after SEARCH_NAME_MAX, the rest of them doesn't travel */
+static unsigned int shown_len(unsigned int len) {
+	return len < SEARCH_NAME_MAX - 1 ? len : SEARCH_NAME_MAX - 1;
+}
+
+/*
+ * The order of the results in one number, larger first: owners, then the
+ * shorter name, then the hash's first bytes. Queries going through
+ * millions of files compare these and touch nothing else.
+ */
+static void set_rank(search_index *s, unsigned int id) {
+	file_entry		*f = &s->files[id];
+	unsigned int	owners = f->owners < 0xffffff ? f->owners : 0xffffff;
+
+	s->ranks[id] = (unsigned long long) owners << 40
+			| (unsigned long long) (SEARCH_NAME_MAX - 1 - shown_len(f->name_len)) << 32
+			| (0xffffffffU - ((unsigned int) f->digest[0] << 24 | f->digest[1] << 16 | f->digest[2] << 8 | f->digest[3]));
+}
+
+static int new_file(search_index *s, const unsigned char *digest, unsigned long long size, const char *name,
+		unsigned int len) {
+	unsigned int	slot = digest_slot(s, digest),
+					id = s->num_files,
+					size_ranks = s->size_files;
+	file_entry		*f;
+
+	if (s->num_files == s->size_files && (grow((void **) &s->files, &s->size_files, sizeof(file_entry), 1024) == -1
+			|| grow((void **) &s->ranks, &size_ranks, sizeof(unsigned long long), 1024) == -1))
+		return -1;
+	f = &s->files[id];
+	memcpy(f->digest, digest, DIGEST_LEN);
+	f->owners = 0;
+	f->size = size;
+	f->name = s->names_len;
+	f->name_len = len;
+	set_rank(s, id);
+	if (append(&s->names, &s->names_len, &s->names_size, name, len) == -1)
+		return -1;
+	s->by_digest.slots[slot] = ++s->num_files;
+	if (s->num_files * 2 > s->by_digest.mask && rehash(s, &s->by_digest, 1) == -1)
+		return -1;
+	return index_name(s, id, name, len) == -1 ? -1 : (int) id;
+}
+
+search_index *search_open() {
+	search_index	*s = calloc(1, sizeof(search_index));
+
+	if (s == NULL)
+		return NULL;
+	if (table_init(&s->by_digest, 1024) == -1 || table_init(&s->by_key, 1024) == -1
+			|| (s->heap = malloc(SEARCH_DEPTH_MAX * sizeof(unsigned int))) == NULL) {
+		search_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+static void free_index(search_index *s) {
+	unsigned int	i;
+
+	for (i = 0; i < s->num_terms; i++)
+		free(s->terms[i].ids);
+	free(s->terms);
+	free(s->files);
+	free(s->ranks);
+	free(s->by_digest.slots);
+	free(s->by_key.slots);
+	free(s->names);
+	free(s->keys);
+	free(s->heap);
+}
+
+void search_close(search_index *s) {
+	if (s == NULL)
+		return;
+	free_index(s);
+	free(s);
+}
+
+/*
+ * Files nobody has any more are dropped and the ids are given again, in
+ * the same order. Takes as long as indexing every name once, so it only
+ * happens when most of the index is gone.
+ */
+static void rebuild(search_index *s) {
+	search_index	*fresh = search_open();
+	file_entry		*f;
+	unsigned int	i;
+	int				id;
+
+	if (fresh == NULL)
+		return;
+	for (i = 0; i < s->num_files; i++) {
+		f = &s->files[i];
+		if (f->owners == 0)
+			continue;
+		if ((id = new_file(fresh, f->digest, f->size, s->names + f->name, f->name_len)) == -1) {
+			log_error("Not enough memory to rebuild the search index.");
+			search_close(fresh);
+			return;
+		}
+		fresh->files[id].owners = f->owners;
+		set_rank(fresh, id);
+		fresh->alive++;
+	}
+	free_index(s);
+	*s = *fresh;
+	free(fresh);
+}
+
+static int add_digest(search_index *s, hash_record *rec, const unsigned char *digest) {
+	const char		*name = rec->filename,
+					*slash;
+	unsigned int	len = strnlen(rec->filename, sizeof(rec->filename)),
+					slot;
+	int				id;
+
+	if ((slash = memrchr(name, '/', len)) != NULL) {
+		len -= slash + 1 - name;
+		name = slash + 1;
+	}
+	slot = digest_slot(s, digest);
+	if (s->by_digest.slots[slot] != 0) {
+		id = s->by_digest.slots[slot] - 1;
+		/* Back before the rebuild, its words are still there */
+		if (s->files[id].owners == 0)
+			s->dead--;
+	}
+	else if ((id = new_file(s, digest, record_size(rec), name, len)) == -1)
+		return -1;
+	if (s->files[id].owners++ == 0)
+		s->alive++;
+	set_rank(s, id);
+	return 0;
+}
+
+/* One more owner of the file. Returns -1 if it couldn't be indexed */
+int search_add(search_index *s, hash_record *rec) {
+	unsigned char	digest[DIGEST_LEN];
+
+	if (hash_digest(rec->hash, digest) == -1)
+		return -1;
+	return add_digest(s, rec, digest);
+}
+
+static int remove_digest(search_index *s, const unsigned char *digest) {
+	unsigned int	id;
+
+	if ((id = s->by_digest.slots[digest_slot(s, digest)]) == 0 || s->files[id - 1].owners == 0)
+		return -1;
+	s->files[id - 1].owners--;
+	set_rank(s, id - 1);
+	if (s->files[id - 1].owners == 0) {
+		s->alive--;
+		s->dead++;
+		if (s->dead > 65536 && s->dead > s->alive)
+			rebuild(s);
+	}
+	return 0;
+}
+
+/* One owner less. Returns -1 if the hash isn't there */
+int search_remove(search_index *s, char *hash) {
+	unsigned char	digest[DIGEST_LEN];
+
+	if (hash_digest(hash, digest) == -1)
+		return -1;
+	return remove_digest(s, digest);
+}
+
+/* Every file of a hash list, list_load() did the checking and decoding. Returns how many */
+long search_add_list(search_index *s, hash_list *list) {
+	long	num = 0,
+			i;
+
+	for (i = 0; i < list->num_kept; i++)
+		if (add_digest(s, &list->records[list->kept[i]], list->digests[i]) == 0)
+			num++;
+	return num;
+}
+
+long search_remove_list(search_index *s, hash_list *list) {
+	long	num = 0,
+			i;
+
+	for (i = 0; i < list->num_kept; i++)
+		if (remove_digest(s, list->digests[i]) == 0)
+			num++;
+	return num;
+}
+
+/* Files somebody has */
+long search_count(search_index *s) {
+	return s->alive;
+}
+
+unsigned long long search_memory(search_index *s) {
+	return sizeof(search_index) + (unsigned long long) s->size_files * sizeof(file_entry)
+			+ (unsigned long long) s->size_terms * sizeof(term)
+			+ (s->by_digest.mask + 1ULL + s->by_key.mask + 1ULL) * sizeof(unsigned int)
+			+ (unsigned long long) s->size_files * sizeof(unsigned long long)
+			+ s->names_size + s->keys_size + s->posting_bytes + SEARCH_DEPTH_MAX * sizeof(unsigned int);
+}
+
+/* Above 0 if file a goes after b: fewer owners, a longer name, then the hash */
+static int rank(search_index *s, unsigned int a, unsigned int b) {
+	if (s->ranks[a] != s->ranks[b])
+		return s->ranks[a] < s->ranks[b] ? 1 : -1;
+	return memcmp(s->files[a].digest, s->files[b].digest, DIGEST_LEN);
+}
+
+/* The same order, for results that came from different servers */
+int search_compare(const search_result *a, const search_result *b) {
+	size_t	x = strlen(a->name),
+			y = strlen(b->name);
+
+	if (a->owners != b->owners)
+		return a->owners < b->owners ? 1 : -1;
+	if (x != y)
+		return x > y ? 1 : -1;
+	return strcmp(a->hash, b->hash);
+}
+
+static int by_compare(const void *a, const void *b) {
+	return search_compare(a, b);
+}
+
+/* heap[0] is the worst of the best matches kept so far */
+static void sift_down(search_index *s, unsigned int *heap, int num, int i) {
+	unsigned int	x = heap[i];
+	int				child;
+
+	while ((child = 2 * i + 1) < num) {
+		if (child + 1 < num && rank(s, heap[child + 1], heap[child]) > 0)
+			child++;
+		if (rank(s, heap[child], x) <= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = x;
+}
+
+static void keep(search_index *s, unsigned int *heap, int *num, int max, unsigned int id) {
+	int	i,
+		parent;
+
+	if (*num < max) {
+		for (i = (*num)++; i > 0 && rank(s, heap[parent = (i - 1) / 2], id) < 0; i = parent)
+			heap[i] = heap[parent];
+		heap[i] = id;
+	}
+	else if (rank(s, id, heap[0]) < 0) {
+		heap[0] = id;
+		sift_down(s, heap, *num, 0);
+	}
+}
+
+/* First position from i on whose id isn't less than id: galloping, then halving */
+static unsigned int seek(const unsigned int *ids, unsigned int num, unsigned int i, unsigned int id) {
+	unsigned int	step = 1,
+					hi,
+					mid;
+
+	if (i >= num || ids[i] >= id)
+		return i;
+	while (i + step < num && ids[i + step] < id) {
+		i += step;
+		step *= 2;
+	}
+	hi = i + step < num ? i + step : num;
+	for (i++; i < hi; )
+		if (ids[mid = i + (hi - i) / 2] < id)
+			i = mid + 1;
+		else
+			hi = mid;
+	return i;
+}
+
+/* A word of the name starts with the whole prefix, not just its first letters */
+static int has_prefix(search_index *s, unsigned int id, query_term *q) {
+	file_entry		*f = &s->files[id];
+	char			word[SEARCH_TOKEN_MAX];
+	unsigned int	pos = 0,
+					n;
+
+	while ((n = next_word(s->names + f->name, f->name_len, &pos, word)) > 0)
+		if (n >= q->prefix_len && memcmp(word, q->prefix, q->prefix_len) == 0)
+			return 1;
+	return 0;
+}
+
+/* The words of the text as terms, returns how many */
+static int parse_terms(char *text, query_term *terms, int max) {
+	char			word[SEARCH_TEXT_MAX];
+	unsigned int	len,
+					pos,
+					n;
+	int				num = 0,
+					star;
+
+	for (; *text != '\0'; text += len) {
+		while (*text == ' ' || *text == '\t')
+			text++;
+		for (len = 0; text[len] != '\0' && text[len] != ' ' && text[len] != '\t'; len++)
+			;
+		if (len == 0)
+			break;
+		if (len > 4 && strncmp(text, "ext:", 4) == 0) {
+			/* Nothing has a longer one, or one that isn't a word */
+			if (len - 4 > SEARCH_EXT_MAX)
+				return 0;
+			terms[num].key[0] = MARK_EXT;
+			for (n = 4; n < len; n++)
+				if (!is_word_char(text[n]))
+					return 0;
+				else
+					terms[num].key[n - 3] = lower(text[n]);
+			terms[num].len = len - 3;
+			terms[num].prefix_len = 0;
+			if (++num == max)
+				break;
+			continue;
+		}
+		star = text[len - 1] == '*';
+		pos = 0;
+		while (num < max && (n = next_word(text, len, &pos, word)) > 0) {
+			terms[num].prefix_len = 0;
+			/* Only the last word before the '*' is a prefix */
+			if (star && pos >= len - 1 && n >= SEARCH_PREFIX) {
+				terms[num].key[0] = MARK_PREFIX;
+				terms[num].len = (n < SEARCH_PREFIX_MAX ? n : SEARCH_PREFIX_MAX) + 1;
+				memcpy(terms[num].key + 1, word, terms[num].len - 1);
+				if (n > SEARCH_PREFIX_MAX) {
+					memcpy(terms[num].prefix, word, n);
+					terms[num].prefix_len = n;
+				}
+			}
+			else {
+				memcpy(terms[num].key, word, n);
+				terms[num].len = n;
+			}
+			num++;
+		}
+	}
+	return num;
+}
+
+static int by_postings(const void *a, const void *b) {
+	const query_term	*x = a,
+						*y = b;
+
+	return x->t->num < y->t->num ? -1 : x->t->num > y->t->num;
+}
+
+/*
+ * Matches of the text, the best limit of them after offset go in out and
+ * their number in num. Returns how many files matched, all of them.
+ */
+long search_query(search_index *s, char *text, long offset, int limit, search_result *out, int *num) {
+	query_term		terms[SEARCH_TEXT_MAX / 2];
+	unsigned int	*ids,
+					id,
+					i;
+	file_entry		*f;
+	long			total = 0;
+	int				nterms,
+					kept = 0,
+					depth,
+					j;
+
+	*num = 0;
+	if (offset < 0 || limit <= 0 || offset >= SEARCH_DEPTH_MAX
+			|| (nterms = parse_terms(text, terms, SEARCH_TEXT_MAX / 2)) == 0)
+		return 0;
+	for (j = 0; j < nterms; j++) {
+		if ((terms[j].t = find_term(s, terms[j].key, terms[j].len)) == NULL)
+			return 0;
+		terms[j].pos = 0;
+	}
+	/* The rarest term leads, the others are looked for in its files only */
+	qsort(terms, nterms, sizeof(query_term), by_postings);
+	depth = offset + limit < SEARCH_DEPTH_MAX ? offset + limit : SEARCH_DEPTH_MAX;
+	ids = terms[0].t->ids;
+	for (i = 0; i < terms[0].t->num; i++) {
+		id = ids[i];
+		if (s->ranks[id] >> 40 == 0)
+			continue;	/* Nobody has it */
+		for (j = 1; j < nterms; j++) {
+			terms[j].pos = seek(terms[j].t->ids, terms[j].t->num, terms[j].pos, id);
+			if (terms[j].pos == terms[j].t->num) {
+				i = terms[0].t->num;	/* No file has all of them any more */
+				break;
+			}
+			if (terms[j].t->ids[terms[j].pos] != id)
+				break;
+		}
+		if (j < nterms)
+			continue;
+		for (j = 0; j < nterms; j++)
+			if (terms[j].prefix_len > 0 && !has_prefix(s, id, &terms[j]))
+				break;
+		if (j < nterms)
+			continue;
+		total++;
+		keep(s, s->heap, &kept, depth, id);
+	}
+
+	/* Best first: the worst one is taken off the top every time */
+	for (j = kept - 1; j >= 0; j--) {
+		id = s->heap[0];
+		s->heap[0] = s->heap[j];
+		sift_down(s, s->heap, j, 0);
+		if (j < offset || j >= offset + limit)
+			continue;
+		f = &s->files[id];
+		digest_hash(f->digest, out[j - offset].hash);
+		out[j - offset].size = f->size;
+		out[j - offset].owners = f->owners;
+		memcpy(out[j - offset].name, s->names + f->name, shown_len(f->name_len));
+		out[j - offset].name[shown_len(f->name_len)] = '\0';
+		(*num)++;
+	}
+	return total;
+}
+
+static void put32(char *p, unsigned int x) {
+	x = htonl(x);
+	memcpy(p, &x, 4);
+}
+
+static unsigned int get32(const char *p) {
+	unsigned int	x;
+
+	memcpy(&x, p, 4);
+	return ntohl(x);
+}
+
+/* Copies a SEARCH_SIZE bytes message out, -1 if it isn't one */
+int parse_search(char *frame, char *text, long *offset, int *limit) {
+	if (strncmp(frame, "SRCH-", 5) != 0 || strnlen(frame + 13, SEARCH_TEXT_MAX) == SEARCH_TEXT_MAX)
+		return -1;
+	*offset = get32(frame + 5);
+	*limit = get32(frame + 9);
+	if (*limit > SEARCH_PAGE_MAX)
+		*limit = SEARCH_PAGE_MAX;
+	strcpy(text, frame + 13);
+	return 0;
+}
+
+/* Only to servers that agreed on OPT_SEARCH, older ones would hang up */
+int send_search(conn *c, char *text, long offset, int limit) {
+	char	frame[SEARCH_SIZE];
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, "SRCH-", 5);
+	put32(frame + 5, offset);
+	put32(frame + 9, limit);
+	snprintf(frame + 13, SEARCH_TEXT_MAX, "%s", text);
+	return conn_send(c, frame, sizeof(frame));
+}
+
+int send_results(conn *c, long total, search_result *results, int num) {
+	char	header[RESULTS_SIZE],
+			result[RESULT_SIZE];
+	int		i;
+
+	memcpy(header, "RSLT", 4);
+	put32(header + 4, total);
+	put32(header + 8, num);
+	if (conn_write(c, header, sizeof(header)) == -1)
+		return -1;
+	for (i = 0; i < num; i++) {
+		memset(result, 0, sizeof(result));
+		memcpy(result, results[i].hash, HASH_LEN);
+		put32(result + HASH_LEN, results[i].size >> 32);
+		put32(result + HASH_LEN + 4, results[i].size);
+		put32(result + HASH_LEN + 8, results[i].owners);
+		memcpy(result + HASH_LEN + 12, results[i].name, strlen(results[i].name));
+		if (conn_write(c, result, sizeof(result)) == -1)
+			return -1;
+	}
+	return conn_flush(c);
+}
+
+/* Returns how many results came, at most max, and how many matched in total */
+int read_results(conn *c, long *total, search_result *results, int max) {
+	char	header[RESULTS_SIZE],
+			result[RESULT_SIZE];
+	int		num,
+			i;
+
+	if (conn_read(c, header, sizeof(header)) == -1 || strncmp(header, "RSLT", 4) != 0
+			|| (num = get32(header + 8)) > max)
+		return -1;
+	*total = get32(header + 4);
+	for (i = 0; i < num; i++) {
+		if (conn_read(c, result, sizeof(result)) == -1)
+			return -1;
+		memcpy(results[i].hash, result, HASH_LEN);
+		results[i].hash[HASH_LEN] = '\0';
+		results[i].size = (unsigned long long) get32(result + HASH_LEN) << 32 | get32(result + HASH_LEN + 4);
+		results[i].owners = get32(result + HASH_LEN + 8);
+		memcpy(results[i].name, result + HASH_LEN + 12, SEARCH_NAME_MAX - 1);
+		results[i].name[SEARCH_NAME_MAX - 1] = '\0';
+	}
+	return num;
+}
+
+/*
+ * Asks every server of a cluster: each one has its part of the files, so
+ * each one's best offset + limit are merged and the page is cut from
+ * them. Returns how many matched in total, -1 on errors.
+ */
+long search_servers(conn **servers, int num_servers, char *text, long offset, int limit, search_result *out, int *num) {
+	search_result	*all;
+	long			total = 0,
+					matched;
+	int				depth,
+					got = 0,
+					asked,
+					n,
+					i;
+
+	*num = 0;
+	if (limit > SEARCH_PAGE_MAX)
+		limit = SEARCH_PAGE_MAX;
+	if (num_servers == 1) {
+		if (send_search(servers[0], text, offset, limit) == -1 || (n = read_results(servers[0], &total, out, limit)) == -1)
+			return -1;
+		*num = n;
+		return total;
+	}
+	depth = offset + limit < SEARCH_DEPTH_MAX ? offset + limit : SEARCH_DEPTH_MAX;
+	if (offset >= depth || (all = malloc((size_t) num_servers * depth * sizeof(search_result))) == NULL)
+		return 0;
+	for (i = 0; i < num_servers; i++)
+		for (asked = 0; asked < depth; asked += n) {
+			if (send_search(servers[i], text, asked, depth - asked < SEARCH_PAGE_MAX ? depth - asked : SEARCH_PAGE_MAX) == -1
+					|| (n = read_results(servers[i], &matched, all + got, SEARCH_PAGE_MAX)) == -1) {
+				free(all);
+				return -1;
+			}
+			got += n;
+			if (asked == 0)
+				total += matched;
+			if (n < SEARCH_PAGE_MAX)
+				break;
+		}
+	qsort(all, got, sizeof(search_result), by_compare);
+	for (i = offset; i < got && i < offset + limit; i++)
+		out[(*num)++] = all[i];
+	free(all);
+	return total;
+}
@@ -0,0 +1,59 @@
+/*
+ * Search.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+#include "Conn.h"
+#include "Protocol.h"
+#include "Ingest.h"
+
+#define SEARCH_TEXT_MAX 256		/* Query text, '\0' included */
+#define SEARCH_NAME_MAX 128		/* Name sent with each result, '\0' included */
+#define SEARCH_PAGE_MAX 100		/* Results per answer */
+#define SEARCH_DEPTH_MAX 10000	/* Offset + limit, deeper pages aren't ranked */
+#define SEARCH_TOKEN_MAX 32		/* Longer words are cut */
+#define SEARCH_PREFIX 3			/* Letters a word* needs, shorter ones match whole words */
+#define SEARCH_PREFIX_MAX 5		/* Longer ones are checked on the names */
+#define SEARCH_EXT_MAX 8		/* Longer endings after a '.' aren't extensions */
+
+/*
+ * Inverted index of the shared file names. A file is its hash: it's found
+ * by the words of the name its first owner gave it (the part after the
+ * last '/'), its extension and the first 3 to 5 letters of each word.
+ * Files nobody has any more are skipped until there are enough of
+ * them to rebuild the index without.
+ *
+ * Queries are words, all of them must match: "word" matches whole words,
+ * "word*" words starting with it and "ext:pdf" the extension. Results go
+ * by owners first, the shorter name when tied.
+ */
+typedef struct search_index search_index;
+
+typedef struct search_result {
+	char				hash[HASH_LEN + 1];
+	unsigned long long	size;
+	unsigned int		owners;
+	char				name[SEARCH_NAME_MAX];
+} search_result;
+
+search_index *search_open();
+void search_close(search_index *);
+int search_add(search_index *, hash_record *);
+int search_remove(search_index *, char *);
+long search_add_list(search_index *, hash_list *);
+long search_remove_list(search_index *, hash_list *);
+long search_count(search_index *);
+unsigned long long search_memory(search_index *);
+long search_query(search_index *, char *, long, int, search_result *, int *);
+int search_compare(const search_result *, const search_result *);
+int parse_search(char *, char *, long *, int *);
+int send_search(conn *, char *, long, int);
+int send_results(conn *, long, search_result *, int);
+int read_results(conn *, long *, search_result *, int);
+long search_servers(conn **, int, char *, long, int, search_result *, int *);
+
+#endif /* SEARCH_H_ */
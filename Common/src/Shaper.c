@@ -0,0 +1,214 @@
+/*
+ ============================================================================
+ Name        : Shaper.c
+ Author      : Giacomo Persichini
+ Description : Token buckets limiting the transfers' bandwidth
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - free() - strtol() */
+#include <string.h> /* strcmp() - strncpy() - strdup() */
+#include <time.h> /* clock_gettime() - nanosleep() */
+#include <arpa/inet.h> /* INET_ADDRSTRLEN */
+
+#include "Shaper.h"
+#include "Config.h"
+#include "Log.h"
+
+#define USEC 1000000LL
+
+/* Tokens are kept in bytes times microseconds, so refills don't lose anything */
+#define SCALED_BURST ((long long) SHAPER_BURST * USEC)
+
+struct peer_limit {
+	char				ip[INET_ADDRSTRLEN];
+	bucket				b;
+	int					refs;
+	struct peer_limit	*next;
+};
+
+unsigned long long shaper_now() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * USEC + ts.tv_nsec / 1000;
+}
+
+/* Starts full, rate in bytes per second */
+void bucket_init(bucket *b, unsigned long long rate) {
+	b->rate = rate;
+	b->tokens = SCALED_BURST;
+	b->last = shaper_now();
+}
+
+/* Microseconds before the bucket may send again, 0 if it may now */
+unsigned long long bucket_delay(bucket *b, unsigned long long now) {
+	unsigned long long	elapsed;
+
+	if (b == NULL || b->rate == 0)
+		return 0;
+	elapsed = now > b->last ? now - b->last : 0;
+	b->last = now;
+	/* Long idle times would overflow the product, they fill it anyway */
+	if (elapsed >= (unsigned long long) (SCALED_BURST - b->tokens) / b->rate)
+		b->tokens = SCALED_BURST;
+	else
+		b->tokens += elapsed * b->rate;
+	if (b->tokens >= 0)
+		return 0;
+	return (-b->tokens + b->rate - 1) / b->rate;
+}
+
+void bucket_spend(bucket *b, size_t bytes) {
+	if (b != NULL && b->rate != 0)
+		b->tokens -= (long long) bytes * USEC;
+}
+
+/*
+ * Rates in bytes per second, 0 for no limit. weights may be NULL, every
+ * peer weighs 1 then.
+ */
+shaper *shaper_open(unsigned long long global, unsigned long long peer, unsigned long long transfer, char *weights) {
+	shaper	*s;
+
+	if ((s = calloc(1, sizeof(shaper))) == NULL)
+		return NULL;
+	bucket_init(&s->global, global);
+	s->peer_rate = peer;
+	s->transfer_rate = transfer;
+	if (weights != NULL && weights[0] != '\0')
+		s->weights = strdup(weights);
+	return s;
+}
+
+/*
+ * The limits of one direction, "upload" or "download": <dir>-limit for
+ * the whole peer, <dir>-peer-limit for each remote peer and
+ * <dir>-transfer-limit for each file, all in KB/s. peer-weights is shared.
+ */
+shaper *shaper_from_config(char *direction) {
+	char	key[64],
+			weights[CONFIG_LINE_SIZE];
+	int		limits[3],
+			i;
+	char	*names[] = { "limit", "peer-limit", "transfer-limit" };
+
+	for (i = 0; i < 3; i++) {
+		snprintf(key, sizeof(key), "%s-%s", direction, names[i]);
+		if ((limits[i] = i_read_config_default(key, 0)) < 0) {
+			log_warn("%s can't be negative, ignoring it.", key);
+			limits[i] = 0;
+		}
+	}
+	c_read_config_default(weights, "peer-weights", "");
+	return shaper_open(limits[0] * 1024ULL, limits[1] * 1024ULL, limits[2] * 1024ULL, weights);
+}
+
+void shaper_close(shaper *s) {
+	struct peer_limit	*p;
+
+	if (s == NULL)
+		return;
+	while ((p = s->peers) != NULL) {
+		s->peers = p->next;
+		free(p);
+	}
+	free(s->weights);
+	free(s);
+}
+
+/* Nothing to shape: no limits and no weights */
+int shaper_limited(shaper *s) {
+	return s != NULL && (s->global.rate != 0 || s->peer_rate != 0 || s->transfer_rate != 0 || s->weights != NULL);
+}
+
+/*
+ * The bucket every transfer with ip shares, NULL without a per-peer
+ * limit. Give it back with shaper_release() when the transfer is over.
+ */
+bucket *shaper_peer(shaper *s, char *ip) {
+	struct peer_limit	*p;
+
+	if (s == NULL || s->peer_rate == 0)
+		return NULL;
+	for (p = s->peers; p != NULL; p = p->next)
+		if (strcmp(p->ip, ip) == 0) {
+			p->refs++;
+			return &p->b;
+		}
+	if ((p = calloc(1, sizeof(struct peer_limit))) == NULL)
+		return NULL;
+	strncpy(p->ip, ip, sizeof(p->ip) - 1);
+	bucket_init(&p->b, s->peer_rate);
+	p->refs = 1;
+	p->next = s->peers;
+	s->peers = p;
+	return &p->b;
+}
+
+void shaper_release(shaper *s, bucket *b) {
+	struct peer_limit	**pp,
+						*p;
+
+	if (s == NULL || b == NULL)
+		return;
+	for (pp = &s->peers; (p = *pp) != NULL; pp = &p->next)
+		if (&p->b == b) {
+			if (--p->refs == 0) {
+				*pp = p->next;
+				free(p);
+			}
+			return;
+		}
+}
+
+/* The weight given to ip in peer-weights, 1 if it isn't there */
+int shaper_weight(shaper *s, char *ip) {
+	char	*p,
+			*end;
+	size_t	len = strlen(ip);
+	long	weight;
+
+	if (s == NULL || s->weights == NULL)
+		return 1;
+	for (p = s->weights; (p = strstr(p, ip)) != NULL; p += len) {
+		/* A whole entry, not the tail of a longer address */
+		if ((p != s->weights && p[-1] != ';') || p[len] != ':')
+			continue;
+		weight = strtol(p + len + 1, &end, 10);
+		if (end == p + len + 1 || weight < 1)
+			return 1;
+		return weight > SHAPER_MAX_WEIGHT ? SHAPER_MAX_WEIGHT : (int) weight;
+	}
+	return 1;
+}
+
+/*
+ * For the plain read/write loop, which moves one file at a time: pays for
+ * bytes already moved and sleeps until every bucket is out of debt.
+ */
+void shaper_throttle(shaper *s, bucket *peer, bucket *own, size_t bytes) {
+	unsigned long long	now,
+						delay,
+						d;
+	struct timespec		pause;
+
+	if (s == NULL)
+		return;
+	bucket_spend(&s->global, bytes);
+	bucket_spend(peer, bytes);
+	bucket_spend(own, bytes);
+	now = shaper_now();
+	delay = bucket_delay(&s->global, now);
+	if (peer != NULL && (d = bucket_delay(peer, now)) > delay)
+		delay = d;
+	if (own != NULL && (d = bucket_delay(own, now)) > delay)
+		delay = d;
+	if (delay == 0)
+		return;
+	pause.tv_sec = delay / USEC;
+	pause.tv_nsec = (delay % USEC) * 1000;
+	while (nanosleep(&pause, &pause) == -1)
+		;
+}
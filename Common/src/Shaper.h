@@ -0,0 +1,49 @@
+/*
+ * Shaper.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef SHAPER_H_
+#define SHAPER_H_
+
+#include <stddef.h> /* size_t */
+
+#define SHAPER_BURST 65536	/* Bytes an idle bucket may send at once */
+#define SHAPER_MAX_WEIGHT 100
+
+/*
+ * Token bucket: rate bytes per second, at most burst saved up. A chunk may
+ * go as soon as tokens aren't negative, and it's paid in full even if that
+ * leaves the bucket in debt, so the long-run rate is exact whatever the
+ * chunk size.
+ */
+typedef struct bucket {
+	unsigned long long	rate;	/* 0 means no limit */
+	long long			tokens;
+	unsigned long long	last;	/* usec of the last refill */
+} bucket;
+
+/* The limits of one direction, uploads or downloads */
+typedef struct shaper {
+	bucket				global;
+	unsigned long long	peer_rate;
+	unsigned long long	transfer_rate;
+	struct peer_limit	*peers;		/* Buckets shared by the transfers with a peer */
+	char				*weights;	/* "ip:weight;ip:weight", from the configuration */
+} shaper;
+
+unsigned long long shaper_now();
+void bucket_init(bucket *, unsigned long long);
+unsigned long long bucket_delay(bucket *, unsigned long long);
+void bucket_spend(bucket *, size_t);
+shaper *shaper_open(unsigned long long, unsigned long long, unsigned long long, char *);
+shaper *shaper_from_config(char *);
+void shaper_close(shaper *);
+int shaper_limited(shaper *);
+bucket *shaper_peer(shaper *, char *);
+void shaper_release(shaper *, bucket *);
+int shaper_weight(shaper *, char *);
+void shaper_throttle(shaper *, bucket *, bucket *, size_t);
+
+#endif /* SHAPER_H_ */
@@ -0,0 +1,242 @@
+/*
+ ============================================================================
+ Name        : Store.c
+ Author      : Giacomo Persichini
+ Description : Local files by their hash, so that the same content is kept once
+ ============================================================================
+ */
+
+#define _GNU_SOURCE /* copy_file_range() */
+
+#include <stdio.h>
+#include <string.h> /* strcmp() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* link() - unlink() - close() - copy_file_range() */
+#include <dirent.h> /* opendir() - readdir() */
+#include <sys/ioctl.h> /* ioctl() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* stat() - mkdir() */
+#include <linux/fs.h> /* FICLONE - FIDEDUPERANGE */
+/* Non-standard header files */
+#include <gcrypt.h> /* gcry_md_hash_buffer() */
+
+#include "Store.h"
+#include "Config.h"
+#include "Protocol.h"
+#include "Log.h"
+
+#define DEDUPE_STEP (16 << 20)	/* Filesystems may not dedupe more at once */
+
+/* dedupe=reflink, the default, hardlink or off */
+int store_mode() {
+	char	value[CONFIG_LINE_SIZE];
+
+	c_read_config_default(value, "dedupe", "reflink");
+	if (strcmp(value, "off") == 0)
+		return STORE_OFF;
+	if (strcmp(value, "hardlink") == 0)
+		return STORE_HARDLINK;
+	if (strcmp(value, "reflink") != 0)
+		log_warn("Unknown dedupe '%s', using reflink.", value);
+	return STORE_REFLINK;
+}
+
+int store_init(char *dir) {
+	if (mkdir(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/* The SHA-1 of a file's content, as hash_record has it */
+static int file_hash(char *path, char *hash) {
+	unsigned char	digest[20];
+	struct stat		st;
+	char			*buffer = NULL;
+	int				fd,
+					i;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1
+			|| (st.st_size > 0 && (buffer = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+		close(fd);
+		return -1;
+	}
+	gcry_md_hash_buffer(GCRY_MD_SHA1, digest, buffer, st.st_size);
+	for (i = 0; i < 20; i++)
+		sprintf(hash + i * 2, "%02x", digest[i]);
+	if (buffer != NULL)
+		munmap(buffer, st.st_size);
+	close(fd);
+	return 0;
+}
+
+/*
+ * Entries are links to files the user may edit in place: one is only
+ * trusted if its content still has the hash it's named after.
+ */
+static int entry_valid(char *entry, char *hash) {
+	char	got[HASH_LEN + 1];
+
+	return file_hash(entry, got) == 0 && strcmp(got, hash) == 0;
+}
+
+/*
+ * Asks the kernel to share from's blocks with to, where they're the same.
+ * It compares them itself, nothing changes if they aren't. Returns the
+ * bytes now shared.
+ */
+static long long dedupe_range(char *from, char *to, unsigned long long size) {
+	struct {
+		struct file_dedupe_range		range;
+		struct file_dedupe_range_info	info;
+	}					arg;
+	unsigned long long	offset = 0;
+	int					src = open(from, O_RDONLY),
+						dst = open(to, O_RDWR);
+
+	while (src != -1 && dst != -1 && offset < size) {
+		memset(&arg, 0, sizeof(arg));
+		arg.range.src_offset = offset;
+		arg.range.src_length = size - offset < DEDUPE_STEP ? size - offset : DEDUPE_STEP;
+		arg.range.dest_count = 1;
+		arg.info.dest_fd = dst;
+		arg.info.dest_offset = offset;
+		if (ioctl(src, FIDEDUPERANGE, &arg) == -1 || arg.info.status != FILE_DEDUPE_RANGE_SAME
+				|| arg.info.bytes_deduped == 0)
+			break;
+		offset += arg.info.bytes_deduped;
+	}
+	if (src != -1)
+		close(src);
+	if (dst != -1)
+		close(dst);
+	return offset;
+}
+
+/*
+ * Records path, whose content hashes to hash. If the store already has
+ * that content in another file the two are deduplicated as mode says.
+ * Returns the bytes that stopped taking space of their own, -1 on errors.
+ */
+long long store_add(char *dir, char *hash, char *path, int mode) {
+	char		entry[1024],
+				tmp[1100];
+	struct stat	st,
+				e;
+
+	snprintf(entry, sizeof(entry), "%s/%s", dir, hash);
+	if (stat(path, &st) == -1)
+		return -1;
+	if (link(path, entry) == 0)
+		return 0;
+	/* Another filesystem: the store can't have it, nothing can be shared with it either */
+	if (errno == EXDEV)
+		return 0;
+	if (errno != EEXIST || stat(entry, &e) == -1)
+		return -1;
+	if (e.st_dev == st.st_dev && e.st_ino == st.st_ino)
+		return 0;
+	if (e.st_size != st.st_size || !entry_valid(entry, hash)) {
+		/* Edited since it was added, this one takes its place */
+		if (unlink(entry) == -1 || link(path, entry) == -1)
+			return -1;
+		return 0;
+	}
+	switch (mode) {
+	case STORE_REFLINK:
+		return dedupe_range(entry, path, st.st_size);
+	case STORE_HARDLINK:
+		/* Renamed over it, path never goes missing */
+		snprintf(tmp, sizeof(tmp), "%s.store", path);
+		unlink(tmp);
+		if (link(entry, tmp) == -1)
+			return -1;
+		if (rename(tmp, path) == -1) {
+			unlink(tmp);
+			return -1;
+		}
+		return st.st_size;
+	default:
+		return 0;
+	}
+}
+
+/* A private copy: cloned if the filesystem can, copied by the kernel otherwise */
+static int copy_entry(char *entry, char *target) {
+	struct stat	st;
+	loff_t		in = 0,
+				out = 0;
+	ssize_t		n = 0;
+	int			src = open(entry, O_RDONLY),
+				dst = open(target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH),
+				ret = -1;
+
+	if (src != -1 && dst != -1 && fstat(src, &st) == 0) {
+		if (ioctl(dst, FICLONE, src) == 0)
+			ret = 0;
+		else {
+			while (in < st.st_size && (n = copy_file_range(src, &in, dst, &out, st.st_size - in, 0)) > 0)
+				;
+			if (in == st.st_size)
+				ret = 0;
+		}
+	}
+	if (src != -1)
+		close(src);
+	if (dst != -1 && close(dst) == -1)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Puts the content with hash at target, if the store has it: a download
+ * that doesn't need the network. With hardlinks target becomes one more
+ * name of the same file. Returns 1 if it's there, 0 if the store doesn't
+ * have it and -1 on errors.
+ */
+int store_place(char *dir, char *hash, char *target, int mode) {
+	char	entry[1024],
+			tmp[1100];
+
+	snprintf(entry, sizeof(entry), "%s/%s", dir, hash);
+	if (access(entry, R_OK) == -1)
+		return 0;
+	if (!entry_valid(entry, hash)) {
+		unlink(entry);
+		return 0;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.store", target);
+	unlink(tmp);
+	if ((mode != STORE_HARDLINK || link(entry, tmp) == -1) && copy_entry(entry, tmp) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, target) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+	return 1;
+}
+
+/* Entries nothing else links to any more: their files have been deleted */
+int store_prune(char *dir) {
+	DIR				*d;
+	struct dirent	*ent;
+	struct stat		st;
+	char			entry[1024];
+	int				removed = 0;
+
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(entry, sizeof(entry), "%s/%s", dir, ent->d_name);
+		if (lstat(entry, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(entry) == 0)
+			removed++;
+	}
+	closedir(d);
+	return removed;
+}
@@ -0,0 +1,24 @@
+/*
+ * Store.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+/*
+ * Every file the peer has, shared or downloaded, under its hash: one hard
+ * link each in the store's folder, so entries cost no space of their own.
+ */
+#define STORE_OFF 0			/* Files with the same content are left alone */
+#define STORE_REFLINK 1		/* They share their blocks, copy-on-write, if the filesystem can */
+#define STORE_HARDLINK 2	/* They become one file: editing one edits them all */
+
+int store_mode();
+int store_init(char *);
+long long store_add(char *, char *, char *, int);
+int store_place(char *, char *, char *, int);
+int store_prune(char *);
+
+#endif /* STORE_H_ */
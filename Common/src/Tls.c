@@ -0,0 +1,229 @@
+/*
+ ============================================================================
+ Name        : Tls.c
+ Author      : Giacomo Persichini
+ Description : Connections encrypted with TLS, by the kernel when it can
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h> /* strcmp() */
+#include <errno.h> /* errno */
+#include <poll.h> /* POLLIN - POLLOUT */
+/* Non-standard header files */
+#include <openssl/ssl.h> /* SSL_CTX_new() - SSL_connect() - SSL_read() */
+#include <openssl/err.h> /* ERR_get_error() */
+
+#include "Tls.h"
+#include "Protocol.h"
+#include "Config.h"
+#include "Log.h"
+
+static SSL_CTX	*ctx = NULL;
+static int		policy = TLS_OFF;
+
+/* tls=off, the default, on or required */
+int tls_mode() {
+	char	value[CONFIG_LINE_SIZE];
+
+	c_read_config_default(value, "tls", "off");
+	if (strcmp(value, "on") == 0)
+		return TLS_ON;
+	if (strcmp(value, "required") == 0)
+		return TLS_REQUIRED;
+	if (strcmp(value, "off") != 0)
+		log_warn("Unknown tls '%s', using off.", value);
+	return TLS_OFF;
+}
+
+static void log_ssl(char *what) {
+	char	reason[256] = "unknown reason";
+
+	if (ERR_peek_error() != 0)
+		ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+	ERR_clear_error();
+	log_error("%s: %s.", what, reason);
+}
+
+/*
+ * For the whole program, both ends of every connection: this side's
+ * certificate and key (PEM), and the CA the other side's must be signed
+ * by, both ways. Without a CA nobody's certificate is checked, the
+ * connections are only encrypted: not enough for TLS_REQUIRED, an error
+ * then. With kernel set the kernel is asked to
+ * take over once the hand-shake is done. Returns 0 or -1.
+ */
+int tls_init(int mode, char *cert, char *key, char *ca, int kernel) {
+	if (ctx != NULL)
+		SSL_CTX_free(ctx);
+	ctx = NULL;
+	policy = mode;
+	if (mode == TLS_OFF)
+		return 0;
+	if ((ctx = SSL_CTX_new(TLS_method())) == NULL) {
+		log_ssl("Couldn't set up TLS");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/* Connections aren't resumed, and kTLS can't read tickets coming after the hand-shake */
+	SSL_CTX_set_num_tickets(ctx, 0);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	if (kernel)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(ctx) != 1) {
+		log_ssl("Couldn't load the TLS certificate and key");
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+	if ((ca == NULL || ca[0] == '\0') && mode == TLS_REQUIRED) {
+		log_error("tls=required needs tls-ca: without it anybody's certificate would do.");
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+	if (ca == NULL || ca[0] == '\0')
+		log_warn("No tls-ca: connections are encrypted, but nobody's certificate is checked.");
+	else if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) {
+		log_ssl("Couldn't load the TLS CA");
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+	else
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	return 0;
+}
+
+/* tls_init() from the config: tls, tls-cert, tls-key, tls-ca and tls-kernel=on, the default, or off */
+int tls_setup() {
+	char	cert[CONFIG_LINE_SIZE],
+			key[CONFIG_LINE_SIZE],
+			ca[CONFIG_LINE_SIZE],
+			kernel[CONFIG_LINE_SIZE];
+	int		mode = tls_mode();
+
+	c_read_config_default(cert, "tls-cert", "cert.pem");
+	c_read_config_default(key, "tls-key", "key.pem");
+	c_read_config_default(ca, "tls-ca", "");
+	c_read_config_default(kernel, "tls-kernel", "on");
+	return tls_init(mode, cert, key, ca, strcmp(kernel, "off") != 0);
+}
+
+/* What to add to the options offered in hand-shakes */
+int tls_offer() {
+	return ctx != NULL ? OPT_TLS : 0;
+}
+
+int tls_required() {
+	return policy == TLS_REQUIRED;
+}
+
+/*
+ * The TLS hand-shake on c, as the server if accepted is set. Nothing may
+ * be in c's buffer: OpenSSL reads the socket itself. Returns 0 or -1.
+ */
+int tls_start(conn *c, int accepted) {
+	SSL		*ssl;
+	long	verified;
+
+	if (ctx == NULL || conn_buffered(c) > 0 || c->out_len > 0)
+		return -1;
+	if ((ssl = SSL_new(ctx)) == NULL || SSL_set_fd(ssl, c->fd) != 1) {
+		log_ssl("Couldn't start TLS");
+		SSL_free(ssl);
+		return -1;
+	}
+	if ((accepted ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+		if ((verified = SSL_get_verify_result(ssl)) != X509_V_OK)
+			log_error("TLS hand-shake failed: %s.", X509_verify_cert_error_string(verified));
+		else
+			log_ssl("TLS hand-shake failed");
+		SSL_free(ssl);
+		return -1;
+	}
+	c->tls = ssl;
+	c->tls_kernel = (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? TLS_SEND : 0)
+			| (BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? TLS_RECV : 0);
+	return 0;
+}
+
+/* If the socket itself can be read or written, TLS_RECV or TLS_SEND, with io_uring for one */
+int tls_raw(conn *c, int direction) {
+	return c->tls == NULL || (c->tls_kernel & direction) == direction;
+}
+
+/*
+ * read() for a TLS connection. Returns 0 when the other side closed it;
+ * on a non-blocking socket -1 with errno EAGAIN until a whole record has
+ * come, see tls_wants(). What OpenSSL has left of a record is read too:
+ * select() can't tell about it.
+ */
+ssize_t tls_read(conn *c, void *buffer, size_t len) {
+	int		n;
+	size_t	got;
+
+	do {
+		errno = 0;
+		n = SSL_read(c->tls, buffer, len > (size_t) 1 << 30 ? 1 << 30 : len);
+	} while (n <= 0 && SSL_get_error(c->tls, n) == SSL_ERROR_SYSCALL && errno == EINTR);
+	if (n > 0) {
+		for (got = n; got < len && SSL_pending(c->tls) > 0; got += n)
+			if ((n = SSL_read(c->tls, (char *) buffer + got, len - got > (size_t) 1 << 30 ? 1 << 30 : len - got)) <= 0)
+				break;
+		ERR_clear_error();
+		return got;
+	}
+	switch (SSL_get_error(c->tls, n)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		/* Closed without a close_notify */
+		return errno == 0 ? 0 : -1;
+	default:
+		ERR_clear_error();
+		return -1;
+	}
+}
+
+/*
+ * write() for a TLS connection, all of it or -1. On a non-blocking socket
+ * errno is EAGAIN if it has to be tried again, with the same bytes, once
+ * the socket is ready for tls_wants().
+ */
+ssize_t tls_write(conn *c, const void *buffer, size_t len) {
+	int	n,
+		err;
+
+	do
+		n = SSL_write(c->tls, buffer, len > (size_t) 1 << 30 ? 1 << 30 : len);
+	while (n <= 0 && (err = SSL_get_error(c->tls, n)) == SSL_ERROR_SYSCALL && errno == EINTR);
+	if (n <= 0) {
+		ERR_clear_error();
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+			errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
+
+/* What the socket must be ready for, POLLIN or POLLOUT, after EAGAIN */
+short tls_wants(conn *c) {
+	return SSL_want_write(c->tls) ? POLLOUT : POLLIN;
+}
+
+/* Says goodbye without waiting for the answer, the socket is closed right after */
+void tls_end(conn *c) {
+	if (c->tls == NULL)
+		return;
+	SSL_shutdown(c->tls);
+	SSL_free(c->tls);
+	ERR_clear_error();
+	c->tls = NULL;
+	c->tls_kernel = 0;
+}
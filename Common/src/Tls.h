@@ -0,0 +1,39 @@
+/*
+ * Tls.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stddef.h> /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+#include "Conn.h"
+
+/*
+ * TLS between peers and with the server, agreed on in the hand-shake
+ * (OPT_TLS). The kernel takes over the records where it can (kTLS): the
+ * socket then moves plaintext as before, io_uring and all. Where it
+ * can't, conn_read() and conn_write() go through OpenSSL instead.
+ */
+#define TLS_OFF 0
+#define TLS_ON 1			/* Offered, plaintext with those that don't */
+#define TLS_REQUIRED 2		/* Those that don't are dropped */
+#define TLS_SEND 1			/* The kernel encrypts what's written on the socket */
+#define TLS_RECV 2			/* The kernel decrypts what's read from it */
+
+int tls_mode();
+int tls_init(int, char *, char *, char *, int);
+int tls_setup();
+int tls_offer();
+int tls_required();
+int tls_start(conn *, int);
+int tls_raw(conn *, int);
+ssize_t tls_read(conn *, void *, size_t);
+ssize_t tls_write(conn *, const void *, size_t);
+short tls_wants(conn *);
+void tls_end(conn *);
+
+#endif /* TLS_H_ */
@@ -0,0 +1,181 @@
+/*
+ ============================================================================
+ Name        : Verify.c
+ Author      : Giacomo Persichini
+ Description : Downloads checked against their hash while they're received
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc() - free() */
+#include <string.h> /* memset() - memcpy() - strcmp() */
+#include <unistd.h> /* unlink() */
+#include <pthread.h> /* stuff with threads */
+/* Non-standard header files */
+#include <gcrypt.h> /* gcry_md_open() - gcry_md_write() - gcry_md_read() */
+
+#include "Verify.h"
+#include "Protocol.h"
+#include "Log.h"
+
+int verify_open(verifier *v) {
+	gcry_md_hd_t	md;
+
+	memset(v, 0, sizeof(verifier));
+	if (gcry_md_open(&md, GCRY_MD_SHA1, 0) != 0)
+		return -1;
+	v->md = md;
+	return 0;
+}
+
+struct verify_queue {
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	more,	/* Something to hash, or done */
+					room;	/* Something hashed */
+	void			*md;	/* The verifier's, the thread's alone meanwhile */
+	char			*ring;
+	size_t			start,	/* Where the bytes not hashed yet begin */
+					used;
+	int				done;	/* Nothing more is coming */
+};
+
+/* The hashing thread: the ring's pieces, as they're put in, until done */
+static void *hasher(void *arg) {
+	verify_queue	*q = arg;
+	size_t			n;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->used == 0 && !q->done)
+			pthread_cond_wait(&q->more, &q->lock);
+		if (q->used == 0)
+			break;
+		/* Hashed outside the lock, the caller doesn't write over it meanwhile */
+		n = q->used < VERIFY_QUEUE - q->start ? q->used : VERIFY_QUEUE - q->start;
+		pthread_mutex_unlock(&q->lock);
+		gcry_md_write((gcry_md_hd_t) q->md, q->ring + q->start, n);
+		pthread_mutex_lock(&q->lock);
+		q->start = (q->start + n) % VERIFY_QUEUE;
+		q->used -= n;
+		pthread_cond_signal(&q->room);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/* Starts the hashing thread. Returns 0, or -1 and the caller goes on hashing */
+static int queue_start(verifier *v) {
+	verify_queue	*q;
+
+	if ((q = calloc(1, sizeof(verify_queue))) == NULL || (q->ring = malloc(VERIFY_QUEUE)) == NULL) {
+		free(q);
+		return -1;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->more, NULL);
+	pthread_cond_init(&q->room, NULL);
+	q->md = v->md;
+	if (pthread_create(&q->thread, NULL, hasher, q) != 0) {
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->more);
+		pthread_cond_destroy(&q->room);
+		free(q->ring);
+		free(q);
+		return -1;
+	}
+	v->q = q;
+	return 0;
+}
+
+/* Waits for everything queued to be hashed, then the thread goes */
+static void queue_stop(verifier *v) {
+	verify_queue	*q = v->q;
+
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_signal(&q->more);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->more);
+	pthread_cond_destroy(&q->room);
+	free(q->ring);
+	free(q);
+	v->q = NULL;
+}
+
+/*
+ * Takes a verifier as void *, so that it fits receive_stream(). Past
+ * VERIFY_INLINE the piece is only copied, the hashing thread takes it
+ * from there: data is the caller's buffer, about to be filled again.
+ */
+void verify_data(void *arg, const char *data, size_t len) {
+	verifier		*v = arg;
+	verify_queue	*q;
+	size_t			end,
+					n;
+
+	if (v->q == NULL && (v->bytes + len <= VERIFY_INLINE || queue_start(v) == -1)) {
+		gcry_md_write((gcry_md_hd_t) v->md, data, len);
+		v->bytes += len;
+		return;
+	}
+	q = v->q;
+	v->bytes += len;
+	pthread_mutex_lock(&q->lock);
+	while (len > 0) {
+		while (q->used == VERIFY_QUEUE)
+			pthread_cond_wait(&q->room, &q->lock);
+		end = (q->start + q->used) % VERIFY_QUEUE;
+		n = VERIFY_QUEUE - q->used;
+		n = n < VERIFY_QUEUE - end ? n : VERIFY_QUEUE - end;
+		n = n < len ? n : len;
+		/* The thread only reads what's used, the rest is this side's */
+		pthread_mutex_unlock(&q->lock);
+		memcpy(q->ring + end, data, n);
+		pthread_mutex_lock(&q->lock);
+		q->used += n;
+		pthread_cond_signal(&q->more);
+		data += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* 1 if what came so far hashes to hash, 0 otherwise. Nothing more may come after */
+int verify_match(verifier *v, char *hash) {
+	char	got[HASH_LEN + 1];
+
+	queue_stop(v);
+	digest_hash(gcry_md_read((gcry_md_hd_t) v->md, GCRY_MD_SHA1), got);
+	return strcmp(got, hash) == 0;
+}
+
+void verify_close(verifier *v) {
+	queue_stop(v);
+	if (v->md != NULL)
+		gcry_md_close((gcry_md_hd_t) v->md);
+	v->md = NULL;
+}
+
+/*
+ * receive_file() for a file that must hash to hash. One that doesn't is
+ * removed and VERIFY_MISMATCH returned.
+ */
+int receive_verified(char *filepath, conn *c, char *hash) {
+	verifier	v;
+	int			ret;
+
+	if (verify_open(&v) == -1)
+		return 0;
+	if ((ret = receive_stream(filepath, c, FILE_SIZE_MAX, verify_data, &v)) == 1 && !verify_match(&v, hash)) {
+		log_error("%s doesn't match its hash, %llu bytes thrown away.", filepath, v.bytes);
+		unlink(filepath);
+		ret = VERIFY_MISMATCH;
+	}
+	verify_close(&v);
+	return ret;
+}
@@ -0,0 +1,39 @@
+/*
+ * Verify.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <stddef.h> /* size_t */
+
+#include "Conn.h"
+
+#define VERIFY_MISMATCH -1	/* The whole file came, its content has another hash */
+
+#define VERIFY_INLINE (256 * 1024)	/* Hashed by the caller up to this much, past it on a thread of its own */
+#define VERIFY_QUEUE (4 << 20)		/* Bytes copied for that thread and not hashed yet, at most */
+
+/* Pieces waiting for the hashing thread, in a ring */
+typedef struct verify_queue verify_queue;
+
+/*
+ * The SHA-1 of a download, fed as the pieces are written: once the last
+ * one is in there's nothing left to read back. A large one is hashed on
+ * another thread while the next pieces are received.
+ */
+typedef struct verifier {
+	void				*md;	/* gcry_md_hd_t */
+	unsigned long long	bytes;
+	verify_queue		*q;		/* NULL while the caller hashes */
+} verifier;
+
+int verify_open(verifier *);
+void verify_data(void *, const char *, size_t);
+int verify_match(verifier *, char *);
+void verify_close(verifier *);
+int receive_verified(char *, conn *, char *);
+
+#endif /* VERIFY_H_ */
@@ -0,0 +1,114 @@
+/*
+ ============================================================================
+ Name        : Wheel.c
+ Author      : Giacomo Persichini
+ Description : Timeouts by the hundred thousand, O(1) each
+ ============================================================================
+ */
+
+#include <stddef.h> /* NULL */
+
+#include "Wheel.h"
+
+#define SPAN(level) (1ULL << (WHEEL_BITS * ((level) + 1)))
+
+void wheel_init(wheel *w, unsigned long long now) {
+	int	l,
+		s;
+
+	w->now = now;
+	w->count = 0;
+	for (l = 0; l < WHEEL_LEVELS; l++)
+		for (s = 0; s < WHEEL_SLOTS; s++)
+			w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+}
+
+/* Into the slot of the lowest level that reaches that far */
+static void place(wheel *w, wheel_timer *t) {
+	unsigned long long	at = t->expires > w->now ? t->expires : w->now;
+	wheel_timer			*head;
+	int					l;
+
+	for (l = 0; l < WHEEL_LEVELS - 1 && at - w->now >= SPAN(l); l++)
+		;
+	if (at - w->now >= SPAN(l))
+		at = w->now + SPAN(l) - 1;
+	head = &w->slots[l][(at >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1)];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/* Fires on the first tick past expires, at once if that's gone already */
+void wheel_add(wheel *w, wheel_timer *t, unsigned long long expires) {
+	if (t->next != NULL)
+		wheel_del(w, t);
+	t->expires = expires > w->now ? expires : w->now + 1;
+	place(w, t);
+	w->count++;
+}
+
+void wheel_del(wheel *w, wheel_timer *t) {
+	if (t->next == NULL)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	w->count--;
+}
+
+/* The slot's timers are due within the next 64^level ticks, one level down */
+static void cascade(wheel *w, int level) {
+	wheel_timer	*head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)],
+				*t = head->next,
+				*next;
+
+	head->next = head->prev = head;
+	for (; t != head; t = next) {
+		next = t->next;
+		place(w, t);
+	}
+}
+
+/*
+ * Moves the wheel to tick now, calling fire on every timer that expired.
+ * The timer is out of the wheel by then, fire may add it again or free it.
+ * Returns how many fired.
+ */
+long wheel_advance(wheel *w, unsigned long long now, void (*fire)(wheel_timer *, void *), void *arg) {
+	wheel_timer	due,
+				*head,
+				*t;
+	long		fired = 0;
+	int			l;
+
+	while (w->now < now) {
+		/* Nothing to wait for, nothing to go through */
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+		w->now++;
+		for (l = 1; l < WHEEL_LEVELS && (w->now & (SPAN(l - 1) - 1)) == 0; l++)
+			cascade(w, l);
+
+		/* Taken out whole first: fire may add timers to this very slot */
+		head = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+		if (head->next == head)
+			continue;
+		due.next = head->next;
+		due.prev = head->prev;
+		due.next->prev = due.prev->next = &due;
+		head->next = head->prev = head;
+		while ((t = due.next) != &due) {
+			due.next = t->next;
+			t->next->prev = &due;
+			t->next = t->prev = NULL;
+			w->count--;
+			fired++;
+			fire(t, arg);
+		}
+	}
+	return fired;
+}
@@ -0,0 +1,41 @@
+/*
+ * Wheel.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4		/* 64^4 ticks ahead, later timers wait in the last slot */
+
+/*
+ * Goes inside whatever needs a timeout. It's in one list of the wheel
+ * while armed, next is NULL otherwise.
+ */
+typedef struct wheel_timer {
+	struct wheel_timer	*next;
+	struct wheel_timer	*prev;
+	unsigned long long	expires;	/* Tick */
+} wheel_timer;
+
+/*
+ * Hierarchical timing wheel: level l holds the timers due within 64^(l+1)
+ * ticks, by 64^l ticks per slot. Adding and removing a timer is O(1), a
+ * tick fires its slot of the first level and every 64 ticks the next slot
+ * of a higher level is spread over the lower ones.
+ */
+typedef struct wheel {
+	unsigned long long	now;		/* Last tick done */
+	long				count;		/* Timers armed */
+	wheel_timer			slots[WHEEL_LEVELS][WHEEL_SLOTS];	/* List heads */
+} wheel;
+
+void wheel_init(wheel *, unsigned long long);
+void wheel_add(wheel *, wheel_timer *, unsigned long long);
+void wheel_del(wheel *, wheel_timer *);
+long wheel_advance(wheel *, unsigned long long, void (*)(wheel_timer *, void *), void *);
+
+#endif /* WHEEL_H_ */
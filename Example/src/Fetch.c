@@ -0,0 +1,93 @@
+/*
+ ============================================================================
+ Name        : Fetch.c
+ Author      : Giacomo Persichini
+ Description : Downloads files by hash with the client library, all at once
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi() */
+#include <string.h> /* strcmp() */
+
+#include "Client.h"
+
+static int	failed = 0;
+
+static char *status_name(int status) {
+	switch (status) {
+	case CLIENT_OK:
+		return "ok";
+	case CLIENT_NOTFOUND:
+		return "nobody has it";
+	case CLIENT_MISMATCH:
+		return "didn't match its hash, deleted";
+	case CLIENT_BUSY:
+		return "the server is busy";
+	default:
+		return "failed";
+	}
+}
+
+static void connected(void *arg, int status) {
+	if (status != CLIENT_OK)
+		fprintf(stderr, "[ERROR] %s: %s\n", (char *) arg, status_name(status));
+}
+
+static void done(void *arg, char *hash, int status, unsigned long long bytes) {
+	if (status == CLIENT_OK)
+		printf("[INFO] %s: %llu bytes\n", hash, bytes);
+	else {
+		fprintf(stderr, "[ERROR] %s: %s\n", hash, status_name(status));
+		failed++;
+	}
+}
+
+/*
+ * Fetch [-z] [-j downloads] server-ip server-port hash...
+ * Fetch [-z] [-j downloads] -p peer-ip hash...
+ * Every hash is looked up in one go and downloaded in the current folder,
+ * named after it, at most downloads (8) at a time; -z offers compression.
+ * With -p they all come from that peer in bundles, nobody is asked.
+ */
+int main(int argc, char **argv) {
+	client	*c;
+	char	*peer = NULL;
+	int		downloads = 8,
+			options = 0,
+			i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-z") == 0)
+			options = OPT_ZLIB;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			downloads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			peer = argv[++i];
+		else
+			break;
+	}
+	if (argc - i < (peer == NULL ? 3 : 1)) {
+		fprintf(stderr, "Usage: %s [-z] [-j downloads] (server-ip server-port | -p peer-ip) hash...\n", argv[0]);
+		return 1;
+	}
+	if ((c = client_open(downloads, options)) == NULL
+			|| (peer == NULL && client_connect(c, argv[i], atoi(argv[i + 1]), connected, argv[i]) == -1)) {
+		fprintf(stderr, "[ERROR] Couldn't connect to %s\n", peer == NULL ? argv[i] : peer);
+		client_close(c);
+		return 1;
+	}
+	if (peer != NULL && client_bundle(c, peer, argv + i, argv + i, argc - i, done, NULL) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't ask %s for them, are they all hashes?\n", peer);
+		failed++;
+	}
+	for (i += 2; peer == NULL && i < argc; i++)
+		if (client_fetch(c, argv[i], argv[i], done, NULL) == -1) {
+			fprintf(stderr, "[ERROR] %s isn't a hash\n", argv[i]);
+			failed++;
+		}
+	while (client_run(c, -1) > 0)
+		;
+	client_close(c);
+	return failed > 0;
+}
@@ -0,0 +1,160 @@
+/*
+ ============================================================================
+ Name        : Index.c
+ Author      : Giacomo Persichini
+ Description : In-memory copy of the hash file, shared by every thread
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* calloc() - realloc() - free() */
+#include <string.h> /* strcmp() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* read() - close() */
+#include <pthread.h> /* pthread_mutex_t */
+
+#include "Index.h"
+
+static shared_file		*files = NULL;
+static int				files_num = 0;
+static int				*slots = NULL;	/* Open addressing by hash: the file's place + 1, 0 if free */
+static unsigned int		slots_mask = 0;
+static pthread_mutex_t	index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a of the hex digits */
+static unsigned int slot_of(const char *hash, unsigned int mask) {
+	unsigned int	x = 2166136261U;
+
+	while (*hash != '\0')
+		x = (x ^ (unsigned char) *hash++) * 16777619U;
+	return x & mask;
+}
+
+/* Where hash is in files, -1 if it isn't. The lock must be held */
+static int lookup(char *hash) {
+	unsigned int	i;
+
+	if (slots == NULL)
+		return -1;
+	for (i = slot_of(hash, slots_mask); slots[i] != 0; i = (i + 1) & slots_mask)
+		if (strcmp(files[slots[i] - 1].rec.hash, hash) == 0)
+			return slots[i] - 1;
+	return -1;
+}
+
+/* A table twice as large as num, at least: the first of files listed twice is found, like a scan would */
+static int *build_slots(shared_file *loaded, int num, unsigned int *mask) {
+	unsigned int	size = 16,
+					j;
+	int				*table,
+					i;
+
+	while (size < 2 * (unsigned int) num)
+		size <<= 1;
+	if ((table = calloc(size, sizeof(int))) == NULL)
+		return NULL;
+	*mask = size - 1;
+	for (i = 0; i < num; i++) {
+		for (j = slot_of(loaded[i].rec.hash, *mask); table[j] != 0; j = (j + 1) & *mask)
+			if (strcmp(loaded[table[j] - 1].rec.hash, loaded[i].rec.hash) == 0)
+				break;
+		if (table[j] == 0)
+			table[j] = i + 1;
+	}
+	return table;
+}
+
+/*
+ * (Re)loads the hash file in memory, keeping only well formed records.
+ * Returns the number of shared files.
+ */
+int load_hash_index() {
+	hash_record		hrec;
+	shared_file		*loaded = NULL,
+					*tmp;
+	int				*table,
+					num = 0,
+					size = 0,
+					hash_file;
+	unsigned int	mask = 0;
+
+	hash_file = open(HASH_FILE, O_RDONLY);
+	/* No need to notice the user in case of error, there is nothing to share */
+	if (hash_file != -1) {
+		while (read(hash_file, &hrec, sizeof(hrec)) == sizeof(hrec)) {
+			/* Am I reading a file made of real hash_record-s? */
+			if (strnlen(hrec.hash, sizeof(hrec.hash)) != sizeof(hrec.hash) - 1)
+				continue;
+			if (num == size) {
+				size = size ? size * 2 : 64;
+				if ((tmp = realloc(loaded, size * sizeof(shared_file))) == NULL) {
+					fprintf(stderr, "[ERROR] Not enough memory to load the hash file.\n");
+					break;
+				}
+				loaded = tmp;
+			}
+			loaded[num].rec = hrec;
+			loaded[num].rec.filename[sizeof(hrec.filename) - 1] = '\0';
+			loaded[num].bytes_served = 0;
+			loaded[num].requests = 0;
+			num++;
+		}
+		close(hash_file);
+	}
+	if ((table = build_slots(loaded, num, &mask)) == NULL)
+		num = 0;
+
+	pthread_mutex_lock(&index_lock);
+	free(files);
+	free(slots);
+	files = loaded;
+	files_num = num;
+	slots = table;
+	slots_mask = mask;
+	pthread_mutex_unlock(&index_lock);
+	return num;
+}
+
+int index_count() {
+	int	num;
+
+	pthread_mutex_lock(&index_lock);
+	num = files_num;
+	pthread_mutex_unlock(&index_lock);
+	return num;
+}
+
+/* Copies the record of the given hash in out, returns 1 if it has been found */
+int index_find(char *hash, hash_record *out) {
+	int	i;
+
+	pthread_mutex_lock(&index_lock);
+	if ((i = lookup(hash)) != -1) {
+		*out = files[i].rec;
+		files[i].requests++;
+	}
+	pthread_mutex_unlock(&index_lock);
+	return i != -1;
+}
+
+void index_served(char *hash, unsigned long long bytes) {
+	int	i;
+
+	pthread_mutex_lock(&index_lock);
+	if ((i = lookup(hash)) != -1)
+		files[i].bytes_served += bytes;
+	pthread_mutex_unlock(&index_lock);
+}
+
+/* One line per shared file: hash, requests, bytes served and path */
+int index_format(char *out, int size) {
+	int	i,
+		len = 0;
+
+	pthread_mutex_lock(&index_lock);
+	for (i = 0; i < files_num && len < size; i++)
+		len += snprintf(out + len, size - len, "file %s %lu %llu %s\n", files[i].rec.hash,
+				files[i].requests, files[i].bytes_served, files[i].rec.filename);
+	pthread_mutex_unlock(&index_lock);
+	return len < size ? len : size;
+}
@@ -0,0 +1,25 @@
+/*
+ * Index.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include "Peer.h"
+#include "Protocol.h"
+
+typedef struct shared_file {
+	hash_record			rec;
+	unsigned long long	bytes_served;
+	unsigned long		requests;
+} shared_file;
+
+int load_hash_index();
+int index_count();
+int index_find(char *, hash_record *);
+void index_served(char *, unsigned long long);
+int index_format(char *, int);
+
+#endif /* INDEX_H_ */
@@ -11,18 +11,38 @@
 #include <dirent.h> /* DIR* - stuff with directories */
 #include <sys/stat.h> /* mkdir() - creat() */
 #include <fcntl.h> /* open() */
-#include <sys/mman.h> /* mmap() */
 #include <unistd.h> /* write() - read() - close() - etc... */
+#include <time.h> /* nanosleep() - time() */
 #include <sys/socket.h> /* AF_INET - SOCK_STREAM */
 #include <arpa/inet.h> /* inet_addr() */
 #include <pthread.h> /* stuff with threads */
 #include <errno.h> /* errno */
+#include <signal.h> /* signal() - SIGPIPE */
 /* Non-standard header files */
 #include <gcrypt.h> /* gcry_md_get_algo_dlen() - gcry_md_hash_buffer() */
 
 #include "Peer.h"
+#include "Index.h"
+#include "Stats.h"
+#include "Config.h"
+#include "Conn.h"
+#include "Protocol.h"
+#include "Engine.h"
+#include "Delta.h"
+#include "Cache.h"
+#include "Tls.h"
+#include "Store.h"
+#include "Shaper.h"
+#include "Dht.h"
+#include "Search.h"
+#include "Log.h"
 
 volatile short int quit;
+engine *downloads = NULL;	/* Used by the UI thread only */
+int options;	/* Offered in every hand-shake */
+int dedupe;		/* How files with the same content share it, STORE_* */
+dht *node = NULL;	/* discovery=dht, requests are answered by the listener */
+hot_cache *hot = NULL;	/* The files uploaded most, NULL with hot-fds=0 */
 
 void clrscr() {
 	register int i;
@@ -43,119 +63,6 @@ unsigned long get_size_by_fd(int fd) {
     return statbuf.st_size;
 }
 
-int create_config_file() {
-	char	ex[] = "server-ip=1.2.3.4\nserver-port=1313\nshared-folder=/home/user/shared;/home/user/public";
-	int		config_file;
-
-	if ((config_file = creat(CONFIG_FILE, S_IREAD | S_IWRITE)) == -1) {
-		switch(errno) {
-		case EACCES:	/* Insufficient permissions */
-			fprintf(stderr, "[ERROR] Not enough permission to create an example configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "An error has occured while creating an example configuration file.");
-			break;
-		}
-		return -1;
-	}
-	else {
-		if (write(config_file, ex, strlen(ex)) == -1) {
-			close(config_file);
-			fprintf(stderr, "Not enough permission to write an example configuration file.\n");
-			return -1;
-		}
-		else
-			close(config_file);
-	}
-	printf("[INFO] An example configuration file has been created. Please edit it.\n");
-	return 0;
-}
-
-/* Read only positive integers **/
-int i_read_config(char *field) {
-	char	buffer[BUFFER_SIZE],
-			a[BUFFER_SIZE];
-	int		ret = 0,
-			found = 0;
-	FILE	*config_file = NULL;
-
-	/* TOCTOU bug avoidance, use fopen(), not access() */
-	config_file = fopen(CONFIG_FILE, "r");
-	if (config_file == NULL) {
-		switch (errno) {
-		case ENOENT:	/* The file does not exist */
-			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
-			create_config_file();
-			break;
-		case EACCES:	/* The file is not accessible to the current user */
-			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
-			break;
-		}
-		return -1;
-	}
-	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
-		if (sscanf(buffer, "%[^=]=%d", a, &ret) == 2 && strcmp(field, a) == 0)
-			found = 1;	/* The requested field has been found */
-	fclose(config_file);
-	if (found) {
-		if (ret < 0) {
-			fprintf(stderr, "[ERROR] 'server-port' can't be negative!\n");	/* 'Not a positive integer' error */
-			return -1;
-		}
-		else
-			return ret;
-	}
-	else { /* Field not found */
-		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", field);
-		return -1;
-	}
-}
-
-void c_read_config(char *var, char *field, int *err) {
-	char	buffer[BUFFER_SIZE],
-			a[BUFFER_SIZE],
-			b[BUFFER_SIZE];
-	FILE	*config_file = NULL;
-	int		found = 0;
-
-	*err = 0;
-	config_file = fopen(CONFIG_FILE, "r");
-	if (config_file == NULL) {
-		switch (errno) {
-		case ENOENT:	/* The file does not exist */
-			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
-			create_config_file();
-			break;
-		case EACCES:	/* The file is not accessible to the current user */
-			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
-			break;
-		}
-		*err = -1;
-		return;
-	}
-	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
-		if (sscanf(buffer, "%[^=]=%[^=]", a, b) == 2 && strcmp(field, a) == 0) {
-			/* The requested field has been found */
-			strcpy(var, b);
-			/* There's the new-line character, it must be removed. */
-			var[strlen(var)-1] = '\0';
-			found = 1;
-		}
-	fclose(config_file);
-	/* If the field has not been found it returns an empty string */
-	if (!found || strcmp(var, "") == 0) {
-		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", var);
-		*err = -1;
-	}
-	return;
-}
-
 void sha1_hash(char *strout, const void *object, const size_t length) {
 	register int	i;
 	int				hash_len = gcry_md_get_algo_dlen(GCRY_MD_SHA1);
@@ -172,25 +79,6 @@ void sha1_hash(char *strout, const void *object, const size_t length) {
 	free(out);
 }
 
-int counth_hash_file() {
-	hash_record	hrec;
-	int			num,
-				hash_file;
-
-	num = 0;
-	hash_file = open(HASH_FILE, O_RDONLY);
-	/* No need to notice the user in case of error, just return 0 */
-	if (hash_file != -1) {
-		while(read(hash_file, &hrec, sizeof(hrec)) == sizeof(hrec)) {
-			/* Am I reading a file made of real hash_record-s? */
-			if (strlen(hrec.hash) == gcry_md_get_algo_dlen(GCRY_MD_SHA1)*2)
-				num++;
-		}
-		close(hash_file);
-	}
-	return num;
-}
-
 void print_files() {
 	hash_record	hrec;
 	int			hash_file;
@@ -227,17 +115,24 @@ void write_hash_list() {
 	register int	i;
 	int				hash_file,
 					shared_file,
+					duplicates = 0,
 					err = 0;
+	long long		saved;
 	unsigned long	file_size;
 	struct dirent	*ent = NULL;
+	manifest		m;
 	char			directories[BUFFER_SIZE],
+					manifest_path[BUFFER_SIZE],
 					*current_dir = NULL,
-					*file_buffer = NULL,
 					file_path[BUFFER_SIZE],
 					*hash_str = (char *) malloc(sizeof(char) * ((gcry_md_get_algo_dlen(GCRY_MD_SHA1) * 2) + 1));
 
 	c_read_config(directories, "shared-folder", &err);
 	if (err == 0) {
+		STAT_SET(hash_files_done, 0);
+		STAT_SET(hash_files_total, 0);
+		STAT_SET(hash_bytes_done, 0);
+		STAT_SET(hashing, 1);
 		current_dir = strtok(directories, ";");
 		hash_file = open(HASH_FILE, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 		if (hash_file == -1) {
@@ -249,9 +144,18 @@ void write_hash_list() {
 				fprintf(stderr, "[ERROR] An error has occurred while opening the hash file.\n");
 				break;
 			}
+			STAT_SET(hashing, 0);
 			mypause();
 			return;
 		}
+		/* Without manifests files can still be shared, only whole */
+		if (mkdir(MANIFEST_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST)
+			fprintf(stderr, "[ERROR] Couldn't create the '%s' folder.\n", MANIFEST_DIR);
+		/* Files deleted since the last time leave their entries behind */
+		if (store_init(STORE_DIR) == -1)
+			fprintf(stderr, "[ERROR] Couldn't create the '%s' folder.\n", STORE_DIR);
+		else
+			store_prune(STORE_DIR);
 		while (current_dir != NULL) {
 			for (i = 0; i < 2; i++) {
 				dir = opendir(current_dir);
@@ -283,12 +187,21 @@ void write_hash_list() {
 				else
 					break;
 			}
+			/* Count this folder's files first, so that the progress makes sense */
+			while ((ent = readdir(dir)) != NULL)
+				if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+					STAT_ADD(hash_files_total, 1);
+			rewinddir(dir);
 			while ((ent = readdir(dir)) != NULL) {
 				if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
 					/* Creating the relative file path */
 					strcpy(file_path, current_dir);
 					strcat(file_path, "/");
 					strcat(file_path, ent->d_name);
+					if (strlen(file_path) >= sizeof(hrec.filename)) {
+						fprintf(stderr, "[ERROR] The path of '%s' is too long to share it.\n", file_path);
+						continue;
+					}
 					shared_file = open(file_path, O_RDONLY);
 					if (shared_file == -1) {
 						switch (errno) {
@@ -307,20 +220,31 @@ void write_hash_list() {
 						fprintf(stderr, "[ERROR] File '%s' is 0 bytes, can't hash it.\n", file_path);
 						continue;
 					}
-					/* I need to put the file in memory to hash it */
-					file_buffer = mmap(0, file_size, PROT_READ, MAP_SHARED, shared_file, 0);
-					if (*file_buffer == -1) {
-						fprintf(stderr, "[ERROR] Unable to map %s into memory.\n", file_path);
+					/* The chunks for delta downloads come with the same pass, large files read around the page cache */
+					if (manifest_build_file(&m, file_path, hash_str) == -1) {
+						fprintf(stderr, "[ERROR] An error has occurred while trying to read the file: %s.\n", file_path);
 						close(shared_file);
 						continue;
 					}
+					snprintf(manifest_path, sizeof(manifest_path), "%s/%s", MANIFEST_DIR, hash_str);
+					manifest_save(&m, manifest_path);
+					manifest_free(&m);
+					/* The bytes after the name are sent too, nothing from the stack */
+					memset(&hrec, 0, sizeof(hrec));
 					strcpy(hrec.filename, file_path);
-					sha1_hash(hash_str, file_buffer, file_size);
+					record_set_size(&hrec, file_size);
 					strcpy(hrec.hash, hash_str);
+					if ((saved = store_add(STORE_DIR, hash_str, file_path, dedupe)) > 0) {
+						STAT_ADD(bytes_deduplicated, saved);
+						duplicates++;
+					}
 					if (write(hash_file, &hrec, sizeof(hrec)) == -1)
 						fprintf(stderr, "[ERROR] Unable to write record '%s' into hash file. Freeing memory and proceeding.\n", file_path);
 					close(shared_file);
-					munmap(file_buffer, file_size);
+					STAT_ADD(hash_files_done, 1);
+					STAT_ADD(hash_bytes_done, file_size);
+					printf("[INFO] Hashed %lu/%lu files.\r", STAT_GET(hash_files_done), STAT_GET(hash_files_total));
+					fflush(stdout);
 				}
 			}
 			closedir(dir);
@@ -330,200 +254,435 @@ void write_hash_list() {
 		close(hash_file);
 		free(ent);
 		free(hash_str);
-		printf("[INFO] Hash list generated.\n");
+		STAT_SET(hashing, 0);
+		printf("\n[INFO] Hash list generated, %d files shared.\n", load_hash_index());
+		/* What's open or in memory may not be what's shared anymore */
+		if (hot != NULL)
+			hot_clear(hot);
+		if (duplicates > 0)
+			printf("[INFO] %d duplicates now share their content with another file.\n", duplicates);
 	}
 	mypause();
 	return;
 }
 
-int is_connected(int socket) {
-	if (send(socket, NULL, 0, 0) == -1)
-		return -1;
-	else
-		return 0;
+/* Downloads are counted as they arrive, uploads as they leave */
+static void count_downloaded(size_t bytes) {
+	STAT_ADD(bytes_downloaded, bytes);
 }
 
-int handshake(int type, int *socket) {
-	char	buffer[1024],
-			msg[9],
-			p2s[] = "HELLO",
-			p2p[] = "HELLOPEER";
+static void count_uploaded(size_t bytes) {
+	STAT_ADD(bytes_uploaded, bytes);
+}
 
-	if (is_connected(*socket) == -1)
-		return -1;
+/*
+ * Bandwidth limits. The engine shapes its own transfers, the plain loop
+ * moves one file at a time per thread and pays for it from the callbacks.
+ */
+static shaper	*download_shaper = NULL,	/* UI thread */
+				*upload_shaper = NULL;		/* Listener thread */
+static bucket	*download_peer = NULL,
+				download_limit,
+				*upload_peer = NULL,
+				upload_limit;
+
+static void shaped_download(size_t bytes) {
+	count_downloaded(bytes);
+	shaper_throttle(download_shaper, download_peer, &download_limit, bytes);
+}
 
-	if (type == 0)
-		strcpy(msg, p2s);
-	else
-		strcpy(msg, p2p);
+static void shaped_upload(size_t bytes) {
+	count_uploaded(bytes);
+	shaper_throttle(upload_shaper, upload_peer, &upload_limit, bytes);
+}
 
-	if (send(*socket, msg, strlen(msg), 0) == -1)
-		return -1;
-	bzero(buffer, 1024);
-	while (read(*socket, buffer, sizeof(buffer)) > 0) {
-		if (strcmp(buffer, msg) != 0) {
-			send(*socket, "NO", 2, 0); /* No need to return -1 at this point */
-			close(*socket);
-			*socket = -1;
-			return -1;
-		}
-		break;
-	}
-	return 0;
+static void hash_downloaded(transfer *t, const char *data, size_t len) {
+	verify_data(&((download *) t)->v, data, len);
 }
 
-int send_file(char *filepath, int *socket) {
-	char			buffer[BUFFER_SIZE];
-	size_t			bytes;
-	int				file;
-	unsigned long	length;
+/* The limits of one file moved by the plain loop, to ip */
+static void limit_transfer(shaper *s, char *ip, bucket **peer, bucket *own) {
+	*peer = shaper_peer(s, ip);
+	bucket_init(own, s != NULL ? s->transfer_rate : 0);
+}
 
-	if (is_connected(*socket) == -1)
-		return -2;
+static void unlimit_transfer(shaper *s, bucket **peer) {
+	shaper_release(s, *peer);
+	*peer = NULL;
+}
+
+/* Connections to every server are open and still alive */
+static int server_connected(tracker *server) {
+	int	i;
 
-	file = open(filepath, O_RDONLY);
-	if (file != -1) {
-		bzero(buffer, BUFFER_SIZE);
-		length = htonl((uint32_t) get_size_by_fd(file));
-		if (send(*socket, &length, sizeof(length), 0) == -1)
-			return -2;
-		while ((bytes = read(file, buffer, sizeof(buffer))) > 0)
-			if (send(*socket, buffer, bytes, 0) == -1)
-				return -2;
-		close(file);
+	if (server->dht != NULL)
+		return server->joined;
+	if (server->ring == NULL)
+		return 0;
+	for (i = 0; i < server->ring->shards; i++)
+		if (server->shards[i] == NULL || is_connected(server->shards[i]->fd) != 0)
+			return 0;
+	return 1;
+}
+
+void disconnect(tracker *server) {
+	int	i;
+
+	/* Records in the DHT can't be taken back, they expire unless announced again */
+	server->joined = 0;
+	for (i = 0; server->ring != NULL && i < server->ring->shards; i++) {
+		conn_close(server->shards[i]);
+		server->shards[i] = NULL;
 	}
-	else
-		return -1;
-	return 0;
+	ring_close(server->ring);
+	server->ring = NULL;
 }
 
-int receive_file(char *filepath, int *socket) {
-	char			buffer[BUFFER_SIZE];
-	int				recvd_flag = 0,
-					fp;
-	size_t			bytes = 0;
-	unsigned long	length = 0;
-	unsigned long	bytecount = 0;
+/*
+ * Connects to addr and shakes hands, offering the options. Older programs
+ * don't know about them: then it connects again and offers nothing.
+ * Errors are printed, NULL is returned. When a server is busy nothing is
+ * printed, busy is set and retry_after gets the msec it asked to wait.
+ */
+static conn *connect_to(struct sockaddr_in *addr, int type, int *busy, unsigned int *retry_after) {
+	conn	*c;
+	int		fd,
+			offer = type == HANDSHAKE_SERVER ? options | OPT_SEARCH | OPT_LOAD | OPT_HEARTBEAT : options,
+			ret;
+
+	do {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			perror("[ERROR] socket() syscall failed");
+			return NULL;
+		}
 
-	if (is_connected(*socket) == -1)
-		return recvd_flag;
+		if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) == -1) {
+			perror("[ERROR] Connection failed");
+			close(fd);
+			return NULL;
+		}
 
-	while (read(*socket, &length, sizeof(length)) == sizeof(length)) {
-		length = ntohl(length);
-		printf("[INFO] File size: %lu bytes.\n", length);
-		break;
-	}
+		if ((c = conn_open(fd)) == NULL) {
+			fprintf(stderr, "[ERROR] Not enough memory for the connection.\n");
+			close(fd);
+			return NULL;
+		}
 
-	fp = open(filepath, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-	if (fp == -1) {
-		switch (errno) {
-		case EACCES:			/* Insufficient permissions */
-			fprintf(stderr, "[ERROR] Not enough permissions to create the received file.\n");
-			break;
-		default:				/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while opening the file.\n");
-			break;
+		/* Hand-shake */
+		if ((ret = handshake(type, c, offer)) != 0) {
+			if (ret == HANDSHAKE_BUSY && busy != NULL)
+				*busy = 1;
+			if (ret == HANDSHAKE_BUSY && retry_after != NULL)
+				*retry_after = c->retry_after;
+			conn_close(c);
+			c = NULL;
 		}
-		mypause();
-		return recvd_flag;
-	}
+		offer = 0;
+	} while (ret == HANDSHAKE_OLD);
 
-	bzero(buffer, BUFFER_SIZE);
-	while ((bytes = read(*socket, buffer, sizeof(buffer))) > 0) {
-		bytecount += bytes;
-		write(fp, buffer, bytes);
-		bzero(buffer, BUFFER_SIZE);
-		if (bytecount >= length) {
-			printf("[INFO] File transfer completed.\n");
-			recvd_flag = 1;
-			break;
+	if (ret == -1 || (ret == HANDSHAKE_BUSY && busy == NULL))
+		fprintf(stderr, "[ERROR] Hand-shake failed.\n");
+	return c;
+}
+
+/*
+ * connect_to() a server, again while it's busy: after the time it asked,
+ * which it already spreads over the peers it turned away, plus up to a
+ * tenth of it at random. When it couldn't tell, twice as long as the time
+ * before plus up to half of it, so that peers turned away together don't
+ * come back together. connect-retries times at most.
+ */
+static conn *connect_backoff(struct sockaddr_in *addr, char *name) {
+	static unsigned int	seed = 0;
+	struct timespec		pause;
+	unsigned int		retry_after,
+						delay = BACKOFF_FIRST,
+						wait;
+	int					retries = i_read_config_default("connect-retries", CONNECT_RETRIES),
+						busy,
+						attempt;
+	conn				*c;
+
+	if (seed == 0)
+		seed = time(NULL) ^ getpid();
+	for (attempt = 0; ; attempt++) {
+		busy = 0;
+		if ((c = connect_to(addr, HANDSHAKE_SERVER, &busy, &retry_after)) != NULL || !busy)
+			return c;
+		if (attempt >= retries) {
+			fprintf(stderr, "[ERROR] %s is busy, gave up after %d tries.\n", name, attempt + 1);
+			return NULL;
+		}
+		if (retry_after > 0) {
+			wait = retry_after < BACKOFF_MAX ? retry_after : BACKOFF_MAX;
+			wait += rand_r(&seed) % (wait / 10 + 1);
+		}
+		else {
+			wait = delay;
+			delay = delay < BACKOFF_MAX / 2 ? delay * 2 : BACKOFF_MAX;
+			wait += rand_r(&seed) % (wait / 2 + 1);
 		}
+		printf("[INFO] %s is busy, trying again in %.1f s.\n", name, wait / 1000.0);
+		pause.tv_sec = wait / 1000;
+		pause.tv_nsec = (wait % 1000) * 1000000L;
+		nanosleep(&pause, NULL);
 	}
-	close(fp);
-	return recvd_flag;
 }
 
-void conn_to_server(int *socket2server) {
-	int		server_port,
-			err = 0;
-	struct	sockaddr_in server;
-	char	server_ip[15] = "";
+/*
+ * The hash list cut in one file per shard, each record where ring_shard()
+ * puts it. Returns -1 if they couldn't be written.
+ */
+static int split_hash_list(ring *r) {
+	hash_record	hrec;
+	char		path[BUFFER_SIZE];
+	int			files[RING_MAX_SHARDS],
+				hash_file,
+				err = 0,
+				i;
 
-	if (counth_hash_file() == 0) {
-		fprintf(stderr, "[ERROR] You must share some files! Generate a hash list and try again.\n");
-		mypause();
-		return;
+	if ((hash_file = open(HASH_FILE, O_RDONLY)) == -1)
+		return -1;
+	for (i = 0; i < r->shards; i++) {
+		snprintf(path, sizeof(path), SHARD_FILE, i);
+		if ((files[i] = open(path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1)
+			err = -1;
 	}
+	while (err == 0 && read(hash_file, &hrec, sizeof(hash_record)) == sizeof(hash_record))
+		if (write(files[ring_shard(r, hrec.hash)], &hrec, sizeof(hrec)) != sizeof(hrec))
+			err = -1;
+	for (i = 0; i < r->shards; i++)
+		if (files[i] != -1)
+			close(files[i]);
+	close(hash_file);
+	return err;
+}
 
-	/* Check if connections is already established */
-	if (is_connected(*socket2server) == 0) {
-		fprintf(stderr, "[ERROR] Already connected!\n");
+/* Tells the DHT about every shared file. Returns how many it took, -1 without the hash file */
+static int announce_files(dht *d, int *files) {
+	hash_record	hrec;
+	dht_stats	announce;
+	int			hash_file,
+				announced = 0;
+
+	*files = 0;
+	if ((hash_file = open(HASH_FILE, O_RDONLY)) == -1)
+		return -1;
+	while (read(hash_file, &hrec, sizeof(hash_record)) == sizeof(hash_record)) {
+		(*files)++;
+		announced += dht_announce(d, hrec.hash, PEER_PORT, &announce) > 0;
+	}
+	close(hash_file);
+	return announced;
+}
+
+/*
+ * Joins the DHT through the peers in dht-bootstrap=IP:PORT;IP:PORT;...
+ * and tells it about every shared file. Without bootstrap peers this is
+ * the first one, the others will join through it. load_reporter() tells
+ * it again before the records expire.
+ */
+static void announce_hash_list(tracker *server) {
+	char		bootstrap[CONFIG_LINE_SIZE];
+	int			contacts,
+				files,
+				announced;
+
+	c_read_config_default(bootstrap, "dht-bootstrap", "");
+	contacts = dht_join(server->dht, bootstrap);
+	if (contacts <= 0 && bootstrap[0] != '\0') {
+		fprintf(stderr, "[ERROR] None of the peers in dht-bootstrap answered.\n");
 		mypause();
 		return;
 	}
-
-	/* Retrieve server's info */
-	c_read_config(server_ip, "server-ip", &err);
-	server_port = i_read_config("server-port");
-
-	if (server_port < 0 || err != 0) {
+	if ((announced = announce_files(server->dht, &files)) == -1) {
+		fprintf(stderr, "[ERROR] An error has occurred while opening the hash file.\n");
 		mypause();
 		return;
 	}
+	pthread_mutex_lock(&server->lock);
+	server->joined = 1;
+	pthread_mutex_unlock(&server->lock);
+	printf("[INFO] Joined the DHT, %d peers known, %d/%d files announced.\n", contacts, announced, files);
+}
 
-	/* Connection to server */
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = inet_addr(server_ip);
-	server.sin_port = htons(server_port);
-
-	/* I'm going to cast sockaddr_in in sockaddr, I need to do this */
-	memset(&server.sin_zero, '\0', sizeof(server.sin_zero));
+/* conn_to_server() failed: what it connected goes, then the user is told */
+static void give_up(tracker *server) {
+	pthread_mutex_lock(&server->lock);
+	disconnect(server);
+	pthread_mutex_unlock(&server->lock);
+	mypause();
+}
 
-	if ((*socket2server = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		perror("[ERROR] socket() syscall failed");
+/*
+ * servers=IP:PORT;IP:PORT;... makes a cluster, every server keeps the
+ * records its part of the hash space. Without it server-ip and server-port
+ * are the only one. Called without server->lock: connecting may wait for
+ * busy servers, the lock is only taken to put each connection in place,
+ * so the load reports keep those already there alive meanwhile.
+ */
+void conn_to_server(tracker *server) {
+	int		server_port,
+			err = 0,
+			i;
+	char	server_ip[16] = "",
+			servers[CONFIG_LINE_SIZE],
+			path[BUFFER_SIZE];
+	ring	*r;
+	conn	*c;
+
+	if (index_count() == 0) {
+		fprintf(stderr, "[ERROR] You must share some files! Generate a hash list and try again.\n");
 		mypause();
 		return;
 	}
 
-	if (connect(*socket2server, (struct sockaddr *) &server, sizeof(server)) == -1) {
-		perror("[ERROR] Connection failed");
-		*socket2server = -1;
+	/* Check if connections is already established */
+	if (server_connected(server)) {
+		fprintf(stderr, "[ERROR] Already connected!\n");
 		mypause();
 		return;
 	}
 
-	/* Hand-shake */
-	if (handshake(0, socket2server) == -1) {
-		fprintf(stderr, "[ERROR] Hand-shake failed.\n");
-		mypause();
+	if (server->dht != NULL) {
+		announce_hash_list(server);
 		return;
 	}
 
-	/* Send hash file */
-	err = send_file("hash", socket2server);
-	if (err == -1) {
-		fprintf(stderr, "[ERROR] Could not open file to send.\n");
+	/* Retrieve server's info */
+	c_read_config_default(servers, "servers", "");
+	if (servers[0] == '\0') {
+		c_read_config(server_ip, "server-ip", &err);
+		server_port = i_read_config("server-port");
+		if (server_port < 0 || err != 0) {
+			mypause();
+			return;
+		}
+		snprintf(servers, sizeof(servers), "%s:%d", server_ip, server_port);
+	}
+	if ((r = ring_open(servers)) == NULL) {
+		fprintf(stderr, "[ERROR] Bad server address in '%s'.\n", servers);
 		mypause();
 		return;
 	}
-	else if (err == -2) {
-		fprintf(stderr, "[ERROR] Could not send hash file, send() failed.\n");
+	if (r->shards > 1 && split_hash_list(r) == -1) {
+		fprintf(stderr, "[ERROR] Couldn't split the hash list between the servers.\n");
+		ring_close(r);
 		mypause();
 		return;
 	}
+	pthread_mutex_lock(&server->lock);
+	server->ring = r;
+	pthread_mutex_unlock(&server->lock);
+
+	for (i = 0; i < r->shards; i++) {
+		if ((c = connect_backoff(&r->addrs[i], r->names[i])) == NULL) {
+			fprintf(stderr, "[ERROR] Couldn't connect to %s.\n", r->names[i]);
+			give_up(server);
+			return;
+		}
+
+		/* Send hash file, or this server's part of it: nobody else has c yet */
+		snprintf(path, sizeof(path), SHARD_FILE, i);
+		err = send_file(r->shards > 1 ? path : HASH_FILE, c);
+		if (r->shards > 1)
+			unlink(path);
+		pthread_mutex_lock(&server->lock);
+		server->shards[i] = c;
+		pthread_mutex_unlock(&server->lock);
+		if (err == -1) {
+			fprintf(stderr, "[ERROR] Could not open file to send.\n");
+			give_up(server);
+			return;
+		}
+		else if (err == -2) {
+			fprintf(stderr, "[ERROR] Could not send hash file, send() failed.\n");
+			give_up(server);
+			return;
+		}
+	}
+	if (r->shards > 1)
+		printf("[INFO] Connected to %d servers.\n", r->shards);
 }
 
-void download_file(int *socket2server) {
-	char	buffer[BUFFER_SIZE],
-			hash[41],
-			hash_cmd[46] = "HASH-",
-			filename[BUFFER_SIZE],
-			*tok = NULL,
-			filepath[18] = "downloads/";
-	int		sock2peer;
-	struct	sockaddr_in peer;
+/*
+ * Only the server in charge of the hash knows who has it. Returns what
+ * read_reply() does, -2 if the query couldn't be sent.
+ */
+static int ask_server(tracker *server, char *hash, char *owner) {
+	conn	*shard = server->shards[ring_shard(server->ring, hash)];
+	int		ret = -2;
+
+	pthread_mutex_lock(&server->lock);
+	if (send_query(shard, hash) != -1) {
+		printf("[INFO] Hash requested to server.\n");
+		ret = read_reply(shard, owner);
+	}
+	pthread_mutex_unlock(&server->lock);
+	return ret;
+}
 
-	if (is_connected(*socket2server) == -1)
+/* Files of the other peers by name, their hashes are what download_file() wants */
+void search_files(tracker *server) {
+	search_result	results[SEARCH_PAGE];
+	char			text[SEARCH_TEXT_MAX],
+					more[8] = "";
+	long			total,
+					offset = 0;
+	int				num,
+					i;
+
+	if (!server_connected(server) || server->dht != NULL)
+		return;
+	for (i = 0; i < server->ring->shards; i++)
+		if (!(server->shards[i]->options & OPT_SEARCH)) {
+			fprintf(stderr, "[ERROR] The server at %s can't search, it's too old.\n", server->ring->names[i]);
+			mypause();
+			return;
+		}
+
+	clrscr();
+	printf("############################\n");
+	printf("# Search files:            #\n");
+	printf("############################\n\n");
+	printf("Words, word* or ext:pdf: ");
+	scanf(" %255[^\n]", text);
+	do {
+		pthread_mutex_lock(&server->lock);
+		total = search_servers(server->shards, server->ring->shards, text, offset, SEARCH_PAGE, results, &num);
+		pthread_mutex_unlock(&server->lock);
+		if (total == -1) {
+			fprintf(stderr, "[ERROR] The server didn't answer the search.\n");
+			break;
+		}
+		printf("\n[INFO] %ld files found, %ld to %ld:\n\n", total, num > 0 ? offset + 1 : offset, offset + num);
+		for (i = 0; i < num; i++)
+			printf("- Filename: %s\n- Hash: %s\n- Size: %llu KB, %u owners\n\n", results[i].name, results[i].hash,
+					(results[i].size + 1023) / 1024, results[i].owners);
+		offset += num;
+		if (num == 0 || offset >= total || offset >= SEARCH_DEPTH_MAX)
+			break;
+		printf("More? (y/n): ");
+		scanf("%7s", more);
+	} while (more[0] == 'y');
+	mypause();
+}
+
+void download_file(tracker *server) {
+	char	hash[HASH_LEN + 1],
+			owner[INET_ADDRSTRLEN],
+			filename[1001],	/* What scanf() takes below, downloads/ must fit too */
+			filepath[BUFFER_SIZE];
+	int			received,
+				delta;
+	conn		*c = NULL;
+	download	d;
+	delta_stats	ds;
+	struct	sockaddr_in peer,
+			owners[1];
+	dht_stats	lookup;
+
+	if (!server_connected(server))
 		return;
 
 	clrscr();
@@ -531,100 +690,521 @@ void download_file(int *socket2server) {
 	printf("# Download a file:         #\n");
 	printf("############################\n\n");
 	printf("Hash: ");
-	scanf("%s", hash);
+	scanf("%40s", hash);
 	printf("Save as: ");
-	scanf("%s", filename);
-	strcat(hash_cmd, hash);
-	if (send(*socket2server, hash_cmd, 46, 0) == -1) {
-		perror("[ERROR] Couldn't request the hash to the server");
+	scanf("%1000s", filename);
+	snprintf(filepath, sizeof(filepath), "downloads/%s", filename);
+
+	/* Shared or downloaded before, maybe with another name */
+	if (store_place(STORE_DIR, hash, filepath, dedupe) == 1) {
+		printf("[INFO] The file is already here, nothing to download.\n");
+		STAT_ADD(downloads_local, 1);
 		mypause();
 		return;
 	}
-	else
-		printf("[INFO] Hash requested to server.\n");
 
-	bzero(buffer, 1024);
-	while (read(*socket2server, buffer, sizeof(buffer)) > 0) {
-		tok = strtok(buffer, "-");
-		if (strcmp(tok, "NOTFOUND") == 0) {
-			printf("[INFO] Server responded. Hash not found!\n");
+	if (server->dht != NULL) {
+		if (dht_find(server->dht, hash, owners, 1, &lookup) <= 0) {
+			printf("[INFO] Hash not found in the DHT, %d hops.\n", lookup.hops);
 			mypause();
 			return;
 		}
-		else if (strcmp(tok, "FOUND") == 0) {
-			tok = strtok(NULL, "-");
-			printf("[INFO] Server responded. Owner: %s\n", tok);
-			break;
-		}
+		inet_ntop(AF_INET, &owners[0].sin_addr, owner, sizeof(owner));
+		printf("[INFO] Found in the DHT, %d hops, %llu us. Owner: %s\n", lookup.hops, lookup.usec, owner);
 	}
-
-	if ((sock2peer = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-			perror("[ERROR] socket() call failed");
-			mypause();
-			return;
+	else switch (ask_server(server, hash, owner)) {
+	case 0:
+		printf("[INFO] Server responded. Hash not found!\n");
+		mypause();
+		return;
+	case 1:
+		printf("[INFO] Server responded. Owner: %s\n", owner);
+		break;
+	case -2:
+		perror("[ERROR] Couldn't request the hash to the server");
+		mypause();
+		return;
+	default:
+		fprintf(stderr, "[ERROR] The server didn't answer.\n");
+		mypause();
+		return;
 	}
 
 	peer.sin_family = AF_INET;
-	peer.sin_addr.s_addr = inet_addr(tok);
-	peer.sin_port = htons(25546);
+	peer.sin_addr.s_addr = inet_addr(owner);
+	peer.sin_port = htons(PEER_PORT);
 
 	/* I'm going to cast sockaddr_in in sockaddr, I need to do this */
 	memset(&peer.sin_zero, '\0', sizeof(peer.sin_zero));
 
-	if (connect(sock2peer, (struct sockaddr *) &peer, sizeof(peer))==-1) {
-		perror("[ERROR] connect() call failed");
+	if ((c = connect_to(&peer, HANDSHAKE_PEER, NULL, NULL)) == NULL) {
 		mypause();
 		return;
 	}
+	c->on_read = count_downloaded;
 
-	/* Hand-shake */
-	if (handshake(1, &sock2peer) == -1) {
-		printf("[ERROR] Hand-shake failed.\n");
-		close(sock2peer);
-		mypause();
-		return;
-	}
-
-	if (send(sock2peer, hash_cmd, 46, 0) == -1) {
+	/* An older version of the file is already here: only what changed is needed */
+	delta = (c->options & OPT_DELTA) && access(filepath, R_OK) == 0;
+	if ((delta ? send_delta_query(c, hash) : send_query(c, hash)) == -1) {
 		perror("[ERROR] Couldn't request the hash to the peer");
-		close(sock2peer);
+		conn_close(c);
 		mypause();
 		return;
 	}
 
-	strcat(filepath, filename);
-	if (receive_file(filepath, &sock2peer) == 0)
+	/* It may be one of the store's links, a new file is written instead of this one */
+	if (!delta)
+		unlink(filepath);
+	STAT_ADD(active_downloads, 1);
+	if (delta) {
+		limit_transfer(download_shaper, owner, &download_peer, &download_limit);
+		c->on_read = shaped_download;
+		received = delta_receive(c, hash, filepath, &ds) == 0;
+		unlimit_transfer(download_shaper, &download_peer);
+		if (received)
+			printf("[INFO] %llu KB were already here, %llu KB downloaded.\n", ds.reused / 1024, ds.fetched / 1024);
+		if (received && ds.refetched > 0)
+			printf("[INFO] %llu KB came broken and were downloaded again.\n", ds.refetched / 1024);
+	}
+	/* With TLS in OpenSSL rather than in the kernel the engine can't read the socket */
+	else if (downloads != NULL && tls_raw(c, TLS_RECV)) {
+		memset(&d, 0, sizeof(d));
+		d.t.on_progress = count_downloaded;
+		d.t.on_data = hash_downloaded;
+		received = 0;
+		if (verify_open(&d.v) == 0 && engine_download(downloads, &d.t, c, filepath) == 0) {
+			received = engine_wait(downloads, &d.t) == ENGINE_DONE;
+			close(d.t.file);
+			if (received && !verify_match(&d.v, hash)) {
+				unlink(filepath);
+				received = VERIFY_MISMATCH;
+			}
+		}
+		verify_close(&d.v);
+	}
+	else {
+		limit_transfer(download_shaper, owner, &download_peer, &download_limit);
+		c->on_read = shaped_download;
+		received = receive_verified(filepath, c, hash);
+		unlimit_transfer(download_shaper, &download_peer);
+	}
+	if (received == VERIFY_MISMATCH) {
+		fprintf(stderr, "[ERROR] The file doesn't match its hash, it's been thrown away.\n");
+		STAT_ADD(downloads_corrupt, 1);
+		STAT_ADD(downloads_failed, 1);
+	}
+	else if (!received) {
 		fprintf(stderr, "[ERROR] Couldn't receive the file.\n");
+		STAT_ADD(downloads_failed, 1);
+	}
+	else {
+		printf("[INFO] File transfer completed.\n");
+		STAT_ADD(downloads_completed, 1);
+		/* The next download of the same content won't need the network */
+		store_add(STORE_DIR, hash, filepath, dedupe);
+	}
+	STAT_SUB(active_downloads, 1);
 
-	close(sock2peer);
+	conn_close(c);
 	mypause();
 }
 
+/* The engine hands the upload back here once the file has been sent */
+static void upload_done(transfer *t) {
+	upload	*u = (upload *) t;
+
+	if (t->status == ENGINE_DONE)
+		STAT_ADD(uploads_completed, 1);
+	else
+		log_error("Could not send file, send() failed (%s).", u->hash);
+	index_served(u->hash, t->done);
+	STAT_SUB(active_uploads, 1);
+	(*u->client_num)--;
+	if (u->hot != NULL)
+		hot_release(hot, u->hot);
+	else
+		close(t->file);
+	conn_close(u->c);
+	free(u);
+}
+
+/*
+ * A file in memory goes in one write, unless uploads are limited: the
+ * listener waits for it like the plain loop would, but it's small.
+ * Returns 1 if it's been sent, -2 if it failed and 0 if it isn't in
+ * memory.
+ */
+static int serve_memory(conn *c, hash_record *x, hot_entry *e) {
+	char	*image;
+	size_t	len;
+
+	if (shaper_limited(upload_shaper) || (image = hot_image(hot, e, c->options & OPT_ZLIB, &len)) == NULL)
+		return 0;
+	c->on_write = count_uploaded;
+	if (conn_write(c, image, len) == -1 || conn_flush(c) == -1)
+		return -2;
+	STAT_ADD(uploads_completed, 1);
+	index_served(x->hash, len);
+	return 1;
+}
+
+/*
+ * Sends the file the client asked for. With the engine the listener goes
+ * back to the others right away; returns 1 if the engine owns c now.
+ * Files going through the page cache as usual come from the hot cache.
+ */
+static int serve(engine *uploads, conn *c, hash_record *x, int *client_num) {
+	unsigned long long	sent;
+	upload				*u;
+	hot_entry			*e = NULL;
+	int					err;
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	char				ip[INET_ADDRSTRLEN] = "";
+
+	STAT_ADD(active_uploads, 1);
+	if (hot != NULL && (e = hot_get(hot, x->hash, x->filename)) != NULL && !cache_normal(e->size)) {
+		hot_release(hot, e);
+		e = NULL;
+	}
+	if (e != NULL && (err = serve_memory(c, x, e)) != 0) {
+		if (err == -2)
+			log_error("Could not send file, send() failed (%s).", x->filename);
+		hot_release(hot, e);
+		STAT_SUB(active_uploads, 1);
+		return 0;
+	}
+	if (uploads != NULL && tls_raw(c, TLS_SEND) && (u = calloc(1, sizeof(upload))) != NULL) {
+		u->c = c;
+		u->client_num = client_num;
+		strcpy(u->hash, x->hash);
+		u->t.on_progress = count_uploaded;
+		u->t.on_done = upload_done;
+		if (e != NULL) {
+			/* Read at offsets only, other uploads of the file share the descriptor */
+			u->hot = e;
+			u->t.file = u->t.cache.fd = e->fd;
+			err = engine_send(uploads, &u->t, c, e->size, hot_encoding(hot, e, c->options & OPT_ZLIB));
+		}
+		else
+			err = engine_upload(uploads, &u->t, c, x->filename);
+		if (err == 0)
+			return 1;
+		free(u);
+	}
+	else {
+		if (getpeername(c->fd, (struct sockaddr *) &addr, &len) == 0)
+			inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+		limit_transfer(upload_shaper, ip, &upload_peer, &upload_limit);
+		c->on_write = shaped_upload;
+		sent = STAT_GET(bytes_uploaded);
+		err = send_file(x->filename, c);
+		unlimit_transfer(upload_shaper, &upload_peer);
+		if (err == 0)
+			STAT_ADD(uploads_completed, 1);
+		/* Other uploads can't run meanwhile, the difference is this file's */
+		index_served(x->hash, STAT_GET(bytes_uploaded) - sent);
+	}
+	if (e != NULL)
+		hot_release(hot, e);
+	if (err == -1)
+		log_error("Could not open file to send (%s).", x->filename);
+	else if (err == -2)
+		log_error("Could not send file, send() failed (%s).", x->filename);
+	STAT_SUB(active_uploads, 1);
+	return 0;
+}
+
+/*
+ * The downloader has an older version of the file: it gets the manifest
+ * and asks for the chunks it's missing. That's a few percent of the file,
+ * it's sent right here like the plain loop would.
+ */
+static void serve_delta(conn *c, hash_record *x) {
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	char				ip[INET_ADDRSTRLEN] = "",
+						path[BUFFER_SIZE];
+	long long			sent;
+
+	STAT_ADD(active_uploads, 1);
+	if (getpeername(c->fd, (struct sockaddr *) &addr, &len) == 0)
+		inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+	limit_transfer(upload_shaper, ip, &upload_peer, &upload_limit);
+	c->on_write = shaped_upload;
+	snprintf(path, sizeof(path), "%s/%s", MANIFEST_DIR, x->hash);
+	if ((sent = delta_serve(c, x->filename, path)) == -1)
+		log_error("Could not send the changes of %s.", x->filename);
+	else {
+		STAT_ADD(uploads_completed, 1);
+		index_served(x->hash, sent);
+	}
+	unlimit_transfer(upload_shaper, &upload_peer);
+	STAT_SUB(active_uploads, 1);
+}
+
+/* The files of b that were in c's buffer have gone, they count as served */
+static void bundle_served(bundle_upload *b) {
+	char	hash[HASH_LEN + 1];
+
+	for (; b->flushed < b->next; b->flushed++)
+		if (b->buffered[b->flushed] > 0) {
+			memcpy(hash, b->hashes + b->flushed * HASH_LEN, HASH_LEN);
+			hash[HASH_LEN] = '\0';
+			index_served(hash, b->buffered[b->flushed]);
+		}
+}
+
+/*
+ * The bundle's file x without the engine, the listener waits like the
+ * plain loop would: the files buffered before it go first. Returns 0,
+ * -1 if it couldn't be opened and -2 if the connection failed.
+ */
+static int bundle_now(bundle_upload *b, hash_record *x, hot_entry *e) {
+	conn				*c = b->u.c;
+	unsigned long long	sent;
+	int					err;
+
+	if (conn_flush(c) == -1)
+		return -2;
+	bundle_served(b);
+	sent = STAT_GET(bytes_uploaded);
+	if (e == NULL)
+		err = send_file(x->filename, c);
+	else if ((err = send_descriptor(c, e->fd, e->size, hot_encoding(hot, e, c->options & OPT_ZLIB))) == 0)
+		err = conn_flush(c);
+	if (err == 0)
+		STAT_ADD(uploads_completed, 1);
+	/* Other uploads can't run meanwhile, the difference is this file's */
+	index_served(x->hash, STAT_GET(bytes_uploaded) - sent);
+	return err == 0 ? 0 : (e != NULL || err == -2 ? -2 : -1);
+}
+
+/*
+ * Sends the bundle's files from b->next on, in their order. Small ones
+ * in memory go in c's buffer behind each other while they fit, the first
+ * one that doesn't is handed to the engine: b comes back here once it's
+ * sent. Larger than BUNDLE_FILE_MAX they're to be asked for on their
+ * own. Returns 1 while the engine has one, 0 once they're all sent and
+ * -1 if the connection failed.
+ */
+static int bundle_step(bundle_upload *b) {
+	conn		*c = b->u.c;
+	hash_record	x;
+	hot_entry	*e;
+	char		*image;
+	size_t		len;
+	int			zlib = c->options & OPT_ZLIB,
+				err;
+
+	for (; b->next < b->num && !b->failed; b->next++) {
+		memcpy(b->u.hash, b->hashes + b->next * HASH_LEN, HASH_LEN);
+		b->u.hash[HASH_LEN] = '\0';
+		if (!index_find(b->u.hash, &x)) {
+			if (send_file_header(c, 0, BUNDLE_MISSING) == -1)
+				return -1;
+			continue;
+		}
+		if (record_size(&x) > BUNDLE_FILE_MAX) {
+			if (send_file_header(c, 0, BUNDLE_SEPARATE) == -1)
+				return -1;
+			continue;
+		}
+		if (hot != NULL && (e = hot_get(hot, x.hash, x.filename)) != NULL && !cache_normal(e->size)) {
+			hot_release(hot, e);
+			e = NULL;
+		}
+		if (e != NULL && !shaper_limited(upload_shaper) && (image = hot_image(hot, e, zlib, &len)) != NULL
+				&& len <= CONN_BUFFER_SIZE - c->out_len) {
+			/* It fits, nothing is sent yet */
+			conn_write(c, image, len);
+			hot_release(hot, e);
+			b->buffered[b->next] = len;
+			STAT_ADD(uploads_completed, 1);
+			continue;
+		}
+		if (b->uploads == NULL)
+			err = bundle_now(b, &x, e);
+		else {
+			b->u.hot = e;
+			b->starting = 1;
+			if (e != NULL) {
+				/* Read at offsets only, other uploads of the file share the descriptor */
+				memset(&b->u.t.cache, 0, sizeof(b->u.t.cache));
+				b->u.t.file = b->u.t.cache.fd = e->fd;
+				err = engine_send(b->uploads, &b->u.t, c, e->size, hot_encoding(hot, e, zlib));
+			}
+			else
+				err = engine_upload(b->uploads, &b->u.t, c, x.filename);
+			b->starting = 0;
+			if (err == 0) {
+				bundle_served(b);
+				if (b->u.t.status == ENGINE_RUNNING)
+					return 1;
+				/* Over already, bundle_done() has moved on */
+				b->next--;
+				continue;
+			}
+			b->u.hot = NULL;
+		}
+		if (e != NULL)
+			hot_release(hot, e);
+		/* Gone since it was indexed: nothing of it was sent yet */
+		if (err == 0 || (err == -1 && send_file_header(c, 0, BUNDLE_MISSING) == 0))
+			continue;
+		return -1;
+	}
+	if (b->failed || conn_flush(c) == -1)
+		return -1;
+	bundle_served(b);
+	return 0;
+}
+
+/* The bundle is over, err tells how: its connection is left to the caller */
+static void bundle_end(bundle_upload *b, int err) {
+	if (err != 0)
+		log_error("Could not send a bundle of %d files, send() failed.", b->num);
+	else
+		STAT_ADD(bundles_served, 1);
+	STAT_SUB(active_uploads, 1);
+	free(b->buffered);
+	free(b->hashes);
+	free(b);
+}
+
+/* The engine is done with one of the bundle's files, on with the next */
+static void bundle_done(transfer *t) {
+	bundle_upload	*b = (bundle_upload *) t;
+	conn			*c = b->u.c;
+	int				*client_num = b->u.client_num,
+					err;
+
+	if (t->status == ENGINE_DONE)
+		STAT_ADD(uploads_completed, 1);
+	else
+		b->failed = 1;
+	index_served(b->u.hash, t->done);
+	if (b->u.hot != NULL)
+		hot_release(hot, b->u.hot);
+	else
+		close(t->file);
+	b->u.hot = NULL;
+	b->next++;
+	if (b->starting)
+		return;
+	if ((err = bundle_step(b)) != 1) {
+		bundle_end(b, err);
+		(*client_num)--;
+		conn_close(c);
+	}
+}
+
+/*
+ * Every file of the bundle, in the order of hashes, on one connection.
+ * Like single files, with the engine the listener goes back to the
+ * others and the engine moves the bundle's files one after the other;
+ * without it the listener waits. Returns 1 if the engine owns c now.
+ */
+static int serve_bundle(engine *uploads, conn *c, char *hashes, int num, int *client_num) {
+	struct sockaddr_in	addr;
+	socklen_t			len = sizeof(addr);
+	char				ip[INET_ADDRSTRLEN] = "";
+	bundle_upload		*b;
+	int					err;
+
+	if ((b = calloc(1, sizeof(bundle_upload))) == NULL || (b->hashes = malloc(num * HASH_LEN)) == NULL
+			|| (b->buffered = calloc(num, sizeof(size_t))) == NULL) {
+		if (b != NULL)
+			free(b->hashes);
+		free(b);
+		log_error("Could not send a bundle of %d files, out of memory.", num);
+		return 0;
+	}
+	memcpy(b->hashes, hashes, num * HASH_LEN);
+	b->num = num;
+	b->u.c = c;
+	b->u.client_num = client_num;
+	b->u.t.on_progress = count_uploaded;
+	b->u.t.on_done = bundle_done;
+	STAT_ADD(active_uploads, 1);
+	if (uploads != NULL && tls_raw(c, TLS_SEND)) {
+		b->uploads = uploads;
+		if ((err = bundle_step(b)) == 1)
+			return 1;
+	}
+	else {
+		if (getpeername(c->fd, (struct sockaddr *) &addr, &len) == 0)
+			inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+		limit_transfer(upload_shaper, ip, &upload_peer, &upload_limit);
+		c->on_write = shaped_upload;
+		err = bundle_step(b);
+		unlimit_transfer(upload_shaper, &upload_peer);
+	}
+	bundle_end(b, err);
+	return 0;
+}
+
+/*
+ * Serves the query in c's buffer, if it's all there: the client may have
+ * sent it right behind the hand-shake. A bundle is served once all its
+ * hashes have come. Returns 0 while something is still missing, 1 once
+ * c has been handed over or closed.
+ */
+static int answer(engine *uploads, conn *c, int *client_num) {
+	char		*query,
+				hash[HASH_LEN + 1];
+	hash_record	x;
+	int			num;
+
+	if ((query = conn_peek(c, QUERY_SIZE)) == NULL)
+		return 0;
+	if ((c->options & OPT_BUNDLE) && (num = parse_bundle(query)) != -1) {
+		if ((query = conn_frame(c, BUNDLE_SIZE + num * HASH_LEN)) == NULL)
+			return 0;
+		if (!tls_raw(c, TLS_RECV))
+			conn_nonblock(c, 0);
+		if (serve_bundle(uploads, c, query + BUNDLE_SIZE, num, client_num))
+			return 1;
+		(*client_num)--;
+		conn_close(c);
+		return 1;
+	}
+	query = conn_frame(c, QUERY_SIZE);
+	/* One that waited in the set didn't block, serving it does again */
+	if (!tls_raw(c, TLS_RECV))
+		conn_nonblock(c, 0);
+	/* See what the client needs and send it, then serve another client */
+	if (parse_query(query, hash) == 0 && index_find(hash, &x) && serve(uploads, c, &x, client_num))
+		return 1;
+	if (parse_delta_query(query, hash) == 0 && index_find(hash, &x))
+		serve_delta(c, &x);
+	(*client_num)--;
+	conn_close(c);
+	return 1;
+}
+
 void peer_listener() {
 	fd_set				master,
 						read_fds;
 	socklen_t			client_len;
-	hash_record			x;
 	struct sockaddr_in	server,
 						client;
 	struct timeval		timeout;
-	char				buffer[BUFFER_SIZE],
-						*tok = NULL;
+	char				transfer_engine[BUFFER_SIZE];
+	static conn			*clients[FD_SETSIZE];	/* One per descriptor in the master set */
+	conn				*c = NULL;
+	engine				*uploads = NULL;
+	ssize_t				got;
 	int					fdmax,
 						listener,
 						newfd,
 						selectval,
-						bytes,
 						yes = 1, /* for setsockopt() */
 						client_num = 0,
-						found = 0,
+						max_clients = 1,
 						i,
-						fp,
-						err = 0;
-
-	/* Set the timeout to 1 second */
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
+						control,
+						ring = -1;
 
 	/* Clear the master and temp sets */
 	FD_ZERO(&master);
@@ -645,7 +1225,7 @@ void peer_listener() {
 
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port = htons(25546);
+	server.sin_port = htons(PEER_PORT);
 
 	/* I'm going to cast sockaddr_in in sockaddr, I need to do this */
 	memset(&server.sin_zero, '\0', sizeof(server.sin_zero));
@@ -656,7 +1236,23 @@ void peer_listener() {
 		pthread_exit(NULL);
 	}
 
-	if (listen(listener, 1) == -1) {
+	/*
+	 * With io_uring many uploads run at the same time from this thread,
+	 * otherwise clients are served one at a time.
+	 */
+	c_read_config_default(transfer_engine, "transfer-engine", "uring");
+	if (strcmp(transfer_engine, "uring") == 0
+			&& (uploads = engine_open(i_read_config_default("max-uploads", MAX_UPLOADS))) != NULL) {
+		max_clients = engine_free_slots(uploads);
+		ring = engine_fd(uploads);
+	}
+	upload_shaper = shaper_from_config("upload");
+	if (uploads != NULL)
+		engine_shape(uploads, upload_shaper);
+	STAT_SET(upload_slots, max_clients);
+	STAT_SET(upload_limit, upload_shaper != NULL ? upload_shaper->global.rate : 0);
+
+	if (listen(listener, max_clients) == -1) {
 		perror("[ERROR] Listener: listen() call failed");
 		mypause();
 		pthread_exit(NULL);
@@ -665,13 +1261,38 @@ void peer_listener() {
 	FD_SET(listener, &master);
 	fdmax = listener;
 
+	/* The control socket is optional, stats can still be seen from the menu */
+	if ((control = control_open()) != -1) {
+		FD_SET(control, &master);
+		if (control > fdmax)
+			fdmax = control;
+	}
+
+	/* The ring is readable when transfers have made progress */
+	if (ring != -1) {
+		FD_SET(ring, &master);
+		if (ring > fdmax)
+			fdmax = ring;
+	}
+
+	/* Other peers' lookups, with discovery=dht */
+	if (node != NULL) {
+		FD_SET(dht_fd(node), &master);
+		if (dht_fd(node) > fdmax)
+			fdmax = dht_fd(node);
+	}
+
 	while (1) {
 		read_fds = master;
+		stats_tick();
+
+		/* select() may modify the timeout, set it to 1 second every time */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
 
 		selectval = select(fdmax+1, &read_fds, NULL, NULL, &timeout);
 		if (selectval < 0) {
-			perror("[ERROR] Listener: select() call failed");
-			mypause();
+			log_error("Listener: select() call failed: %s", strerror(errno));
 			pthread_exit(NULL);
 		}
 		else if (selectval == 0) {
@@ -693,83 +1314,167 @@ void peer_listener() {
 					client_len = sizeof(client);
 
 					if ((newfd = accept(listener, (struct sockaddr *) &client, &client_len)) == -1) {
-						perror("[ERROR] Listener: accept() call failed");
+						log_error("Listener: accept() call failed: %s", strerror(errno));
 					}
 					else { /* Let's test the client before adding it to the set */
 						client_num++;
-						if (client_num > 1) { /* There can only be one connected client, kick the new one */
+						if (client_num > max_clients || newfd >= FD_SETSIZE) { /* No room for it, kick the new one */
 							close(newfd);
 							client_num--;
-							break;
+							continue;
 						}
-						if (handshake(1, &newfd) == -1) { /* If handshake fails, kick the client */
+						if ((c = conn_open(newfd)) == NULL) {
+							close(newfd);
 							client_num--;
-							break;
+							continue;
+						}
+						c->on_write = count_uploaded;
+						conn_timeout(c, IO_TIMEOUT);
+						if (handshake_reply(HANDSHAKE_PEER, c, options) == -1) { /* If handshake fails, kick the client */
+							conn_close(c);
+							client_num--;
+							continue;
 						}
 
 						/* If we're here there's a genuine client to serve */
+						if (answer(uploads, c, &client_num))
+							continue;
+						/* Part of a TLS record mustn't stop the others, see Server */
+						if (!tls_raw(c, TLS_RECV))
+							conn_nonblock(c, 1);
+						clients[newfd] = c;
 						FD_SET(newfd, &master);
 						if(newfd > fdmax)
 							fdmax = newfd;
 					}
 				}
 				/*
-				 * 2 - An already connected client is sending some data
+				 * 2 - Someone is asking for stats on the control socket
+				 */
+				else if (i == control) {
+					control_serve(control);
+				}
+				/*
+				 * 3 - Uploads have made progress
+				 */
+				else if (i == ring) {
+					engine_run(uploads, 0);
+				}
+				/*
+				 * 4 - DHT requests, all of those waiting
+				 */
+				else if (node != NULL && i == dht_fd(node)) {
+					while (dht_handle(node) != -1)
+						;
+				}
+				/*
+				 * 5 - An already connected client is sending some data
 				 */
 				else {
-					if ((bytes = read(i, buffer, sizeof(buffer))) <= 0) {
+					c = clients[i];
+					if ((got = conn_fill(c)) == CONN_AGAIN)
+						continue;
+					if (got <= 0) {
 						/* Client closed the connection or an error happened */
-						close(i);
+						conn_close(c);
+						clients[i] = NULL;
 						client_num--;
 						FD_CLR(i, &master);
 					}
-					else {
-						/* See what the client needs and send it */
-						tok = strtok(buffer, "-");;
-						if(strcmp(tok, "HASH") == 0) {
-							tok = strtok(NULL, "-");
-							fp = open(HASH_FILE, O_RDONLY);
-							if (fp != -1) {
-								while ((read(fp, &x, sizeof(hash_record))) == sizeof(hash_record)) {
-									if (strcmp(x.hash, tok) == 0) {
-										found = 1;
-										break;
-									}
-								}
-								close(fp);
-							}
-							else
-								fprintf(stderr, "[ERROR] Couldn't open the hash file while sending a shared file.\n");
-						}
-						if (found == 1) {
-							err = send_file(x.filename, &i);
-							if (err == -1)
-								fprintf(stderr, "[ERROR] Could not open file to send.\n");
-							else if (err == -2)
-								fprintf(stderr, "[ERROR] Could not send hash file, send() failed.\n");
-						}
-
-						/* Done, clear everything and serve another client */
-						found = 0;
-						client_num--;
-						close(i);
+					else if (answer(uploads, c, &client_num)) {
+						clients[i] = NULL;
 						FD_CLR(i, &master);
 					}
 				}
 			}
 		}
+		/* Uploads started in this round go to the kernel all together */
+		if (uploads != NULL)
+			engine_run(uploads, 0);
 	}
 	close(listener);
 	/* Disconnecting all the clients */
 	for (i = 0; i <= fdmax; i++)
-		if (FD_ISSET(i, &master))
-			close(i);
+		if (FD_ISSET(i, &master)) {
+			if (clients[i] != NULL) {
+				conn_close(clients[i]);
+				clients[i] = NULL;
+			}
+			else if (i != ring && (node == NULL || i != dht_fd(node)))
+				close(i);
+		}
+	engine_close(uploads);
+	shaper_close(upload_shaper);
+	hot_close(hot);
+	hot = NULL;
+	if (control != -1)
+		unlink(CONTROL_SOCKET);
 	pthread_exit(NULL);
 }
 
-void user_interface(int *socket2server) {
+/*
+ * Every LOAD_INTERVAL seconds the servers hear how busy the uploads are,
+ * so that they send downloaders where they'll be served quicker. Servers
+ * that don't want reports but drop silent peers get a ping every
+ * HEARTBEAT_INTERVAL instead. Both are skipped while the UI is using the
+ * connections. In the DHT there are no servers: the shared files are
+ * announced again every DHT_REANNOUNCE seconds, before their records
+ * expire, here rather than in the UI's way.
+ */
+void load_reporter(tracker *server) {
+	struct timespec	pause = { 0, 100000000 };
+	load_report		r;
+	conn			*c;
+	int				ticks = 0,
+					beat,
+					joined,
+					files,
+					announced,
+					i;
+
+	while (!quit) {
+		nanosleep(&pause, NULL);
+		if (++ticks % (DHT_REANNOUNCE * 10) == 0 && server->dht != NULL) {
+			pthread_mutex_lock(&server->lock);
+			joined = server->joined;
+			pthread_mutex_unlock(&server->lock);
+			if (joined && (announced = announce_files(server->dht, &files)) != -1)
+				log_info("Announced %d/%d files to the DHT again.", announced, files);
+		}
+		if (ticks % (LOAD_INTERVAL * 10) != 0 && ticks % (HEARTBEAT_INTERVAL * 10) != 0)
+			continue;
+		beat = ticks % (HEARTBEAT_INTERVAL * 10) == 0;
+		r.active = STAT_GET(active_uploads);
+		r.free_slots = STAT_GET(upload_slots) > (int) r.active ? STAT_GET(upload_slots) - r.active : 0;
+		r.rate = STAT_GET(upload_rate) < 0xffffffffULL ? STAT_GET(upload_rate) : 0xffffffffU;
+		r.limit = STAT_GET(upload_limit) < 0xffffffffULL ? STAT_GET(upload_limit) : 0xffffffffU;
+		if (pthread_mutex_trylock(&server->lock) != 0)
+			continue;
+		for (i = 0; server->ring != NULL && i < server->ring->shards; i++) {
+			if ((c = server->shards[i]) == NULL)
+				continue;
+			if ((c->options & OPT_LOAD) && ticks % (LOAD_INTERVAL * 10) == 0)
+				send_load(c, &r);
+			else if ((c->options & OPT_HEARTBEAT) && !(c->options & OPT_LOAD) && beat)
+				send_ping(c);
+		}
+		pthread_mutex_unlock(&server->lock);
+	}
+	pthread_exit(NULL);
+}
+
+void user_interface(tracker *server) {
 	short int	choice = 0,
 				exit = 0;
+	int			connected;
+	char		transfer_engine[BUFFER_SIZE];
+
+	c_read_config_default(transfer_engine, "transfer-engine", "uring");
+	if (strcmp(transfer_engine, "uring") == 0)
+		downloads = engine_open(1);
+	download_shaper = shaper_from_config("download");
+	if (downloads != NULL)
+		engine_shape(downloads, download_shaper);
 
 	while (!exit) {
 		clrscr();
@@ -777,31 +1482,50 @@ void user_interface(int *socket2server) {
 		printf("# Peer %2.2f                #\n", _VERSION_);
 		printf("############################\n");
 		printf("# Stats: #\n");
-		printf("- Shared files:\t%d\n", counth_hash_file());
-		printf("############################\n\n\n\n\n\n");
+		printf("- Shared files:\t%d\n", index_count());
+		printf("- Uploads:\t%d active, %lu done, %llu KB/s\n", STAT_GET(active_uploads),
+				STAT_GET(uploads_completed), STAT_GET(upload_rate) / 1024);
+		printf("- Downloads:\t%d active, %lu done, %lu failed (%lu corrupt), %llu KB/s\n", STAT_GET(active_downloads),
+				STAT_GET(downloads_completed), STAT_GET(downloads_failed), STAT_GET(downloads_corrupt),
+				STAT_GET(download_rate) / 1024);
+		printf("- Sent:\t\t%llu KB\n- Received:\t%llu KB\n", STAT_GET(bytes_uploaded) / 1024, STAT_GET(bytes_downloaded) / 1024);
+		printf("- Local:\t%lu downloads found here, %llu KB deduplicated\n", STAT_GET(downloads_local),
+				STAT_GET(bytes_deduplicated) / 1024);
+		if (STAT_GET(hashing))
+			printf("- Hashing:\t%lu/%lu files\n", STAT_GET(hash_files_done), STAT_GET(hash_files_total));
+		printf("############################\n\n\n");
 		printf("# Menu: #\n");
-		if (is_connected(*socket2server) == -1)
+		if (!server_connected(server))
 			printf("1) Connect\n");
 		else
 			printf("1) Disconnect\n");
 		printf("2) List shared files\n");
 		printf("3) Generate hash list\n");
-		if (is_connected(*socket2server) == 0)
+		if (server_connected(server))
 			printf("4) Download file\n");
+		if (server_connected(server) && server->dht == NULL)
+			printf("5) Search files\n");
 		printf("\n0) Exit\n\n\n");
 		printf("Your choice: ");
-		scanf("%hd", &choice);
+		/* Without a terminal (e.g. started in background) keep serving */
+		if (scanf("%hd", &choice) == EOF)
+			pthread_exit(NULL);
 		switch (choice) {
 		case 0:
 			exit = 1;
-			if (is_connected(*socket2server) == 0)
-				close(*socket2server);
+			pthread_mutex_lock(&server->lock);
+			disconnect(server);
+			pthread_mutex_unlock(&server->lock);
 			break;
 		case 1:
-			if (is_connected(*socket2server) == -1)
-				conn_to_server(socket2server);
-			else
-				close(*socket2server);
+			/* Only this thread changes the connections, the load reports use them */
+			connected = server_connected(server);
+			/* A server may have gone away, forget the old connections */
+			pthread_mutex_lock(&server->lock);
+			disconnect(server);
+			pthread_mutex_unlock(&server->lock);
+			if (!connected)
+				conn_to_server(server);
 			break;
 		case 2:
 			print_files();
@@ -810,31 +1534,75 @@ void user_interface(int *socket2server) {
 			write_hash_list();
 			break;
 		case 4:
-			if (is_connected(*socket2server) == 0)
-				download_file(socket2server);
+			if (server_connected(server))
+				download_file(server);
+			break;
+		case 5:
+			search_files(server);
 			break;
 		default:
 			choice = 0;
 			break;
 		}
 	}
+	engine_close(downloads);
+	shaper_close(download_shaper);
 	quit = 1; /* Tell the listener thread to terminate as soon as possible */
 	pthread_exit(NULL);
 }
 
 int main() {
 	pthread_t	listener,
+				reporter,
 				ui;
-	int			socket2server;
+	tracker		server;
+	char		discovery[BUFFER_SIZE],
+				log_level[BUFFER_SIZE],
+				log_format[BUFFER_SIZE],
+				log_file[BUFFER_SIZE];
 
 	quit = 0;
+	memset(&server, 0, sizeof(server));
+	pthread_mutex_init(&server.lock, NULL);
+	config_example = "server-ip=1.2.3.4\nserver-port=1313\nshared-folder=/home/user/shared;/home/user/public\n";
+	load_hash_index();
+
+	/* The listener must not write on the terminal the menu is using */
+	c_read_config_default(log_level, "log-level", "warn");
+	c_read_config_default(log_format, "log-format", "text");
+	c_read_config_default(log_file, "log-file", "-");
+	if (log_init(log_level_parse(log_level), log_format_parse(log_format), log_file, 2) == -1)
+		return -1;
+	if (tls_setup() == -1)
+		return -1;
+	options = handshake_options();
+	dedupe = store_mode();
+	cache_init(cache_mode(), (unsigned long long) i_read_config_default("page-cache-min", CACHE_MIN) << 20,
+			(unsigned long long) i_read_config_default("readahead", 0) << 10);
+	store_init(STORE_DIR);
+	hot = hot_setup();
+	c_read_config_default(discovery, "discovery", "server");
+	if (strcmp(discovery, "dht") == 0
+			&& (node = dht_open(i_read_config_default("dht-port", DHT_PORT))) == NULL) {
+		fprintf(stderr, "[ERROR] Couldn't open the DHT port.\n");
+		return -1;
+	}
+	server.dht = node;
+
+	/* A downloader that goes away while we send must not kill the peer */
+	signal(SIGPIPE, SIG_IGN);
 
 	if (pthread_create(&listener, NULL, (void *) &peer_listener, NULL) < 0) {
 		perror("[ERROR] Couldn't start listener thread");
 		return -1;
 	}
 
-	if (pthread_create(&ui, NULL, (void *) &user_interface, &socket2server) < 0) {
+	if (pthread_create(&reporter, NULL, (void *) &load_reporter, &server) < 0) {
+		perror("[ERROR] Couldn't start load reporter thread");
+		return -1;
+	}
+
+	if (pthread_create(&ui, NULL, (void *) &user_interface, &server) < 0) {
 		perror("[ERROR] Couldn't start UI thread");
 		return -1;
 	}
@@ -844,7 +1612,11 @@ int main() {
 	 */
 	pthread_join(ui, NULL);
 	pthread_join(listener, NULL);
+	pthread_join(reporter, NULL);
+	pthread_mutex_destroy(&server.lock);
 
+	dht_close(node);
+	log_shutdown();
 	printf("Thank you for using Peer %2.2f\n", _VERSION_);
 	return 0;
 }
@@ -7,33 +7,82 @@
 #ifndef PEER_H_
 #define PEER_H_
 
+#include <pthread.h> /* pthread_mutex_t */
+
+#include "Conn.h"
+#include "Engine.h"
+#include "Verify.h"
+#include "Ring.h"
+#include "Dht.h"
+#include "Hot.h"
+
 #define _VERSION_ 0.01
 #define BUFFER_SIZE 1024
-#define CONFIG_FILE "config"
 #define HASH_FILE "hash"
+#define SHARD_FILE "hash.%d"		/* The part of the hash list one shard keeps */
+#define MANIFEST_DIR "manifests"	/* Each shared file's chunks, named after its hash */
+#define STORE_DIR "store"			/* Every local file by its hash, see Store.h */
+#define IO_TIMEOUT 5000	/* msec a downloader may stall while we wait for it */
+#define MAX_UPLOADS 64
+#define SEARCH_PAGE 10	/* Results shown at a time */
+#define CONNECT_RETRIES 5		/* Times a busy server is tried again */
+#define BACKOFF_FIRST 500		/* msec, doubled at every try */
+#define BACKOFF_MAX 30000
+
+/* An upload handed to the engine, the transfer must come first */
+typedef struct upload {
+	transfer	t;
+	conn		*c;
+	char		hash[41];
+	int			*client_num;
+	hot_entry	*hot;		/* The file comes from the hot cache, it's released instead of closed */
+} upload;
+
+/* A bundle handed to the engine: its files one after the other, each an upload of u.t */
+typedef struct bundle_upload {
+	upload		u;
+	engine		*uploads;
+	char		*hashes;	/* num of them, HASH_LEN each */
+	int			num;
+	int			next;		/* The one being sent */
+	int			flushed;	/* Those before have left c's buffer */
+	size_t		*buffered;	/* Bytes of each one written in c's buffer */
+	int			starting;	/* The engine is being handed one, it may be over at once */
+	int			failed;
+} bundle_upload;
+
+/* A download handed to the engine, hashed as it's written */
+typedef struct download {
+	transfer	t;
+	verifier	v;
+} download;
+
+/*
+ * The servers, each one in charge of a part of the hash space. With
+ * discovery=dht there are none, the peers find each other.
+ */
+typedef struct tracker {
+	ring			*ring;
+	conn			*shards[RING_MAX_SHARDS];
+	dht				*dht;
+	int				joined;		/* The hash list has been announced in the DHT */
+	pthread_mutex_t	lock;		/* The UI and the load reports share the connections */
+} tracker;
 
-typedef struct hash_record {
-	char hash[41];
-	char filename[1024];
-} hash_record;
+extern hot_cache *hot;
 
 void clrscr();
 void mypause();
 unsigned long _get_size_by_fd(int);
-int create_config_file();
-int i_read_config(char *);
-void c_read_config(char *, char *, int *);
 void sha1_hash(char *, const void *, const size_t);
-int counth_hash_file();
 void print_files();
 void write_hash_list();
-int is_connected(int);
-int handshake(int, int *);
-int send_file(char *, int *);
-int receive_file(char *, int *);
-void conn_to_server(int *);
-void download_file(int *);
+void conn_to_server(tracker *);
+void disconnect(tracker *);
+void search_files(tracker *);
+void download_file(tracker *);
 void peer_listener();
-void user_interface(int *);
+void load_reporter(tracker *);
+void user_interface(tracker *);
 
 #endif /* PEER_H_ */
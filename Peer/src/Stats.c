@@ -0,0 +1,169 @@
+/*
+ ============================================================================
+ Name        : Stats.c
+ Author      : Giacomo Persichini
+ Description : Live transfer counters and the local control socket
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h> /* strncmp() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* read() - write() - close() - unlink() */
+#include <sys/socket.h> /* AF_UNIX - SOCK_STREAM */
+#include <sys/un.h> /* struct sockaddr_un */
+
+#include "Stats.h"
+#include "Index.h"
+#include "Log.h"
+
+peer_stats stats;
+
+static unsigned long long now_msec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Samples the byte counters and turns them into rates. It is called by
+ * the listener thread at every loop, at most once a second does any work.
+ */
+void stats_tick() {
+	static unsigned long long	last_time = 0,
+								last_up = 0,
+								last_down = 0;
+	unsigned long long			now = now_msec(),
+								up,
+								down;
+
+	if (last_time != 0 && now - last_time < 1000)
+		return;
+	up = STAT_GET(bytes_uploaded);
+	down = STAT_GET(bytes_downloaded);
+	if (last_time != 0) {
+		STAT_SET(upload_rate, (up - last_up) * 1000 / (now - last_time));
+		STAT_SET(download_rate, (down - last_down) * 1000 / (now - last_time));
+	}
+	last_time = now;
+	last_up = up;
+	last_down = down;
+}
+
+/* Plain "name value" lines, easy to parse from a shell script */
+int stats_format(char *out, int size) {
+	int	len;
+
+	len = snprintf(out, size,
+			"shared_files %d\n"
+			"active_uploads %d\n"
+			"active_downloads %d\n"
+			"uploads_completed %lu\n"
+			"downloads_completed %lu\n"
+			"downloads_failed %lu\n"
+			"downloads_corrupt %lu\n"
+			"downloads_local %lu\n"
+			"bundles_served %lu\n"
+			"bytes_deduplicated %llu\n"
+			"bytes_uploaded %llu\n"
+			"bytes_downloaded %llu\n"
+			"upload_rate %llu\n"
+			"download_rate %llu\n"
+			"upload_slots %d\n"
+			"upload_limit %llu\n"
+			"hashing %d\n"
+			"hash_files_done %lu\n"
+			"hash_files_total %lu\n"
+			"hash_bytes_done %llu\n"
+			"log_dropped %lu\n",
+			index_count(),
+			STAT_GET(active_uploads),
+			STAT_GET(active_downloads),
+			STAT_GET(uploads_completed),
+			STAT_GET(downloads_completed),
+			STAT_GET(downloads_failed),
+			STAT_GET(downloads_corrupt),
+			STAT_GET(downloads_local),
+			STAT_GET(bundles_served),
+			STAT_GET(bytes_deduplicated),
+			STAT_GET(bytes_uploaded),
+			STAT_GET(bytes_downloaded),
+			STAT_GET(upload_rate),
+			STAT_GET(download_rate),
+			STAT_GET(upload_slots),
+			STAT_GET(upload_limit),
+			STAT_GET(hashing),
+			STAT_GET(hash_files_done),
+			STAT_GET(hash_files_total),
+			STAT_GET(hash_bytes_done),
+			log_dropped());
+	if (hot != NULL && len < size)
+		len += hot_format(hot, out + len, size - len);
+	return len < size ? len : size;
+}
+
+/* Opens the control socket, a UNIX socket next to the hash file */
+int control_open() {
+	int					listener;
+	struct sockaddr_un	addr;
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("[ERROR] Control: socket() call failed");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CONTROL_SOCKET, sizeof(addr.sun_path) - 1);
+	/* A previous run may have left the socket file behind */
+	unlink(CONTROL_SOCKET);
+
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("[ERROR] Control: bind() call failed");
+		close(listener);
+		return -1;
+	}
+	if (listen(listener, 8) == -1) {
+		perror("[ERROR] Control: listen() call failed");
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+/*
+ * Answers a single command:
+ *  STATS - the global counters
+ *  FILES - the counters plus a line for every shared file
+ */
+void control_serve(int listener) {
+	static char		out[STATS_BUFFER_SIZE];
+	char			cmd[64];
+	int				client,
+					len;
+	struct timeval	timeout;
+
+	if ((client = accept(listener, NULL, NULL)) == -1) {
+		log_error("Control: accept() call failed");
+		return;
+	}
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 100000;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	memset(cmd, 0, sizeof(cmd));
+	if (read(client, cmd, sizeof(cmd) - 1) > 0) {
+		if (strncmp(cmd, "STATS", 5) == 0)
+			len = stats_format(out, sizeof(out));
+		else if (strncmp(cmd, "FILES", 5) == 0) {
+			len = stats_format(out, sizeof(out));
+			len += index_format(out + len, sizeof(out) - len);
+		}
+		else
+			len = snprintf(out, sizeof(out), "error unknown command\n");
+		write(client, out, len);
+	}
+	close(client);
+}
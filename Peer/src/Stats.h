@@ -0,0 +1,49 @@
+/*
+ * Stats.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#define CONTROL_SOCKET "control"
+#define STATS_BUFFER_SIZE 65536
+
+/* Counters are updated from several threads without taking a lock */
+#define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n) __atomic_sub_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&stats.field, (v), __ATOMIC_RELAXED)
+
+typedef struct peer_stats {
+	unsigned long long	bytes_uploaded;
+	unsigned long long	bytes_downloaded;
+	int					active_uploads;
+	int					active_downloads;
+	unsigned long		uploads_completed;
+	unsigned long		downloads_completed;
+	unsigned long		downloads_failed;
+	unsigned long		downloads_corrupt;	/* Failed too, the content didn't match the hash */
+	unsigned long		downloads_local;	/* Found in the store, nothing was downloaded */
+	unsigned long		bundles_served;		/* Their files count as uploads too */
+	unsigned long long	bytes_deduplicated;
+	/* Bytes per second over the last sampling period, see stats_tick() */
+	unsigned long long	upload_rate;
+	unsigned long long	download_rate;
+	int					upload_slots;	/* Uploads the listener takes at once */
+	unsigned long long	upload_limit;	/* Bytes per second, 0 if none */
+	int					hashing;
+	unsigned long		hash_files_done;
+	unsigned long		hash_files_total;
+	unsigned long long	hash_bytes_done;
+} peer_stats;
+
+extern peer_stats stats;
+
+void stats_tick();
+int stats_format(char *, int);
+int control_open();
+void control_serve(int);
+
+#endif /* STATS_H_ */
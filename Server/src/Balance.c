@@ -0,0 +1,129 @@
+/*
+ ============================================================================
+ Name        : Balance.c
+ Author      : Giacomo Persichini
+ Description : Which owner a downloader is sent to, by the load peers report
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h> /* memset() */
+#include <sys/select.h> /* FD_SETSIZE */
+
+#include "Balance.h"
+#include "Metrics.h"
+#include "Log.h"
+
+/* Only the listener thread gets here, like for the metrics */
+static peer_load	peers[FD_SETSIZE];
+static int			num_peers = 0;
+static unsigned int	turn = 0;	/* Rotates owners that are just as good */
+
+static peer_load *by_fd(int fd) {
+	int	i;
+
+	for (i = 0; i < num_peers; i++)
+		if (peers[i].fd == fd)
+			return &peers[i];
+	return NULL;
+}
+
+/* An address may have a few connections, a peer that reconnected: the one that reported last */
+static peer_load *by_addr(unsigned int addr) {
+	peer_load	*p = NULL;
+	int			i;
+
+	for (i = 0; i < num_peers; i++)
+		if (peers[i].addr == addr && (p == NULL || peers[i].updated > p->updated))
+			p = &peers[i];
+	return p;
+}
+
+void balance_join(int fd, char *ip) {
+	peer_load	*p;
+
+	if (num_peers == FD_SETSIZE)
+		return;
+	p = &peers[num_peers++];
+	memset(p, 0, sizeof(peer_load));
+	p->fd = fd;
+	inet_pton(AF_INET, ip, &p->addr);
+}
+
+void balance_leave(int fd) {
+	peer_load	*p = by_fd(fd);
+
+	if (p != NULL)
+		*p = peers[--num_peers];
+}
+
+/* The report tells about the downloaders sent so far, they aren't pending any more */
+void balance_report(int fd, load_report *r) {
+	peer_load	*p = by_fd(fd);
+
+	if (p == NULL)
+		return;
+	p->last = *r;
+	p->reported = 1;
+	p->pending = 0;
+	p->updated = now_usec();
+	p->peak = p->peak * 15 / 16 > r->rate ? p->peak * 15 / 16 : r->rate;
+}
+
+/*
+ * Bytes per second one more downloader can expect from the peer. Peers
+ * that never reported, or not lately, are taken for idle ones sending
+ * BALANCE_UNKNOWN_RATE.
+ */
+static unsigned long long share(peer_load *p, unsigned long long now, int *free) {
+	unsigned long long	capacity;
+	unsigned int		busy;
+
+	if (p == NULL || !p->reported || now - p->updated > BALANCE_STALE * 1000000ULL) {
+		*free = 1;
+		return BALANCE_UNKNOWN_RATE / ((p != NULL ? p->pending : 0) + 1);
+	}
+	*free = p->last.free_slots > p->pending;
+	capacity = p->peak > BALANCE_UNKNOWN_RATE ? p->peak : BALANCE_UNKNOWN_RATE;
+	if (p->last.limit != 0 && p->last.limit < capacity)
+		capacity = p->last.limit;
+	busy = p->last.active + p->pending;
+	return capacity / (busy + 1);
+}
+
+/*
+ * The owner to send the downloader to, among num of them: the index in
+ * owners. It's counted as pending until the owner reports again.
+ */
+int balance_pick(char (*owners)[INET_ADDRSTRLEN], int num) {
+	unsigned long long	now = now_usec(),
+						best_share = 0,
+						s;
+	unsigned int		addr;
+	peer_load			*p,
+						*best_peer = NULL;
+	int					best = -1,
+						best_free = 0,
+						free,
+						i,
+						j;
+
+	turn++;
+	for (j = 0; j < num; j++) {
+		/* Starting from a different owner every time, ties go round */
+		i = (j + turn) % num;
+		p = inet_pton(AF_INET, owners[i], &addr) == 1 ? by_addr(addr) : NULL;
+		s = share(p, now, &free);
+		if (best == -1 || free > best_free || (free == best_free && s > best_share)) {
+			best = i;
+			best_free = free;
+			best_share = s;
+			best_peer = p;
+		}
+	}
+	if (best_peer != NULL)
+		best_peer->pending++;
+	if (best != -1 && !best_free)
+		metrics.lookups_all_busy++;
+	return best;
+}
@@ -0,0 +1,40 @@
+/*
+ * Balance.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef BALANCE_H_
+#define BALANCE_H_
+
+#include <arpa/inet.h> /* INET_ADDRSTRLEN */
+
+#include "Protocol.h"
+
+#define BALANCE_MAX_OWNERS 64				/* Looked at for a lookup, the others aren't found */
+#define BALANCE_UNKNOWN_RATE (1 << 20)		/* Bytes per second expected from a peer that never sent that much */
+#define BALANCE_STALE (3 * LOAD_INTERVAL)	/* Seconds a report is trusted for */
+
+/*
+ * What the server knows of each connected peer's uploads. Every lookup
+ * sends the downloader to the owner it can expect the most bandwidth
+ * from: what the owner can send (its limit, or the most it has been seen
+ * sending) split between its uploads and the downloaders sent its way
+ * since its last report. Owners with free slots go first.
+ */
+typedef struct peer_load {
+	int					fd;
+	unsigned int		addr;		/* Network order, as in db/ */
+	int					reported;
+	load_report			last;
+	unsigned long long	peak;		/* Bytes per second, slowly forgotten */
+	unsigned int		pending;	/* Downloaders sent since the last report */
+	unsigned long long	updated;	/* usec */
+} peer_load;
+
+void balance_join(int, char *);
+void balance_leave(int);
+void balance_report(int, load_report *);
+int balance_pick(char (*)[INET_ADDRSTRLEN], int);
+
+#endif /* BALANCE_H_ */
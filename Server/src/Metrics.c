@@ -0,0 +1,238 @@
+/*
+ ============================================================================
+ Name        : Metrics.c
+ Author      : Giacomo Persichini
+ Description : Server counters, histograms and the Prometheus endpoint
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h> /* memset() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close() - read() - write() */
+#include <sys/socket.h> /* AF_INET - SOCK_STREAM */
+#include <arpa/inet.h> /* htons() - htonl() */
+
+#include "Metrics.h"
+#include "Log.h"
+
+/*
+ * Every counter is only touched by the listener thread, so no locking
+ * is needed here.
+ */
+server_metrics metrics;
+
+unsigned long long now_usec() {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long long value) {
+	int	msb;
+
+	if (value < HIST_SUB_BUCKETS)
+		return (int) value;
+	msb = 63 - __builtin_clzll(value);
+	/* The top bit is implicit, the next HIST_SUB_BITS select the sub-bucket */
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS
+			+ (int) ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Exclusive upper bound of a bucket */
+static unsigned long long hist_upper(int index) {
+	int	major = index / HIST_SUB_BUCKETS,
+		sub = index % HIST_SUB_BUCKETS;
+
+	if (major == 0)
+		return (unsigned long long) sub + 1;
+	return (unsigned long long) (HIST_SUB_BUCKETS + sub + 1) << (major - 1);
+}
+
+void hist_record(histogram *h, unsigned long long value) {
+	h->counts[hist_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+unsigned long long hist_percentile(histogram *h, double p) {
+	unsigned long long	rank,
+						seen = 0;
+	int					i;
+
+	if (h->count == 0)
+		return 0;
+	rank = (unsigned long long) (p * h->count);
+	if (rank < p * h->count || rank == 0)
+		rank++;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			return hist_upper(i) - 1 < h->max ? hist_upper(i) - 1 : h->max;
+	}
+	return h->max;
+}
+
+static int format_histogram(char *out, int size, char *name, char *help, histogram *h) {
+	static const double	quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long long	cumulative = 0,
+						bound;
+	int					len,
+						i,
+						top;
+
+	len = snprintf(out, size, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	/* Exposed buckets are the powers of two, up to the largest recorded value */
+	top = hist_index(h->max) / HIST_SUB_BUCKETS;
+	for (i = 0; i < HIST_BUCKETS && len < size; i++) {
+		cumulative += h->counts[i];
+		if ((i + 1) % HIST_SUB_BUCKETS != 0 || i / HIST_SUB_BUCKETS > top)
+			continue;
+		/* Values are integers, so the inclusive bound is one less */
+		bound = hist_upper(i) - 1;
+		len += snprintf(out + len, size - len, "%s_bucket{le=\"%llu\"} %llu\n", name, bound, cumulative);
+	}
+	if (len < size)
+		len += snprintf(out + len, size - len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+				name, h->count, name, h->sum, name, h->count);
+	if (len < size)
+		len += snprintf(out + len, size - len, "# TYPE %s_quantile gauge\n", name);
+	for (i = 0; i < 4 && len < size; i++)
+		len += snprintf(out + len, size - len, "%s_quantile{quantile=\"%g\"} %llu\n",
+				name, quantiles[i], hist_percentile(h, quantiles[i]));
+	return len < size ? len : size;
+}
+
+static int format_counter(char *out, int size, char *name, char *type, char *help, unsigned long long value) {
+	int	len;
+
+	len = snprintf(out, size, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+	return len < size ? len : size;
+}
+
+/* Writes the Prometheus text exposition of every metric, returns its length */
+int metrics_format(char *out, int size) {
+	int	len = 0;
+
+	len += format_counter(out + len, size - len, "fs_connections_accepted_total", "counter",
+			"Connections accepted by the listener.", metrics.connections_accepted);
+	len += format_counter(out + len, size - len, "fs_connections_rejected_total", "counter",
+			"Connections turned away because max-connections was reached.", metrics.connections_rejected);
+	len += format_counter(out + len, size - len, "fs_connections_rejected_ip_total", "counter",
+			"Connections turned away because their address had max-per-ip already.", metrics.connections_rejected_ip);
+	len += format_counter(out + len, size - len, "fs_handshake_failures_total", "counter",
+			"Connections dropped during the hand-shake.", metrics.handshake_failures);
+	len += format_counter(out + len, size - len, "fs_connections_closed_total", "counter",
+			"Peer connections closed after being verified.", metrics.connections_closed);
+	len += format_counter(out + len, size - len, "fs_connections_reaped_total", "counter",
+			"Peer connections closed because the peer went silent.", metrics.connections_reaped);
+	len += format_counter(out + len, size - len, "fs_active_connections", "gauge",
+			"Peers currently connected.", (unsigned long long) metrics.active_connections);
+	len += format_counter(out + len, size - len, "fs_received_bytes_total", "counter",
+			"Bytes read from peer sockets.", metrics.bytes_received);
+	len += format_counter(out + len, size - len, "fs_sent_bytes_total", "counter",
+			"Bytes written to peer sockets.", metrics.bytes_sent);
+	len += format_counter(out + len, size - len, "fs_hash_lists_received_total", "counter",
+			"Hash lists ingested successfully.", metrics.lists_received);
+	len += format_counter(out + len, size - len, "fs_hash_lists_failed_total", "counter",
+			"Hash lists that could not be received.", metrics.lists_failed);
+	len += format_counter(out + len, size - len, "fs_hash_lists_rejected_total", "counter",
+			"Hash lists turned down as malformed.", metrics.lists_rejected);
+	len += format_counter(out + len, size - len, "fs_hash_lookups_found_total", "counter",
+			"HASH queries answered with an owner.", metrics.lookups_found);
+	len += format_counter(out + len, size - len, "fs_hash_lookups_not_found_total", "counter",
+			"HASH queries answered with NOTFOUND.", metrics.lookups_not_found);
+	len += format_counter(out + len, size - len, "fs_load_reports_total", "counter",
+			"LOAD reports received from peers.", metrics.load_reports);
+	len += format_counter(out + len, size - len, "fs_hash_lookups_all_busy_total", "counter",
+			"HASH queries answered with an owner that had no free upload slot.", metrics.lookups_all_busy);
+	len += format_counter(out + len, size - len, "fs_heartbeats_total", "counter",
+			"PING messages received from peers.", metrics.heartbeats);
+	len += format_counter(out + len, size - len, "fs_searches_total", "counter",
+			"SRCH queries answered.", metrics.searches);
+	len += format_counter(out + len, size - len, "fs_indexed_files", "gauge",
+			"Files with at least one owner in the search index.", (unsigned long long) metrics.indexed_files);
+	len += format_counter(out + len, size - len, "fs_owner_entries", "gauge",
+			"Peer and file pairs in the owner index.", (unsigned long long) metrics.owner_entries);
+	len += format_counter(out + len, size - len, "fs_owner_index_bytes", "gauge",
+			"Memory taken by the owner index.", metrics.owner_index_bytes);
+	len += format_counter(out + len, size - len, "fs_log_lines_dropped_total", "counter",
+			"Log lines dropped because the log ring was full.", (unsigned long long) log_dropped());
+	len += format_histogram(out + len, size - len, "fs_hash_lookup_duration_microseconds",
+			"Time spent resolving a HASH query.", &metrics.lookup_latency);
+	len += format_histogram(out + len, size - len, "fs_search_duration_microseconds",
+			"Time spent answering a SRCH query.", &metrics.search_latency);
+	len += format_histogram(out + len, size - len, "fs_hash_list_size_bytes",
+			"Size of the ingested hash lists.", &metrics.ingest_size);
+	len += format_histogram(out + len, size - len, "fs_hash_list_ingest_duration_microseconds",
+			"Time spent receiving a hash list.", &metrics.ingest_duration);
+	return len;
+}
+
+/* Opens the metrics endpoint on the loopback interface */
+int metrics_open(int port) {
+	int					listener,
+						yes = 1;
+	struct sockaddr_in	addr;
+
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		perror("[ERROR] Metrics: socket() call failed");
+		return -1;
+	}
+	if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+		perror("[ERROR] Metrics: setsockopt() call failed");
+		close(listener);
+		return -1;
+	}
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	memset(&addr.sin_zero, '\0', sizeof(addr.sin_zero));
+
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("[ERROR] Metrics: bind() call failed");
+		close(listener);
+		return -1;
+	}
+	if (listen(listener, 8) == -1) {
+		perror("[ERROR] Metrics: listen() call failed");
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+/*
+ * Answers a single scrape. It runs in the listener thread, so a scraper
+ * that connects and then stays silent must not be able to stall it.
+ */
+void metrics_serve(int listener) {
+	static char		body[METRICS_BUFFER_SIZE];
+	char			header[256],
+					request[1024];
+	int				client,
+					len,
+					hlen;
+	struct timeval	timeout;
+
+	if ((client = accept(listener, NULL, NULL)) == -1) {
+		log_error("Metrics: accept() call failed");
+		return;
+	}
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 100000;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	/* Whatever the request is, the answer is always the same */
+	if (read(client, request, sizeof(request)) > 0) {
+		len = metrics_format(body, sizeof(body));
+		hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+		if (write(client, header, hlen) == hlen)
+			write(client, body, len);
+	}
+	close(client);
+}
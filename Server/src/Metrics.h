@@ -0,0 +1,64 @@
+/*
+ * Metrics.h
+ *
+ *      Author: Giacomo Persichini
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/*
+ * HDR-style histogram: every power of two is split in HIST_SUB_BUCKETS
+ * linear sub-buckets, so the relative error is bounded by 1/HIST_SUB_BUCKETS
+ * no matter how large the recorded value is.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (61 * HIST_SUB_BUCKETS)
+#define METRICS_BUFFER_SIZE 65536
+
+typedef struct histogram {
+	unsigned long long	counts[HIST_BUCKETS];
+	unsigned long long	count;
+	unsigned long long	sum;
+	unsigned long long	max;
+} histogram;
+
+typedef struct server_metrics {
+	unsigned long long	connections_accepted;
+	unsigned long long	connections_rejected;
+	unsigned long long	connections_rejected_ip;
+	unsigned long long	handshake_failures;
+	unsigned long long	connections_closed;
+	unsigned long long	connections_reaped;
+	long				active_connections;
+	unsigned long long	bytes_received;
+	unsigned long long	bytes_sent;
+	unsigned long long	lists_received;
+	unsigned long long	lists_failed;
+	unsigned long long	lists_rejected;		/* Malformed, see list_load() */
+	unsigned long long	lookups_found;
+	unsigned long long	lookups_not_found;
+	unsigned long long	searches;
+	unsigned long long	load_reports;
+	unsigned long long	lookups_all_busy;
+	unsigned long long	heartbeats;
+	long				indexed_files;
+	long				owner_entries;		/* Peer and file pairs HASH queries are answered from */
+	unsigned long long	owner_index_bytes;
+	histogram			lookup_latency;		/* microseconds */
+	histogram			search_latency;		/* microseconds */
+	histogram			ingest_size;		/* bytes */
+	histogram			ingest_duration;	/* microseconds */
+} server_metrics;
+
+extern server_metrics metrics;
+
+unsigned long long now_usec();
+void hist_record(histogram *, unsigned long long);
+unsigned long long hist_percentile(histogram *, double);
+int metrics_format(char *, int);
+int metrics_open(int);
+void metrics_serve(int);
+
+#endif /* METRICS_H_ */
@@ -8,7 +8,6 @@
 
 #include <stdio.h>
 #include <string.h> /* strcmp() */
-#include <dirent.h> /* DIR* - things with directories */
 #include <sys/stat.h> /* mkdir() - creat() */
 #include <fcntl.h> /* open() */
 #include <unistd.h> /* close() - read() - write() - etc... */
@@ -17,194 +16,307 @@
 #include <arpa/inet.h> /* inet_addr() */
 #include <pthread.h> /* stuff with threads */
 #include <errno.h> /* errno */
+#include <signal.h> /* signal() - SIGPIPE */
 
 #include "Server.h"
+#include "Metrics.h"
+#include "Config.h"
+#include "Conn.h"
+#include "Protocol.h"
+#include "Tls.h"
+#include "Search.h"
+#include "Owners.h"
+#include "Balance.h"
+#include "Wheel.h"
+#include "Log.h"
 
 volatile short int quit;
+search_index *names = NULL;	/* Every connected peer's files, by name */
+owner_index *owners = NULL;		/* And who has each of them */
+
+/* Only the listener thread gets here, like for the metrics */
+static char					addrs[FD_SETSIZE][INET_ADDRSTRLEN];	/* Each verified peer's */
+static wheel				reaper;					/* By REAP_TICK ticks */
+static wheel_timer			timers[FD_SETSIZE];
+static unsigned long long	heard[FD_SETSIZE],		/* Tick the peer last sent something */
+							silence[FD_SETSIZE],	/* Ticks it may keep quiet, 0 for ever */
+							joined[FD_SETSIZE],		/* usec it was verified, 0 if it isn't a peer */
+							ingest_at[FD_SETSIZE],	/* usec its list started coming */
+							ingested[FD_SETSIZE];	/* Bytes received since */
+static file_receiver		*lists[FD_SETSIZE];		/* The list still coming, NULL once it's indexed */
+static int					expired[FD_SETSIZE],
+							num_expired;
+
+/* Everything going through a peer's connection is counted */
+static void count_received(size_t bytes) {
+	metrics.bytes_received += bytes;
+}
 
-int create_config_file() {
-	char	ex[] = "server-ip=1.2.3.4\nserver-port=1313\nmax-connections=50";
-	int		config_file;
+static void count_sent(size_t bytes) {
+	metrics.bytes_sent += bytes;
+}
 
-	if ((config_file = creat(CONFIG_FILE, S_IREAD | S_IWRITE)) == -1) {
-		switch(errno) {
-		case EACCES:	/* Insufficient permissions */
-			fprintf(stderr, "[ERROR] Not enough permission to create an example configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "An error has occured while creating an example configuration file.");
-			break;
-		}
-		return -1;
-	}
-	else {
-		if (write(config_file, ex, strlen(ex)) == -1) {
-			close(config_file);
-			fprintf(stderr, "Not enough permission to write an example configuration file.\n");
-			return -1;
-		}
-		else
-			close(config_file);
-	}
-	printf("[INFO] An example configuration file has been created. Please edit it.\n");
-	return 0;
+/*
+ * Looks for the peers, other than the requester, sharing the given hash.
+ * The IP address of the one balance_pick() likes best is copied in owner.
+ */
+int find_owner(char *hash, char *requester, char *owner) {
+	char	found[BALANCE_MAX_OWNERS][INET_ADDRSTRLEN];
+	int		num = owners_find(owners, hash, requester, found, BALANCE_MAX_OWNERS);
+
+	if (num == 0)
+		return 0;
+	strcpy(owner, found[balance_pick(found, num)]);
+	return 1;
 }
 
-/* Read only positive integers **/
-int i_read_config(char *field) {
-	char	buffer[BUFFER_SIZE],
-			a[BUFFER_SIZE];
-	int		ret = 0,
-			found = 0;
-	FILE	*config_file = NULL;
-
-	/* TOCTOU bug avoidance, use fopen(), not access() */
-	config_file = fopen(CONFIG_FILE, "r");
-	if (config_file == NULL) {
-		switch (errno) {
-		case ENOENT:	/* The file does not exist */
-			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
-			create_config_file();
-			break;
-		case EACCES:	/* The file is not accessible to the current user */
-			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
-			break;
-		}
-		return -1;
-	}
-	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
-		if (sscanf(buffer, "%[^=]=%d", a, &ret) == 2 && strcmp(field, a) == 0)
-			found = 1;	/* The requested field has been found */
-	fclose(config_file);
-	if (found) {
-		if (ret < 0) {
-			fprintf(stderr, "[ERROR] 'server-port' can't be negative!\n");	/* 'Not a positive integer' error */
-			return -1;
-		}
-		else
-			return ret;
-	}
-	else { /* Field not found */
-		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", field);
-		return -1;
-	}
+/*
+ * Messages don't move the timers, that would be a wheel_add() for each:
+ * a peer heard from since its timer was set gets the rest of its time.
+ */
+static void timer_fired(wheel_timer *t, void *arg) {
+	int	fd = t - timers;
+
+	(void) arg;
+	if (heard[fd] + silence[fd] > reaper.now)
+		wheel_add(&reaper, t, heard[fd] + silence[fd]);
+	else
+		expired[num_expired++] = fd;
 }
 
-void c_read_config(char *var, char *field, int *err) {
-	char	buffer[BUFFER_SIZE],
-			a[BUFFER_SIZE],
-			b[BUFFER_SIZE];
-	FILE	*config_file = NULL;
-	int		found = 0;
-
-	*err = 0;
-	config_file = fopen(CONFIG_FILE, "r");
-	if (config_file == NULL) {
-		switch (errno) {
-		case ENOENT:	/* The file does not exist */
-			fprintf(stderr, "[ERROR] The configuration file does not exist.\n");
-			create_config_file();
-			break;
-		case EACCES:	/* The file is not accessible to the current user */
-			fprintf(stderr, "[ERROR] Not enough permission to read the configuration file.\n");
-			break;
-		default:		/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while reading the configuration file.\n");
-			break;
-		}
-		*err = -1;
+/* Slots freed by the second, and the turns given to the peers turned away */
+static unsigned long long	window = 0,
+							turn_at = 0;		/* usec, the last turn given */
+static unsigned int			freed = 0,
+							freed_before = 0;	/* In the second before */
+
+static void count_second(unsigned long long now) {
+	if (now - window < 1000000)
 		return;
-	}
-	while (fgets(buffer, sizeof buffer, config_file) != NULL && !found)
-		if (sscanf(buffer, "%[^=]=%[^=]", a, b) == 2 && strcmp(field, a) == 0) {
-			/* The requested field has been found */
-			strcpy(var, b);
-			/* There's the new-line character, it must be removed. */
-			var[strlen(var)-1] = '\0';
-			found = 1;
-		}
-	fclose(config_file);
-	/* If the field has not been found it returns an empty string */
-	if (!found || strcmp(var, "") == 0) {
-		fprintf(stderr, "[ERROR] Configuration file exists and is accessible, but '%s' may be missing.\n", var);
-		*err = -1;
-	}
-	return;
+	freed_before = now - window < 2000000 ? freed : 0;
+	freed = 0;
+	window = now;
 }
 
-int is_connected(int socket) {
-	if (send(socket, NULL, 0, 0) == -1)
-		return -1;
-	else
-		return 0;
+static void slot_freed() {
+	count_second(now_usec());
+	freed++;
 }
 
-int handshake(int *socket) {
-	char	buffer[1024],
-			msg[] = "HELLO";
+/*
+ * How many msec a peer turned away is asked to wait. Each one gets a turn
+ * after the one before, as often as slots free up lately, so that they
+ * come back one by one instead of all at once. 0 if nobody left lately:
+ * there's no telling, the peers back off by themselves.
+ */
+static unsigned int retry_hint() {
+	unsigned long long	now = now_usec(),
+						gap = 0;
+
+	count_second(now);
+	/* usec between two slots freed, over the second before or what's gone of this one */
+	if (freed_before > 0)
+		gap = 1000000 / freed_before;
+	if (freed > 0 && (gap == 0 || (now - window) / freed < gap))
+		gap = (now - window) / freed;
+	if (gap == 0)
+		return 0;
+	turn_at = (turn_at > now ? turn_at : now) + gap;
+	return turn_at - now < BUSY_RETRY_MAX * 1000ULL ? (turn_at - now + 999) / 1000 : BUSY_RETRY_MAX;
+}
 
-	if (is_connected(*socket) == -1)
-		return -1;
+/*
+ * Where the list the peer on fd sent is kept. One file per connection:
+ * the same address may have a few, a peer that reconnected before its
+ * old connection was dropped too.
+ */
+static void list_path(char *path, size_t size, char *ip, int fd) {
+	snprintf(path, size, "db/%s-%d", ip, fd);
+}
 
-	if (send(*socket, msg, strlen(msg), 0) == -1)
-		return -1;
-	bzero(buffer, 1024);
-	while (read(*socket, buffer, sizeof(buffer)) > 0) {
-		if (strcmp(buffer, msg) != 0) {
-			send(*socket, "NO", 2, 0); /* No need to return -1 at this point */
-			close(*socket);
-			*socket = -1;
-			return -1;
+/*
+ * Whatever the server knows about the peer on fd goes, but the connection.
+ * Owners are by address: if another connection from it is left, the list
+ * it sent last is what the address has.
+ */
+static void forget_peer(int fd) {
+	hash_list	list;
+	char		path[BUFFER_SIZE];
+	int			latest = -1,
+				j;
+
+	joined[fd] = 0;
+	list_path(path, sizeof(path), addrs[fd], fd);
+	if (list_load(&list, path) == 0)
+		search_remove_list(names, &list);
+	list_free(&list);
+	metrics.indexed_files = search_count(names);
+	for (j = 0; j < FD_SETSIZE; j++)
+		if (joined[j] != 0 && strcmp(addrs[j], addrs[fd]) == 0 && (latest == -1 || joined[j] > joined[latest]))
+			latest = j;
+	if (latest == -1)
+		owners_remove(owners, addrs[fd]);
+	else {
+		list_path(path, sizeof(path), addrs[latest], latest);
+		if (list_load(&list, path) != 0 || owners_add_list(owners, addrs[latest], &list) == -1)
+			log_error("Couldn't index the list of hashes again (%s).", addrs[latest]);
+		list_free(&list);
+	}
+	list_path(path, sizeof(path), addrs[fd], fd);
+	metrics.owner_entries = owners_count(owners);
+	metrics.owner_index_bytes = owners_memory(owners);
+	if (remove(path) != 0) {
+		switch(errno) {
+		case EACCES:
+			log_error("Couldn't delete client's hash list file, not enough permissions.");
+			break;
+		case EBUSY:
+			log_error("Couldn't delete client's hash list file, file is busy.");
+			break;
+		case ENOENT:
+			log_error("Couldn't delete client's hash list file, file does not exist.");
+			break;
+		default:
+			log_error("Couldn't delete client's hash list file, an error occurred.");
+			break;
 		}
-		break;
 	}
-	return 0;
+	balance_leave(fd);
+	wheel_del(&reaper, &timers[fd]);
+	slot_freed();
 }
 
-int receive_file(char *filepath, int *socket) {
-	char			buffer[BUFFER_SIZE];
-	int				recvd_flag = 0,
-					fp;
-	size_t			bytes = 0;
-	unsigned long	length = 0;
-	unsigned long	bytecount = 0;
+/* A peer whose list didn't come whole goes, nothing of it was indexed */
+static void drop_list(int fd) {
+	char	path[BUFFER_SIZE];
 
-	if (is_connected(*socket) == -1)
-		return recvd_flag;
+	receiver_close(lists[fd]);
+	lists[fd] = NULL;
+	list_path(path, sizeof(path), addrs[fd], fd);
+	remove(path);
+	wheel_del(&reaper, &timers[fd]);
+}
 
-	while (read(*socket, &length, sizeof(length)) == sizeof(length)) {
-		length = ntohl(length);
-		break;
-	}
+/*
+ * Takes what came of the list the peer on fd is sending, a piece at a
+ * time like queries, so that a slow one holds nobody up. Once it's whole
+ * it's indexed, the peer may keep quiet for quiet ticks from then on and
+ * what followed the list is answered. Returns 1 then, 0 while more is
+ * expected and -1 if the list is broken: the caller drops the peer.
+ */
+static int take_list(int fd, conn *c, unsigned long long quiet) {
+	hash_list	list;
+	char		path[BUFFER_SIZE];
+	int			err;
 
-	fp = open(filepath, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-	if (fp == -1) {
-		switch (errno) {
-		case EACCES:			/* Insufficient permissions */
-			fprintf(stderr, "[ERROR] Not enough permissions to create the received file.\n");
-			break;
-		default:				/* Generic error */
-			fprintf(stderr, "[ERROR] An error has occurred while opening the file.\n");
-			break;
+	if ((err = receiver_take(lists[fd], c)) == 0)
+		return 0;
+	list_path(path, sizeof(path), addrs[fd], fd);
+	/* Checked whole first, nothing of a malformed list is indexed */
+	memset(&list, 0, sizeof(list));
+	if ((err = err == 1 ? list_load(&list, path) : -1) != 0) {
+		/* The rest of the list would be taken for queries, drop the peer */
+		if (err == LIST_MALFORMED) {
+			log_info("Malformed list of hashes, closed connection (%s).", addrs[fd]);
+			metrics.lists_rejected++;
 		}
-		return recvd_flag;
+		else {
+			log_info("Couldn't get the list of hashes, closed connection (%s).", addrs[fd]);
+			metrics.lists_failed++;
+		}
+		list_free(&list);
+		drop_list(fd);
+		return -1;
 	}
+	receiver_close(lists[fd]);
+	lists[fd] = NULL;
+	log_info("File transfer completed (%s).", addrs[fd]);
+	search_add_list(names, &list);
+	metrics.indexed_files = search_count(names);
+	if (owners_add_list(owners, addrs[fd], &list) == -1)
+		log_error("Couldn't index the list of hashes (%s).", addrs[fd]);
+	metrics.owner_entries = owners_count(owners);
+	metrics.owner_index_bytes = owners_memory(owners);
+	metrics.lists_received++;
+	hist_record(&metrics.ingest_size, ingested[fd]);
+	hist_record(&metrics.ingest_duration, now_usec() - ingest_at[fd]);
+	list_free(&list);
+
+	balance_join(fd, addrs[fd]);
+	joined[fd] = now_usec();
+	heard[fd] = now_usec() / REAP_TICK;
+	silence[fd] = quiet;
+	if (silence[fd] > 0)
+		wheel_add(&reaper, &timers[fd], heard[fd] + silence[fd]);
+	else
+		wheel_del(&reaper, &timers[fd]);
+	log_info("Peer verified (%s).", addrs[fd]);
+	/* Queries that came with the list are already buffered */
+	answer_queries(c, addrs[fd]);
+	return 1;
+}
 
-	bzero(buffer, BUFFER_SIZE);
-	while ((bytes = read(*socket, buffer, sizeof(buffer))) > 0) {
-		bytecount += bytes;
-		write(fp, buffer, bytes);
-		bzero(buffer, BUFFER_SIZE);
-		if (bytecount >= length) {
-			recvd_flag = 1;
-			break;
+/* A page of the files whose names match */
+static void answer_search(conn *c, char *frame, char *ip) {
+	static search_result	results[SEARCH_PAGE_MAX];
+	unsigned long long		start = now_usec();
+	char					text[SEARCH_TEXT_MAX];
+	long					offset,
+							total = 0;
+	int						limit,
+							num = 0;
+
+	if (parse_search(frame, text, &offset, &limit) == -1)
+		log_warn("Malformed search, answered with nothing (%s).", ip);
+	else
+		total = search_query(names, text, offset, limit, results, &num);
+	hist_record(&metrics.search_latency, now_usec() - start);
+	metrics.searches++;
+	if (send_results(c, total, results, num) == -1)
+		log_error("Couldn't answer the peer, send() failed: %s", strerror(errno));
+}
+
+/* Answers every whole query received, a partial one waits for the rest */
+void answer_queries(conn *c, char *ip) {
+	unsigned long long	lookup_start;
+	char				*query = NULL,
+						hash[HASH_LEN + 1],
+						owner[INET_ADDRSTRLEN];
+	load_report			load;
+	int					found;
+
+	while ((query = conn_peek(c, QUERY_SIZE)) != NULL) {
+		/* Searches are longer than queries, the same first letters tell them apart */
+		if ((c->options & OPT_SEARCH) && strncmp(query, "SRCH-", 5) == 0) {
+			if ((query = conn_frame(c, SEARCH_SIZE)) == NULL)
+				break;
+			answer_search(c, query, ip);
+			continue;
+		}
+		query = conn_frame(c, QUERY_SIZE);
+		if ((c->options & OPT_HEARTBEAT) && parse_ping(query) == 0) {
+			metrics.heartbeats++;
+			continue;
+		}
+		if ((c->options & OPT_LOAD) && parse_load(query, &load) == 0) {
+			balance_report(c->fd, &load);
+			metrics.load_reports++;
+			continue;
+		}
+		if (parse_query(query, hash) == -1) {
+			log_warn("Unrecognized command, ignored (%s).", ip);
+			continue;
 		}
+		lookup_start = now_usec();
+		found = find_owner(hash, ip, owner);
+		hist_record(&metrics.lookup_latency, now_usec() - lookup_start);
+		if (found == 1)
+			metrics.lookups_found++;
+		else
+			metrics.lookups_not_found++;
+		if (send_reply(c, found == 1 ? owner : NULL) == -1)
+			log_error("Couldn't answer the peer, send() failed: %s", strerror(errno));
 	}
-	close(fp);
-	return recvd_flag;
 }
 
 void server_listener() {
@@ -218,29 +330,30 @@ void server_listener() {
 							selectval,
 							i,
 							client_num = 0,
-							found = 0,
-							fp;
-	char					server_ip[15] = "",
-							*tok = NULL,
-							found_cmd[21] = "FOUND-",
+							metrics_port,
+							metrics_listener = -1,
+							peer_timeout,	/* Seconds, for peers that send heartbeats */
+							idle_timeout,	/* For those that don't */
+							list_timeout,	/* Seconds to send the whole list */
+							max_per_ip,		/* Connections from one address, 0 for any */
+							same_ip,
+							accept_queue,
+							j,
+							options;	/* Offered in every hand-shake */
+	unsigned long long		tick,
+							list_max;		/* Bytes */
+	char					server_ip[16] = "",
 							path[BUFFER_SIZE],
-							ip[INET_ADDRSTRLEN],
-							buffer[BUFFER_SIZE];
+							ip[INET_ADDRSTRLEN];
 	struct sockaddr_in		server,
-							client, *tmp = NULL;
-	struct sockaddr_storage	storage;
-	socklen_t				client_len = sizeof(client),
-							storage_len = sizeof(storage);
+							client;
+	socklen_t				client_len = sizeof(client);
+	ssize_t					got;
 	struct timeval			timeout;
 	fd_set					master,
 							read_fds;
-	DIR						*dir;
-	hash_record				x;
-	struct dirent			*ent = NULL;
-
-	/* Set the timeout to 1 second */
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
+	static conn				*peers[FD_SETSIZE];	/* One per descriptor in the master set */
+	conn					*c = NULL;
 
 	/* Clear the master and temp sets */
 	FD_ZERO(&master);
@@ -262,10 +375,29 @@ void server_listener() {
 	c_read_config(server_ip, "server-ip", &err);
 	server_port = i_read_config("server-port");
 	max_connections = i_read_config("max-connections");
+	metrics_port = i_read_config_default("metrics-port", 0);
+	max_per_ip = i_read_config_default("max-per-ip", 4);
+	accept_queue = i_read_config_default("accept-queue", 128);
+	peer_timeout = i_read_config_default("peer-timeout", 3 * HEARTBEAT_INTERVAL);
+	idle_timeout = i_read_config_default("idle-timeout", 0);
+	list_timeout = i_read_config_default("list-timeout", LIST_TIMEOUT);
+	list_max = (unsigned long long) i_read_config_default("max-list-records", LIST_RECORDS_MAX) * sizeof(hash_record);
+	if (tls_setup() == -1)
+		pthread_exit(NULL);
+	/* Delta sync is between peers, the server has nothing to offer for it */
+	options = (handshake_options() & ~OPT_DELTA) | OPT_SEARCH | OPT_LOAD;
+	if (peer_timeout > 0)
+		options |= OPT_HEARTBEAT;
 
 	if (server_port < 0 || err != 0 || max_connections < 0)
 		pthread_exit(NULL);
 
+	if ((names = search_open()) == NULL || (owners = owners_open()) == NULL) {
+		fprintf(stderr, "[ERROR] Not enough memory for the search index.\n");
+		search_close(names);
+		pthread_exit(NULL);
+	}
+
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = inet_addr(server_ip);
 	server.sin_port = htons(server_port);
@@ -279,7 +411,8 @@ void server_listener() {
 		pthread_exit(NULL);
 	}
 
-	if (listen(listener, max_connections) == -1) {
+	/* The kernel keeps the connections not accepted yet, as many as accept-queue */
+	if (listen(listener, accept_queue) == -1) {
 		perror("[ERROR] Listener: listen() call failed");
 		pthread_exit(NULL);
 	}
@@ -288,17 +421,62 @@ void server_listener() {
 
 	FD_SET(listener, &master);
 	fdmax = listener;
+	wheel_init(&reaper, now_usec() / REAP_TICK);
+
+	/* The metrics endpoint is optional and only reachable from this machine */
+	if (metrics_port > 0 && (metrics_listener = metrics_open(metrics_port)) != -1) {
+		printf("[INFO] Metrics: http://127.0.0.1:%d/metrics\n", metrics_port);
+		FD_SET(metrics_listener, &master);
+		if (metrics_listener > fdmax)
+			fdmax = metrics_listener;
+	}
 
 	/* Clients connection management starts here */
 	while (1) {
 		read_fds = master;
 
+		/* select() may modify the timeout, set it to 1 second every time */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+
 		selectval = select(fdmax+1, &read_fds, NULL, NULL, &timeout);
 		if (selectval < 0) {
-			perror("[ERROR] Listener: select() call failed");
+			log_error("Listener: select() call failed: %s", strerror(errno));
 			pthread_exit(NULL);
 		}
-		else if (selectval == 0) {
+
+		/* Peers that went silent: crashed, or their connection is half-open */
+		tick = now_usec() / REAP_TICK;
+		num_expired = 0;
+		wheel_advance(&reaper, tick, timer_fired, NULL);
+		for (j = 0; j < num_expired; j++) {
+			i = expired[j];
+			/* A list is given its time whole, a byte now and then doesn't get it more */
+			if (lists[i] != NULL) {
+				log_info("The list of hashes took over %d s, closed connection (%s).", list_timeout, addrs[i]);
+				drop_list(i);
+				metrics.lists_failed++;
+			}
+			/* What it sent is waiting for us, we were the slow ones */
+			else if (FD_ISSET(i, &read_fds)) {
+				heard[i] = tick;
+				wheel_add(&reaper, &timers[i], tick + silence[i]);
+				continue;
+			}
+			else {
+				log_info("Nothing heard for %llu s, closed connection (%s).", silence[i] * REAP_TICK / 1000000, addrs[i]);
+				forget_peer(i);
+			}
+			conn_close(peers[i]);
+			peers[i] = NULL;
+			client_num--;
+			FD_CLR(i, &master);
+			FD_CLR(i, &read_fds);
+			metrics.connections_reaped++;
+			metrics.active_connections = client_num;
+		}
+
+		if (selectval == 0) {
 			/* timeout */
 			if (quit) {
 				break;
@@ -315,143 +493,130 @@ void server_listener() {
 				 */
 				if (i == listener) {
 					if ((newfd = accept(listener, (struct sockaddr *) &client, &client_len)) == -1)
-						perror("[ERROR] Listener: accept() call failed");
+						log_error("Listener: accept() call failed: %s", strerror(errno));
 					else { /* Let's test the client before adding it to the set */
+						metrics.connections_accepted++;
+						/* Format the address once, not for every line logged */
+						inet_ntop(AF_INET, &client.sin_addr, ip, sizeof ip);
+						for (same_ip = 0, j = 0; max_per_ip > 0 && j <= fdmax; j++)
+							same_ip += peers[j] != NULL && strcmp(addrs[j], ip) == 0;
+
+						/* No room: the peer is told when to come back instead of retrying at once */
+						if (client_num >= max_connections || (max_per_ip > 0 && same_ip >= max_per_ip)) {
+							if (send_busy(newfd, retry_hint()) == -1)
+								log_warn("Couldn't tell the peer the server is busy (%s).", ip);
+							else
+								log_info("Busy, turned the peer away (%s).", ip);
+							close(newfd);
+							if (client_num >= max_connections)
+								metrics.connections_rejected++;
+							else
+								metrics.connections_rejected_ip++;
+							continue;
+						}
 						client_num++;
-						if (client_num > max_connections) { /* Check if current client # respects max_connections */
+						if (newfd >= FD_SETSIZE || (c = conn_open(newfd)) == NULL) {
 							close(newfd);
 							client_num--;
+							metrics.connections_rejected++;
 							continue;
 						}
-
-						printf("[INFO] New connection (%s).\n", inet_ntoa(client.sin_addr));
-
-						if (handshake(&newfd) == -1) { /* If handshake fails, kick the client */
-							printf("[INFO] Hand-shake failed!\n[INFO] Closed connection (%s).\n", inet_ntoa(client.sin_addr));
+						c->on_read = count_received;
+						c->on_write = count_sent;
+						/* Nobody else is served meanwhile, a stalled peer must not hang us */
+						conn_timeout(c, IO_TIMEOUT);
+						log_info("New connection (%s).", ip);
+
+						if (handshake_reply(HANDSHAKE_SERVER, c, options) == -1) { /* If handshake fails, kick the client */
+							log_info("Hand-shake failed! Closed connection (%s).", ip);
+							conn_close(c);
 							client_num--;
+							metrics.handshake_failures++;
 							continue;
 						}
 
 						/* If we're here there's a genuine client, I expect a list of hashesh from it */
-						bzero(path, BUFFER_SIZE);
-						strcpy(path, "db/");
-						strcat(path, inet_ntoa(client.sin_addr));
-						if (receive_file(path, &newfd))
-							printf("[INFO] File transfer completed (%s).\n", inet_ntoa(client.sin_addr));
-						else
-							printf("[INFO] Couldn't get the list of hashes (%s).\n", inet_ntoa(client.sin_addr));
-
+						list_path(path, sizeof(path), ip, newfd);
+						if ((lists[newfd] = receiver_open(path, list_max)) == NULL) {
+							log_error("Not enough memory to receive a list of hashes (%s).", ip);
+							conn_close(c);
+							client_num--;
+							continue;
+						}
+						/*
+						 * It comes in the select() loop like queries. Through
+						 * OpenSSL a readable socket may hold only part of a
+						 * record: waiting for the rest would stop everyone
+						 */
+						if (!tls_raw(c, TLS_RECV))
+							conn_nonblock(c, 1);
+						peers[newfd] = c;
+						strcpy(addrs[newfd], ip);
+						ingest_at[newfd] = now_usec();
+						ingested[newfd] = conn_buffered(c);
+						heard[newfd] = ingest_at[newfd] / REAP_TICK;
+						silence[newfd] = (unsigned long long) list_timeout * (1000000 / REAP_TICK);
+						if (silence[newfd] > 0)
+							wheel_add(&reaper, &timers[newfd], heard[newfd] + silence[newfd]);
 						FD_SET(newfd, &master);
 						if(newfd > fdmax)
 							fdmax = newfd;
-						printf("[INFO] Peer verified (%s).\n", inet_ntoa(client.sin_addr));
+						metrics.active_connections = client_num;
+						/* What came with the hand-shake is already buffered */
+						if (take_list(newfd, c, (unsigned long long) ((c->options & OPT_HEARTBEAT) ? peer_timeout
+								: idle_timeout) * (1000000 / REAP_TICK)) == -1) {
+							conn_close(c);
+							peers[newfd] = NULL;
+							client_num--;
+							FD_CLR(newfd, &master);
+							metrics.active_connections = client_num;
+						}
 					}
 				}
 				/*
-				 * 2 - An already connected client is sending some data
+				 * 2 - Someone is scraping the metrics endpoint
+				 */
+				else if (i == metrics_listener) {
+					metrics_serve(metrics_listener);
+				}
+				/*
+				 * 3 - An already connected client is sending some data
 				 */
 				else {
-					/* Retrieving client's data from socket descriptor */
-					if (getpeername(i, (struct sockaddr *) &storage, &storage_len) == -1) {
-						fprintf(stderr, "[ERROR] An error occurred while retrieving the IP address of a client.\n");
-						continue;
-					}
-					tmp = (struct sockaddr_in *) &storage;
-					inet_ntop(AF_INET, &tmp->sin_addr, ip, sizeof ip);
+					c = peers[i];
 
-					bzero(buffer, BUFFER_SIZE);
-					if (read(i, buffer, sizeof(buffer)) <= 0) {
+					if ((got = conn_fill(c)) == CONN_AGAIN)
+						continue;	/* Part of a TLS record, the rest comes later */
+					if (got <= 0) {
 						/* Client closed the connection or an error happened */
-						printf("[INFO] Closed connection (%s).\n", ip);
-						bzero(path, BUFFER_SIZE);
-						strcpy(path, "db/");
-						strcat(path, ip);
-						if (remove(path) != 0) {
-							fprintf(stderr, "[ERROR] Couldn't delete client's hash list file, ");
-							switch(errno) {
-							case EACCES:
-								fprintf(stderr, "not enough permissions.\n");
-								break;
-							case EBUSY:
-								fprintf(stderr, "file is busy.\n");
-								break;
-							case ENOENT:
-								fprintf(stderr, "file does not exist.\n");
-								break;
-							default:
-								fprintf(stderr, "an error occurred.\n");
-								break;
-							}
+						log_info("Closed connection (%s).", addrs[i]);
+						if (lists[i] != NULL) {
+							drop_list(i);
+							metrics.lists_failed++;
 						}
-						close(i);
+						else
+							forget_peer(i);
+						conn_close(c);
+						peers[i] = NULL;
 						client_num--;
 						FD_CLR(i, &master);
+						metrics.connections_closed++;
+						metrics.active_connections = client_num;
 					}
-					else {
-						tok = strtok(buffer, "-");
-						if (strcmp(tok, "HASH") == 0) {
-							tok = strtok(NULL, "-");
-							dir = opendir("db");
-							if (dir == NULL) {
-								fprintf(stderr, "[ERROR] Couldn't open 'db/' directory, ");
-								switch(errno) {
-								case EACCES:
-									fprintf(stderr, "not enough permissions.\n");
-									break;
-								case ENOENT:
-									fprintf(stderr, "directory does not exist.\n");
-									break;
-								default:
-									fprintf(stderr, "an error has occurred.\n");
-									break;
-								}
-							}
-							else  {
-								/*
-								 * A client sent an hash, find who's sharing it
-								 */
-								while ((ent = readdir(dir)) != NULL) {
-									if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0 && strcmp(ent->d_name, ip) != 0) {
-										bzero(path, BUFFER_SIZE);
-										strcpy(path, "db/");
-										strcat(path, ent->d_name);
-										fp = open(path, O_RDONLY);
-										if (fp == -1) {
-											switch(errno) {
-											case EACCES:	/* Insufficient permissions */
-												fprintf(stderr, "[ERROR] Not enough permissions to read the hash file.\n");
-												break;
-											default:		/* Generic error */
-												fprintf(stderr, "[ERROR] An error has occurred while opening the hash file.\n");
-												break;
-											}
-										}
-										else {
-											while (read(fp, &x, sizeof(hash_record)) == sizeof(hash_record)) {
-												if (strcmp(x.hash, tok) == 0) {
-													found = 1;
-													break;
-												}
-											}
-											close(fp);
-										}
-										if (found == 1)
-											break;
-									}
-								}
-								closedir(dir);
-							}
-							if (found == 1) {
-								strcat(found_cmd, ent->d_name);
-								if (send(i, found_cmd, 21, 0) == -1)
-									perror("[ERROR] Couldn't tell the peer I found the hash, send() failed");
-							}
-							else
-								if (send(i, "NOTFOUND", 8, 0) == -1)
-									perror("[ERROR] Couldn't tell the peer I haven't found the hash, send() failed");
+					else if (lists[i] != NULL) {
+						ingested[i] += got;
+						if (take_list(i, c, (unsigned long long) ((c->options & OPT_HEARTBEAT) ? peer_timeout
+								: idle_timeout) * (1000000 / REAP_TICK)) == -1) {
+							conn_close(c);
+							peers[i] = NULL;
+							client_num--;
+							FD_CLR(i, &master);
+							metrics.active_connections = client_num;
 						}
-						else
-							break; /* Client sent an unrecognized command */
+					}
+					else {
+						heard[i] = tick;
+						answer_queries(c, addrs[i]);
 					}
 				}
 			}
@@ -460,8 +625,20 @@ void server_listener() {
 	close(listener);
 	/* Disconnecting all the clients */
 	for (i = 0; i <= fdmax; i++)
-		if (FD_ISSET(i, &master))
-			close(i);
+		if (FD_ISSET(i, &master)) {
+			if (peers[i] != NULL) {
+				if (lists[i] != NULL)
+					drop_list(i);
+				conn_close(peers[i]);
+				peers[i] = NULL;
+			}
+			else
+				close(i);
+		}
+	search_close(names);
+	names = NULL;
+	owners_close(owners);
+	owners = NULL;
 	pthread_exit(NULL);
 }
 
@@ -469,7 +646,9 @@ void user_input_handler() {
 	short int	choice = -1;
 
 	while (choice != 0) {
-		scanf("%hd", &choice);
+		/* Without a terminal (e.g. started in background) keep serving */
+		if (scanf("%hd", &choice) == EOF)
+			pthread_exit(NULL);
 		if (choice == 0)
 			quit = 1;
 	}
@@ -480,6 +659,21 @@ void user_input_handler() {
 int main() {
 	pthread_t	listener,
 				ui;
+	char		log_level[BUFFER_SIZE],
+				log_format[BUFFER_SIZE],
+				log_file[BUFFER_SIZE];
+
+	config_example = "server-ip=1.2.3.4\nserver-port=1313\nmax-connections=50\nmetrics-port=9313\n";
+
+	/* Logs are written by their own thread, the listener only queues them */
+	c_read_config_default(log_level, "log-level", "info");
+	c_read_config_default(log_format, "log-format", "text");
+	c_read_config_default(log_file, "log-file", "-");
+	if (log_init(log_level_parse(log_level), log_format_parse(log_format), log_file, 1) == -1)
+		return -1;
+
+	/* A peer that disconnects while we write must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
 
 	if (pthread_create(&listener, NULL, (void *) &server_listener, NULL) < 0) {
 		perror("[ERROR] Couldn't start listener thread");
@@ -497,6 +691,7 @@ int main() {
 	pthread_join(ui, NULL);
 	pthread_join(listener, NULL);
 
+	log_shutdown();
 	printf("Thank you for using Server %2.2f\n", _VERSION_);
 	return 0;
 }
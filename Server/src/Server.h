@@ -7,21 +7,17 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+#include "Conn.h"
+
 #define BUFFER_SIZE 1024
 #define _VERSION_ 0.01
-#define CONFIG_FILE "config"
-
-typedef struct hash_record {
-	char hash[41];
-	char filename[1024];
-} hash_record;
+#define IO_TIMEOUT 5000	/* msec a peer may stall while we wait for it */
+#define LIST_TIMEOUT 30	/* Seconds a peer has to send its whole list, list-timeout */
+#define REAP_TICK 100000	/* usec, how precisely silent peers are dropped */
+#define BUSY_RETRY_MAX 30000	/* msec, the longest a peer turned away is asked to wait */
 
-int create_config_file();
-int i_read_config(char *);
-void c_read_config(char *, char *, int *);
-int is_connected(int);
-int handshake(int *);
-int receive_file(char *, int *);
+int find_owner(char *, char *, char *);
+void answer_queries(conn *, char *);
 void server_listener();
 void user_input_handler();
 